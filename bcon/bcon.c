@@ -18,11 +18,31 @@
  *    limitations under the License.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "bcon.h"
+#include "bcon_private.h"
+#include "bcon_probes.h"
 #include <error.h>
 #include "inc/utstring.h"
 
-char * BCON_MAGIC = "BCON_MAGIC";
+const char bcon_magic[] = "BCON_MAGIC";
+
+/*
+ * Binaries built when BCON_MAGIC was a variable load the sentinel from it
+ * by name, so it stays exported and points at the same bytes.
+ */
+#undef BCON_MAGIC
+char * BCON_MAGIC = (char *)bcon_magic;
+#define BCON_MAGIC ((char *)bcon_magic)
+
+BCON_PROBE_DEFINE(encode_begin);
+BCON_PROBE_DEFINE(encode_end);
+BCON_PROBE_DEFINE(dump_begin);
+BCON_PROBE_DEFINE(dump_end);
+BCON_PROBE_DEFINE(error);
 
 static char * BCON_TYPE_ENUM_STR[] = {
 #include "bcon_enum_str.h"
@@ -31,11 +51,10 @@ static char * BCON_TYPE_ENUM_STR[] = {
     "BCONT_DOC_START",
     "BCONT_DOC_END",
     "BCONT_END",
-    "BCONT_ERROR"
+    "BCONT_ERROR",
+    "BCONT_OMIT"
 };
 
-int bcon_to_bson_put_value(bson_t * bson, const char * key, void * in, bcon_type_t type);
-
 bcon_type_t bcon_token(bcon_t ** stream, void ** out)
 {
     bcon_type_t type;
@@ -86,73 +105,214 @@ bcon_type_t bcon_token(bcon_t ** stream, void ** out)
     return type;
 }
 
-int bcon_to__bson(bcon_t ** in, bson_t * bson, int is_array)
+static int bcon_skip_value(bcon_t ** in)
 {
     void * obj = NULL;
-    bcon_type_t type;
-    bson_t child;
-
-    int i = 0;
-    char i_str[100];
-    const char * key;
-
-    while (1) {
-        if (is_array) {
-            sprintf(i_str, "%d", i);
-            key = i_str;
-        } else {
-            type = bcon_token(in, &obj);
-
-            if (type == BCONT_END || type == BCONT_DOC_END) return 0;
-
-            // TODO deal with indirection here
-            assert(type == BCONT_UTF8);
-
-            key = *((char **)obj);
-        }
+    int depth = 0;
 
-        type = bcon_token(in, &obj);
-
-        switch(type) {
-            case BCONT_END:
-                return is_array ? 0 : 1;
-                break;
+    do {
+        switch (bcon_token(in, &obj)) {
             case BCONT_DOC_START:
-                bson_append_document_begin(bson, key, -1, &child);
-                if (bcon_to__bson(in, &child, 0)) return 1;
-                bson_append_document_end(bson, &child);
-                break;
-            case BCONT_DOC_END:
-                return 0;
-                break;
             case BCONT_ARRAY_START:
-                bson_append_array_begin(bson, key, -1, &child);
-                if (bcon_to__bson(in, &child, 1)) return 1;
-                bson_append_array_end(bson, &child);
+                depth++;
                 break;
+            case BCONT_DOC_END:
             case BCONT_ARRAY_END:
-                return is_array ? 0 : 1;
+                if (depth == 0) return 1;
+                depth--;
                 break;
+            case BCONT_END:
+            case BCONT_ERROR:
+                return 1;
             default:
-                if (bcon_to_bson_put_value(bson, key, obj, type)) return 1;
                 break;
         }
+    } while (depth);
+
+    return 0;
+}
 
-        i++;
+int bcon_skip_omitted(const bcon_t * at, bcon_t ** in)
+{
+    switch (at[1].type) {
+        case BCONT_PITER_ELEMENT:
+        case BCONT_PBCON_RAW:
+        case BCONT_PBCON_IF:
+            return 0;
+        default:
+            return bcon_skip_value(in);
+    }
+}
+
+bcon_t * bcon_if_body(void * val)
+{
+    bcon_if_t * cond = *((bcon_if_t **)val);
+
+    return *(cond->cond) ? cond->body : NULL;
+}
+
+bson_type_t bcon_bson_type(bcon_type_t type)
+{
+    switch(type) {
+        case BCONT_UTF8:            return BSON_TYPE_UTF8;
+        case BCONT_DOUBLE:          return BSON_TYPE_DOUBLE;
+        case BCONT_BSON_DOCUMENT:   return BSON_TYPE_DOCUMENT;
+        case BCONT_BSON_ARRAY:      return BSON_TYPE_ARRAY;
+        case BCONT_BIN:             return BSON_TYPE_BINARY;
+        case BCONT_UNDEFINED:       return BSON_TYPE_UNDEFINED;
+        case BCONT_BSON_OID:        return BSON_TYPE_OID;
+        case BCONT_BOOL:            return BSON_TYPE_BOOL;
+        case BCONT_DATE_TIME:       return BSON_TYPE_DATE_TIME;
+        case BCONT_NULL:            return BSON_TYPE_NULL;
+        case BCONT_BCON_REGEX:      return BSON_TYPE_REGEX;
+        case BCONT_BCON_DBPOINTER:  return BSON_TYPE_DBPOINTER;
+        case BCONT_BCON_CODE:       return BSON_TYPE_CODE;
+        case BCONT_SYMBOL:          return BSON_TYPE_SYMBOL;
+        case BCONT_BCON_CODEWSCOPE: return BSON_TYPE_CODEWSCOPE;
+        case BCONT_INT32:           return BSON_TYPE_INT32;
+        case BCONT_BCON_TIMESTAMP:  return BSON_TYPE_TIMESTAMP;
+        case BCONT_INT64:           return BSON_TYPE_INT64;
+        case BCONT_MAXKEY:          return BSON_TYPE_MAXKEY;
+        case BCONT_MINKEY:          return BSON_TYPE_MINKEY;
+        case BCONT_BCON_UTF8_LEN:   return BSON_TYPE_UTF8;
+        case BCONT_BCON_SYMBOL_LEN: return BSON_TYPE_SYMBOL;
+        case BCONT_BCON_CODE_LEN:   return BSON_TYPE_CODE;
+        case BCONT_BCON_NEW_OID:    return BSON_TYPE_OID;
+        case BCONT_BCON_NOW:        return BSON_TYPE_DATE_TIME;
+        case BCONT_DOC_START:
+        case BCONT_BCON_DOCUMENT:   return BSON_TYPE_DOCUMENT;
+        case BCONT_ARRAY_START:
+        case BCONT_BCON_ARRAY:      return BSON_TYPE_ARRAY;
+        default:                    return BSON_TYPE_EOD;
+    }
+}
+
+static int bcon_bson_visit_begin(void * data, const char * key, int is_array)
+{
+    bcon_bson_visitor_t * state = data;
+    bson_t * parent;
+    bson_t * child;
+
+    if (state->depth == 0) {
+        state->depth = 1;
+        return 0;
+    }
+
+    parent = state->stack[state->depth - 1];
+
+    if (state->depth < BCON_BSON_VISITOR_INLINE_DEPTH) {
+        child = &state->children[state->depth];
+    } else {
+        if (! state->deep_children) {
+            state->deep_children = malloc(sizeof(bson_t) * (BCON_VISIT_MAX_DEPTH - BCON_BSON_VISITOR_INLINE_DEPTH));
+            if (! state->deep_children) return 1;
+        }
+
+        child = &state->deep_children[state->depth - BCON_BSON_VISITOR_INLINE_DEPTH];
+    }
+
+    if (is_array) {
+        bson_append_array_begin(parent, key, -1, child);
+    } else {
+        bson_append_document_begin(parent, key, -1, child);
     }
 
+    state->stack[state->depth++] = child;
+
     return 0;
 }
 
-char * bcon_to_bson(bcon_t * in, bson_t * bson)
+static int bcon_bson_visit_end(void * data, int is_array)
 {
-    int r = bcon_to__bson(&in, bson, 0);
+    bcon_bson_visitor_t * state = data;
+
+    state->depth--;
+
+    if (state->depth == 0) return 0;
 
-    if (r) {
-        return bcon_dump(in);
+    if (is_array) {
+        bson_append_array_end(state->stack[state->depth - 1], state->stack[state->depth]);
     } else {
-        return NULL;
+        bson_append_document_end(state->stack[state->depth - 1], state->stack[state->depth]);
     }
+
+    return 0;
+}
+
+static int bcon_bson_visit_value(void * data, const char * key, void * val, bcon_type_t type)
+{
+    bcon_bson_visitor_t * state = data;
+
+    return bcon_to_bson_put_value(state->stack[state->depth - 1], key, val, type);
+}
+
+void bcon_bson_visitor_init(bcon_visitor_t * v, bcon_bson_visitor_t * state, bson_t * bson)
+{
+    memset(v, 0, sizeof(*v));
+
+    state->stack[0] = bson;
+    state->deep_children = NULL;
+    state->depth = 0;
+
+    v->begin = bcon_bson_visit_begin;
+    v->end = bcon_bson_visit_end;
+    v->value = bcon_bson_visit_value;
+    v->data = state;
+}
+
+void bcon_bson_visitor_destroy(bcon_bson_visitor_t * state)
+{
+    free(state->deep_children);
+    state->deep_children = NULL;
+}
+
+/*
+ * Appends the stream to bson.  For arrays, *count is the index of the
+ * first element and is left at one past the last one appended.
+ */
+static int bcon_to__bson_at(bcon_t ** in, bson_t * bson, int is_array, bson_uint32_t * count)
+{
+    bcon_bson_visitor_t state;
+    bcon_visitor_t v;
+    int r;
+
+    bcon_bson_visitor_init(&v, &state, bson);
+    state.depth = 1;
+
+    r = bcon_visit__walk(in, is_array, 1, count, &v, 1);
+
+    bcon_bson_visitor_destroy(&state);
+
+    return r;
+}
+
+int bcon_to__bson(bcon_t ** in, bson_t * bson, int is_array)
+{
+    bson_uint32_t count = 0;
+
+    return bcon_to__bson_at(in, bson, is_array, &count);
+}
+
+char * bcon_to_bson(bcon_t * in, bson_t * bson)
+{
+    bcon_bson_visitor_t state;
+    bcon_visitor_t v;
+    bson_uint32_t start_len = bson->len;
+    int tokens = 0, depth = 0;
+    char * err;
+
+    if (BCON_PROBE_ENABLED(encode_begin)) bcon_probe_shape(in, &tokens, &depth);
+    BCON_PROBE3(encode_begin, in, tokens, depth);
+
+    bcon_bson_visitor_init(&v, &state, bson);
+
+    err = bcon_visit(in, &v, 1);
+
+    bcon_bson_visitor_destroy(&state);
+
+    BCON_PROBE3(encode_end, in, bson->len - start_len, err != NULL);
+
+    return err;
 }
 
 int bcon_to_bson_put_value(bson_t * bson, const char * key, void * val, bcon_type_t type)
@@ -168,16 +328,22 @@ int bcon_to_bson_put_value(bson_t * bson, const char * key, void * val, bcon_typ
         case BCONT_DOUBLE:
             bson_append_double(bson, key, -1, *((double *)val));
             break;
-        case BCONT_BCON_DOCUMENT:
+        case BCONT_BCON_DOCUMENT: {
+            bcon_t * child_bcon = *((bcon_t **)val);
+
             bson_append_document_begin(bson, key, -1, &child);
-            if (bcon_to__bson(((bcon_t **)val), &child, 0)) return 1;
+            if (bcon_to__bson(&child_bcon, &child, 0)) return 1;
             bson_append_document_end(bson, &child);
             break;
-        case BCONT_BCON_ARRAY:
+        }
+        case BCONT_BCON_ARRAY: {
+            bcon_t * child_bcon = *((bcon_t **)val);
+
             bson_append_array_begin(bson, key, -1, &child);
-            if (bcon_to__bson(((bcon_t **)val), &child, 1)) return 1;
+            if (bcon_to__bson(&child_bcon, &child, 1)) return 1;
             bson_append_array_end(bson, &child);
             break;
+        }
         case BCONT_BIN: {
             bcon_binary_t * z = *((bcon_binary_t **)val);
 
@@ -220,16 +386,66 @@ int bcon_to_bson_put_value(bson_t * bson, const char * key, void * val, bcon_typ
         case BCONT_SYMBOL:
             bson_append_symbol(bson, key, -1, *((char **)val), -1);
             break;
+        case BCONT_BCON_UTF8_LEN: {
+            bcon_string_t * z = *((bcon_string_t **)val);
+
+            bson_append_utf8(bson, key, -1, z->str, z->length);
+            break;
+        }
+        case BCONT_BCON_NEW_OID: {
+            bson_oid_t * out = *((bson_oid_t **)val);
+            bson_oid_t oid;
+
+            bcon_oid_gen(&oid);
+            if (out) *out = oid;
+
+            bson_append_oid(bson, key, -1, &oid);
+            break;
+        }
+        case BCONT_BCON_NOW: {
+            bson_int64_t * out = *((bson_int64_t **)val);
+            bson_int64_t now = bcon_now_ms();
+
+            if (out) *out = now;
+
+            bson_append_date_time(bson, key, -1, now);
+            break;
+        }
+        case BCONT_BCON_SYMBOL_LEN: {
+            bcon_string_t * z = *((bcon_string_t **)val);
+
+            bson_append_symbol(bson, key, -1, z->str, z->length);
+            break;
+        }
+        case BCONT_BCON_CODE_LEN: {
+            bcon_string_t * z = *((bcon_string_t **)val);
+            char stack[256];
+            char * code = z->length < sizeof(stack) ? stack : malloc(z->length + 1);
+
+            if (! code) return 1;
+
+            /* bson_append_code() only takes NUL terminated code */
+            memcpy(code, z->str, z->length);
+            code[z->length] = '\0';
+
+            bson_append_code(bson, key, -1, code);
+
+            if (code != stack) free(code);
+            break;
+        }
         case BCONT_BCON_CODEWSCOPE: {
             bcon_code_t * code = *((bcon_code_t **)val);
-            bcon_t ** child_bcon = &code->scope;
+            bcon_t * child_bcon = code->scope;
+
+            int r;
 
-            bson_t * child = bson_new();
-            int r = bcon_to__bson(child_bcon, child, 0);
+            bson_init(&child);
 
-            if (! r) bson_append_code_with_scope(bson, key, -1, code->code, child);
+            r = bcon_to__bson(&child_bcon, &child, 0);
 
-            bson_destroy(child);
+            if (! r) bson_append_code_with_scope(bson, key, -1, code->code, &child);
+
+            bson_destroy(&child);
 
             if (r) return r;
 
@@ -265,6 +481,45 @@ int bcon_to_bson_put_value(bson_t * bson, const char * key, void * val, bcon_typ
             bson_append_document(bson, key, -1, child);
             break;
         }
+        case BCONT_BCON_CALLBACK: {
+            bcon_callback_t * cb = *((bcon_callback_t **)val);
+            bcon_append_ctx_t ctx;
+
+            if (cb->type == BSON_TYPE_ARRAY) {
+                bson_append_array_begin(bson, key, -1, &child);
+            } else {
+                bson_append_document_begin(bson, key, -1, &child);
+            }
+
+            ctx.bson = &child;
+            ctx.is_array = cb->type == BSON_TYPE_ARRAY;
+            ctx.count = 0;
+
+            if (cb->fn(&ctx, cb->data)) return 1;
+
+            if (cb->type == BSON_TYPE_ARRAY) {
+                bson_append_array_end(bson, &child);
+            } else {
+                bson_append_document_end(bson, &child);
+            }
+            break;
+        }
+        case BCONT_ITER:
+        case BCONT_ITER_ELEMENT:
+            if (! bson_append_iter(bson, key, -1, *((bson_iter_t **)val))) return 1;
+            break;
+        case BCONT_BCON_RAW: {
+            bson_type_t raw_type;
+            const char * raw_key;
+            const bson_uint8_t * data;
+            bson_uint32_t len;
+
+            if (bcon_raw_split(*((bcon_raw_t **)val), &raw_type, &raw_key, &data, &len)) return 1;
+
+            if (bcon_append_raw(bson, raw_type, key ? key : raw_key, data, len)) return 1;
+
+            break;
+        }
         default:
             return 1;
             break;
@@ -273,16 +528,153 @@ int bcon_to_bson_put_value(bson_t * bson, const char * key, void * val, bcon_typ
     return 0;
 }
 
+const char * bcon_append_key(bcon_append_ctx_t * ctx, const char * key)
+{
+    if (ctx->is_array) {
+        sprintf(ctx->key, "%u", ctx->count);
+        key = ctx->key;
+    }
+
+    ctx->count++;
+
+    return key;
+}
+
+char * bcon_append(bcon_append_ctx_t * ctx, bcon_t * in)
+{
+    bson_uint32_t count = ctx->count;
+    int r = bcon_to__bson_at(&in, ctx->bson, ctx->is_array, &count);
+
+    if (r) return bcon_dump(in);
+
+    ctx->count = count;
+
+    return NULL;
+}
+
+int bcon_raw_iter_init(bcon_raw_iter_t * ri, const bcon_raw_t * raw)
+{
+    bson_uint32_t len, le_len;
+    bson_type_t type;
+    const char * key;
+    const bson_uint8_t * value;
+    bson_uint32_t value_len;
+
+    ri->buf = ri->stack;
+
+    if (bcon_raw_split(raw, &type, &key, &value, &value_len)) return 1;
+
+    /* framed with a length prefix and a terminator */
+    if (raw->length > 0x7fffffff - 5) return 1;
+
+    len = raw->length + 5;
+    le_len = BSON_UINT32_TO_LE(len);
+
+    if (len > sizeof(ri->stack)) {
+        ri->buf = malloc(len);
+        if (! ri->buf) return 1;
+    }
+
+    memcpy(ri->buf, &le_len, 4);
+    memcpy(ri->buf + 4, raw->data, raw->length);
+    ri->buf[len - 1] = '\0';
+
+    if (! bson_init_static(&ri->doc, ri->buf, len)) return 1;
+    if (! bson_iter_init(&ri->iter, &ri->doc)) return 1;
+
+    return ! bson_iter_next(&ri->iter);
+}
+
+void bcon_raw_iter_destroy(bcon_raw_iter_t * ri)
+{
+    if (ri->buf != ri->stack) free(ri->buf);
+}
+
+/*
+ * Appends every element of doc to bson as its bytes.  libbson versions
+ * without bson_concat() get the same bytes through bson_append_iter().
+ */
+int bcon_concat(bson_t * bson, const bson_t * doc)
+{
+#ifdef HAVE_BSON_CONCAT
+    return ! bson_concat(bson, doc);
+#else
+    bson_iter_t iter;
+
+    if (! bson_iter_init(&iter, doc)) return 1;
+
+    while (bson_iter_next(&iter)) {
+        if (! bson_append_iter(bson, NULL, 0, &iter)) return 1;
+    }
+
+    return 0;
+#endif
+}
+
+/*
+ * The element is framed as a one element document and concatenated, so
+ * its value bytes are copied as they are.
+ */
+int bcon_append_raw(bson_t * bson, bson_type_t type, const char * key, const bson_uint8_t * value, bson_uint32_t value_len)
+{
+    bson_uint8_t stack[128];
+    bson_uint8_t * buf = stack;
+    size_t key_len = strlen(key) + 1;
+    size_t len = 4 + 1 + key_len + value_len + 1;
+    bson_uint32_t le_len;
+    bson_t doc;
+    int r;
+
+    if (value_len > 0x7fffffff - 6 - key_len) return 1;
+
+    if (len > sizeof(stack)) {
+        buf = malloc(len);
+        if (! buf) return 1;
+    }
+
+    le_len = BSON_UINT32_TO_LE((bson_uint32_t)len);
+
+    memcpy(buf, &le_len, 4);
+    buf[4] = (bson_uint8_t)type;
+    memcpy(buf + 5, key, key_len);
+    memcpy(buf + 5 + key_len, value, value_len);
+    buf[len - 1] = '\0';
+
+    r = ! bson_init_static(&doc, buf, len) || bcon_concat(bson, &doc);
+
+    if (buf != stack) free(buf);
+
+    return r;
+}
+
+/*
+ * Everything after the key of the element under iter.  libbson keeps the
+ * end of the current element in next_off.
+ */
+void bcon_iter_value_data(const bson_iter_t * iter, const bson_uint8_t ** data, bson_uint32_t * len)
+{
+    const char * key = bson_iter_key(iter);
+
+    *data = (const bson_uint8_t *)key + strlen(key) + 1;
+    *len = (bson_uint32_t)((iter->raw + iter->next_off) - *data);
+}
+
 void bcon_DUMP_AS_JSON(bcon_t * in)
 {
     bson_t * bson = bson_new();
-    char * err_str = bcon_to_bson(in, bson);
+    char * err_str;
+
+    BCON_PROBE1(dump_begin, in);
+
+    err_str = bcon_to_bson(in, bson);
 
     if (err_str) {
+        BCON_PROBE2(dump_end, in, 0);
         printf("ERROR: %s\n", err_str);
         free(err_str);
     } else {
         char * json = bson_as_json(bson, NULL);
+        BCON_PROBE2(dump_end, in, strlen(json));
         printf("%s\n", json);
         free(json);
     }
@@ -290,79 +682,107 @@ void bcon_DUMP_AS_JSON(bcon_t * in)
     bson_destroy(bson);
 }
 
-void bcon__DUMP(bcon_t ** in, int is_array, UT_string * s, int indent)
+typedef struct bcon_dump_state {
+    UT_string * s;
+    int base;
+    int depth;
+    bson_uint8_t is_array[BCON_VISIT_MAX_DEPTH + 1];
+} bcon_dump_state_t;
+
+static void bcon__dump(bcon_t * in, UT_string * s, int base);
+
+static void bcon_dump_key(bcon_dump_state_t * d, const char * key)
 {
-    bcon_type_t type;
-    void * ptr = NULL;
-    char * key;
-    bcon_t * child;
-    int keep_going = 1;
+    int indent = d->base + 2 * d->depth;
 
-    utstring_printf(s, "%s\n", is_array ? "[" : "{");
+    if (key && ! d->is_array[d->depth]) {
+        utstring_printf(d->s, "%-*s\"%s\" : ", indent, "", key);
+    } else {
+        utstring_printf(d->s, "%-*s", indent, "");
+    }
+}
 
-    while (keep_going) {
-        if (is_array) {
-            type = bcon_token(in, &ptr);
+static int bcon_dump_visit_begin(void * data, const char * key, int is_array)
+{
+    bcon_dump_state_t * d = data;
 
-            if (! (type == BCONT_ERROR || type == BCONT_END)) {
-                utstring_printf(s, "%-*s", indent + 2, "");
-            }
-        } else {
-            type = bcon_token(in, &ptr);
+    if (d->depth) bcon_dump_key(d, key);
 
-            if (type == BCONT_END) {
-                keep_going = 0;
-                break;
-            } else if (type == BCONT_UTF8) {
-                key = *(char **)ptr;
+    utstring_printf(d->s, "%s\n", is_array ? "[" : "{");
 
-                utstring_printf(s, "%-*s\"%s\" : ", indent + 2, "", key);
+    d->is_array[++d->depth] = is_array;
 
-                type = bcon_token(in, &ptr);
-            } else {
-                type = BCONT_ERROR;
-            }
-        }
+    return 0;
+}
 
-        switch (type) {
-            case BCONT_UTF8:
-                utstring_printf(s, "\"%s\"", *(char **)ptr);
-                break;
-            case BCONT_BCON_DOCUMENT:
-                child = *(bcon_t **)ptr;
-                bcon__DUMP(&child, 0, s, indent + 2);
-                break;
-            case BCONT_BCON_ARRAY:
-                child = *(bcon_t **)ptr;
-                bcon__DUMP(&child, 1, s, indent + 2);
-                break;
-            case BCONT_BCON_CODEWSCOPE: {
-                bcon_code_t * code = *(bcon_code_t **)ptr;
+static int bcon_dump_visit_end(void * data, int is_array)
+{
+    bcon_dump_state_t * d = data;
 
-                utstring_printf(s, "%s(", BCON_TYPE_ENUM_STR[type]);
-                bcon__DUMP(&code->scope, 0, s, indent + 2);
-                utstring_printf(s, "%-*s)", indent, "");
-                break;
-            }
-            case BCONT_ERROR:
-                utstring_printf(s, "<ERROR HERE>");
-                return;
-            case BCONT_END:
-                if (! is_array) {
-                    utstring_printf(s, "<ERROR HERE>");
-                    return;
-                }
-                keep_going = 0;
-                break;
-            default:
-                utstring_printf(s, "%s", BCON_TYPE_ENUM_STR[type]);
-                break;
+    d->depth--;
+
+    utstring_printf(d->s, "%-*s%s", d->base + 2 * d->depth, "", is_array ? "]" : "}");
+
+    if (d->depth) utstring_printf(d->s, ",\n");
+
+    return 0;
+}
+
+static int bcon_dump_visit_value(void * data, const char * key, void * val, bcon_type_t type)
+{
+    bcon_dump_state_t * d = data;
+
+    bcon_dump_key(d, key);
+
+    switch (type) {
+        case BCONT_UTF8:
+            utstring_printf(d->s, "\"%s\"", *(char **)val);
+            break;
+        case BCONT_BCON_UTF8_LEN: {
+            bcon_string_t * z = *(bcon_string_t **)val;
+
+            utstring_printf(d->s, "\"%.*s\"", (int)z->length, z->str);
+            break;
         }
+        case BCONT_BCON_CODEWSCOPE: {
+            bcon_code_t * code = *(bcon_code_t **)val;
 
-        if (keep_going) utstring_printf(s, ",\n");
+            utstring_printf(d->s, "%s(", BCON_TYPE_ENUM_STR[type]);
+            bcon__dump(code->scope, d->s, d->base + 2 * d->depth);
+            utstring_printf(d->s, "%-*s)", d->base + 2 * (d->depth - 1), "");
+            break;
+        }
+        default:
+            utstring_printf(d->s, "%s", BCON_TYPE_ENUM_STR[type]);
+            break;
     }
 
-    utstring_printf(s, "%-*s%s", indent, "", is_array ? "]" : "}");
+    utstring_printf(d->s, ",\n");
+
+    return 0;
+}
+
+/*
+ * Renders as much of the stream as is well formed, marking where it stops
+ * being so.
+ */
+static void bcon__dump(bcon_t * in, UT_string * s, int base)
+{
+    bcon_dump_state_t d;
+    bcon_visitor_t v;
+
+    memset(&d, 0, sizeof(d));
+    memset(&v, 0, sizeof(v));
+
+    d.s = s;
+    d.base = base;
+
+    v.begin = bcon_dump_visit_begin;
+    v.end = bcon_dump_visit_end;
+    v.value = bcon_dump_visit_value;
+    v.data = &d;
+
+    if (bcon_visit__doc(&in, 0, &v, 1)) utstring_printf(s, "<ERROR HERE>");
 }
 
 char * bcon_dump(bcon_t * in)
@@ -370,7 +790,11 @@ char * bcon_dump(bcon_t * in)
     UT_string s;
     utstring_init(&s);
 
-    bcon__DUMP(&in, 0, &s, 0);
+    BCON_PROBE1(dump_begin, in);
+
+    bcon__dump(in, &s, 0);
+
+    BCON_PROBE2(dump_end, in, utstring_len(&s));
 
     return utstring_body(&s);
 }
@@ -21,23 +21,63 @@
 #ifndef BCON_H_
 #define BCON_H_
 
+#include <stdarg.h>
+#include <stddef.h>
 #include <bson.h>
 
 #include "bcon_pp.h"
 
+#ifdef __cplusplus
+extern "C++" {
+#include <initializer_list>
+}
+#endif
+
+/*
+ * An unnamed array of type, for the token literals and the structs typed
+ * tokens point at.  C++ has no array compound literals, so there it's an
+ * initializer_list's array instead, which only lives until the end of
+ * the full expression: BCON() has to be used within the call it's
+ * passed to.  The typed tokens use designated initializers, so C++ needs
+ * -std=c++20 (or a compiler that takes them as an extension).
+ */
+#ifdef __cplusplus
+#define BCON_LITERAL(type, ...) (const_cast<type *>(std::initializer_list<type>{ __VA_ARGS__ }.begin()))
+#else
+#define BCON_LITERAL(type, ...) ((type []){ __VA_ARGS__ })
+#endif
+
 #define BCON_ADD_BRACKETS(v) { v }
-#define BCON(...) ((bcon_t []){ BCON_MACRO_MAP( BCON_ADD_BRACKETS, (,), __VA_ARGS__, 0 ) })
+#define BCON(...) BCON_LITERAL(bcon_t, BCON_MACRO_MAP( BCON_ADD_BRACKETS, (,), __VA_ARGS__, 0 ))
 #include "bcon_sub_symbols.h"
 #define BCON_DOC(...) BCON_BCON_DOCUMENT(BCON( __VA_ARGS__ ))
 #define BCON_ARRAY(...) BCON_BCON_ARRAY(BCON( __VA_ARGS__ ))
-#define BCON_BINARY(subtype, binary, length) BCON_BIN(((bcon_binary_t []){{subtype, (uint8_t *)(binary), length}}))
-#define BCON_REGEX(...) BCON_BCON_REGEX(((bcon_regex_t []){{ __VA_ARGS__ }}))
-#define BCON_TIMESTAMP(...) BCON_BCON_TIMESTAMP(((bcon_timestamp_t []){{ __VA_ARGS__ }}))
-#define BCON_DBPOINTER(...) BCON_BCON_DBPOINTER(((bcon_dbpointer_t []){{ __VA_ARGS__ }}))
-#define BCON_CODEWSCOPE(code, ...) BCON_BCON_CODEWSCOPE(((bcon_code_t []){{code, BCON( __VA_ARGS__ )}}))
-#define BCON_CODE(code) BCON_BCON_CODE(((bcon_code_t []){{code, 0}}))
+#define BCON_BINARY(subtype, binary, length) BCON_BIN(BCON_LITERAL(bcon_binary_t, {subtype, (uint8_t *)(binary), length}))
+#define BCON_REGEX(...) BCON_BCON_REGEX(BCON_LITERAL(bcon_regex_t, { __VA_ARGS__ }))
+#define BCON_TIMESTAMP(...) BCON_BCON_TIMESTAMP(BCON_LITERAL(bcon_timestamp_t, { __VA_ARGS__ }))
+#define BCON_DBPOINTER(...) BCON_BCON_DBPOINTER(BCON_LITERAL(bcon_dbpointer_t, { __VA_ARGS__ }))
+#define BCON_CODEWSCOPE(code, ...) BCON_BCON_CODEWSCOPE(BCON_LITERAL(bcon_code_t, {code, BCON( __VA_ARGS__ )}))
+#define BCON_CODE(code) BCON_BCON_CODE(BCON_LITERAL(bcon_code_t, {code, 0}))
+#define BCON_CALLBACK_DOC(fn, data) BCON_BCON_CALLBACK(BCON_LITERAL(bcon_callback_t, {fn, data, BSON_TYPE_DOCUMENT}))
+#define BCON_CALLBACK_ARRAY(fn, data) BCON_BCON_CALLBACK(BCON_LITERAL(bcon_callback_t, {fn, data, BSON_TYPE_ARRAY}))
+#define BCON_RAW(data, length) BCON_BCON_RAW(BCON_LITERAL(bcon_raw_t, {(const bson_uint8_t *)(data), length}))
+#define BCON_UTF8_LEN(str, length) BCON_BCON_UTF8_LEN(BCON_LITERAL(bcon_string_t, {(const char *)(str), length}))
+#define BCON_SYMBOL_LEN(str, length) BCON_BCON_SYMBOL_LEN(BCON_LITERAL(bcon_string_t, {(const char *)(str), length}))
+#define BCON_CODE_LEN(str, length) BCON_BCON_CODE_LEN(BCON_LITERAL(bcon_string_t, {(const char *)(str), length}))
+#define BCON_NEW_OID(out) BCON_BCON_NEW_OID(out)
+#define BCON_NOW(out) BCON_BCON_NOW(out)
+#define BCON_IF(cond, ...) BCON_BCON_IF(BCON_LITERAL(bcon_if_t, {(const bson_bool_t *)(cond), BCON( __VA_ARGS__ )}))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
-extern char * BCON_MAGIC;
+/*
+ * The address of a library object rather than a pointer variable, so token
+ * checks compare against a link time constant.
+ */
+extern const char bcon_magic[];
+#define BCON_MAGIC ((char *)bcon_magic)
 
 typedef enum {
 #include "bcon_enum.h"
@@ -47,6 +87,7 @@ typedef enum {
     BCONT_DOC_END,
     BCONT_END,
     BCONT_ERROR,
+    BCONT_OMIT,
 } bcon_type_t;
 
 typedef struct bcon_binary {
@@ -62,7 +103,7 @@ typedef struct bcon_regex {
 
 typedef struct bcon_code {
     char * code;
-    union bcon * scope;
+    union bcon_slot * scope;
 } bcon_code_t;
 
 typedef struct bcon_dbpointer {
@@ -75,15 +116,838 @@ typedef struct bcon_timestamp {
     bson_uint32_t increment;
 } bcon_timestamp_t;
 
-typedef union bcon {
+/*
+ * A complete element (type byte, key and value) as it appears inside a
+ * document.  BCON_RAW and BCON_ITER_ELEMENT go in key position and bring
+ * their own key, except inside arrays where the index is used.
+ */
+typedef struct bcon_raw {
+    const bson_uint8_t * data;
+    bson_uint32_t length;
+} bcon_raw_t;
+
+/*
+ * A string that isn't NUL terminated, such as a slice of a network
+ * buffer.  BCON_UTF8_LEN(), BCON_SYMBOL_LEN() and BCON_CODE_LEN() encode
+ * exactly length bytes of str without scanning or copying it first.
+ * Since the token holds a pointer to the bcon_string_t, passing a
+ * caller's variable directly (BCON_BCON_UTF8_LEN(&slice)) reads whatever
+ * it holds at encode time.
+ */
+typedef struct bcon_string {
+    const char * str;
+    bson_uint32_t length;
+} bcon_string_t;
+
+/*
+ * Elements that are only there while *cond is true, so documents with
+ * optional fields can share one template.  BCON_IF(&cond, ...) goes in key
+ * position and holds key/value pairs, or just values inside an array.
+ * The condition is read every time the template is encoded.
+ *
+ * Likewise a P binding whose pointer is NULL at encode time leaves its
+ * element out, key and all:
+ *
+ *     BCON( "user", BCON_PUTF8(&name_ref),
+ *           BCON_IF(&is_admin, "role", "admin", "level", BCON_RINT32(&lvl)) )
+ *
+ * A NULL P binding in key position drops the value after it too, along
+ * with the body of an inline "{" or "[".  Array elements after a missing
+ * one are numbered without a gap.
+ */
+typedef struct bcon_if {
+    const bson_bool_t * cond;
+    union bcon_slot * body;
+} bcon_if_t;
+
+/*
+ * Handed to BCON_CALLBACK_DOC/BCON_CALLBACK_ARRAY callbacks while their
+ * document or array is open.  Callbacks append straight to bson, either
+ * with bcon_append() or with libbson's bson_append_* functions using
+ * bcon_append_key() for the key (which numbers array elements).
+ */
+typedef struct bcon_append_ctx {
+    bson_t * bson;
+    int is_array;
+    bson_uint32_t count;
+    char key[16];
+} bcon_append_ctx_t;
+
+/* Return non-zero to fail the encode. */
+typedef int (*bcon_callback_fn_t)(bcon_append_ctx_t * ctx, void * data);
+
+typedef struct bcon_callback {
+    bcon_callback_fn_t fn;
+    void * data;
+    bson_type_t type;
+} bcon_callback_t;
+
+/*
+ * Braced initializers set a union's first member, so in C++ a bare string
+ * in BCON() lands in a const char * rather than binding a literal to
+ * char *.  It shares the slot with UTF8, and C never sees it.
+ */
+typedef union bcon_slot {
+#ifdef __cplusplus
+    const char * CUTF8;
+#endif
 #include "bcon_union.h"
 
     bcon_type_t type;
 } bcon_t;
 
+typedef enum {
+    BCON_HASH_VALUES,
+    BCON_HASH_SHAPE,
+} bcon_hash_mode_t;
+
+typedef struct bcon_hash {
+    bson_uint64_t lo;
+    bson_uint64_t hi;
+} bcon_hash_t;
+
+bcon_type_t bcon_token(bcon_t ** stream, void ** out);
+bson_type_t bcon_bson_type(bcon_type_t type);
+
 char * bcon_dump(bcon_t * in);
+const char * bcon_append_key(bcon_append_ctx_t * ctx, const char * key);
+char * bcon_append(bcon_append_ctx_t * ctx, bcon_t * in);
+
+/*
+ * Encodes in into bson, returning a bcon_dump() of in on error.  Templates
+ * nest at most BCON_VISIT_MAX_DEPTH levels, the top level document
+ * included; deeper ones are an error.
+ */
 char * bcon_to_bson(bcon_t * in, bson_t * bson);
 void bcon_DUMP(bcon_t * in);
 void bcon_DUMP_AS_JSON(bcon_t * in);
 
+/*
+ * Hash a template and its bound values without encoding it.  The hash is
+ * taken over the bson encoding of the document with every document and array
+ * length prefix (and the code with scope total length) left out, so
+ * bcon_hash() of a template equals bcon_hash_bson() of its encoding.
+ * BCON_HASH_SHAPE only covers types, keys and nesting.  Templates holding
+ * BCON_CALLBACK_* tokens can't be hashed.
+ */
+char * bcon_hash(bcon_t * in, bcon_hash_mode_t mode, bcon_hash_t * out);
+void bcon_hash_bson(const bson_t * bson, bcon_hash_mode_t mode, bcon_hash_t * out);
+
+/* Running hash state, exposed so bcon_hash_visitor_init() can be used. */
+typedef struct bcon_hash_state {
+    bson_uint64_t h1;
+    bson_uint64_t h2;
+    bson_uint64_t total;
+    bson_uint8_t tail[8];
+    int tail_len;
+    bcon_hash_mode_t mode;
+} bcon_hash_state_t;
+
+/*
+ * Returns 1 if encoding the template would produce exactly the bytes in
+ * bson, 0 otherwise.  Walks both in lockstep and stops at the first
+ * difference without allocating.  BCON_CALLBACK_* tokens never compare
+ * equal.
+ */
+int bcon_equal_bson(bcon_t * in, const bson_t * bson);
+
+/*
+ * Query matching.  The pattern is a BCON document mapping (optionally
+ * dotted) paths to either a value to compare for equality or a document of
+ * operators:
+ *
+ *     BCON( "age", BCON_DOC( "$gte", BCON_INT32(21), "$lt", BCON_INT32(65) ),
+ *           "tags", BCON_DOC( "$in", BCON_ARRAY( "a", "b" ) ),
+ *           "name", "John" )
+ *
+ * Supported operators are $eq, $ne, $gt, $gte, $lt, $lte, $in, $nin and
+ * $exists.  Binary, regex, code, code with scope and DBPointer values
+ * compare by their bytes.  Array values match when any element does, and
+ * a dotted path steps into every document in an array it meets.
+ *
+ * Each document is walked once.  Clauses are checked as their fields turn
+ * up, in the matcher's current order, stopping at the first that fails,
+ * and the clauses that fail most often are moved to the front as the
+ * matcher is used.  Matching updates those failure counts, so a
+ * matcher must not be shared between threads without a lock; compile one
+ * per thread instead.
+ */
+typedef struct bcon_matcher bcon_matcher_t;
+
+/* Return non-zero from the batch callback to stop early. */
+typedef int (*bcon_match_cb_t)(const bson_t * bson, void * ctx);
+
+char * bcon_matcher_compile(bcon_t * pattern, bcon_matcher_t ** matcher);
+int bcon_matcher_match(bcon_matcher_t * matcher, const bson_t * bson);
+int bcon_matcher_match_data(bcon_matcher_t * matcher, const bson_uint8_t * data, size_t len);
+long bcon_matcher_match_batch(bcon_matcher_t * matcher, const bson_uint8_t * data, size_t len, bcon_match_cb_t cb, void * ctx);
+void bcon_matcher_destroy(bcon_matcher_t * matcher);
+
+/*
+ * Appends the fields of bson named in spec to out, in source order.  A
+ * field whose spec value is a document (BCON_DOC or an inline "{") is
+ * projected recursively, applying to each document of an array (other
+ * array elements are dropped and the rest renumbered); any other spec
+ * value copies the whole field.  The projection is written into a single
+ * buffer, copying each field's source bytes rather than decoding them,
+ * and appended to out in one go.
+ *
+ *     bcon_project(bson, BCON( "_id", BCON_BOOL(1), "addr", BCON_DOC( "zip", BCON_BOOL(1) ) ), out);
+ */
+char * bcon_project(const bson_t * bson, bcon_t * spec, bson_t * out);
+
+/*
+ * The number of bytes bcon_to_bson() would produce, without encoding.
+ */
+char * bcon_encoded_size(bcon_t * in, bson_uint32_t * size);
+
+/*
+ * Resumable encoding into caller supplied, fixed size buffers.
+ *
+ *     bcon_encoder_init(&enc, bcon);
+ *     status = bcon_encoder_feed(&enc, buf, sizeof(buf), &n);
+ *     while (status == BCON_ENCODER_NEED_SPACE) {
+ *         send(fd, buf, n, 0);
+ *         status = bcon_encoder_resume(&enc, &n);
+ *     }
+ *     send(fd, buf, n, 0);
+ *
+ * Nesting lives on an explicit stack inside bcon_encoder_t, so no memory
+ * is allocated.  Length prefixes are patched in place when a document ends
+ * within the same buffer.  When a buffer fills up with documents still
+ * open, those documents are sized from their tokens before returning so
+ * nothing already handed back needs fixing later.  BCON_CALLBACK_* tokens
+ * aren't supported.
+ */
+#define BCON_ENCODER_MAX_DEPTH 100
+
+typedef enum {
+    BCON_ENCODER_INIT,
+    BCON_ENCODER_DONE,
+    BCON_ENCODER_NEED_SPACE,
+    BCON_ENCODER_ERROR,
+} bcon_encoder_status_t;
+
+typedef struct bcon_encoder_piece {
+    const bson_uint8_t * ptr;
+    bson_uint32_t len;
+} bcon_encoder_piece_t;
+
+typedef struct bcon_encoder_frame {
+    bcon_t * stream;
+    bcon_t * start;
+    bson_uint64_t offset;
+    bson_uint32_t index;
+    bson_uint8_t len_bytes[4];
+    bson_uint8_t is_array;
+    bson_uint8_t is_inline;
+    bson_uint8_t is_splice;
+    bson_uint8_t patched;
+    int level;
+    bson_uint32_t live;
+    bson_uint32_t ends;
+} bcon_encoder_frame_t;
+
+typedef struct bcon_encoder {
+    bcon_encoder_frame_t stack[BCON_ENCODER_MAX_DEPTH];
+    int depth;
+
+    bcon_encoder_piece_t pieces[8];
+    int n_pieces;
+    int cur_piece;
+    bson_uint32_t piece_off;
+
+    bson_uint8_t type_byte;
+    bson_uint8_t scratch[16];
+    char key[16];
+
+    bson_uint8_t * buf;
+    size_t len;
+    size_t pos;
+    bson_uint64_t chunk_start;
+
+    struct bcon_capture * captures;
+    int n_captures;
+
+    bcon_encoder_status_t status;
+} bcon_encoder_t;
+
+void bcon_encoder_init(bcon_encoder_t * enc, bcon_t * in);
+bcon_encoder_status_t bcon_encoder_feed(bcon_encoder_t * enc, bson_uint8_t * buf, size_t len, size_t * written);
+bcon_encoder_status_t bcon_encoder_resume(bcon_encoder_t * enc, size_t * written);
+
+/*
+ * Captures record where chosen elements land while the encoder writes
+ * them, so a router can find the shard key or patch a field in the output
+ * without scanning it again.  Paths are dotted keys; array elements are
+ * named by their index, as in "tags.0".
+ *
+ *     bcon_capture_t caps[2] = { { "user" }, { "loc.region" } };
+ *
+ *     bcon_encoder_init(&enc, bcon);
+ *     bcon_encoder_capture(&enc, caps, 2);
+ *     ... feed until done ...
+ *     bcon_capture_shard_hash(caps, 2, &shard);
+ *
+ * offset is that of the element's type byte from the start of the
+ * document and length covers the whole element, key included.  type is
+ * BSON_TYPE_EOD for paths that weren't found; with repeated keys the first
+ * one wins.  hash is taken over the value bytes as they are written.
+ * Documents and arrays built from tokens aren't in memory yet at that
+ * point, so their hash is left zero and only their type counts towards
+ * the shard hash.  Captures stay with the encoder until the next
+ * bcon_encoder_init(); at most BCON_ENCODER_MAX_CAPTURES can be set.
+ */
+#define BCON_ENCODER_MAX_CAPTURES 32
+
+typedef struct bcon_capture {
+    const char * path;
+    bson_uint64_t offset;
+    bson_uint32_t length;
+    bson_type_t type;
+    bcon_hash_t hash;
+} bcon_capture_t;
+
+int bcon_encoder_capture(bcon_encoder_t * enc, bcon_capture_t * caps, int n);
+
+/*
+ * Combines the value hashes of the captures in list order, with missing
+ * paths counting as such, into a key independent of where the fields sat
+ * in the document.
+ */
+void bcon_capture_shard_hash(const bcon_capture_t * caps, int n, bcon_hash_t * out);
+
+
+/*
+ * Sinks receive encoded bytes in BCON_SINK_CHUNK sized pieces as they are
+ * produced, so a document never has to exist in memory in full.  A
+ * compressing sink forwards its output to the next sink in the chain.
+ *
+ *     bcon_sink_file_init(&file, fp);
+ *     bcon_sink_zlib_init(&zlib, &file, 6);
+ *     bcon_encode_batch_to_sink(docs, n_docs, &zlib);
+ *     bcon_sink_finish(&zlib);
+ *     bcon_sink_destroy(&zlib);
+ *
+ * write and finish return non-zero on failure.  zstd is only available if
+ * it was found at configure time; otherwise bcon_sink_zstd_init() fails.
+ */
+#define BCON_SINK_CHUNK 4096
+
+typedef struct bcon_sink bcon_sink_t;
+
+struct bcon_sink {
+    int (*write)(bcon_sink_t * sink, const bson_uint8_t * data, size_t len);
+    int (*finish)(bcon_sink_t * sink);
+    void (*destroy)(bcon_sink_t * sink);
+    void * data;
+    bcon_sink_t * next;
+};
+
+void bcon_sink_file_init(bcon_sink_t * sink, FILE * fp);
+char * bcon_sink_zlib_init(bcon_sink_t * sink, bcon_sink_t * next, int level);
+char * bcon_sink_zstd_init(bcon_sink_t * sink, bcon_sink_t * next, int level);
+int bcon_sink_finish(bcon_sink_t * sink);
+void bcon_sink_destroy(bcon_sink_t * sink);
+
+char * bcon_encode_to_sink(bcon_t * in, bcon_sink_t * sink);
+char * bcon_encode_batch_to_sink(bcon_t ** in, size_t n, bcon_sink_t * sink);
+
+
+/*
+ * Per-element byte accounting for a template with its current bindings,
+ * without encoding it.  key_bytes counts each element's type byte, key and
+ * terminator; value_bytes counts leaf values; overhead_bytes counts the
+ * length prefix and terminator of every document and array, so
+ *
+ *     total == key_bytes + value_bytes + overhead_bytes
+ *
+ * If tree isn't NULL it receives a bcon_DUMP style rendering with the
+ * size of every element, which the caller frees.  Document and array
+ * lines also carry the number of elements below them and the levels of
+ * nesting they span, counting themselves.
+ */
+typedef struct bcon_size_report {
+    bson_uint32_t total;
+    bson_uint32_t key_bytes;
+    bson_uint32_t value_bytes;
+    bson_uint32_t overhead_bytes;
+    bson_uint32_t elements;
+    int max_depth;
+} bcon_size_report_t;
+
+char * bcon_size_report(bcon_t * in, bcon_size_report_t * report, char ** tree);
+
+
+/*
+ * A reusable encoding context, meant to be kept per thread.  The output
+ * buffer only ever grows and the nesting stack lives in the embedded
+ * encoder, so once the buffer has reached the size of the largest
+ * document encoding a template performs no allocations at all.
+ *
+ *     bson = bcon_ctx_to_bson(&ctx, BCON( "x", BCON_RINT32(&x) ));
+ *     if (! bson) fprintf(stderr, "%s\n", bcon_ctx_error(&ctx));
+ *
+ * The returned document points into the context and is valid until the
+ * next call.  BCON_CALLBACK_* tokens aren't supported.  If the buffer
+ * can't grow the call fails with "out of memory" and the context keeps
+ * the buffer it had.
+ */
+typedef struct bcon_ctx {
+    bcon_encoder_t encoder;
+    bson_uint8_t * buf;
+    size_t buf_len;
+    bson_t doc;
+    char * err;
+    bcon_capture_t * captures;
+    int n_captures;
+} bcon_ctx_t;
+
+void bcon_ctx_init(bcon_ctx_t * ctx);
+void bcon_ctx_reset(bcon_ctx_t * ctx);
+void bcon_ctx_destroy(bcon_ctx_t * ctx);
+const bson_t * bcon_ctx_to_bson(bcon_ctx_t * ctx, bcon_t * in);
+const char * bcon_ctx_error(const bcon_ctx_t * ctx);
+
+/*
+ * Captures to fill on every following bcon_ctx_to_bson(), or NULL to
+ * stop.  See bcon_encoder_capture().
+ */
+int bcon_ctx_capture(bcon_ctx_t * ctx, bcon_capture_t * caps, int n);
+
+
+/*
+ * Struct mapped encoding.  A descriptor lists the members of a C struct
+ * once; each member has the C type bcon_types.txt gives its BCON type
+ * (R and P variants read through one or two pointers), an embedded
+ * struct, or a pointer to an array of structs with a size_t count member.
+ *
+ *     static bcon_field_t point_fields[] = {
+ *         BCON_FIELD(point_t, x, DOUBLE),
+ *         BCON_FIELD(point_t, y, DOUBLE),
+ *         BCON_FIELD_END
+ *     };
+ *     static bcon_struct_t point_desc = BCON_STRUCT(point_t, point_fields);
+ *
+ *     bcon_struct_write(&point_desc, points, n_points, writer);
+ *
+ * bcon_struct_init() resolves every field to a type specific appender and
+ * precomputes its key length; the encoders call it on first use, so call
+ * it up front when a descriptor is shared between threads.  It leaves
+ * the declared types alone, so a descriptor that failed can be fixed and
+ * initialized again.
+ *
+ * As with bindings in templates, a P member that is NULL, or points to
+ * NULL, leaves its field out.  A NULL R member is an encoding error.
+ */
+typedef struct bcon_field bcon_field_t;
+typedef struct bcon_struct bcon_struct_t;
+
+typedef int (*bcon_field_put_t)(bson_t * bson, const bcon_field_t * field, const void * val, const bson_uint8_t * record);
+
+struct bcon_field {
+    const char * key;
+    bcon_type_t type;
+    size_t offset;
+    const bcon_struct_t * nested;
+    size_t count_offset;
+
+    int key_len;
+    int indirection;
+    bcon_type_t base_type;
+    bcon_field_put_t put;
+};
+
+struct bcon_struct {
+    size_t size;
+    bcon_field_t * fields;
+    int ready;
+};
+
+#define BCON_FIELD(s, member, type) { #member, BCONT_##type, offsetof(s, member), NULL, 0 }
+#define BCON_FIELD_AS(key, s, member, type) { key, BCONT_##type, offsetof(s, member), NULL, 0 }
+#define BCON_FIELD_STRUCT(s, member, desc) { #member, BCONT_DOC_START, offsetof(s, member), &(desc), 0 }
+#define BCON_FIELD_STRUCT_ARRAY(s, member, count, desc) { #member, BCONT_ARRAY_START, offsetof(s, member), &(desc), offsetof(s, count) }
+#define BCON_FIELD_END { NULL }
+#define BCON_STRUCT(s, fields) { sizeof(s), fields, 0 }
+
+char * bcon_struct_init(bcon_struct_t * desc);
+char * bcon_struct_to_bson(bcon_struct_t * desc, const void * record, bson_t * bson);
+char * bcon_struct_array_to_bson(bcon_struct_t * desc, const void * records, size_t n, bson_t * bson, const char * key);
+char * bcon_struct_write(bcon_struct_t * desc, const void * records, size_t n, bson_writer_t * writer);
+
+
+/*
+ * Columnar extraction.  The spec names top level keys and the arrays to
+ * fill, using R (or P) variants so each token points at the start of a
+ * column; plain value tokens are rejected:
+ *
+ *     bcon_columns_init(&cols, BCON( "ts", BCON_RINT64(ts), "value", BCON_RDOUBLE(vals) ), validity, n);
+ *     bcon_columns_from_data(&cols, data, len);
+ *
+ * Each document is iterated once, filling row n_rows of every column.
+ * Columns may be int32, int64 (which also takes int32 and date_time
+ * milliseconds), double, bool or utf8 (pointers into the source
+ * document).  validity, if not NULL, holds one bitmap per column, bit
+ * row % 8 of byte row / 8 set when the row holds a value; missing, null
+ * or mistyped fields clear it and store zero.
+ */
+#define BCON_COLUMNS_MAX 64
+
+typedef struct bcon_column {
+    const char * key;
+    size_t key_len;
+    bcon_type_t type;
+    void * data;
+    bson_uint8_t * validity;
+} bcon_column_t;
+
+typedef struct bcon_columns {
+    bcon_column_t cols[BCON_COLUMNS_MAX];
+    int n_cols;
+    size_t n_rows;
+    size_t capacity;
+} bcon_columns_t;
+
+char * bcon_columns_init(bcon_columns_t * c, bcon_t * spec, bson_uint8_t ** validity, size_t capacity);
+char * bcon_columns_add(bcon_columns_t * c, const bson_t * bson);
+char * bcon_columns_from_bson(bcon_columns_t * c, const bson_t * const * docs, size_t n);
+char * bcon_columns_from_data(bcon_columns_t * c, const bson_uint8_t * data, size_t len);
+
+
+/*
+ * Token stream visitor.  bcon_visit() tokenizes a template once and calls
+ * every registered visitor in order for each event: begin and end of each
+ * document or array (key is NULL for the top level document) and each
+ * value, with R and P variants already resolved.  Inline "{" / "[" and
+ * BCON_DOC() / BCON_ARRAY() both show up as begin/end pairs; array
+ * elements get their index as key.  BCON_ITER_ELEMENT and BCON_RAW in key
+ * position are passed with a NULL key.  Any callback returning non-zero
+ * stops the walk, as does nesting past BCON_VISIT_MAX_DEPTH levels.
+ *
+ *     bcon_size_visitor_init(&v[0], &size);
+ *     bcon_hash_visitor_init(&v[1], &hash_state, BCON_HASH_VALUES);
+ *     bcon_bson_visitor_init(&v[2], &bson_state, bson);
+ *     bcon_visit(bcon, v, 3);
+ *     bcon_hash_visitor_final(&hash_state, &hash);
+ *
+ * bcon_to_bson(), bcon_hash() and bcon_dump() are built on these.  The
+ * bson visitor keeps the first few levels of children in its state and
+ * allocates the rest on first use; bcon_bson_visitor_destroy() frees them.
+ */
+#define BCON_VISIT_MAX_DEPTH 100
+#define BCON_BSON_VISITOR_INLINE_DEPTH 8
+
+typedef struct bcon_visitor {
+    int (*begin)(void * data, const char * key, int is_array);
+    int (*end)(void * data, int is_array);
+    int (*value)(void * data, const char * key, void * val, bcon_type_t type);
+    void * data;
+} bcon_visitor_t;
+
+typedef struct bcon_bson_visitor {
+    bson_t * stack[BCON_VISIT_MAX_DEPTH];
+    bson_t children[BCON_BSON_VISITOR_INLINE_DEPTH];
+    bson_t * deep_children;
+    int depth;
+} bcon_bson_visitor_t;
+
+char * bcon_visit(bcon_t * in, bcon_visitor_t * visitors, int n_visitors);
+
+void bcon_bson_visitor_init(bcon_visitor_t * v, bcon_bson_visitor_t * state, bson_t * bson);
+void bcon_bson_visitor_destroy(bcon_bson_visitor_t * state);
+void bcon_size_visitor_init(bcon_visitor_t * v, bson_uint32_t * size);
+void bcon_hash_visitor_init(bcon_visitor_t * v, bcon_hash_state_t * state, bcon_hash_mode_t mode);
+void bcon_hash_visitor_final(bcon_hash_state_t * state, bcon_hash_t * out);
+
+
+/*
+ * Asynchronous JSON logging.  The calling thread only copies (or encodes)
+ * a record's BSON bytes into a fixed-size slot of a lock-free ring shared
+ * by any number of producers; a background thread turns records into JSON
+ * lines and writes them out a batch at a time.  When the ring is full the
+ * policy decides: DROP counts the record as dropped, SAMPLE starts keeping
+ * only every sample_every'th record once the ring is half full, and BLOCK
+ * waits for the writer to free a slot.  Records larger than slot_size are
+ * counted as oversized and templates that fail to encode as errors;
+ * neither is logged.
+ *
+ *     opts.out = stderr;
+ *     opts.n_slots = 1024;
+ *     opts.slot_size = 512;
+ *     opts.policy = BCON_LOG_DROP;
+ *     bcon_log_start(&opts, &log);
+ *     bcon_log(log, BCON( "op", "insert", "ms", BCON_INT32(ms) ));
+ *     bcon_log_stop(log);
+ *
+ * bcon_log_stop() writes out everything already in the ring before it
+ * returns.
+ */
+typedef enum {
+    BCON_LOG_DROP,
+    BCON_LOG_SAMPLE,
+    BCON_LOG_BLOCK,
+} bcon_log_policy_t;
+
+typedef struct bcon_log_opts {
+    FILE * out;
+    size_t n_slots;
+    size_t slot_size;
+    bcon_log_policy_t policy;
+    bson_uint32_t sample_every;
+    size_t batch;
+} bcon_log_opts_t;
+
+typedef struct bcon_log_stats {
+    bson_uint64_t logged;
+    bson_uint64_t written;
+    bson_uint64_t dropped;
+    bson_uint64_t oversized;
+    bson_uint64_t errors;
+} bcon_log_stats_t;
+
+typedef struct bcon_log bcon_log_t;
+
+char * bcon_log_start(const bcon_log_opts_t * opts, bcon_log_t ** log);
+int bcon_log(bcon_log_t * log, bcon_t * in);
+int bcon_log_bson(bcon_log_t * log, const bson_t * bson);
+void bcon_log_stats(bcon_log_t * log, bcon_log_stats_t * stats);
+void bcon_log_stop(bcon_log_t * log);
+
+
+/*
+ * Incremental re-encoding.  bcon_incr_init() encodes a template once and
+ * remembers where every value landed.  bcon_incr_update() then checks
+ * each bound value against the bytes already there and re-encodes only
+ * the elements that changed, shifting the rest of the document and
+ * fixing the enclosing length prefixes as needed.
+ *
+ *     bcon_incr_init(&incr, SESSION_TEMPLATE);
+ *     send(fd, bson_get_data(&incr.doc), incr.doc.len, 0);
+ *     user_name = "bob";
+ *     bcon_incr_update(&incr);
+ *
+ * The template's tokens are read again on every update, so it has to
+ * outlive the bcon_incr_t, and its shape (keys, nesting and types) must
+ * not change; only the values behind R and P bindings may.  That includes
+ * BCON_IF() conditions and NULL P bindings, which add or drop elements.
+ * n_changed is the number of elements the last update rewrote.  After an
+ * error the document is in no useful state and the bcon_incr_t has to be
+ * destroyed and initialized again.
+ */
+typedef struct bcon_incr_elem {
+    bson_uint32_t offset;
+    bson_uint32_t len;
+    bson_uint32_t header_len;
+    int doc;
+    bcon_type_t type;
+    void * val;
+} bcon_incr_elem_t;
+
+typedef struct bcon_incr_doc {
+    bson_uint32_t offset;
+    int parent;
+} bcon_incr_doc_t;
+
+typedef struct bcon_incr {
+    bcon_t * in;
+    bson_uint8_t * buf;
+    bson_uint32_t buf_len;
+    bson_uint32_t len;
+    bcon_incr_elem_t * elems;
+    int n_elems;
+    bcon_incr_doc_t * docs;
+    int n_docs;
+    int n_changed;
+    bson_t doc;
+} bcon_incr_t;
+
+char * bcon_incr_init(bcon_incr_t * incr, bcon_t * in);
+char * bcon_incr_update(bcon_incr_t * incr);
+void bcon_incr_destroy(bcon_incr_t * incr);
+
+
+/*
+ * Templates parsed at runtime from JSON-like text, so document shapes can
+ * come from configuration.  Values are written as in JSON; placeholders
+ * are $N:type with N counting from 1 and type one of utf8, int32, int64,
+ * double, bool, doc, array (bson_t *), oid (bson_oid_t *) or date
+ * (struct timeval *).
+ *
+ *     bcon_template_compile("{ \"user\": $1:utf8, \"n\": $2:int32 }", &t);
+ *     bcon_to_bson(bcon_template_bind(t, "alice", 3), bson);
+ *
+ * Compiling produces the same token stream the BCON() macro would, with
+ * placeholders as R tokens into the template's argument slots, so it
+ * encodes at the same speed.  bcon_template_bind() fills the slots from
+ * its arguments in placeholder order and returns the stream; it stays
+ * valid until the template is destroyed.
+ *
+ * bcon_format() compiles on first use and caches the template by the
+ * address of fmt, so fmt should be a string literal or otherwise never
+ * change.  The cache is per thread; bcon_format_cleanup() frees the
+ * calling thread's templates.
+ */
+#define BCON_TEMPLATE_MAX_ARGS 32
+
+typedef struct bcon_template bcon_template_t;
+
+char * bcon_template_compile(const char * text, bcon_template_t ** t);
+bcon_t * bcon_template_bind(bcon_template_t * t, ...);
+bcon_t * bcon_template_vbind(bcon_template_t * t, va_list ap);
+void bcon_template_destroy(bcon_template_t * t);
+
+char * bcon_format(bson_t * bson, const char * fmt, ...);
+void bcon_format_cleanup(void);
+
+
+/*
+ * Values generated while encoding.  BCON_NEW_OID(out) encodes a fresh
+ * ObjectId and BCON_NOW(out) the current time as a date; out may be NULL,
+ * or a bson_oid_t * / bson_int64_t * (milliseconds) to receive the value.
+ *
+ *     bcon_to_bson(BCON( "_id", BCON_NEW_OID(&id), "at", BCON_NOW(NULL), ... ), bson);
+ *
+ * ObjectIds come from a per thread block of a process wide counter, so
+ * generating one takes no lock and no system call.  Times come from
+ * CLOCK_REALTIME_COARSE where available, which is read through the vDSO
+ * and is only as precise as the kernel tick.  bcon_hash() can't hash
+ * these in BCON_HASH_VALUES mode, and bcon_equal() accepts any value of
+ * the right type for them.
+ */
+void bcon_oid_gen(bson_oid_t * oid);
+bson_int64_t bcon_now_ms(void);
+
+
+/*
+ * Token streams built at runtime, for documents whose fields or array
+ * lengths aren't known until then.  The builder appends the same tokens
+ * the BCON() macro expands to, so the stream works anywhere a BCON() one
+ * does.
+ *
+ *     bcon_builder_init(&b);
+ *     for (i = 0; i < n_fields; i++) bcon_builder_int32(&b, names[i], values[i]);
+ *     bcon_builder_begin_array(&b, "tags");
+ *     for (i = 0; i < n_tags; i++) bcon_builder_utf8(&b, NULL, tags[i]);
+ *     bcon_builder_end_array(&b);
+ *     err = bcon_to_bson(bcon_builder_tokens(&b), bson);
+ *     bcon_builder_reset(&b);
+ *
+ * Keys are ignored inside arrays.  Strings, bson_t and bson_oid_t values
+ * are referenced rather than copied, as in BCON(); bcon_builder_strdup()
+ * copies one into the builder's arena when it won't outlive the stream.
+ * Values that BCON() keeps in a compound literal (dates, regexes, binary
+ * and so on) go in the arena too.  bcon_builder_value() appends any
+ * other token, including R and P bindings that are read at encode time.
+ *
+ * Token space doubles as it fills and reset keeps both it and the arena,
+ * so a builder reused for documents of similar size stops allocating.
+ * bcon_builder_tokens() returns NULL if a document or array is left open
+ * or closed twice.  The stream is valid until the next append or reset.
+ */
+typedef struct bcon_builder_block bcon_builder_block_t;
+
+typedef struct bcon_builder {
+    bcon_t * tokens;
+    size_t n_tokens;
+    size_t cap;
+
+    bcon_builder_block_t * blocks;
+    bcon_builder_block_t * cur;
+
+    int depth;
+    int failed;
+    bson_uint8_t is_array[BCON_VISIT_MAX_DEPTH + 1];
+} bcon_builder_t;
+
+void bcon_builder_init(bcon_builder_t * b);
+void bcon_builder_reset(bcon_builder_t * b);
+void bcon_builder_destroy(bcon_builder_t * b);
+bcon_t * bcon_builder_tokens(bcon_builder_t * b);
+
+void * bcon_builder_alloc(bcon_builder_t * b, size_t size);
+char * bcon_builder_strdup(bcon_builder_t * b, const char * str);
+
+void bcon_builder_begin_doc(bcon_builder_t * b, const char * key);
+void bcon_builder_end_doc(bcon_builder_t * b);
+void bcon_builder_begin_array(bcon_builder_t * b, const char * key);
+void bcon_builder_end_array(bcon_builder_t * b);
+
+void bcon_builder_value(bcon_builder_t * b, const char * key, bcon_type_t type, bcon_t value);
+void bcon_builder_utf8(bcon_builder_t * b, const char * key, const char * str);
+void bcon_builder_utf8_len(bcon_builder_t * b, const char * key, const char * str, bson_uint32_t len);
+void bcon_builder_int32(bcon_builder_t * b, const char * key, bson_int32_t v);
+void bcon_builder_int64(bcon_builder_t * b, const char * key, bson_int64_t v);
+void bcon_builder_double(bcon_builder_t * b, const char * key, double v);
+void bcon_builder_bool(bcon_builder_t * b, const char * key, bson_bool_t v);
+void bcon_builder_null(bcon_builder_t * b, const char * key);
+void bcon_builder_oid(bcon_builder_t * b, const char * key, const bson_oid_t * oid);
+void bcon_builder_date_time(bcon_builder_t * b, const char * key, bson_int64_t ms);
+void bcon_builder_bson(bcon_builder_t * b, const char * key, const bson_t * bson, int is_array);
+void bcon_builder_regex(bcon_builder_t * b, const char * key, const char * regex, const char * flags);
+void bcon_builder_binary(bcon_builder_t * b, const char * key, bson_subtype_t subtype, const bson_uint8_t * data, bson_uint32_t len);
+
+
+/*
+ * Compiled encoding plans.  bcon_plan_compile() walks a template once and
+ * turns it into a flat list of steps over a prebuilt image: type bytes,
+ * keys (array indices included) and terminators become literal runs that
+ * are copied as one block, and each value becomes a step that reads the
+ * token at a fixed slot, straight through its R pointer when it has one.
+ * Encoding then does no token parsing, key strlen() or index formatting.
+ *
+ *     bcon_plan_compile(BCON( "user", BCON_RUTF8(&name), "n", BCON_RINT32(&n) ), &plan);
+ *     size = bcon_plan_encode(plan, BCON( "user", BCON_RUTF8(&name), "n", BCON_RINT32(&n) ), buf, sizeof(buf));
+ *
+ * A plan can encode any template of the same shape: the same keys, types
+ * and nesting, with values free to change.  P bindings and BCON_IF() in
+ * documents become tests that jump over their elements.  bcon_plan_encode()
+ * makes a single pass, writing the document if it fits in len and
+ * returning its size either way; values such as BCON_NEW_OID() are
+ * generated on every call, short buffer or not.
+ *
+ * On x86-64 a compiled plan is also turned into machine code, with keys
+ * and type bytes as immediate stores and bound values loaded straight
+ * through their pointers.  The code is written to a private mapping that
+ * is only made executable once it's complete.  Where that isn't possible
+ * the plan's steps run instead, so the output is the same either way.
+ * bcon_plan_is_native() says which a plan got.  Templates holding P
+ * bindings or BCON_IF() inside arrays (dropping an element would renumber
+ * the rest), callbacks, iterators, raw elements, code with scope or
+ * DBPointers, bound keys, or bound BCON_DOC()/BCON_ARRAY()/BCON_IF()
+ * tokens don't compile.
+ *
+ * A bcon_hot_t promotes the template at one call site to a plan once it
+ * has run BCON_HOT_THRESHOLD times through bcon_ctx_to_bson_hot(); one
+ * that doesn't compile keeps using the encoder.  Sites may be shared
+ * between threads.  Contexts with captures always use the encoder.
+ *
+ *     static bcon_hot_t hot = BCON_HOT_INIT;
+ *
+ *     bson = bcon_ctx_to_bson_hot(&ctx, &hot, BCON( "x", BCON_RINT32(&x) ));
+ */
+#define BCON_HOT_THRESHOLD 64
+
+typedef struct bcon_plan bcon_plan_t;
+
+char * bcon_plan_compile(bcon_t * in, bcon_plan_t ** plan);
+bson_uint32_t bcon_plan_encode(const bcon_plan_t * plan, bcon_t * in, bson_uint8_t * buf, size_t len);
+void bcon_plan_destroy(bcon_plan_t * plan);
+int bcon_plan_is_native(const bcon_plan_t * plan);
+
+typedef struct bcon_hot {
+    unsigned long runs;
+    bcon_plan_t * plan;
+    int cold;
+} bcon_hot_t;
+
+#define BCON_HOT_INIT { 0, NULL, 0 }
+
+const bson_t * bcon_ctx_to_bson_hot(bcon_ctx_t * ctx, bcon_hot_t * hot, bcon_t * in);
+void bcon_hot_destroy(bcon_hot_t * hot);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,258 @@
+/*
+ * @file bcon.hpp
+ * @brief BCON (BSON C Object Notation) C++ document
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef BCON_HPP_
+#define BCON_HPP_
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "bcon.h"
+
+namespace bcon {
+
+/*
+ * Thrown when a token stream can't be encoded, with bcon_dump() of the
+ * stream as the message.
+ */
+class error : public std::runtime_error {
+public:
+    explicit error(const std::string & what) : std::runtime_error(what) {}
+
+    static error from_dump(char * dump)
+    {
+        std::string what(dump ? dump : "bcon: encode failed");
+
+        std::free(dump);
+
+        return error(what);
+    }
+};
+
+/*
+ * A bson_t over bytes owned by something else, for passing a document
+ * to libbson functions.  It stays valid as long as those bytes do.
+ */
+class view {
+public:
+    view(const bson_uint8_t * data, bson_uint32_t len) noexcept
+    {
+        bson_init_static(&bson_, data, len);
+    }
+
+    view(const view & other) noexcept
+    {
+        bson_init_static(&bson_, bson_get_data(&other.bson_), other.bson_.len);
+    }
+
+    view & operator=(const view & other) noexcept
+    {
+        bson_init_static(&bson_, bson_get_data(&other.bson_), other.bson_.len);
+        return *this;
+    }
+
+    const bson_t * get() const noexcept { return &bson_; }
+    operator const bson_t * () const noexcept { return &bson_; }
+
+private:
+    bson_t bson_;
+};
+
+/*
+ * An encoded BSON document that owns its bytes.  Documents up to
+ * inline_capacity bytes live inside the object, so building one costs no
+ * allocation at all; larger ones take a single malloc of the exact size.
+ *
+ *     bcon::document doc(BCON( "user", BCON_RUTF8(&name), "n", BCON_INT32(3) ));
+ *     send(fd, doc.data(), doc.size(), 0);
+ *     bson_as_json(doc.as_view(), NULL);
+ *
+ * Documents are move only.  Moving one copies its bytes when they're
+ * inline and steals the buffer otherwise, leaving the source an empty
+ * document; copies have to be asked for with copy().
+ */
+class document {
+public:
+    static const bson_uint32_t inline_capacity = 256;
+
+    document() noexcept : data_(inline_), len_(5)
+    {
+        set_empty();
+    }
+
+    explicit document(bcon_t * in) : data_(inline_), len_(5)
+    {
+        set_empty();
+        encode(in);
+    }
+
+    explicit document(const bson_t * bson) : data_(inline_), len_(5)
+    {
+        set_empty();
+        assign(bson_get_data(bson), bson->len);
+    }
+
+    document(document && other) noexcept : data_(inline_), len_(5)
+    {
+        take(other);
+    }
+
+    document & operator=(document && other) noexcept
+    {
+        if (this != &other) {
+            release();
+            take(other);
+        }
+
+        return *this;
+    }
+
+    document(const document &) = delete;
+    document & operator=(const document &) = delete;
+
+    ~document()
+    {
+        release();
+    }
+
+    /*
+     * Replaces the contents with what in encodes to.  Throws bcon::error,
+     * leaving an empty document, if it doesn't encode.
+     */
+    void encode(bcon_t * in)
+    {
+        bcon_encoder_t enc;
+        bcon_encoder_status_t status;
+        bson_uint32_t total;
+        bson_uint8_t * buf;
+        size_t written, rest;
+        char * err;
+
+        release();
+
+        bcon_encoder_init(&enc, in);
+        status = bcon_encoder_feed(&enc, inline_, inline_capacity, &written);
+
+        if (status == BCON_ENCODER_DONE) {
+            len_ = (bson_uint32_t)written;
+            return;
+        }
+
+        if (status != BCON_ENCODER_NEED_SPACE) fail(bcon_dump(in));
+
+        err = bcon_encoded_size(in, &total);
+        if (err) fail(err);
+
+        buf = static_cast<bson_uint8_t *>(std::malloc(total));
+        if (! buf) {
+            set_empty();
+            throw std::bad_alloc();
+        }
+
+        std::memcpy(buf, inline_, written);
+
+        status = bcon_encoder_feed(&enc, buf + written, total - written, &rest);
+
+        if (status != BCON_ENCODER_DONE || written + rest != total) {
+            std::free(buf);
+            fail(bcon_dump(in));
+        }
+
+        data_ = buf;
+        len_ = total;
+    }
+
+    document copy() const
+    {
+        document out;
+
+        out.assign(data_, len_);
+
+        return out;
+    }
+
+    const bson_uint8_t * data() const noexcept { return data_; }
+    bson_uint32_t size() const noexcept { return len_; }
+    bool is_inline() const noexcept { return data_ == inline_; }
+
+    view as_view() const noexcept { return view(data_, len_); }
+
+private:
+    void set_empty() noexcept
+    {
+        static const bson_uint8_t empty[5] = { 5, 0, 0, 0, 0 };
+
+        std::memcpy(inline_, empty, 5);
+        len_ = 5;
+    }
+
+    [[noreturn]] void fail(char * dump)
+    {
+        set_empty();
+        throw error::from_dump(dump);
+    }
+
+    void release() noexcept
+    {
+        if (data_ != inline_) std::free(data_);
+
+        data_ = inline_;
+        set_empty();
+    }
+
+    void assign(const bson_uint8_t * data, bson_uint32_t len)
+    {
+        release();
+
+        if (len > inline_capacity) {
+            bson_uint8_t * buf = static_cast<bson_uint8_t *>(std::malloc(len));
+            if (! buf) throw std::bad_alloc();
+            data_ = buf;
+        }
+
+        std::memcpy(data_, data, len);
+        len_ = len;
+    }
+
+    void take(document & other) noexcept
+    {
+        if (other.data_ == other.inline_) {
+            std::memcpy(inline_, other.inline_, other.len_);
+            data_ = inline_;
+        } else {
+            data_ = other.data_;
+            other.data_ = other.inline_;
+        }
+
+        len_ = other.len_;
+        other.set_empty();
+    }
+
+    bson_uint8_t * data_;
+    bson_uint32_t len_;
+    bson_uint8_t inline_[inline_capacity];
+};
+
+}
+
+#endif
@@ -0,0 +1,344 @@
+/*
+ * @file bcon_builder.c
+ * @brief BCON (BSON C Object Notation) Runtime token builder
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+
+#define BCON_BUILDER_INITIAL_TOKENS 64
+#define BCON_BUILDER_BLOCK_SIZE 4096
+#define BCON_BUILDER_ALIGN 8
+
+/*
+ * Arena blocks are chained rather than grown, so nothing already handed
+ * out moves.  Reset rewinds to the first block and refills the chain in
+ * order.
+ */
+struct bcon_builder_block {
+    bcon_builder_block_t * next;
+    size_t used;
+    size_t size;
+    bson_uint8_t * data;
+};
+
+void bcon_builder_init(bcon_builder_t * b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+void bcon_builder_reset(bcon_builder_t * b)
+{
+    bcon_builder_block_t * block;
+
+    for (block = b->blocks; block; block = block->next) {
+        block->used = 0;
+    }
+
+    b->cur = b->blocks;
+    b->n_tokens = 0;
+    b->depth = 0;
+    b->failed = 0;
+    b->is_array[0] = 0;
+}
+
+void bcon_builder_destroy(bcon_builder_t * b)
+{
+    bcon_builder_block_t * block, * next;
+
+    for (block = b->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+
+    free(b->tokens);
+
+    memset(b, 0, sizeof(*b));
+}
+
+static bcon_t * bcon_builder_slots(bcon_builder_t * b, size_t n)
+{
+    bcon_t * slots;
+
+    /* one spare slot for the terminator */
+    if (b->n_tokens + n + 1 > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : BCON_BUILDER_INITIAL_TOKENS;
+        if (b->cap < b->n_tokens + n + 1) b->cap = b->n_tokens + n + 1;
+        b->tokens = realloc(b->tokens, b->cap * sizeof(*b->tokens));
+    }
+
+    slots = b->tokens + b->n_tokens;
+    b->n_tokens += n;
+
+    return slots;
+}
+
+void * bcon_builder_alloc(bcon_builder_t * b, size_t size)
+{
+    bcon_builder_block_t * block = b->cur;
+    bcon_builder_block_t ** link;
+    void * out;
+
+    size = (size + BCON_BUILDER_ALIGN - 1) & ~(size_t)(BCON_BUILDER_ALIGN - 1);
+
+    while (block && block->used + size > block->size) {
+        block = block->next;
+    }
+
+    if (! block) {
+        size_t block_size = size > BCON_BUILDER_BLOCK_SIZE ? size : BCON_BUILDER_BLOCK_SIZE;
+
+        block = malloc(sizeof(*block) + BCON_BUILDER_ALIGN + block_size);
+        block->next = NULL;
+        block->used = 0;
+        block->size = block_size;
+        block->data = (bson_uint8_t *)(((size_t)(block + 1) + BCON_BUILDER_ALIGN - 1) & ~(size_t)(BCON_BUILDER_ALIGN - 1));
+
+        for (link = &b->blocks; *link; link = &(*link)->next);
+        *link = block;
+    }
+
+    b->cur = block;
+
+    out = block->data + block->used;
+    block->used += size;
+
+    return out;
+}
+
+char * bcon_builder_strdup(bcon_builder_t * b, const char * str)
+{
+    size_t len = strlen(str) + 1;
+    char * out = bcon_builder_alloc(b, len);
+
+    memcpy(out, str, len);
+
+    return out;
+}
+
+/*
+ * Keys are bare strings unless they'd be read as structure, in which case
+ * they take the typed form, which the walkers accept in key position too.
+ */
+static int bcon_builder_key(bcon_builder_t * b, const char * key)
+{
+    bcon_t * slots;
+
+    if (b->is_array[b->depth]) return 0;
+
+    if (! key) {
+        b->failed = 1;
+        return 1;
+    }
+
+    switch (key[0]) {
+        case '{':
+        case '}':
+        case '[':
+        case ']':
+            slots = bcon_builder_slots(b, 3);
+            slots[0].UTF8 = BCON_MAGIC;
+            slots[1].type = BCONT_UTF8;
+            slots[2].UTF8 = (char *)key;
+            break;
+        default:
+            bcon_builder_slots(b, 1)->UTF8 = (char *)key;
+            break;
+    }
+
+    return 0;
+}
+
+static void bcon_builder_begin(bcon_builder_t * b, const char * key, int is_array)
+{
+    if (bcon_builder_key(b, key)) return;
+
+    if (b->depth == BCON_VISIT_MAX_DEPTH) {
+        b->failed = 1;
+        return;
+    }
+
+    bcon_builder_slots(b, 1)->UTF8 = is_array ? "[" : "{";
+    b->is_array[++b->depth] = is_array;
+}
+
+static void bcon_builder_end(bcon_builder_t * b, int is_array)
+{
+    if (b->depth == 0 || b->is_array[b->depth] != is_array) {
+        b->failed = 1;
+        return;
+    }
+
+    b->depth--;
+    bcon_builder_slots(b, 1)->UTF8 = is_array ? "]" : "}";
+}
+
+void bcon_builder_begin_doc(bcon_builder_t * b, const char * key)
+{
+    bcon_builder_begin(b, key, 0);
+}
+
+void bcon_builder_end_doc(bcon_builder_t * b)
+{
+    bcon_builder_end(b, 0);
+}
+
+void bcon_builder_begin_array(bcon_builder_t * b, const char * key)
+{
+    bcon_builder_begin(b, key, 1);
+}
+
+void bcon_builder_end_array(bcon_builder_t * b)
+{
+    bcon_builder_end(b, 1);
+}
+
+bcon_t * bcon_builder_tokens(bcon_builder_t * b)
+{
+    if (b->failed || b->depth) return NULL;
+
+    /* the terminator isn't counted, so further appends overwrite it */
+    bcon_builder_slots(b, 1)->UTF8 = NULL;
+    b->n_tokens--;
+
+    return b->tokens;
+}
+
+void bcon_builder_value(bcon_builder_t * b, const char * key, bcon_type_t type, bcon_t value)
+{
+    bcon_t * slots;
+
+    if (bcon_builder_key(b, key)) return;
+
+    slots = bcon_builder_slots(b, 3);
+    slots[0].UTF8 = BCON_MAGIC;
+    slots[1].type = type;
+    slots[2] = value;
+}
+
+void bcon_builder_utf8(bcon_builder_t * b, const char * key, const char * str)
+{
+    bcon_t value;
+
+    value.UTF8 = (char *)str;
+    bcon_builder_value(b, key, BCONT_UTF8, value);
+}
+
+void bcon_builder_utf8_len(bcon_builder_t * b, const char * key, const char * str, bson_uint32_t len)
+{
+    bcon_string_t * z = bcon_builder_alloc(b, sizeof(*z));
+    bcon_t value;
+
+    z->str = str;
+    z->length = len;
+
+    value.BCON_UTF8_LEN = z;
+    bcon_builder_value(b, key, BCONT_BCON_UTF8_LEN, value);
+}
+
+void bcon_builder_int32(bcon_builder_t * b, const char * key, bson_int32_t v)
+{
+    bcon_t value;
+
+    value.INT32 = v;
+    bcon_builder_value(b, key, BCONT_INT32, value);
+}
+
+void bcon_builder_int64(bcon_builder_t * b, const char * key, bson_int64_t v)
+{
+    bcon_t value;
+
+    value.INT64 = v;
+    bcon_builder_value(b, key, BCONT_INT64, value);
+}
+
+void bcon_builder_double(bcon_builder_t * b, const char * key, double v)
+{
+    bcon_t value;
+
+    value.DOUBLE = v;
+    bcon_builder_value(b, key, BCONT_DOUBLE, value);
+}
+
+void bcon_builder_bool(bcon_builder_t * b, const char * key, bson_bool_t v)
+{
+    bcon_t value;
+
+    value.BOOL = v;
+    bcon_builder_value(b, key, BCONT_BOOL, value);
+}
+
+void bcon_builder_null(bcon_builder_t * b, const char * key)
+{
+    bcon_t value;
+
+    value.UTF8 = NULL;
+    bcon_builder_value(b, key, BCONT_NULL, value);
+}
+
+void bcon_builder_oid(bcon_builder_t * b, const char * key, const bson_oid_t * oid)
+{
+    bcon_t value;
+
+    value.BSON_OID = (bson_oid_t *)oid;
+    bcon_builder_value(b, key, BCONT_BSON_OID, value);
+}
+
+void bcon_builder_date_time(bcon_builder_t * b, const char * key, bson_int64_t ms)
+{
+    struct timeval * tv = bcon_builder_alloc(b, sizeof(*tv));
+    bcon_t value;
+
+    tv->tv_sec = ms / 1000;
+    tv->tv_usec = (ms % 1000) * 1000;
+
+    value.DATE_TIME = tv;
+    bcon_builder_value(b, key, BCONT_DATE_TIME, value);
+}
+
+void bcon_builder_bson(bcon_builder_t * b, const char * key, const bson_t * bson, int is_array)
+{
+    bcon_t value;
+
+    value.BSON_DOCUMENT = (bson_t *)bson;
+    bcon_builder_value(b, key, is_array ? BCONT_BSON_ARRAY : BCONT_BSON_DOCUMENT, value);
+}
+
+void bcon_builder_regex(bcon_builder_t * b, const char * key, const char * regex, const char * flags)
+{
+    bcon_regex_t * r = bcon_builder_alloc(b, sizeof(*r));
+    bcon_t value;
+
+    r->regex = (char *)regex;
+    r->flags = (char *)flags;
+
+    value.BCON_REGEX = r;
+    bcon_builder_value(b, key, BCONT_BCON_REGEX, value);
+}
+
+void bcon_builder_binary(bcon_builder_t * b, const char * key, bson_subtype_t subtype, const bson_uint8_t * data, bson_uint32_t len)
+{
+    bcon_binary_t * z = bcon_builder_alloc(b, sizeof(*z));
+    bcon_t value;
+
+    z->subtype = subtype;
+    z->binary = (bson_uint8_t *)data;
+    z->length = len;
+
+    value.BIN = z;
+    bcon_builder_value(b, key, BCONT_BIN, value);
+}
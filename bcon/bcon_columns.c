@@ -0,0 +1,230 @@
+/*
+ * @file bcon_columns.c
+ * @brief BCON (BSON C Object Notation) Columnar extraction
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+
+char * bcon_columns_init(bcon_columns_t * c, bcon_t * spec, bson_uint8_t ** validity, size_t capacity)
+{
+    bcon_t * start = spec;
+    bcon_column_t * col;
+    void * obj = NULL;
+    bcon_type_t type, raw;
+
+    memset(c, 0, sizeof(*c));
+    c->capacity = capacity;
+
+    while (1) {
+        type = bcon_token(&spec, &obj);
+
+        if (type == BCONT_END) break;
+
+        if (type != BCONT_UTF8) return bcon_dump(start);
+        if (c->n_cols == BCON_COLUMNS_MAX) return strdup("too many columns");
+
+        col = &c->cols[c->n_cols];
+        col->key = *((char **)obj);
+        col->key_len = strlen(col->key);
+        col->validity = validity ? validity[c->n_cols] : NULL;
+
+        /* only R and P tokens point at caller memory to fill */
+        if (spec->UTF8 != BCON_MAGIC) return bcon_dump(start);
+
+        raw = spec[1].type;
+
+        type = bcon_token(&spec, &obj);
+
+        if (raw != type + 1 && raw != type + 2) return bcon_dump(start);
+
+        switch (type) {
+            case BCONT_INT32:
+            case BCONT_INT64:
+            case BCONT_DOUBLE:
+            case BCONT_BOOL:
+            case BCONT_UTF8:
+                col->type = type;
+                col->data = obj;
+                break;
+            default:
+                return bcon_dump(start);
+        }
+
+        c->n_cols++;
+    }
+
+    return NULL;
+}
+
+static void bcon_column_set_valid(bcon_column_t * col, size_t row, int valid)
+{
+    if (! col->validity) return;
+
+    if (valid) {
+        col->validity[row >> 3] |= (bson_uint8_t)(1 << (row & 7));
+    } else {
+        col->validity[row >> 3] &= (bson_uint8_t)~(1 << (row & 7));
+    }
+}
+
+/*
+ * Stores the element under iter into row of col.  Integers widen into
+ * int64 columns, dates are stored as their int64 milliseconds, and
+ * strings point into the source document.  Anything else leaves a zero
+ * and clears the validity bit.
+ */
+static int bcon_column_store(bcon_column_t * col, size_t row, const bson_iter_t * iter)
+{
+    bson_type_t t = bson_iter_type(iter);
+
+    switch (col->type) {
+        case BCONT_INT32:
+            if (t != BSON_TYPE_INT32) break;
+            ((bson_int32_t *)col->data)[row] = bson_iter_int32(iter);
+            return 1;
+        case BCONT_INT64:
+            if (t == BSON_TYPE_INT64) {
+                ((bson_int64_t *)col->data)[row] = bson_iter_int64(iter);
+            } else if (t == BSON_TYPE_INT32) {
+                ((bson_int64_t *)col->data)[row] = bson_iter_int32(iter);
+            } else if (t == BSON_TYPE_DATE_TIME) {
+                ((bson_int64_t *)col->data)[row] = bson_iter_date_time(iter);
+            } else {
+                break;
+            }
+            return 1;
+        case BCONT_DOUBLE:
+            if (t != BSON_TYPE_DOUBLE) break;
+            ((double *)col->data)[row] = bson_iter_double(iter);
+            return 1;
+        case BCONT_BOOL:
+            if (t != BSON_TYPE_BOOL) break;
+            ((bson_bool_t *)col->data)[row] = bson_iter_bool(iter);
+            return 1;
+        case BCONT_UTF8:
+            if (t != BSON_TYPE_UTF8) break;
+            ((const char **)col->data)[row] = bson_iter_utf8(iter, NULL);
+            return 1;
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+static void bcon_column_clear(bcon_column_t * col, size_t row)
+{
+    switch (col->type) {
+        case BCONT_INT32:
+            ((bson_int32_t *)col->data)[row] = 0;
+            break;
+        case BCONT_INT64:
+            ((bson_int64_t *)col->data)[row] = 0;
+            break;
+        case BCONT_DOUBLE:
+            ((double *)col->data)[row] = 0;
+            break;
+        case BCONT_BOOL:
+            ((bson_bool_t *)col->data)[row] = 0;
+            break;
+        case BCONT_UTF8:
+            ((const char **)col->data)[row] = NULL;
+            break;
+        default:
+            break;
+    }
+
+    bcon_column_set_valid(col, row, 0);
+}
+
+char * bcon_columns_add(bcon_columns_t * c, const bson_t * bson)
+{
+    bson_uint64_t seen = 0;
+    bson_iter_t iter;
+    const char * key;
+    size_t row = c->n_rows, key_len;
+    int i, found = 0;
+
+    if (row == c->capacity) return strdup("columns are full");
+    if (! bson_iter_init(&iter, bson)) return strdup("invalid bson");
+
+    while (found < c->n_cols && bson_iter_next(&iter)) {
+        key = bson_iter_key(&iter);
+        key_len = strlen(key);
+
+        for (i = 0; i < c->n_cols; i++) {
+            if (seen & ((bson_uint64_t)1 << i)) continue;
+            if (c->cols[i].key_len != key_len || memcmp(c->cols[i].key, key, key_len) != 0) continue;
+
+            seen |= (bson_uint64_t)1 << i;
+            found++;
+
+            if (bcon_column_store(&c->cols[i], row, &iter)) {
+                bcon_column_set_valid(&c->cols[i], row, 1);
+            } else {
+                bcon_column_clear(&c->cols[i], row);
+            }
+        }
+    }
+
+    for (i = 0; found < c->n_cols && i < c->n_cols; i++) {
+        if (! (seen & ((bson_uint64_t)1 << i))) bcon_column_clear(&c->cols[i], row);
+    }
+
+    c->n_rows++;
+
+    return NULL;
+}
+
+char * bcon_columns_from_bson(bcon_columns_t * c, const bson_t * const * docs, size_t n)
+{
+    char * err;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        err = bcon_columns_add(c, docs[i]);
+        if (err) return err;
+    }
+
+    return NULL;
+}
+
+char * bcon_columns_from_data(bcon_columns_t * c, const bson_uint8_t * data, size_t len)
+{
+    bson_uint32_t doc_len;
+    size_t off = 0;
+    bson_t bson;
+    char * err;
+
+    while (off < len) {
+        if (len - off < 5) return strdup("truncated document");
+
+        memcpy(&doc_len, data + off, 4);
+        doc_len = BSON_UINT32_FROM_LE(doc_len);
+
+        if (doc_len < 5 || doc_len > len - off) return strdup("truncated document");
+        if (! bson_init_static(&bson, data + off, doc_len)) return strdup("invalid bson");
+
+        err = bcon_columns_add(c, &bson);
+        if (err) return err;
+
+        off += doc_len;
+    }
+
+    return NULL;
+}
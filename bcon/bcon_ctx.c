@@ -0,0 +1,148 @@
+/*
+ * @file bcon_ctx.c
+ * @brief BCON (BSON C Object Notation) Reusable encoding context
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+#include "bcon_private.h"
+#include "bcon_probes.h"
+
+#define BCON_CTX_INITIAL_SIZE 256
+
+void bcon_ctx_init(bcon_ctx_t * ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void bcon_ctx_reset(bcon_ctx_t * ctx)
+{
+    free(ctx->err);
+    ctx->err = NULL;
+}
+
+void bcon_ctx_destroy(bcon_ctx_t * ctx)
+{
+    bcon_ctx_reset(ctx);
+    free(ctx->buf);
+
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+/* Doubles the buffer, keeping the old one and setting err on failure. */
+static int bcon_ctx_grow(bcon_ctx_t * ctx)
+{
+    size_t buf_len = ctx->buf_len ? ctx->buf_len * 2 : BCON_CTX_INITIAL_SIZE;
+    bson_uint8_t * buf;
+
+    if (buf_len < ctx->buf_len || ! (buf = realloc(ctx->buf, buf_len))) {
+        ctx->err = strdup("out of memory");
+        return 1;
+    }
+
+    ctx->buf = buf;
+    ctx->buf_len = buf_len;
+
+    return 0;
+}
+
+/*
+ * Encodes straight into the context's buffer.  When it runs out the
+ * buffer is doubled and the encoder resumes in the new space; bytes
+ * already written carry over through realloc().
+ */
+const bson_t * bcon_ctx_to_bson(bcon_ctx_t * ctx, bcon_t * in)
+{
+    bcon_encoder_status_t status;
+    size_t n, len;
+
+    bcon_ctx_reset(ctx);
+
+    if (! ctx->buf && bcon_ctx_grow(ctx)) return NULL;
+
+    bcon_encoder_init(&ctx->encoder, in);
+    if (ctx->captures) bcon_encoder_capture(&ctx->encoder, ctx->captures, ctx->n_captures);
+    status = bcon_encoder_feed(&ctx->encoder, ctx->buf, ctx->buf_len, &n);
+    len = n;
+
+    while (status == BCON_ENCODER_NEED_SPACE) {
+        if (bcon_ctx_grow(ctx)) return NULL;
+
+        status = bcon_encoder_feed(&ctx->encoder, ctx->buf + len, ctx->buf_len - len, &n);
+        len += n;
+    }
+
+    if (status != BCON_ENCODER_DONE || ! bson_init_static(&ctx->doc, ctx->buf, len)) {
+        BCON_PROBE2(error, __func__, in);
+        ctx->err = bcon_dump(in);
+        return NULL;
+    }
+
+    return &ctx->doc;
+}
+
+int bcon_ctx_capture(bcon_ctx_t * ctx, bcon_capture_t * caps, int n)
+{
+    if (n < 0 || n > BCON_ENCODER_MAX_CAPTURES) return 1;
+
+    ctx->captures = caps;
+    ctx->n_captures = caps ? n : 0;
+
+    return 0;
+}
+
+const bson_t * bcon_ctx_to_bson_hot(bcon_ctx_t * ctx, bcon_hot_t * hot, bcon_t * in)
+{
+    bcon_plan_t * plan = __atomic_load_n(&hot->plan, __ATOMIC_ACQUIRE);
+    bson_uint32_t size;
+
+    if (ctx->captures) return bcon_ctx_to_bson(ctx, in);
+
+    if (! plan) {
+        if (__atomic_load_n(&hot->cold, __ATOMIC_RELAXED)) return bcon_ctx_to_bson(ctx, in);
+        if (__atomic_add_fetch(&hot->runs, 1, __ATOMIC_RELAXED) < BCON_HOT_THRESHOLD) return bcon_ctx_to_bson(ctx, in);
+
+        plan = bcon_hot_promote(hot, in);
+        if (! plan) return bcon_ctx_to_bson(ctx, in);
+    }
+
+    bcon_ctx_reset(ctx);
+
+    if (! ctx->buf && bcon_ctx_grow(ctx)) return NULL;
+
+    size = bcon_plan_encode(plan, in, ctx->buf, ctx->buf_len);
+
+    if (size > ctx->buf_len) {
+        while (ctx->buf_len < size) {
+            if (bcon_ctx_grow(ctx)) return NULL;
+        }
+        bcon_plan_encode(plan, in, ctx->buf, ctx->buf_len);
+    }
+
+    if (! bson_init_static(&ctx->doc, ctx->buf, size)) {
+        BCON_PROBE2(error, __func__, in);
+        ctx->err = bcon_dump(in);
+        return NULL;
+    }
+
+    return &ctx->doc;
+}
+
+const char * bcon_ctx_error(const bcon_ctx_t * ctx)
+{
+    return ctx->err;
+}
@@ -0,0 +1,948 @@
+/*
+ * @file bcon_encoder.c
+ * @brief BCON (BSON C Object Notation) Resumable encoder
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+#include "bcon_private.h"
+#include "bcon_probes.h"
+
+static const bson_uint8_t bcon_encoder_zero[1] = { 0 };
+
+static void bcon_encoder_le32(bson_uint8_t * out, bson_uint32_t v)
+{
+    v = BSON_UINT32_TO_LE(v);
+    memcpy(out, &v, 4);
+}
+
+static void bcon_encoder_le64(bson_uint8_t * out, bson_uint64_t v)
+{
+    v = BSON_UINT64_TO_LE(v);
+    memcpy(out, &v, 8);
+}
+
+/*
+ * The size of the value bytes a well formed element of type starts with,
+ * or 0 if they're too short to say.
+ */
+static bson_uint32_t bcon_raw_value_size(bson_type_t type, const bson_uint8_t * value, bson_uint32_t len)
+{
+    bson_uint32_t n;
+    const bson_uint8_t * nul;
+
+    switch (type) {
+        case BSON_TYPE_DOUBLE:
+        case BSON_TYPE_DATE_TIME:
+        case BSON_TYPE_TIMESTAMP:
+        case BSON_TYPE_INT64:
+            return 8;
+        case BSON_TYPE_INT32:
+            return 4;
+        case BSON_TYPE_BOOL:
+            return 1;
+        case BSON_TYPE_OID:
+            return 12;
+        case BSON_TYPE_UNDEFINED:
+        case BSON_TYPE_NULL:
+        case BSON_TYPE_MAXKEY:
+        case BSON_TYPE_MINKEY:
+            return 0;
+        case BSON_TYPE_REGEX:
+            nul = memchr(value, '\0', len);
+            if (! nul) return 0;
+            n = (bson_uint32_t)(nul + 1 - value);
+            nul = memchr(value + n, '\0', len - n);
+            if (! nul) return 0;
+            return (bson_uint32_t)(nul + 1 - value);
+        default:
+            break;
+    }
+
+    if (len < 4) return 0;
+
+    memcpy(&n, value, 4);
+    n = BSON_UINT32_FROM_LE(n);
+
+    switch (type) {
+        case BSON_TYPE_UTF8:
+        case BSON_TYPE_CODE:
+        case BSON_TYPE_SYMBOL:
+            return n > len - 4 ? 0 : 4 + n;
+        case BSON_TYPE_DOCUMENT:
+        case BSON_TYPE_ARRAY:
+        case BSON_TYPE_CODEWSCOPE:
+            return n;
+        case BSON_TYPE_BINARY:
+            return n > len - 5 ? 0 : 5 + n;
+        case BSON_TYPE_DBPOINTER:
+            return n > len - 16 ? 0 : 4 + n + 12;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Fails unless raw is exactly one element: trailing bytes from a second
+ * element would otherwise be copied into the output as part of the first.
+ */
+int bcon_raw_split(const bcon_raw_t * raw, bson_type_t * type, const char ** key, const bson_uint8_t ** value, bson_uint32_t * value_len)
+{
+    const bson_uint8_t * nul;
+    bson_uint32_t size;
+
+    if (raw->length < 2) return 1;
+
+    nul = memchr(raw->data + 1, '\0', raw->length - 1);
+    if (! nul) return 1;
+
+    *type = (bson_type_t)raw->data[0];
+    *key = (const char *)raw->data + 1;
+    *value = nul + 1;
+    *value_len = raw->length - (bson_uint32_t)(*value - raw->data);
+
+    size = bcon_raw_value_size(*type, *value, *value_len);
+
+    switch (*type) {
+        case BSON_TYPE_UNDEFINED:
+        case BSON_TYPE_NULL:
+        case BSON_TYPE_MAXKEY:
+        case BSON_TYPE_MINKEY:
+            break;
+        default:
+            if (size == 0) return 1;
+            break;
+    }
+
+    return size != *value_len;
+}
+
+static int bcon_encoded__size(bcon_t ** in, int is_array, bson_uint32_t * size);
+
+static int bcon_key_size(const char * key, bson_uint32_t i, int is_array, bson_uint32_t * size)
+{
+    char i_str[16];
+
+    if (is_array) {
+        *size += sprintf(i_str, "%u", i) + 2;
+    } else {
+        *size += strlen(key) + 2;
+    }
+
+    return 0;
+}
+
+int bcon_value_size(void * val, bcon_type_t type, bson_uint32_t * size)
+{
+    switch (type) {
+        case BCONT_UTF8:
+        case BCONT_SYMBOL:
+            *size += 4 + strlen(*((char **)val)) + 1;
+            break;
+        case BCONT_BCON_UTF8_LEN:
+        case BCONT_BCON_SYMBOL_LEN:
+        case BCONT_BCON_CODE_LEN:
+            *size += 4 + (*((bcon_string_t **)val))->length + 1;
+            break;
+        case BCONT_DOUBLE:
+        case BCONT_DATE_TIME:
+        case BCONT_INT64:
+        case BCONT_BCON_TIMESTAMP:
+        case BCONT_BCON_NOW:
+            *size += 8;
+            break;
+        case BCONT_BCON_DOCUMENT:
+        case BCONT_BCON_ARRAY: {
+            bcon_t * child = *((bcon_t **)val);
+
+            return bcon_encoded__size(&child, type == BCONT_BCON_ARRAY, size);
+        }
+        case BCONT_BSON_DOCUMENT:
+        case BCONT_BSON_ARRAY:
+            *size += (*((bson_t **)val))->len;
+            break;
+        case BCONT_BIN: {
+            bcon_binary_t * z = *((bcon_binary_t **)val);
+
+            *size += 5 + z->length + (z->subtype == BSON_SUBTYPE_BINARY_DEPRECATED ? 4 : 0);
+            break;
+        }
+        case BCONT_UNDEFINED:
+        case BCONT_NULL:
+        case BCONT_MAXKEY:
+        case BCONT_MINKEY:
+            break;
+        case BCONT_BSON_OID:
+        case BCONT_BCON_NEW_OID:
+            *size += 12;
+            break;
+        case BCONT_BOOL:
+            *size += 1;
+            break;
+        case BCONT_BCON_REGEX: {
+            bcon_regex_t * r = *((bcon_regex_t **)val);
+
+            *size += strlen(r->regex) + 1 + (r->flags ? strlen(r->flags) : 0) + 1;
+            break;
+        }
+        case BCONT_BCON_DBPOINTER: {
+            bcon_dbpointer_t * db = *((bcon_dbpointer_t **)val);
+
+            *size += 4 + strlen(db->collection) + 1 + 12;
+            break;
+        }
+        case BCONT_BCON_CODE:
+            *size += 4 + strlen((*((bcon_code_t **)val))->code) + 1;
+            break;
+        case BCONT_BCON_CODEWSCOPE: {
+            bcon_code_t * code = *((bcon_code_t **)val);
+            bcon_t * scope = code->scope;
+
+            *size += 4 + 4 + strlen(code->code) + 1;
+
+            return bcon_encoded__size(&scope, 0, size);
+        }
+        case BCONT_INT32:
+            *size += 4;
+            break;
+        case BCONT_ITER:
+        case BCONT_ITER_ELEMENT: {
+            const bson_uint8_t * data;
+            bson_uint32_t len;
+
+            bcon_iter_value_data(*((bson_iter_t **)val), &data, &len);
+            *size += len;
+            break;
+        }
+        case BCONT_BCON_RAW: {
+            bson_type_t raw_type;
+            const char * raw_key;
+            const bson_uint8_t * data;
+            bson_uint32_t len;
+
+            if (bcon_raw_split(*((bcon_raw_t **)val), &raw_type, &raw_key, &data, &len)) return 1;
+            *size += len;
+            break;
+        }
+        default:
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Sizes the elements of one document or array.  *i is the index of the
+ * next element, carried across the body of a BCON_IF().
+ */
+static int bcon_encoded__elems(bcon_t ** in, int is_array, bson_uint32_t * i, bson_uint32_t * size)
+{
+    void * obj = NULL;
+    bcon_type_t type;
+    bcon_t * body;
+    const char * key = NULL;
+
+    while (1) {
+        if (! is_array) {
+            bcon_t * at = *in;
+
+            type = bcon_token(in, &obj);
+
+            if (type == BCONT_END || type == BCONT_DOC_END) break;
+
+            if (type == BCONT_OMIT) {
+                if (bcon_skip_omitted(at, in)) return 1;
+                continue;
+            }
+
+            if (type == BCONT_BCON_IF) {
+                body = bcon_if_body(obj);
+                if (body && bcon_encoded__elems(&body, 0, i, size)) return 1;
+                continue;
+            }
+
+            if (type == BCONT_ITER_ELEMENT) {
+                key = bson_iter_key(*((bson_iter_t **)obj));
+            } else if (type == BCONT_BCON_RAW) {
+                bson_type_t raw_type;
+                const bson_uint8_t * data;
+                bson_uint32_t len;
+
+                if (bcon_raw_split(*((bcon_raw_t **)obj), &raw_type, &key, &data, &len)) return 1;
+            } else if (type == BCONT_UTF8) {
+                key = *((char **)obj);
+            } else {
+                return 1;
+            }
+
+            if (type != BCONT_UTF8) {
+                bcon_key_size(key, *i, 0, size);
+                if (bcon_value_size(obj, type, size)) return 1;
+                (*i)++;
+                continue;
+            }
+        }
+
+        type = bcon_token(in, &obj);
+
+        if (type == BCONT_END || type == BCONT_ARRAY_END) {
+            if (! is_array) return 1;
+            break;
+        }
+
+        if (type == BCONT_DOC_END) break;
+
+        if (type == BCONT_OMIT) continue;
+
+        if (type == BCONT_BCON_IF) {
+            if (! is_array) return 1;
+            body = bcon_if_body(obj);
+            if (body && bcon_encoded__elems(&body, 1, i, size)) return 1;
+            continue;
+        }
+
+        bcon_key_size(key, *i, is_array, size);
+
+        if (type == BCONT_DOC_START || type == BCONT_ARRAY_START) {
+            if (bcon_encoded__size(in, type == BCONT_ARRAY_START, size)) return 1;
+        } else {
+            if (bcon_value_size(obj, type, size)) return 1;
+        }
+
+        (*i)++;
+    }
+
+    return 0;
+}
+
+static int bcon_encoded__size(bcon_t ** in, int is_array, bson_uint32_t * size)
+{
+    bson_uint32_t i = 0;
+
+    *size += 5;
+
+    return bcon_encoded__elems(in, is_array, &i, size);
+}
+
+char * bcon_encoded_size(bcon_t * in, bson_uint32_t * size)
+{
+    *size = 0;
+
+    if (bcon_encoded__size(&in, 0, size)) {
+        BCON_PROBE2(error, __func__, in);
+        return bcon_dump(in);
+    }
+
+    return NULL;
+}
+
+static void bcon_encoder_piece(bcon_encoder_t * enc, const void * ptr, bson_uint32_t len)
+{
+    enc->pieces[enc->n_pieces].ptr = ptr;
+    enc->pieces[enc->n_pieces].len = len;
+    enc->n_pieces++;
+}
+
+static void bcon_encoder_header(bcon_encoder_t * enc, bson_type_t type, const char * key)
+{
+    enc->type_byte = (bson_uint8_t)type;
+
+    bcon_encoder_piece(enc, &enc->type_byte, 1);
+    bcon_encoder_piece(enc, key, strlen(key) + 1);
+}
+
+/*
+ * Writes the final length of a frame into its prefix.  Bytes of the prefix
+ * that are already in the current buffer are patched in place, the rest go
+ * out later from len_bytes.
+ */
+static void bcon_encoder_patch(bcon_encoder_t * enc, bcon_encoder_frame_t * frame, bson_uint32_t size)
+{
+    bson_uint64_t end = enc->chunk_start + enc->pos;
+    int k;
+
+    bcon_encoder_le32(frame->len_bytes, size);
+
+    for (k = 0; k < 4; k++) {
+        bson_uint64_t at = frame->offset + k;
+
+        if (at >= enc->chunk_start && at < end) enc->buf[at - enc->chunk_start] = frame->len_bytes[k];
+    }
+
+    frame->patched = 1;
+}
+
+static int bcon_encoder_push(bcon_encoder_t * enc, bcon_t * stream, int is_array, int is_inline)
+{
+    bcon_encoder_frame_t * frame;
+    bson_uint64_t offset = enc->chunk_start + enc->pos;
+    int k;
+
+    if (enc->depth == BCON_ENCODER_MAX_DEPTH) return 1;
+
+    for (k = 0; k < enc->n_pieces; k++) {
+        offset += enc->pieces[k].len;
+    }
+
+    frame = &enc->stack[enc->depth++];
+
+    frame->stream = stream;
+    frame->start = stream;
+    frame->offset = offset;
+    frame->index = 0;
+    frame->is_array = is_array;
+    frame->is_inline = is_inline;
+    frame->is_splice = 0;
+    frame->patched = 0;
+    frame->level = enc->depth > 1 ? frame[-1].level + 1 : 0;
+    frame->live = 0;
+    frame->ends = 0;
+
+    memset(frame->len_bytes, 0, 4);
+    bcon_encoder_piece(enc, frame->len_bytes, 4);
+
+    return 0;
+}
+
+/*
+ * Continues the current frame's elements from the body of a true
+ * BCON_IF().  The frame has no prefix or terminator of its own and hands
+ * the element index back when popped.
+ */
+static int bcon_encoder_splice(bcon_encoder_t * enc, void * val)
+{
+    bcon_encoder_frame_t * parent = &enc->stack[enc->depth - 1];
+    bcon_encoder_frame_t * frame;
+    bcon_t * body = bcon_if_body(val);
+
+    if (! body) return 0;
+
+    if (enc->depth == BCON_ENCODER_MAX_DEPTH) return 1;
+
+    frame = &enc->stack[enc->depth++];
+
+    memset(frame, 0, sizeof(*frame));
+
+    frame->stream = body;
+    frame->start = body;
+    frame->index = parent->index;
+    frame->is_array = parent->is_array;
+    frame->is_splice = 1;
+    frame->patched = 1;
+    frame->level = parent->level;
+    frame->live = parent->live;
+
+    return 0;
+}
+
+static int bcon_encoder_pop(bcon_encoder_t * enc)
+{
+    bcon_encoder_frame_t * frame = &enc->stack[--enc->depth];
+
+    if (frame->is_splice) {
+        enc->stack[enc->depth - 1].index = frame->index;
+        return 0;
+    }
+
+    if (! frame->patched || frame->ends) {
+        bson_uint64_t end = enc->chunk_start + enc->pos + 1;
+        int c;
+
+        if (! frame->patched) bcon_encoder_patch(enc, frame, (bson_uint32_t)(end - frame->offset));
+
+        for (c = 0; frame->ends; c++, frame->ends >>= 1) {
+            if (frame->ends & 1) enc->captures[c].length = (bson_uint32_t)(end - enc->captures[c].offset);
+        }
+    }
+
+    if (frame->is_inline) enc->stack[enc->depth - 1].stream = frame->stream;
+
+    bcon_encoder_piece(enc, bcon_encoder_zero, 1);
+
+    return 0;
+}
+
+/*
+ * The buffer is full with frames still open.  Any prefix that hasn't been
+ * patched yet is either in this buffer or still queued, and won't be
+ * reachable once the caller flushes, so size those frames now.
+ */
+static int bcon_encoder_spill(bcon_encoder_t * enc)
+{
+    bcon_encoder_frame_t * frame;
+    bson_uint32_t size;
+    bcon_t * start;
+    int i;
+
+    for (i = 0; i < enc->depth; i++) {
+        frame = &enc->stack[i];
+
+        if (frame->patched) continue;
+
+        start = frame->start;
+        size = 0;
+
+        if (bcon_encoded__size(&start, frame->is_array, &size)) return 1;
+
+        bcon_encoder_patch(enc, frame, size);
+    }
+
+    return 0;
+}
+
+static int bcon_encoder_value(bcon_encoder_t * enc, const char * key, void * val, bcon_type_t type)
+{
+    bson_uint8_t * s = enc->scratch;
+
+    switch (type) {
+        case BCONT_UTF8:
+        case BCONT_SYMBOL: {
+            char * str = *((char **)val);
+            bson_uint32_t len = strlen(str);
+
+            bcon_encoder_header(enc, bcon_bson_type(type), key);
+            bcon_encoder_le32(s, len + 1);
+            bcon_encoder_piece(enc, s, 4);
+            bcon_encoder_piece(enc, str, len + 1);
+            break;
+        }
+        case BCONT_BCON_UTF8_LEN:
+        case BCONT_BCON_SYMBOL_LEN:
+        case BCONT_BCON_CODE_LEN: {
+            bcon_string_t * z = *((bcon_string_t **)val);
+
+            bcon_encoder_header(enc, bcon_bson_type(type), key);
+            bcon_encoder_le32(s, z->length + 1);
+            bcon_encoder_piece(enc, s, 4);
+            bcon_encoder_piece(enc, z->str, z->length);
+            bcon_encoder_piece(enc, bcon_encoder_zero, 1);
+            break;
+        }
+        case BCONT_DOUBLE: {
+            bson_uint64_t v;
+
+            memcpy(&v, val, 8);
+            bcon_encoder_header(enc, BSON_TYPE_DOUBLE, key);
+            bcon_encoder_le64(s, v);
+            bcon_encoder_piece(enc, s, 8);
+            break;
+        }
+        case BCONT_BCON_DOCUMENT:
+        case BCONT_BCON_ARRAY:
+            bcon_encoder_header(enc, bcon_bson_type(type), key);
+            return bcon_encoder_push(enc, *((bcon_t **)val), type == BCONT_BCON_ARRAY, 0);
+        case BCONT_BSON_DOCUMENT:
+        case BCONT_BSON_ARRAY: {
+            bson_t * bson = *((bson_t **)val);
+
+            bcon_encoder_header(enc, bcon_bson_type(type), key);
+            bcon_encoder_piece(enc, bson_get_data(bson), bson->len);
+            break;
+        }
+        case BCONT_BIN: {
+            bcon_binary_t * z = *((bcon_binary_t **)val);
+
+            bcon_encoder_header(enc, BSON_TYPE_BINARY, key);
+
+            if (z->subtype == BSON_SUBTYPE_BINARY_DEPRECATED) {
+                bcon_encoder_le32(s, z->length + 4);
+                s[4] = z->subtype;
+                bcon_encoder_le32(s + 5, z->length);
+                bcon_encoder_piece(enc, s, 9);
+            } else {
+                bcon_encoder_le32(s, z->length);
+                s[4] = z->subtype;
+                bcon_encoder_piece(enc, s, 5);
+            }
+
+            bcon_encoder_piece(enc, z->binary, z->length);
+            break;
+        }
+        case BCONT_UNDEFINED:
+        case BCONT_NULL:
+        case BCONT_MAXKEY:
+        case BCONT_MINKEY:
+            bcon_encoder_header(enc, bcon_bson_type(type), key);
+            break;
+        case BCONT_BSON_OID:
+            bcon_encoder_header(enc, BSON_TYPE_OID, key);
+            bcon_encoder_piece(enc, *((bson_oid_t **)val), 12);
+            break;
+        case BCONT_BCON_NEW_OID: {
+            bson_oid_t * out = *((bson_oid_t **)val);
+
+            bcon_oid_gen((bson_oid_t *)s);
+            if (out) memcpy(out, s, 12);
+
+            bcon_encoder_header(enc, BSON_TYPE_OID, key);
+            bcon_encoder_piece(enc, s, 12);
+            break;
+        }
+        case BCONT_BCON_NOW: {
+            bson_int64_t * out = *((bson_int64_t **)val);
+            bson_int64_t now = bcon_now_ms();
+
+            if (out) *out = now;
+
+            bcon_encoder_header(enc, BSON_TYPE_DATE_TIME, key);
+            bcon_encoder_le64(s, (bson_uint64_t)now);
+            bcon_encoder_piece(enc, s, 8);
+            break;
+        }
+        case BCONT_BOOL:
+            bcon_encoder_header(enc, BSON_TYPE_BOOL, key);
+            s[0] = *((bson_bool_t *)val) ? 1 : 0;
+            bcon_encoder_piece(enc, s, 1);
+            break;
+        case BCONT_DATE_TIME: {
+            struct timeval * tv = *((struct timeval **)val);
+
+            bcon_encoder_header(enc, BSON_TYPE_DATE_TIME, key);
+            bcon_encoder_le64(s, (bson_uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000);
+            bcon_encoder_piece(enc, s, 8);
+            break;
+        }
+        case BCONT_BCON_REGEX: {
+            bcon_regex_t * r = *((bcon_regex_t **)val);
+
+            bcon_encoder_header(enc, BSON_TYPE_REGEX, key);
+            bcon_encoder_piece(enc, r->regex, strlen(r->regex) + 1);
+
+            if (r->flags) {
+                bcon_encoder_piece(enc, r->flags, strlen(r->flags) + 1);
+            } else {
+                bcon_encoder_piece(enc, bcon_encoder_zero, 1);
+            }
+            break;
+        }
+        case BCONT_BCON_DBPOINTER: {
+            bcon_dbpointer_t * db = *((bcon_dbpointer_t **)val);
+            bson_uint32_t len = strlen(db->collection);
+
+            bcon_encoder_header(enc, BSON_TYPE_DBPOINTER, key);
+            bcon_encoder_le32(s, len + 1);
+            bcon_encoder_piece(enc, s, 4);
+            bcon_encoder_piece(enc, db->collection, len + 1);
+            bcon_encoder_piece(enc, db->oid, 12);
+            break;
+        }
+        case BCONT_BCON_CODE: {
+            bcon_code_t * code = *((bcon_code_t **)val);
+            bson_uint32_t len = strlen(code->code);
+
+            bcon_encoder_header(enc, BSON_TYPE_CODE, key);
+            bcon_encoder_le32(s, len + 1);
+            bcon_encoder_piece(enc, s, 4);
+            bcon_encoder_piece(enc, code->code, len + 1);
+            break;
+        }
+        case BCONT_BCON_CODEWSCOPE: {
+            bcon_code_t * code = *((bcon_code_t **)val);
+            bcon_t * scope = code->scope;
+            bson_uint32_t len = strlen(code->code);
+            bson_uint32_t scope_size = 0;
+
+            if (bcon_encoded__size(&scope, 0, &scope_size)) return 1;
+
+            bcon_encoder_header(enc, BSON_TYPE_CODEWSCOPE, key);
+            bcon_encoder_le32(s, 4 + 4 + len + 1 + scope_size);
+            bcon_encoder_le32(s + 4, len + 1);
+            bcon_encoder_piece(enc, s, 8);
+            bcon_encoder_piece(enc, code->code, len + 1);
+
+            if (bcon_encoder_push(enc, code->scope, 0, 0)) return 1;
+
+            bcon_encoder_patch(enc, &enc->stack[enc->depth - 1], scope_size);
+            break;
+        }
+        case BCONT_INT32:
+            bcon_encoder_header(enc, BSON_TYPE_INT32, key);
+            bcon_encoder_le32(s, *((bson_int32_t *)val));
+            bcon_encoder_piece(enc, s, 4);
+            break;
+        case BCONT_BCON_TIMESTAMP: {
+            bcon_timestamp_t * ts = *((bcon_timestamp_t **)val);
+
+            bcon_encoder_header(enc, BSON_TYPE_TIMESTAMP, key);
+            bcon_encoder_le32(s, ts->increment);
+            bcon_encoder_le32(s + 4, ts->timestamp);
+            bcon_encoder_piece(enc, s, 8);
+            break;
+        }
+        case BCONT_INT64:
+            bcon_encoder_header(enc, BSON_TYPE_INT64, key);
+            bcon_encoder_le64(s, *((bson_int64_t *)val));
+            bcon_encoder_piece(enc, s, 8);
+            break;
+        case BCONT_ITER:
+        case BCONT_ITER_ELEMENT: {
+            bson_iter_t * iter = *((bson_iter_t **)val);
+            const bson_uint8_t * data;
+            bson_uint32_t len;
+
+            bcon_iter_value_data(iter, &data, &len);
+            bcon_encoder_header(enc, bson_iter_type(iter), key ? key : bson_iter_key(iter));
+            bcon_encoder_piece(enc, data, len);
+            break;
+        }
+        case BCONT_BCON_RAW: {
+            bson_type_t raw_type;
+            const char * raw_key;
+            const bson_uint8_t * data;
+            bson_uint32_t len;
+
+            if (bcon_raw_split(*((bcon_raw_t **)val), &raw_type, &raw_key, &data, &len)) return 1;
+
+            bcon_encoder_header(enc, raw_type, key ? key : raw_key);
+            bcon_encoder_piece(enc, data, len);
+            break;
+        }
+        default:
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Queues the pieces of the next element (or the end of the innermost
+ * frame).  Only called once the previous pieces have all been written.
+ */
+static int bcon_encoder__next(bcon_encoder_t * enc)
+{
+    bcon_encoder_frame_t * frame = &enc->stack[enc->depth - 1];
+    void * obj = NULL;
+    bcon_type_t type;
+    const char * key = NULL;
+
+    enc->n_pieces = 0;
+    enc->cur_piece = 0;
+    enc->piece_off = 0;
+
+    if (frame->is_array) {
+        sprintf(enc->key, "%u", frame->index);
+        key = enc->key;
+    } else {
+        bcon_t * at = frame->stream;
+
+        type = bcon_token(&frame->stream, &obj);
+
+        if (type == BCONT_END || type == BCONT_DOC_END) return bcon_encoder_pop(enc);
+
+        if (type == BCONT_OMIT) return bcon_skip_omitted(at, &frame->stream);
+        if (type == BCONT_BCON_IF) return bcon_encoder_splice(enc, obj);
+
+        if (type == BCONT_ITER_ELEMENT || type == BCONT_BCON_RAW) {
+            frame->index++;
+            return bcon_encoder_value(enc, NULL, obj, type);
+        }
+
+        if (type != BCONT_UTF8) return 1;
+
+        key = *((char **)obj);
+    }
+
+    type = bcon_token(&frame->stream, &obj);
+
+    if (type == BCONT_END || type == BCONT_ARRAY_END) {
+        if (! frame->is_array) return 1;
+        return bcon_encoder_pop(enc);
+    }
+
+    if (type == BCONT_DOC_END) return bcon_encoder_pop(enc);
+
+    if (type == BCONT_OMIT) return 0;
+
+    if (type == BCONT_BCON_IF) {
+        if (! frame->is_array) return 1;
+        return bcon_encoder_splice(enc, obj);
+    }
+
+    frame->index++;
+
+    if (type == BCONT_DOC_START || type == BCONT_ARRAY_START) {
+        bcon_encoder_header(enc, bcon_bson_type(type), key);
+        return bcon_encoder_push(enc, frame->stream, type == BCONT_ARRAY_START, 1);
+    }
+
+    return bcon_encoder_value(enc, key, obj, type);
+}
+
+/*
+ * The level'th component of a dotted path, or NULL if it's shorter.
+ */
+static const char * bcon_capture_part(const char * path, int level, size_t * len)
+{
+    while (level--) {
+        path = strchr(path, '.');
+        if (! path) return NULL;
+        path++;
+    }
+
+    *len = strcspn(path, ".");
+
+    return path;
+}
+
+/*
+ * Checks the element just queued in frame against the captures live
+ * there.  A capture that ends at a document still being written gets its
+ * length when that document is popped; one that goes on through it
+ * becomes live in it.
+ */
+static void bcon_encoder_match(bcon_encoder_t * enc, bcon_encoder_frame_t * frame, bson_uint64_t start, int pushed)
+{
+    bcon_encoder_frame_t * child = pushed ? &enc->stack[enc->depth - 1] : NULL;
+    const char * key = (const char *)enc->pieces[1].ptr;
+    const char * part;
+    bcon_capture_t * cap;
+    size_t len;
+    int c, k;
+
+    for (c = 0; c < enc->n_captures; c++) {
+        if (! (frame->live & (1u << c))) continue;
+
+        cap = &enc->captures[c];
+        if (cap->type != BSON_TYPE_EOD) continue;
+
+        part = bcon_capture_part(cap->path, frame->level, &len);
+        if (! part || strncmp(part, key, len) != 0 || key[len] != '\0') continue;
+
+        if (part[len] == '.') {
+            if (child && (enc->type_byte == BSON_TYPE_DOCUMENT || enc->type_byte == BSON_TYPE_ARRAY)) child->live |= 1u << c;
+            continue;
+        }
+
+        cap->offset = start;
+        cap->type = (bson_type_t)enc->type_byte;
+
+        if (child) {
+            child->ends |= 1u << c;
+            continue;
+        }
+
+        cap->length = 0;
+        for (k = 0; k < enc->n_pieces; k++) {
+            cap->length += enc->pieces[k].len;
+        }
+
+        bcon_hash_pieces(enc->pieces + 2, enc->n_pieces - 2, &cap->hash);
+    }
+}
+
+static int bcon_encoder_next(bcon_encoder_t * enc)
+{
+    bson_uint64_t start = enc->chunk_start + enc->pos;
+    int depth = enc->depth;
+
+    if (bcon_encoder__next(enc)) return 1;
+
+    if (enc->n_captures && enc->n_pieces >= 2 && enc->pieces[0].ptr == &enc->type_byte) {
+        bcon_encoder_match(enc, &enc->stack[depth - 1], start, enc->depth > depth);
+    }
+
+    return 0;
+}
+
+void bcon_encoder_init(bcon_encoder_t * enc, bcon_t * in)
+{
+    memset(enc, 0, sizeof(*enc));
+
+    bcon_encoder_push(enc, in, 0, 0);
+}
+
+int bcon_encoder_capture(bcon_encoder_t * enc, bcon_capture_t * caps, int n)
+{
+    int c;
+
+    if (n < 0 || n > BCON_ENCODER_MAX_CAPTURES) return 1;
+
+    for (c = 0; c < n; c++) {
+        caps[c].offset = 0;
+        caps[c].length = 0;
+        caps[c].type = BSON_TYPE_EOD;
+        memset(&caps[c].hash, 0, sizeof(caps[c].hash));
+    }
+
+    enc->captures = caps;
+    enc->n_captures = n;
+    enc->stack[0].live = n == BCON_ENCODER_MAX_CAPTURES ? 0xffffffffu : (1u << n) - 1;
+
+    return 0;
+}
+
+static bcon_encoder_status_t bcon_encoder_fail(bcon_encoder_t * enc)
+{
+    BCON_PROBE2(error, "bcon_encoder_feed", enc->stack[0].start);
+
+    return enc->status = BCON_ENCODER_ERROR;
+}
+
+bcon_encoder_status_t bcon_encoder_feed(bcon_encoder_t * enc, bson_uint8_t * buf, size_t len, size_t * written)
+{
+    bson_uint32_t n;
+
+    enc->chunk_start += enc->pos;
+    enc->buf = buf;
+    enc->len = len;
+    enc->pos = 0;
+
+    *written = 0;
+
+    if (enc->status != BCON_ENCODER_NEED_SPACE && enc->status != BCON_ENCODER_INIT) return enc->status;
+
+    while (1) {
+        while (enc->cur_piece < enc->n_pieces) {
+            bcon_encoder_piece_t * p = &enc->pieces[enc->cur_piece];
+
+            n = p->len - enc->piece_off;
+            if (n > enc->len - enc->pos) n = enc->len - enc->pos;
+
+            memcpy(enc->buf + enc->pos, p->ptr + enc->piece_off, n);
+            enc->pos += n;
+            enc->piece_off += n;
+
+            if (enc->piece_off < p->len) {
+                enc->status = bcon_encoder_spill(enc) ? bcon_encoder_fail(enc) : BCON_ENCODER_NEED_SPACE;
+                *written = enc->pos;
+                return enc->status;
+            }
+
+            enc->cur_piece++;
+            enc->piece_off = 0;
+        }
+
+        if (enc->depth == 0) {
+            enc->status = BCON_ENCODER_DONE;
+            break;
+        }
+
+        if (bcon_encoder_next(enc)) {
+            bcon_encoder_fail(enc);
+            break;
+        }
+    }
+
+    *written = enc->pos;
+
+    return enc->status;
+}
+
+bcon_encoder_status_t bcon_encoder_resume(bcon_encoder_t * enc, size_t * written)
+{
+    return bcon_encoder_feed(enc, enc->buf, enc->len, written);
+}
@@ -0,0 +1,321 @@
+/*
+ * @file bcon_equal.c
+ * @brief BCON (BSON C Object Notation) Comparison against bson
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+#include "bcon_private.h"
+
+static int bcon_equal__iter(bcon_t ** in, bson_iter_t * iter, int is_array, int * count);
+
+static int bcon_equal_string(const char * str, const char * bson_str, bson_uint32_t bson_len)
+{
+    size_t len = strlen(str);
+
+    return len == bson_len && memcmp(str, bson_str, len) == 0;
+}
+
+static int bcon_equal_slice(const bcon_string_t * z, const char * bson_str, bson_uint32_t bson_len)
+{
+    return z->length == bson_len && memcmp(z->str, bson_str, bson_len) == 0;
+}
+
+static int bcon_equal_cstring(const char * str, const char * bson_str)
+{
+    return strcmp(str ? str : "", bson_str) == 0;
+}
+
+static int bcon_equal_bson_value(const bson_t * bson, bson_iter_t * iter)
+{
+    bson_uint32_t len;
+    const bson_uint8_t * data;
+
+    switch (bson_iter_type(iter)) {
+        case BSON_TYPE_DOCUMENT:
+            bson_iter_document(iter, &len, &data);
+            break;
+        case BSON_TYPE_ARRAY:
+            bson_iter_array(iter, &len, &data);
+            break;
+        default:
+            return 0;
+    }
+
+    return bson->len == len && memcmp(bson_get_data(bson), data, len) == 0;
+}
+
+static int bcon_equal_element(const char * key, const bson_iter_t * a, const bson_iter_t * b)
+{
+    const bson_uint8_t * a_data, * b_data;
+    bson_uint32_t a_len, b_len;
+
+    if (bson_iter_type(a) != bson_iter_type(b)) return 0;
+    if (strcmp(key ? key : bson_iter_key(a), bson_iter_key(b)) != 0) return 0;
+
+    bcon_iter_value_data(a, &a_data, &a_len);
+    bcon_iter_value_data(b, &b_data, &b_len);
+
+    return a_len == b_len && memcmp(a_data, b_data, a_len) == 0;
+}
+
+/*
+ * Compares a BCON_ITER, BCON_ITER_ELEMENT or BCON_RAW token against the
+ * element under iter, including its type and key.
+ */
+static int bcon_equal_splice(const char * key, void * val, bcon_type_t type, bson_iter_t * iter)
+{
+    bcon_raw_iter_t ri;
+    int r;
+
+    if (type != BCONT_BCON_RAW) return bcon_equal_element(key, *((bson_iter_t **)val), iter);
+
+    if (bcon_raw_iter_init(&ri, *((bcon_raw_t **)val))) {
+        r = 0;
+    } else {
+        r = bcon_equal_element(key, &ri.iter, iter);
+    }
+
+    bcon_raw_iter_destroy(&ri);
+
+    return r;
+}
+
+static int bcon_equal_value(void * val, bcon_type_t type, bson_iter_t * iter)
+{
+    bson_iter_t child;
+    bson_uint32_t len;
+    const char * str;
+
+    switch (type) {
+        case BCONT_UTF8:
+            str = bson_iter_utf8(iter, &len);
+            return bcon_equal_string(*((char **)val), str, len);
+        case BCONT_SYMBOL:
+            str = bson_iter_symbol(iter, &len);
+            return bcon_equal_string(*((char **)val), str, len);
+        case BCONT_BCON_UTF8_LEN:
+            str = bson_iter_utf8(iter, &len);
+            return bcon_equal_slice(*((bcon_string_t **)val), str, len);
+        case BCONT_BCON_SYMBOL_LEN:
+            str = bson_iter_symbol(iter, &len);
+            return bcon_equal_slice(*((bcon_string_t **)val), str, len);
+        case BCONT_BCON_CODE_LEN:
+            str = bson_iter_code(iter, &len);
+            return bcon_equal_slice(*((bcon_string_t **)val), str, len);
+        case BCONT_BCON_NEW_OID:
+        case BCONT_BCON_NOW:
+            return 1;
+        case BCONT_DOUBLE: {
+            double d = bson_iter_double(iter);
+
+            return memcmp(val, &d, sizeof(d)) == 0;
+        }
+        case BCONT_BCON_DOCUMENT:
+        case BCONT_BCON_ARRAY: {
+            bcon_t * child_bcon = *((bcon_t **)val);
+
+            bson_iter_recurse(iter, &child);
+
+            return bcon_equal__iter(&child_bcon, &child, type == BCONT_BCON_ARRAY, NULL);
+        }
+        case BCONT_BSON_DOCUMENT:
+        case BCONT_BSON_ARRAY:
+            return bcon_equal_bson_value(*((bson_t **)val), iter);
+        case BCONT_BIN: {
+            bcon_binary_t * z = *((bcon_binary_t **)val);
+            bson_subtype_t subtype;
+            const bson_uint8_t * binary;
+
+            bson_iter_binary(iter, &subtype, &len, &binary);
+
+            return z->subtype == subtype && z->length == len && memcmp(z->binary, binary, len) == 0;
+        }
+        case BCONT_BSON_OID:
+            return memcmp(*((bson_oid_t **)val), bson_iter_oid(iter), 12) == 0;
+        case BCONT_BOOL:
+            return !! *((bson_bool_t *)val) == !! bson_iter_bool(iter);
+        case BCONT_DATE_TIME: {
+            struct timeval * tv = *((struct timeval **)val);
+
+            return (bson_int64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000 == bson_iter_date_time(iter);
+        }
+        case BCONT_BCON_REGEX: {
+            bcon_regex_t * r = *((bcon_regex_t **)val);
+            const char * flags;
+
+            str = bson_iter_regex(iter, &flags);
+
+            return bcon_equal_cstring(r->regex, str) && bcon_equal_cstring(r->flags, flags);
+        }
+        case BCONT_BCON_DBPOINTER: {
+            bcon_dbpointer_t * db = *((bcon_dbpointer_t **)val);
+            const bson_oid_t * oid;
+
+            bson_iter_dbpointer(iter, &len, &str, &oid);
+
+            return bcon_equal_string(db->collection, str, len) && memcmp(db->oid, oid, 12) == 0;
+        }
+        case BCONT_BCON_CODE: {
+            bcon_code_t * code = *((bcon_code_t **)val);
+
+            str = bson_iter_code(iter, &len);
+
+            return bcon_equal_string(code->code, str, len);
+        }
+        case BCONT_BCON_CODEWSCOPE: {
+            bcon_code_t * code = *((bcon_code_t **)val);
+            bcon_t * scope_bcon = code->scope;
+            bson_uint32_t scope_len;
+            const bson_uint8_t * scope_data;
+            bson_t scope;
+
+            str = bson_iter_codewscope(iter, &len, &scope_len, &scope_data);
+
+            if (! bcon_equal_string(code->code, str, len)) return 0;
+
+            bson_init_static(&scope, scope_data, scope_len);
+            bson_iter_init(&child, &scope);
+
+            return bcon_equal__iter(&scope_bcon, &child, 0, NULL);
+        }
+        case BCONT_INT32:
+            return *((bson_int32_t *)val) == bson_iter_int32(iter);
+        case BCONT_BCON_TIMESTAMP: {
+            bcon_timestamp_t * ts = *((bcon_timestamp_t **)val);
+            bson_uint32_t timestamp, increment;
+
+            bson_iter_timestamp(iter, &timestamp, &increment);
+
+            return ts->timestamp == timestamp && ts->increment == increment;
+        }
+        case BCONT_INT64:
+            return *((bson_int64_t *)val) == bson_iter_int64(iter);
+        case BCONT_UNDEFINED:
+        case BCONT_NULL:
+        case BCONT_MAXKEY:
+        case BCONT_MINKEY:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * With count, in is the body of a BCON_IF() matched against the elements
+ * that follow in iter, starting at index *count.
+ */
+static int bcon_equal__iter(bcon_t ** in, bson_iter_t * iter, int is_array, int * count)
+{
+    void * obj = NULL;
+    bcon_type_t type;
+    bson_iter_t child;
+    bcon_t * body;
+    bcon_t * at;
+
+    int i = count ? *count : 0;
+    char i_str[100];
+    const char * key;
+
+    while (1) {
+        if (is_array) {
+            sprintf(i_str, "%d", i);
+            key = i_str;
+        } else {
+            at = *in;
+            type = bcon_token(in, &obj);
+
+            if (type == BCONT_END || type == BCONT_DOC_END) break;
+
+            if (type == BCONT_OMIT) {
+                if (bcon_skip_omitted(at, in)) return 0;
+                continue;
+            }
+
+            if (type == BCONT_BCON_IF) {
+                body = bcon_if_body(obj);
+                if (body && ! bcon_equal__iter(&body, iter, 0, &i)) return 0;
+                continue;
+            }
+
+            if (type == BCONT_ITER_ELEMENT || type == BCONT_BCON_RAW) {
+                if (! bson_iter_next(iter)) return 0;
+                if (! bcon_equal_splice(NULL, obj, type, iter)) return 0;
+                i++;
+                continue;
+            }
+
+            if (type != BCONT_UTF8) return 0;
+
+            key = *((char **)obj);
+        }
+
+        type = bcon_token(in, &obj);
+
+        if (type == BCONT_END || type == BCONT_ARRAY_END) {
+            if (! is_array) return 0;
+            break;
+        }
+
+        if (type == BCONT_DOC_END) break;
+
+        if (type == BCONT_OMIT) continue;
+
+        if (type == BCONT_BCON_IF) {
+            if (! is_array) return 0;
+            body = bcon_if_body(obj);
+            if (body && ! bcon_equal__iter(&body, iter, 1, &i)) return 0;
+            continue;
+        }
+
+        if (! bson_iter_next(iter)) return 0;
+
+        if (type == BCONT_ITER || type == BCONT_ITER_ELEMENT || type == BCONT_BCON_RAW) {
+            if (! bcon_equal_splice(key, obj, type, iter)) return 0;
+            i++;
+            continue;
+        }
+
+        if (bcon_bson_type(type) != bson_iter_type(iter)) return 0;
+        if (strcmp(key, bson_iter_key(iter)) != 0) return 0;
+
+        if (type == BCONT_DOC_START || type == BCONT_ARRAY_START) {
+            bson_iter_recurse(iter, &child);
+            if (! bcon_equal__iter(in, &child, type == BCONT_ARRAY_START, NULL)) return 0;
+        } else {
+            if (! bcon_equal_value(obj, type, iter)) return 0;
+        }
+
+        i++;
+    }
+
+    if (count) {
+        *count = i;
+        return 1;
+    }
+
+    return ! bson_iter_next(iter);
+}
+
+int bcon_equal_bson(bcon_t * in, const bson_t * bson)
+{
+    bson_iter_t iter;
+
+    if (! bson_iter_init(&iter, bson)) return 0;
+
+    return bcon_equal__iter(&in, &iter, 0, NULL);
+}
@@ -0,0 +1,115 @@
+/*
+ * @file bcon_gen.c
+ * @brief BCON (BSON C Object Notation) Generated values
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bcon.h"
+
+#ifdef CLOCK_REALTIME_COARSE
+#define BCON_GEN_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define BCON_GEN_CLOCK CLOCK_REALTIME
+#endif
+
+/* counter values a thread takes from the shared counter at a time */
+#define BCON_GEN_OID_BLOCK 4096
+
+/*
+ * ObjectIds are 4 bytes of seconds, 5 bytes identifying the process and a
+ * 3 byte counter, all big endian.  Threads take blocks of counter values
+ * from the process wide counter with one atomic add and hand them out
+ * from thread local storage, so ids are unique across threads without a
+ * lock or contention on the shared counter.  A forked child gets a new
+ * process id part.
+ */
+static pthread_once_t bcon_gen_once = PTHREAD_ONCE_INIT;
+static bson_uint8_t bcon_gen_process[5];
+static bson_uint32_t bcon_gen_counter;
+static bson_uint32_t bcon_gen_epoch;
+
+static __thread bson_uint32_t bcon_gen_next;
+static __thread bson_uint32_t bcon_gen_left;
+static __thread bson_uint32_t bcon_gen_thread_epoch;
+
+static void bcon_gen_seed(void)
+{
+    struct timespec ts;
+    unsigned int seed;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seed = (unsigned int)(ts.tv_sec ^ ts.tv_nsec ^ ((unsigned int)getpid() << 16));
+
+    for (i = 0; i < 5; i++) bcon_gen_process[i] = (bson_uint8_t)rand_r(&seed);
+
+    __atomic_store_n(&bcon_gen_counter, (bson_uint32_t)rand_r(&seed), __ATOMIC_RELAXED);
+
+    /* invalidates every thread's block */
+    __atomic_add_fetch(&bcon_gen_epoch, 1, __ATOMIC_RELEASE);
+}
+
+static void bcon_gen_init(void)
+{
+    bcon_gen_seed();
+    pthread_atfork(NULL, NULL, bcon_gen_seed);
+}
+
+void bcon_oid_gen(bson_oid_t * oid)
+{
+    bson_uint8_t * out = (bson_uint8_t *)oid;
+    struct timespec ts;
+    bson_uint32_t secs, count, epoch;
+
+    pthread_once(&bcon_gen_once, bcon_gen_init);
+
+    epoch = __atomic_load_n(&bcon_gen_epoch, __ATOMIC_ACQUIRE);
+
+    if (! bcon_gen_left || bcon_gen_thread_epoch != epoch) {
+        bcon_gen_next = __atomic_fetch_add(&bcon_gen_counter, BCON_GEN_OID_BLOCK, __ATOMIC_RELAXED);
+        bcon_gen_left = BCON_GEN_OID_BLOCK;
+        bcon_gen_thread_epoch = epoch;
+    }
+
+    count = bcon_gen_next++;
+    bcon_gen_left--;
+
+    clock_gettime(BCON_GEN_CLOCK, &ts);
+    secs = (bson_uint32_t)ts.tv_sec;
+
+    out[0] = (bson_uint8_t)(secs >> 24);
+    out[1] = (bson_uint8_t)(secs >> 16);
+    out[2] = (bson_uint8_t)(secs >> 8);
+    out[3] = (bson_uint8_t)secs;
+    memcpy(out + 4, bcon_gen_process, 5);
+    out[9] = (bson_uint8_t)(count >> 16);
+    out[10] = (bson_uint8_t)(count >> 8);
+    out[11] = (bson_uint8_t)count;
+}
+
+bson_int64_t bcon_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(BCON_GEN_CLOCK, &ts);
+
+    return (bson_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
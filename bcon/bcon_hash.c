@@ -0,0 +1,535 @@
+/*
+ * @file bcon_hash.c
+ * @brief BCON (BSON C Object Notation) Hashing
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+#include "bcon_private.h"
+
+#define BCON_HASH_C1 0x87c37b91114253d5ULL
+#define BCON_HASH_C2 0x4cf5ad432745937fULL
+
+#define BCON_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/*
+ * A streaming MurmurHash3 style 128 bit mix over 8 byte blocks.  Bytes are
+ * buffered in bcon_hash_state_t until a block is full so the result
+ * doesn't depend on how the input was split up between calls.
+ */
+static void bcon_hash_block(bcon_hash_state_t * h, bson_uint64_t k)
+{
+    k *= BCON_HASH_C1;
+    k = BCON_ROTL64(k, 31);
+    k *= BCON_HASH_C2;
+    h->h1 ^= k;
+    h->h1 = BCON_ROTL64(h->h1, 27);
+    h->h1 += h->h2;
+    h->h1 = h->h1 * 5 + 0x52dce729;
+
+    k *= BCON_HASH_C1;
+    k = BCON_ROTL64(k, 33);
+    h->h2 ^= k;
+    h->h2 = BCON_ROTL64(h->h2, 31);
+    h->h2 += h->h1;
+    h->h2 = h->h2 * 5 + 0x38495ab5;
+}
+
+static void bcon_hash_update(bcon_hash_state_t * h, const void * data, size_t len)
+{
+    const bson_uint8_t * p = data;
+    bson_uint64_t k;
+
+    h->total += len;
+
+    if (h->tail_len) {
+        while (len && h->tail_len < 8) {
+            h->tail[h->tail_len++] = *p++;
+            len--;
+        }
+
+        if (h->tail_len < 8) return;
+
+        memcpy(&k, h->tail, 8);
+        bcon_hash_block(h, BSON_UINT64_FROM_LE(k));
+        h->tail_len = 0;
+    }
+
+    while (len >= 8) {
+        memcpy(&k, p, 8);
+        bcon_hash_block(h, BSON_UINT64_FROM_LE(k));
+        p += 8;
+        len -= 8;
+    }
+
+    memcpy(h->tail, p, len);
+    h->tail_len = len;
+}
+
+static bson_uint64_t bcon_hash_fmix(bson_uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+
+    return k;
+}
+
+static void bcon_hash_init(bcon_hash_state_t * h, bcon_hash_mode_t mode)
+{
+    memset(h, 0, sizeof(*h));
+    h->mode = mode;
+}
+
+static void bcon_hash_final(bcon_hash_state_t * h, bcon_hash_t * out)
+{
+    bson_uint64_t k = 0;
+
+    if (h->tail_len) {
+        memcpy(&k, h->tail, h->tail_len);
+        bcon_hash_block(h, BSON_UINT64_FROM_LE(k));
+    }
+
+    h->h1 ^= h->total;
+    h->h2 ^= h->total;
+    h->h1 += h->h2;
+    h->h2 += h->h1;
+    h->h1 = bcon_hash_fmix(h->h1);
+    h->h2 = bcon_hash_fmix(h->h2);
+    h->h1 += h->h2;
+    h->h2 += h->h1;
+
+    out->lo = h->h1;
+    out->hi = h->h2;
+}
+
+static void bcon_hash_u8(bcon_hash_state_t * h, bson_uint8_t v)
+{
+    bcon_hash_update(h, &v, 1);
+}
+
+static void bcon_hash_u32(bcon_hash_state_t * h, bson_uint32_t v)
+{
+    v = BSON_UINT32_TO_LE(v);
+    bcon_hash_update(h, &v, 4);
+}
+
+static void bcon_hash_u64(bcon_hash_state_t * h, bson_uint64_t v)
+{
+    v = BSON_UINT64_TO_LE(v);
+    bcon_hash_update(h, &v, 8);
+}
+
+static void bcon_hash_cstring(bcon_hash_state_t * h, const char * str)
+{
+    if (! str) str = "";
+
+    bcon_hash_update(h, str, strlen(str) + 1);
+}
+
+static void bcon_hash_string(bcon_hash_state_t * h, const char * str, bson_uint32_t len)
+{
+    bcon_hash_u32(h, len + 1);
+    bcon_hash_update(h, str, len);
+    bcon_hash_u8(h, 0);
+}
+
+static void bcon_hash_key(bcon_hash_state_t * h, bson_type_t type, const char * key)
+{
+    bcon_hash_u8(h, type);
+    bcon_hash_cstring(h, key);
+}
+
+static void bcon_hash__bson(bcon_hash_state_t * h, const bson_t * bson);
+
+static void bcon_hash__iter(bcon_hash_state_t * h, bson_iter_t * iter);
+
+static void bcon_hash_iter_value(bcon_hash_state_t * h, const bson_iter_t * iter)
+{
+    bson_iter_t child;
+    bson_type_t type = bson_iter_type(iter);
+    bson_uint32_t len;
+    const bson_uint8_t * data;
+    const char * str;
+
+    if (type == BSON_TYPE_DOCUMENT || type == BSON_TYPE_ARRAY) {
+        bson_iter_recurse(iter, &child);
+        bcon_hash__iter(h, &child);
+        return;
+    }
+
+    if (type == BSON_TYPE_CODEWSCOPE) {
+        bson_t scope;
+        bson_uint32_t scope_len;
+
+        str = bson_iter_codewscope(iter, &len, &scope_len, &data);
+        if (h->mode == BCON_HASH_VALUES) bcon_hash_string(h, str, len);
+
+        bson_init_static(&scope, data, scope_len);
+        bcon_hash__bson(h, &scope);
+        return;
+    }
+
+    if (h->mode == BCON_HASH_SHAPE) return;
+
+    switch (type) {
+        case BSON_TYPE_UTF8:
+            str = bson_iter_utf8(iter, &len);
+            bcon_hash_string(h, str, len);
+            break;
+        case BSON_TYPE_SYMBOL:
+            str = bson_iter_symbol(iter, &len);
+            bcon_hash_string(h, str, len);
+            break;
+        case BSON_TYPE_CODE:
+            str = bson_iter_code(iter, &len);
+            bcon_hash_string(h, str, len);
+            break;
+        case BSON_TYPE_DOUBLE: {
+            double d = bson_iter_double(iter);
+            bson_uint64_t v;
+
+            memcpy(&v, &d, 8);
+            bcon_hash_u64(h, v);
+            break;
+        }
+        case BSON_TYPE_BINARY: {
+            bson_subtype_t subtype;
+
+            bson_iter_binary(iter, &subtype, &len, &data);
+            bcon_hash_u32(h, len);
+            bcon_hash_u8(h, subtype);
+            bcon_hash_update(h, data, len);
+            break;
+        }
+        case BSON_TYPE_OID:
+            bcon_hash_update(h, bson_iter_oid(iter), 12);
+            break;
+        case BSON_TYPE_BOOL:
+            bcon_hash_u8(h, bson_iter_bool(iter) ? 1 : 0);
+            break;
+        case BSON_TYPE_DATE_TIME:
+            bcon_hash_u64(h, bson_iter_date_time(iter));
+            break;
+        case BSON_TYPE_REGEX: {
+            const char * flags;
+
+            str = bson_iter_regex(iter, &flags);
+            bcon_hash_cstring(h, str);
+            bcon_hash_cstring(h, flags);
+            break;
+        }
+        case BSON_TYPE_DBPOINTER: {
+            const bson_oid_t * oid;
+
+            bson_iter_dbpointer(iter, &len, &str, &oid);
+            bcon_hash_string(h, str, len);
+            bcon_hash_update(h, oid, 12);
+            break;
+        }
+        case BSON_TYPE_INT32:
+            bcon_hash_u32(h, bson_iter_int32(iter));
+            break;
+        case BSON_TYPE_TIMESTAMP: {
+            bson_uint32_t ts, inc;
+
+            bson_iter_timestamp(iter, &ts, &inc);
+            bcon_hash_u32(h, inc);
+            bcon_hash_u32(h, ts);
+            break;
+        }
+        case BSON_TYPE_INT64:
+            bcon_hash_u64(h, bson_iter_int64(iter));
+            break;
+        default:
+            break;
+    }
+}
+
+static void bcon_hash__iter(bcon_hash_state_t * h, bson_iter_t * iter)
+{
+    while (bson_iter_next(iter)) {
+        bcon_hash_key(h, bson_iter_type(iter), bson_iter_key(iter));
+        bcon_hash_iter_value(h, iter);
+    }
+
+    bcon_hash_u8(h, 0);
+}
+
+static void bcon_hash__bson(bcon_hash_state_t * h, const bson_t * bson)
+{
+    bson_iter_t iter;
+
+    bson_iter_init(&iter, bson);
+    bcon_hash__iter(h, &iter);
+}
+
+static int bcon_hash__bcon(bcon_hash_state_t * h, bcon_t ** in, int is_array);
+
+static void bcon_hash_element(bcon_hash_state_t * h, const char * key, const bson_iter_t * iter)
+{
+    bcon_hash_key(h, bson_iter_type(iter), key ? key : bson_iter_key(iter));
+    bcon_hash_iter_value(h, iter);
+}
+
+static int bcon_hash_value(bcon_hash_state_t * h, const char * key, void * val, bcon_type_t type)
+{
+    if (type == BCONT_ITER || type == BCONT_ITER_ELEMENT) {
+        bcon_hash_element(h, key, *((bson_iter_t **)val));
+        return 0;
+    }
+
+    if (type == BCONT_BCON_RAW) {
+        bcon_raw_iter_t ri;
+        int r = bcon_raw_iter_init(&ri, *((bcon_raw_t **)val));
+
+        if (! r) bcon_hash_element(h, key, &ri.iter);
+
+        bcon_raw_iter_destroy(&ri);
+
+        return r;
+    }
+
+    /* generators can't be run without encoding */
+    if (type == BCONT_BCON_CALLBACK) return 1;
+
+    bcon_hash_key(h, bcon_bson_type(type), key);
+
+    switch (type) {
+        case BCONT_BCON_DOCUMENT:
+        case BCONT_BCON_ARRAY: {
+            bcon_t * child = *((bcon_t **)val);
+
+            return bcon_hash__bcon(h, &child, type == BCONT_BCON_ARRAY);
+        }
+        case BCONT_BSON_DOCUMENT:
+        case BCONT_BSON_ARRAY:
+            bcon_hash__bson(h, *((bson_t **)val));
+            return 0;
+        case BCONT_BCON_CODEWSCOPE: {
+            bcon_code_t * code = *((bcon_code_t **)val);
+            bcon_t * scope = code->scope;
+
+            if (h->mode == BCON_HASH_VALUES) bcon_hash_string(h, code->code, strlen(code->code));
+
+            return bcon_hash__bcon(h, &scope, 0);
+        }
+        default:
+            break;
+    }
+
+    if (h->mode == BCON_HASH_SHAPE) return 0;
+
+    switch (type) {
+        case BCONT_UTF8:
+        case BCONT_SYMBOL: {
+            char * str = *((char **)val);
+
+            bcon_hash_string(h, str, strlen(str));
+            break;
+        }
+        case BCONT_BCON_CODE: {
+            bcon_code_t * code = *((bcon_code_t **)val);
+
+            bcon_hash_string(h, code->code, strlen(code->code));
+            break;
+        }
+        case BCONT_BCON_UTF8_LEN:
+        case BCONT_BCON_SYMBOL_LEN:
+        case BCONT_BCON_CODE_LEN: {
+            bcon_string_t * z = *((bcon_string_t **)val);
+
+            bcon_hash_string(h, z->str, z->length);
+            break;
+        }
+        case BCONT_BCON_NEW_OID:
+        case BCONT_BCON_NOW:
+            /* the value only exists once encoded */
+            return 1;
+        case BCONT_DOUBLE: {
+            bson_uint64_t v;
+
+            memcpy(&v, val, 8);
+            bcon_hash_u64(h, v);
+            break;
+        }
+        case BCONT_BIN: {
+            bcon_binary_t * z = *((bcon_binary_t **)val);
+
+            bcon_hash_u32(h, z->length);
+            bcon_hash_u8(h, z->subtype);
+            bcon_hash_update(h, z->binary, z->length);
+            break;
+        }
+        case BCONT_BSON_OID:
+            bcon_hash_update(h, *((bson_oid_t **)val), 12);
+            break;
+        case BCONT_BOOL:
+            bcon_hash_u8(h, *((bson_bool_t *)val) ? 1 : 0);
+            break;
+        case BCONT_DATE_TIME: {
+            struct timeval * tv = *((struct timeval **)val);
+
+            bcon_hash_u64(h, (bson_uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000);
+            break;
+        }
+        case BCONT_BCON_REGEX: {
+            bcon_regex_t * r = *((bcon_regex_t **)val);
+
+            bcon_hash_cstring(h, r->regex);
+            bcon_hash_cstring(h, r->flags);
+            break;
+        }
+        case BCONT_BCON_DBPOINTER: {
+            bcon_dbpointer_t * db = *((bcon_dbpointer_t **)val);
+
+            bcon_hash_string(h, db->collection, strlen(db->collection));
+            bcon_hash_update(h, db->oid, 12);
+            break;
+        }
+        case BCONT_INT32:
+            bcon_hash_u32(h, *((bson_int32_t *)val));
+            break;
+        case BCONT_BCON_TIMESTAMP: {
+            bcon_timestamp_t * ts = *((bcon_timestamp_t **)val);
+
+            bcon_hash_u32(h, ts->increment);
+            bcon_hash_u32(h, ts->timestamp);
+            break;
+        }
+        case BCONT_INT64:
+            bcon_hash_u64(h, *((bson_int64_t *)val));
+            break;
+        case BCONT_UNDEFINED:
+        case BCONT_NULL:
+        case BCONT_MAXKEY:
+        case BCONT_MINKEY:
+            break;
+        default:
+            return 1;
+    }
+
+    return 0;
+}
+
+static int bcon_hash_visit_begin(void * data, const char * key, int is_array)
+{
+    if (key) bcon_hash_key(data, is_array ? BSON_TYPE_ARRAY : BSON_TYPE_DOCUMENT, key);
+
+    return 0;
+}
+
+static int bcon_hash_visit_end(void * data, int is_array)
+{
+    bcon_hash_u8(data, 0);
+
+    return 0;
+}
+
+static int bcon_hash_visit_value(void * data, const char * key, void * val, bcon_type_t type)
+{
+    return bcon_hash_value(data, key, val, type);
+}
+
+void bcon_hash_visitor_init(bcon_visitor_t * v, bcon_hash_state_t * state, bcon_hash_mode_t mode)
+{
+    memset(v, 0, sizeof(*v));
+
+    bcon_hash_init(state, mode);
+
+    v->begin = bcon_hash_visit_begin;
+    v->end = bcon_hash_visit_end;
+    v->value = bcon_hash_visit_value;
+    v->data = state;
+}
+
+void bcon_hash_visitor_final(bcon_hash_state_t * state, bcon_hash_t * out)
+{
+    bcon_hash_final(state, out);
+}
+
+static int bcon_hash__bcon(bcon_hash_state_t * h, bcon_t ** in, int is_array)
+{
+    bcon_visitor_t v;
+
+    memset(&v, 0, sizeof(v));
+
+    v.begin = bcon_hash_visit_begin;
+    v.end = bcon_hash_visit_end;
+    v.value = bcon_hash_visit_value;
+    v.data = h;
+
+    return bcon_visit__doc(in, is_array, &v, 1);
+}
+
+char * bcon_hash(bcon_t * in, bcon_hash_mode_t mode, bcon_hash_t * out)
+{
+    bcon_hash_state_t h;
+
+    bcon_visitor_t v;
+    char * err;
+
+    bcon_hash_visitor_init(&v, &h, mode);
+
+    err = bcon_visit(in, &v, 1);
+    if (err) return err;
+
+    bcon_hash_final(&h, out);
+
+    return NULL;
+}
+
+void bcon_hash_bson(const bson_t * bson, bcon_hash_mode_t mode, bcon_hash_t * out)
+{
+    bcon_hash_state_t h;
+
+    bcon_hash_init(&h, mode);
+    bcon_hash__bson(&h, bson);
+    bcon_hash_final(&h, out);
+}
+
+void bcon_hash_pieces(const bcon_encoder_piece_t * pieces, int n, bcon_hash_t * out)
+{
+    bcon_hash_state_t h;
+    int k;
+
+    bcon_hash_init(&h, BCON_HASH_VALUES);
+
+    for (k = 0; k < n; k++) {
+        bcon_hash_update(&h, pieces[k].ptr, pieces[k].len);
+    }
+
+    bcon_hash_final(&h, out);
+}
+
+void bcon_capture_shard_hash(const bcon_capture_t * caps, int n, bcon_hash_t * out)
+{
+    bcon_hash_state_t h;
+    int c;
+
+    bcon_hash_init(&h, BCON_HASH_VALUES);
+
+    for (c = 0; c < n; c++) {
+        bcon_hash_u8(&h, (bson_uint8_t)caps[c].type);
+        bcon_hash_u64(&h, caps[c].hash.lo);
+        bcon_hash_u64(&h, caps[c].hash.hi);
+    }
+
+    bcon_hash_final(&h, out);
+}
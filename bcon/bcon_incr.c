@@ -0,0 +1,390 @@
+/*
+ * @file bcon_incr.c
+ * @brief BCON (BSON C Object Notation) Incremental re-encoding
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+#include "bcon_private.h"
+
+/*
+ * Builds the element map while walking the template, tracking the offset
+ * each element will be written at the same way the size visitor counts.
+ */
+typedef struct bcon_incr_map {
+    bcon_incr_t * incr;
+    int elems_cap;
+    int docs_cap;
+    int stack[BCON_VISIT_MAX_DEPTH];
+    int depth;
+    bson_uint32_t pos;
+} bcon_incr_map_t;
+
+static int bcon_incr_map_begin(void * data, const char * key, int is_array)
+{
+    bcon_incr_map_t * map = data;
+    bcon_incr_t * incr = map->incr;
+    bcon_incr_doc_t * doc;
+
+    if (key) map->pos += strlen(key) + 2;
+
+    if (incr->n_docs == map->docs_cap) {
+        int cap = map->docs_cap ? map->docs_cap * 2 : 8;
+
+        if (! (doc = realloc(incr->docs, cap * sizeof(*incr->docs)))) return 1;
+
+        incr->docs = doc;
+        map->docs_cap = cap;
+    }
+
+    doc = &incr->docs[incr->n_docs];
+    doc->offset = map->pos;
+    doc->parent = map->depth ? map->stack[map->depth - 1] : -1;
+
+    map->stack[map->depth++] = incr->n_docs++;
+    map->pos += 4;
+
+    return 0;
+}
+
+static int bcon_incr_map_end(void * data, int is_array)
+{
+    bcon_incr_map_t * map = data;
+
+    map->depth--;
+    map->pos += 1;
+
+    return 0;
+}
+
+static int bcon_incr_map_value(void * data, const char * key, void * val, bcon_type_t type)
+{
+    bcon_incr_map_t * map = data;
+    bcon_incr_t * incr = map->incr;
+    bcon_incr_elem_t * e;
+    bson_uint32_t size = 0;
+
+    if (! key) {
+        if (type == BCONT_ITER_ELEMENT) {
+            key = bson_iter_key(*((bson_iter_t **)val));
+        } else {
+            bson_type_t raw_type;
+            const bson_uint8_t * raw_value;
+            bson_uint32_t raw_len;
+
+            if (bcon_raw_split(*((bcon_raw_t **)val), &raw_type, &key, &raw_value, &raw_len)) return 1;
+        }
+    }
+
+    if (bcon_value_size(val, type, &size)) return 1;
+
+    if (incr->n_elems == map->elems_cap) {
+        int cap = map->elems_cap ? map->elems_cap * 2 : 32;
+
+        if (! (e = realloc(incr->elems, cap * sizeof(*incr->elems)))) return 1;
+
+        incr->elems = e;
+        map->elems_cap = cap;
+    }
+
+    e = &incr->elems[incr->n_elems++];
+    e->offset = map->pos;
+    e->header_len = strlen(key) + 2;
+    e->len = e->header_len + size;
+    e->doc = map->stack[map->depth - 1];
+    e->type = type;
+    e->val = val;
+
+    map->pos += e->len;
+
+    return 0;
+}
+
+char * bcon_incr_init(bcon_incr_t * incr, bcon_t * in)
+{
+    bcon_encoder_t enc;
+    bcon_incr_map_t map;
+    bcon_visitor_t v;
+    size_t n;
+    char * err;
+
+    memset(incr, 0, sizeof(*incr));
+    memset(&map, 0, sizeof(map));
+
+    incr->in = in;
+    map.incr = incr;
+
+    v.begin = bcon_incr_map_begin;
+    v.end = bcon_incr_map_end;
+    v.value = bcon_incr_map_value;
+    v.data = &map;
+
+    err = bcon_visit(in, &v, 1);
+    if (err) {
+        bcon_incr_destroy(incr);
+        return err;
+    }
+
+    incr->len = map.pos;
+    incr->buf_len = map.pos * 2;
+
+    if (map.pos > 0x7fffffff || ! (incr->buf = malloc(incr->buf_len))) {
+        bcon_incr_destroy(incr);
+        return strdup("out of memory");
+    }
+
+    bcon_encoder_init(&enc, in);
+
+    if (bcon_encoder_feed(&enc, incr->buf, incr->buf_len, &n) != BCON_ENCODER_DONE || n != incr->len) {
+        bcon_incr_destroy(incr);
+        return bcon_dump(in);
+    }
+
+    bson_init_static(&incr->doc, incr->buf, incr->len);
+
+    return NULL;
+}
+
+/*
+ * Replaces old_len bytes at offset with new_len bytes, then moves every
+ * document that starts after the change and adds the difference to each
+ * length prefix enclosing element e.  Returns 1, leaving the buffer as it
+ * was, if it can't grow.
+ */
+static int bcon_incr_splice(bcon_incr_t * incr, bcon_incr_elem_t * e, bson_uint32_t offset, bson_uint32_t old_len, const void * data, bson_uint32_t new_len)
+{
+    bson_int32_t delta = (bson_int32_t)new_len - (bson_int32_t)old_len;
+    bson_uint32_t prefix;
+    bson_uint8_t * buf;
+    int i;
+
+    if (incr->len + delta > incr->buf_len) {
+        if (incr->len + delta > 0x7fffffff) return 1;
+        if (! (buf = realloc(incr->buf, (incr->len + delta) * 2))) return 1;
+
+        incr->buf = buf;
+        incr->buf_len = (incr->len + delta) * 2;
+    }
+
+    if (delta) memmove(incr->buf + offset + new_len, incr->buf + offset + old_len, incr->len - offset - old_len);
+    memcpy(incr->buf + offset, data, new_len);
+
+    if (! delta) return 0;
+
+    incr->len += delta;
+    e->len += delta;
+
+    for (i = 0; i < incr->n_docs; i++) {
+        if (incr->docs[i].offset > offset) incr->docs[i].offset += delta;
+    }
+
+    for (i = e->doc; i >= 0; i = incr->docs[i].parent) {
+        memcpy(&prefix, incr->buf + incr->docs[i].offset, 4);
+        prefix = BSON_UINT32_TO_LE(BSON_UINT32_FROM_LE(prefix) + delta);
+        memcpy(incr->buf + incr->docs[i].offset, &prefix, 4);
+    }
+
+    return 0;
+}
+
+/*
+ * Compares a value against what's stored in the value bytes of e and
+ * rewrites them if they differ, setting *changed.  Strings and documents
+ * are compared by length first; fixed size values are just compared and
+ * overwritten.
+ */
+static int bcon_incr_check_bytes(bcon_incr_t * incr, bcon_incr_elem_t * e, const void * prefix, bson_uint32_t prefix_len, const void * data, bson_uint32_t data_len, int * changed)
+{
+    bson_uint32_t at = e->offset + e->header_len;
+    bson_uint32_t old_len = e->len - e->header_len;
+    bson_uint8_t * old = incr->buf + at;
+    bson_uint8_t small[64];
+    bson_uint8_t * tmp;
+    int r;
+
+    if (old_len == prefix_len + data_len && (! prefix_len || memcmp(old, prefix, prefix_len) == 0) && memcmp(old + prefix_len, data, data_len) == 0) return 0;
+
+    *changed = 1;
+
+    if (old_len == prefix_len + data_len) {
+        if (prefix_len) memcpy(old, prefix, prefix_len);
+        memcpy(old + prefix_len, data, data_len);
+        return 0;
+    }
+
+    tmp = prefix_len + data_len <= sizeof(small) ? small : malloc(prefix_len + data_len);
+    if (! tmp) return 1;
+
+    if (prefix_len) memcpy(tmp, prefix, prefix_len);
+    memcpy(tmp + prefix_len, data, data_len);
+
+    r = bcon_incr_splice(incr, e, at, old_len, tmp, prefix_len + data_len);
+
+    if (tmp != small) free(tmp);
+
+    return r;
+}
+
+/*
+ * Anything without a fast path is appended to a scratch document and the
+ * whole element compared.
+ */
+static int bcon_incr_check_generic(bcon_incr_t * incr, bcon_incr_elem_t * e, int * changed)
+{
+    const char * key = (const char *)incr->buf + e->offset + 1;
+    const bson_uint8_t * data;
+    bson_uint32_t len;
+    bson_t scratch;
+
+    bson_init(&scratch);
+
+    if (bcon_to_bson_put_value(&scratch, key, e->val, e->type)) {
+        bson_destroy(&scratch);
+        return 1;
+    }
+
+    data = bson_get_data(&scratch) + 4;
+    len = scratch.len - 5;
+
+    if (len != e->len || memcmp(incr->buf + e->offset, data, len) != 0) {
+        if (bcon_incr_splice(incr, e, e->offset, e->len, data, len)) {
+            bson_destroy(&scratch);
+            return 1;
+        }
+
+        *changed = 1;
+    }
+
+    bson_destroy(&scratch);
+
+    return 0;
+}
+
+/*
+ * Walks the template again so P bindings that now point elsewhere are
+ * picked up, and checks each value against the element map in order.
+ * shift is how far the current element has moved from where it was
+ * last time.
+ */
+typedef struct bcon_incr_check {
+    bcon_incr_t * incr;
+    int i;
+    bson_int32_t shift;
+} bcon_incr_check_t;
+
+static int bcon_incr_check_value(void * data, const char * key, void * val, bcon_type_t type)
+{
+    bcon_incr_check_t * check = data;
+    bcon_incr_t * incr = check->incr;
+    bcon_incr_elem_t * e;
+    bson_uint8_t b;
+    bson_uint32_t u32;
+    bson_uint64_t u64;
+    bson_uint32_t before;
+    int changed = 0;
+
+    if (check->i == incr->n_elems) return 1;
+
+    e = &incr->elems[check->i++];
+
+    if (e->type != type) return 1;
+
+    e->offset += check->shift;
+    e->val = val;
+    before = e->len;
+
+    switch (type) {
+        case BCONT_UTF8:
+        case BCONT_SYMBOL: {
+            const char * str = *((char **)val);
+            bson_uint32_t len = strlen(str) + 1;
+
+            u32 = BSON_UINT32_TO_LE(len);
+            if (bcon_incr_check_bytes(incr, e, &u32, 4, str, len, &changed)) return 1;
+            break;
+        }
+        case BCONT_BSON_DOCUMENT:
+        case BCONT_BSON_ARRAY: {
+            const bson_t * bson = *((bson_t **)val);
+
+            if (bcon_incr_check_bytes(incr, e, NULL, 0, bson_get_data(bson), bson->len, &changed)) return 1;
+            break;
+        }
+        case BCONT_INT32:
+            memcpy(&u32, val, 4);
+            u32 = BSON_UINT32_TO_LE(u32);
+            if (bcon_incr_check_bytes(incr, e, NULL, 0, &u32, 4, &changed)) return 1;
+            break;
+        case BCONT_INT64:
+        case BCONT_DOUBLE:
+            memcpy(&u64, val, 8);
+            u64 = BSON_UINT64_TO_LE(u64);
+            if (bcon_incr_check_bytes(incr, e, NULL, 0, &u64, 8, &changed)) return 1;
+            break;
+        case BCONT_BOOL:
+            b = *((bson_bool_t *)val) ? 1 : 0;
+            if (bcon_incr_check_bytes(incr, e, NULL, 0, &b, 1, &changed)) return 1;
+            break;
+        case BCONT_UNDEFINED:
+        case BCONT_NULL:
+        case BCONT_MAXKEY:
+        case BCONT_MINKEY:
+            break;
+        default:
+            if (bcon_incr_check_generic(incr, e, &changed)) return 1;
+            break;
+    }
+
+    check->shift += (bson_int32_t)e->len - (bson_int32_t)before;
+    incr->n_changed += changed;
+
+    return 0;
+}
+
+char * bcon_incr_update(bcon_incr_t * incr)
+{
+    bcon_incr_check_t check;
+    bcon_visitor_t v;
+    char * err;
+
+    memset(&v, 0, sizeof(v));
+    memset(&check, 0, sizeof(check));
+
+    check.incr = incr;
+    incr->n_changed = 0;
+
+    v.value = bcon_incr_check_value;
+    v.data = &check;
+
+    err = bcon_visit(incr->in, &v, 1);
+    if (err) return err;
+
+    if (check.i != incr->n_elems) return bcon_dump(incr->in);
+
+    bson_init_static(&incr->doc, incr->buf, incr->len);
+
+    return NULL;
+}
+
+void bcon_incr_destroy(bcon_incr_t * incr)
+{
+    free(incr->buf);
+    free(incr->elems);
+    free(incr->docs);
+
+    memset(incr, 0, sizeof(*incr));
+}
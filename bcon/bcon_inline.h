@@ -0,0 +1,339 @@
+/*
+ * @file bcon_inline.h
+ * @brief BCON (BSON C Object Notation) Inline encoder
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef BCON_INLINE_H_
+#define BCON_INLINE_H_
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcon.h"
+
+/*
+ * BCON_INLINE_TO_BSON(bson, ...) appends the same document as
+ * bcon_to_bson(BCON(...), bson), but the walk over the tokens is inlined
+ * into the caller.  The token array is a literal of known length at the
+ * call site, so the compiler can unroll the walk, resolve every token at
+ * compile time and leave a straight run of bson_append_*() calls with
+ * constant keys and key lengths.  Values behind R and P bindings are
+ * still read when the line runs.
+ *
+ *     #include "bcon_inline.h"
+ *
+ *     err = BCON_INLINE_TO_BSON(bson, "user", BCON_RUTF8(&name), "n", BCON_INT32(3));
+ *
+ * Types without an inline encoding (callbacks, BCON_IF(), raw elements,
+ * BCON_DOC() and so on) are handed one at a time to bcon_append().  More
+ * than BCON_INLINE_MAX_DEPTH levels of "{" and "[" are an error.  Errors
+ * are returned as from bcon_to_bson(), but bson is left partly written.
+ *
+ * Every call site gets its own copy of the encoder, so this is meant for
+ * the few hot templates where that pays off.  It relies on the length of
+ * C's array compound literals and isn't available from C++.
+ */
+#define BCON_INLINE_MAX_DEPTH 8
+
+#define BCON_INLINE_TO_BSON(bson, ...) \
+    (bcon_inline__to_bson(BCON( __VA_ARGS__ ), sizeof(BCON( __VA_ARGS__ )) / sizeof(bcon_t), (bson)) \
+        ? bcon_dump(BCON( __VA_ARGS__ )) : NULL)
+
+#if defined(__clang__)
+#define BCON_INLINE_UNROLL _Pragma("clang loop unroll(full)")
+#elif defined(__GNUC__) && (__GNUC__ >= 8)
+#define BCON_INLINE_UNROLL _Pragma("GCC unroll 1024")
+#else
+#define BCON_INLINE_UNROLL
+#endif
+
+#if defined(__GNUC__)
+#define BCON_INLINE_FN static inline __attribute__((always_inline))
+#define BCON_INLINE_COLD static __attribute__((noinline, cold, unused))
+#else
+#define BCON_INLINE_FN static inline
+#define BCON_INLINE_COLD static
+#endif
+
+/*
+ * The tokens are passed by value so the literal's address never escapes
+ * the walk; otherwise every append would be assumed to change it.
+ */
+BCON_INLINE_COLD int bcon_inline_fallback(bson_t * bson, int is_array, bson_uint32_t * count, const char * key, bcon_type_t type, bcon_t value)
+{
+    bcon_append_ctx_t ctx;
+    bcon_t tmp[5];
+    char * err;
+    int i = 0;
+
+    if (key) tmp[i++].UTF8 = (char *)key;
+
+    tmp[i++].UTF8 = BCON_MAGIC;
+    tmp[i++].type = type;
+    tmp[i++] = value;
+    tmp[i].UTF8 = NULL;
+
+    ctx.bson = bson;
+    ctx.is_array = is_array;
+    ctx.count = *count;
+
+    err = bcon_append(&ctx, tmp);
+
+    if (err) {
+        free(err);
+        return 1;
+    }
+
+    *count = ctx.count;
+
+    return 0;
+}
+
+BCON_INLINE_FN bcon_type_t bcon_inline_token(bcon_t * in, void ** out)
+{
+    bcon_type_t type = in[1].type;
+
+    in += 2;
+
+    switch (type) {
+#include "bcon_indirection.h"
+        default:
+            type = BCONT_ERROR;
+            break;
+    }
+
+    return type;
+}
+
+BCON_INLINE_FN const char * bcon_inline_index(char * buf, bson_uint32_t i, int * len)
+{
+    char * p = buf + 15;
+
+    *p = '\0';
+
+    do {
+        *--p = (char)('0' + i % 10);
+        i /= 10;
+    } while (i);
+
+    *len = (int)(buf + 15 - p);
+
+    return p;
+}
+
+/*
+ * Appends the common value types directly.  Returns 0 for the types it
+ * leaves to bcon_inline_fallback().
+ */
+BCON_INLINE_FN int bcon_inline_put(bson_t * bson, const char * key, int key_len, void * val, bcon_type_t type)
+{
+    switch (type) {
+        case BCONT_UTF8:
+            bson_append_utf8(bson, key, key_len, *((char **)val), -1);
+            return 1;
+        case BCONT_SYMBOL:
+            bson_append_symbol(bson, key, key_len, *((char **)val), -1);
+            return 1;
+        case BCONT_BCON_UTF8_LEN: {
+            bcon_string_t * z = *((bcon_string_t **)val);
+
+            bson_append_utf8(bson, key, key_len, z->str, z->length);
+            return 1;
+        }
+        case BCONT_INT32:
+            bson_append_int32(bson, key, key_len, *((bson_int32_t *)val));
+            return 1;
+        case BCONT_INT64:
+            bson_append_int64(bson, key, key_len, *((bson_int64_t *)val));
+            return 1;
+        case BCONT_DOUBLE:
+            bson_append_double(bson, key, key_len, *((double *)val));
+            return 1;
+        case BCONT_BOOL:
+            bson_append_bool(bson, key, key_len, *((bson_bool_t *)val));
+            return 1;
+        case BCONT_NULL:
+            bson_append_null(bson, key, key_len);
+            return 1;
+        case BCONT_BSON_OID:
+            bson_append_oid(bson, key, key_len, *((bson_oid_t **)val));
+            return 1;
+        case BCONT_DATE_TIME:
+            bson_append_timeval(bson, key, key_len, *((struct timeval **)val));
+            return 1;
+        case BCONT_BSON_DOCUMENT:
+            bson_append_document(bson, key, key_len, *((bson_t **)val));
+            return 1;
+        case BCONT_BSON_ARRAY:
+            bson_append_array(bson, key, key_len, *((bson_t **)val));
+            return 1;
+        case BCONT_MAXKEY:
+            bson_append_maxkey(bson, key, key_len);
+            return 1;
+        case BCONT_MINKEY:
+            bson_append_minkey(bson, key, key_len);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * The walk takes one slot per iteration, with skip stepping over the
+ * type and value slots of a typed token, so the trip count is the length
+ * of the literal and the loop can be fully unrolled.
+ */
+BCON_INLINE_FN int bcon_inline__to_bson(bcon_t * in, size_t n, bson_t * bson)
+{
+    bson_t children[BCON_INLINE_MAX_DEPTH];
+    bson_t * stack[BCON_INLINE_MAX_DEPTH + 1];
+    bson_uint32_t count[BCON_INLINE_MAX_DEPTH + 1];
+    int is_array[BCON_INLINE_MAX_DEPTH + 1];
+    int depth = 0, skip = 0, key_len = 0, drop = 0, drop_depth = 0;
+    const char * key = NULL;
+    char i_str[16];
+    void * obj = NULL;
+    bcon_type_t type;
+    size_t k;
+
+    stack[0] = bson;
+    count[0] = 0;
+    is_array[0] = 0;
+
+    BCON_INLINE_UNROLL
+    for (k = 0; k + 1 < n; k++) {
+        if (skip) {
+            skip--;
+            continue;
+        }
+
+        if (in[k].UTF8 == BCON_MAGIC) {
+            type = bcon_inline_token(in + k, &obj);
+            skip = 2;
+        } else {
+            switch (in[k].UTF8[0]) {
+                case '{': type = BCONT_DOC_START; break;
+                case '}': type = BCONT_DOC_END; break;
+                case '[': type = BCONT_ARRAY_START; break;
+                case ']': type = BCONT_ARRAY_END; break;
+                default:
+                    type = BCONT_UTF8;
+                    obj = (void *)(in + k);
+                    break;
+            }
+        }
+
+        /* the value of a NULL P key, and the body if it opens one */
+        if (drop) {
+            if (type == BCONT_DOC_START || type == BCONT_ARRAY_START) {
+                drop_depth++;
+            } else if (type == BCONT_DOC_END || type == BCONT_ARRAY_END) {
+                if (drop_depth == 0) return 1;
+                drop_depth--;
+            } else if (type == BCONT_ERROR) {
+                return 1;
+            }
+
+            drop = drop_depth != 0;
+            continue;
+        }
+
+        if (type == BCONT_DOC_END || type == BCONT_ARRAY_END) {
+            if (key || depth == 0 || is_array[depth] != (type == BCONT_ARRAY_END)) return 1;
+
+            depth--;
+
+            if (is_array[depth + 1]) {
+                bson_append_array_end(stack[depth], stack[depth + 1]);
+            } else {
+                bson_append_document_end(stack[depth], stack[depth + 1]);
+            }
+            continue;
+        }
+
+        if (! is_array[depth] && ! key) {
+            switch (type) {
+                case BCONT_UTF8:
+                    key = *((char **)obj);
+                    key_len = (int)strlen(key);
+                    break;
+                case BCONT_OMIT:
+                    switch (in[k + 1].type) {
+                        case BCONT_PITER_ELEMENT:
+                        case BCONT_PBCON_RAW:
+                        case BCONT_PBCON_IF:
+                            break;
+                        default:
+                            drop = 1;
+                            break;
+                    }
+                    break;
+                case BCONT_BCON_IF:
+                case BCONT_BCON_RAW:
+                case BCONT_ITER_ELEMENT:
+                    if (bcon_inline_fallback(stack[depth], 0, &count[depth], NULL, in[k + 1].type, in[k + 2])) return 1;
+                    break;
+                default:
+                    return 1;
+            }
+            continue;
+        }
+
+        if (is_array[depth]) key = bcon_inline_index(i_str, count[depth], &key_len);
+
+        switch (type) {
+            case BCONT_DOC_START:
+            case BCONT_ARRAY_START:
+                if (depth == BCON_INLINE_MAX_DEPTH) return 1;
+
+                if (type == BCONT_ARRAY_START) {
+                    bson_append_array_begin(stack[depth], key, key_len, &children[depth]);
+                } else {
+                    bson_append_document_begin(stack[depth], key, key_len, &children[depth]);
+                }
+
+                count[depth]++;
+                stack[depth + 1] = &children[depth];
+                depth++;
+                count[depth] = 0;
+                is_array[depth] = type == BCONT_ARRAY_START;
+                break;
+            case BCONT_OMIT:
+                break;
+            case BCONT_ERROR:
+                return 1;
+            case BCONT_BCON_IF:
+                if (! is_array[depth]) return 1;
+                if (bcon_inline_fallback(stack[depth], 1, &count[depth], NULL, in[k + 1].type, in[k + 2])) return 1;
+                break;
+            default:
+                if (bcon_inline_put(stack[depth], key, key_len, obj, type)) {
+                    count[depth]++;
+                } else if (bcon_inline_fallback(stack[depth], is_array[depth], &count[depth], is_array[depth] ? NULL : key, in[k + 1].type, in[k + 2])) {
+                    return 1;
+                }
+                break;
+        }
+
+        key = NULL;
+    }
+
+    return depth != 0 || key != NULL || drop;
+}
+
+#endif
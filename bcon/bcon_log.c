@@ -0,0 +1,303 @@
+/*
+ * @file bcon_log.c
+ * @brief BCON (BSON C Object Notation) Asynchronous JSON logging
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "bcon.h"
+#include "inc/utstring.h"
+
+#define BCON_LOG_IDLE_NS 1000000
+
+/*
+ * A bounded MPSC ring after Vyukov's bounded queue.  Each slot carries a
+ * sequence number: seq == pos means free for the producer claiming pos,
+ * seq == pos + 1 means filled and ready for the consumer.  Producers
+ * claim positions with a CAS on enqueue_pos and only ever touch their own
+ * slot afterwards.
+ */
+typedef struct bcon_log_slot {
+    size_t seq;
+    bson_uint32_t len;
+    bson_uint8_t * data;
+} bcon_log_slot_t;
+
+struct bcon_log {
+    bcon_log_slot_t * slots;
+    bson_uint8_t * slab;
+    size_t mask;
+    size_t slot_size;
+
+    size_t enqueue_pos;
+    size_t dequeue_pos;
+
+    bcon_log_opts_t opts;
+
+    bson_uint64_t logged;
+    bson_uint64_t written;
+    bson_uint64_t dropped;
+    bson_uint64_t oversized;
+    bson_uint64_t errors;
+    bson_uint64_t sample_tick;
+
+    pthread_t thread;
+    int stop;
+};
+
+#define BCON_LOG_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define BCON_LOG_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define BCON_LOG_INC(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+
+/*
+ * Whether a record may go in given the policy and how full the ring is.
+ * Sampling kicks in once the ring is half full.
+ */
+static int bcon_log_admit(bcon_log_t * log)
+{
+    size_t used;
+
+    if (log->opts.policy != BCON_LOG_SAMPLE) return 1;
+
+    used = BCON_LOG_LOAD(&log->enqueue_pos) - BCON_LOG_LOAD(&log->dequeue_pos);
+
+    if (used <= log->mask / 2) return 1;
+
+    return BCON_LOG_INC(&log->sample_tick) % log->opts.sample_every == 0;
+}
+
+static bcon_log_slot_t * bcon_log_reserve(bcon_log_t * log, size_t * pos_out)
+{
+    bcon_log_slot_t * slot;
+    size_t pos = __atomic_load_n(&log->enqueue_pos, __ATOMIC_RELAXED);
+    size_t seq;
+    long diff;
+
+    while (1) {
+        slot = &log->slots[pos & log->mask];
+        seq = BCON_LOG_LOAD(&slot->seq);
+        diff = (long)(seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos_out = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            if (log->opts.policy != BCON_LOG_BLOCK) return NULL;
+
+            sched_yield();
+            pos = __atomic_load_n(&log->enqueue_pos, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&log->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void bcon_log_commit(bcon_log_slot_t * slot, size_t pos, bson_uint32_t len)
+{
+    slot->len = len;
+    BCON_LOG_STORE(&slot->seq, pos + 1);
+}
+
+int bcon_log_bson(bcon_log_t * log, const bson_t * bson)
+{
+    bcon_log_slot_t * slot;
+    size_t pos;
+
+    if (bson->len > log->slot_size) {
+        BCON_LOG_INC(&log->oversized);
+        return 1;
+    }
+
+    if (! bcon_log_admit(log) || ! (slot = bcon_log_reserve(log, &pos))) {
+        BCON_LOG_INC(&log->dropped);
+        return 1;
+    }
+
+    memcpy(slot->data, bson_get_data(bson), bson->len);
+    bcon_log_commit(slot, pos, bson->len);
+
+    BCON_LOG_INC(&log->logged);
+
+    return 0;
+}
+
+/*
+ * Encodes straight into the claimed slot.  A template that is too big for
+ * a slot or fails to encode still has to release the slot, so it goes
+ * through empty.
+ */
+int bcon_log(bcon_log_t * log, bcon_t * in)
+{
+    bcon_log_slot_t * slot;
+    bcon_encoder_t enc;
+    bcon_encoder_status_t status;
+    size_t pos, n;
+
+    if (! bcon_log_admit(log) || ! (slot = bcon_log_reserve(log, &pos))) {
+        BCON_LOG_INC(&log->dropped);
+        return 1;
+    }
+
+    bcon_encoder_init(&enc, in);
+
+    status = bcon_encoder_feed(&enc, slot->data, log->slot_size, &n);
+
+    if (status != BCON_ENCODER_DONE) {
+        bcon_log_commit(slot, pos, 0);
+        BCON_LOG_INC(status == BCON_ENCODER_NEED_SPACE ? &log->oversized : &log->errors);
+        return 1;
+    }
+
+    bcon_log_commit(slot, pos, n);
+
+    BCON_LOG_INC(&log->logged);
+
+    return 0;
+}
+
+/*
+ * Formats up to a batch of records and writes them out with one call.
+ * Only the logging thread runs this.
+ */
+static size_t bcon_log_drain(bcon_log_t * log, UT_string * s)
+{
+    bcon_log_slot_t * slot;
+    size_t n = 0, written = 0;
+    bson_t bson;
+    char * json;
+
+    while (n < log->opts.batch) {
+        slot = &log->slots[log->dequeue_pos & log->mask];
+
+        if (BCON_LOG_LOAD(&slot->seq) != log->dequeue_pos + 1) break;
+
+        if (slot->len && bson_init_static(&bson, slot->data, slot->len)) {
+            json = bson_as_json(&bson, NULL);
+            utstring_printf(s, "%s\n", json);
+            free(json);
+            written++;
+        }
+
+        BCON_LOG_STORE(&slot->seq, log->dequeue_pos + log->mask + 1);
+        BCON_LOG_STORE(&log->dequeue_pos, log->dequeue_pos + 1);
+        n++;
+    }
+
+    if (utstring_len(s)) {
+        fwrite(utstring_body(s), 1, utstring_len(s), log->opts.out);
+        fflush(log->opts.out);
+        utstring_clear(s);
+    }
+
+    __atomic_fetch_add(&log->written, written, __ATOMIC_RELAXED);
+
+    return n;
+}
+
+static void * bcon_log_thread(void * data)
+{
+    bcon_log_t * log = data;
+    struct timespec idle = { 0, BCON_LOG_IDLE_NS };
+    UT_string s;
+
+    utstring_init(&s);
+
+    while (1) {
+        if (bcon_log_drain(log, &s)) continue;
+
+        if (BCON_LOG_LOAD(&log->stop)) {
+            /* producers are done, so one more pass empties the ring */
+            while (bcon_log_drain(log, &s));
+            break;
+        }
+
+        nanosleep(&idle, NULL);
+    }
+
+    utstring_done(&s);
+
+    return NULL;
+}
+
+char * bcon_log_start(const bcon_log_opts_t * opts, bcon_log_t ** log_out)
+{
+    bcon_log_t * log;
+    size_t i;
+
+    if (! opts->out) return strdup("no output stream");
+    if (opts->n_slots < 2 || (opts->n_slots & (opts->n_slots - 1))) return strdup("n_slots must be a power of two");
+    if (opts->slot_size < 5) return strdup("slot_size is too small");
+    if (opts->policy == BCON_LOG_SAMPLE && ! opts->sample_every) return strdup("sample_every must be set");
+    if (opts->slot_size > (size_t)-1 / opts->n_slots) return strdup("ring is too large");
+
+    if (! (log = calloc(1, sizeof(*log)))) return strdup("out of memory");
+
+    log->opts = *opts;
+    if (! log->opts.batch) log->opts.batch = 64;
+
+    log->mask = opts->n_slots - 1;
+    log->slot_size = opts->slot_size;
+    log->slots = calloc(opts->n_slots, sizeof(*log->slots));
+    log->slab = malloc(opts->n_slots * opts->slot_size);
+
+    if (! log->slots || ! log->slab) {
+        free(log->slab);
+        free(log->slots);
+        free(log);
+        return strdup("out of memory");
+    }
+
+    for (i = 0; i < opts->n_slots; i++) {
+        log->slots[i].seq = i;
+        log->slots[i].data = log->slab + i * opts->slot_size;
+    }
+
+    if (pthread_create(&log->thread, NULL, bcon_log_thread, log)) {
+        free(log->slab);
+        free(log->slots);
+        free(log);
+        return strdup("pthread_create failed");
+    }
+
+    *log_out = log;
+
+    return NULL;
+}
+
+void bcon_log_stats(bcon_log_t * log, bcon_log_stats_t * stats)
+{
+    stats->logged = __atomic_load_n(&log->logged, __ATOMIC_RELAXED);
+    stats->written = __atomic_load_n(&log->written, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+    stats->oversized = __atomic_load_n(&log->oversized, __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&log->errors, __ATOMIC_RELAXED);
+}
+
+void bcon_log_stop(bcon_log_t * log)
+{
+    BCON_LOG_STORE(&log->stop, 1);
+    pthread_join(log->thread, NULL);
+
+    free(log->slab);
+    free(log->slots);
+    free(log);
+}
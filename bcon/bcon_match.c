@@ -0,0 +1,625 @@
+/*
+ * @file bcon_match.c
+ * @brief BCON (BSON C Object Notation) Query matching
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+
+#define BCON_MATCH_MAX_CLAUSES 64
+#define BCON_MATCH_REORDER_EVERY 1024
+
+typedef enum {
+    BCON_MATCH_EQ,
+    BCON_MATCH_NE,
+    BCON_MATCH_GT,
+    BCON_MATCH_GTE,
+    BCON_MATCH_LT,
+    BCON_MATCH_LTE,
+    BCON_MATCH_IN,
+    BCON_MATCH_NIN,
+    BCON_MATCH_EXISTS,
+} bcon_match_op_t;
+
+typedef struct bcon_match_clause {
+    int key;
+    char * rest;
+    bcon_match_op_t op;
+    bson_iter_t operand;
+    bson_uint64_t fails;
+} bcon_match_clause_t;
+
+/*
+ * keys holds each distinct top level key the clauses look at.  values and
+ * found index one document by those keys while it's being matched.
+ */
+struct bcon_matcher {
+    bson_t * pattern;
+    bcon_match_clause_t * clauses[BCON_MATCH_MAX_CLAUSES];
+    int n_clauses;
+    bson_uint64_t docs;
+
+    char * keys[BCON_MATCH_MAX_CLAUSES];
+    int n_keys;
+    bson_iter_t values[BCON_MATCH_MAX_CLAUSES];
+    bson_uint8_t found[BCON_MATCH_MAX_CLAUSES];
+};
+
+static struct {
+    const char * name;
+    bcon_match_op_t op;
+} bcon_match_ops[] = {
+    { "$eq",     BCON_MATCH_EQ },
+    { "$ne",     BCON_MATCH_NE },
+    { "$gt",     BCON_MATCH_GT },
+    { "$gte",    BCON_MATCH_GTE },
+    { "$lt",     BCON_MATCH_LT },
+    { "$lte",    BCON_MATCH_LTE },
+    { "$in",     BCON_MATCH_IN },
+    { "$nin",    BCON_MATCH_NIN },
+    { "$exists", BCON_MATCH_EXISTS },
+};
+
+static int bcon_match_is_number(bson_type_t type)
+{
+    return type == BSON_TYPE_INT32 || type == BSON_TYPE_INT64 || type == BSON_TYPE_DOUBLE;
+}
+
+static double bcon_match_number(const bson_iter_t * iter)
+{
+    switch (bson_iter_type(iter)) {
+        case BSON_TYPE_INT32:
+            return bson_iter_int32(iter);
+        case BSON_TYPE_INT64:
+            return bson_iter_int64(iter);
+        default:
+            return bson_iter_double(iter);
+    }
+}
+
+static int bcon_match_memcmp(const void * a, bson_uint32_t a_len, const void * b, bson_uint32_t b_len)
+{
+    int r = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (r) return r;
+
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/*
+ * Orders two values of comparable types.  Returns 0 if the values can't be
+ * compared, which makes every operator but $ne/$nin fail for that pair.
+ */
+static int bcon_match_compare(const bson_iter_t * a, const bson_iter_t * b, int * cmp)
+{
+    bson_type_t a_type = bson_iter_type(a);
+    bson_type_t b_type = bson_iter_type(b);
+
+    if (bcon_match_is_number(a_type) && bcon_match_is_number(b_type)) {
+        if (a_type != BSON_TYPE_DOUBLE && b_type != BSON_TYPE_DOUBLE) {
+            bson_int64_t x = a_type == BSON_TYPE_INT32 ? bson_iter_int32(a) : bson_iter_int64(a);
+            bson_int64_t y = b_type == BSON_TYPE_INT32 ? bson_iter_int32(b) : bson_iter_int64(b);
+
+            *cmp = x < y ? -1 : x > y;
+        } else {
+            double x = bcon_match_number(a);
+            double y = bcon_match_number(b);
+
+            if (x != x || y != y) return 0;
+
+            *cmp = x < y ? -1 : x > y;
+        }
+
+        return 1;
+    }
+
+    if (a_type != b_type) return 0;
+
+    switch (a_type) {
+        case BSON_TYPE_UTF8: {
+            bson_uint32_t a_len, b_len;
+            const char * a_str = bson_iter_utf8(a, &a_len);
+            const char * b_str = bson_iter_utf8(b, &b_len);
+
+            *cmp = bcon_match_memcmp(a_str, a_len, b_str, b_len);
+            return 1;
+        }
+        case BSON_TYPE_SYMBOL: {
+            bson_uint32_t a_len, b_len;
+            const char * a_str = bson_iter_symbol(a, &a_len);
+            const char * b_str = bson_iter_symbol(b, &b_len);
+
+            *cmp = bcon_match_memcmp(a_str, a_len, b_str, b_len);
+            return 1;
+        }
+        case BSON_TYPE_DOCUMENT:
+        case BSON_TYPE_ARRAY: {
+            bson_uint32_t a_len, b_len;
+            const bson_uint8_t * a_data, * b_data;
+
+            if (a_type == BSON_TYPE_ARRAY) {
+                bson_iter_array(a, &a_len, &a_data);
+                bson_iter_array(b, &b_len, &b_data);
+            } else {
+                bson_iter_document(a, &a_len, &a_data);
+                bson_iter_document(b, &b_len, &b_data);
+            }
+
+            *cmp = bcon_match_memcmp(a_data, a_len, b_data, b_len);
+            return 1;
+        }
+        case BSON_TYPE_OID:
+            *cmp = memcmp(bson_iter_oid(a), bson_iter_oid(b), 12);
+            return 1;
+        case BSON_TYPE_BOOL:
+            *cmp = (!! bson_iter_bool(a)) - (!! bson_iter_bool(b));
+            return 1;
+        case BSON_TYPE_DATE_TIME: {
+            bson_int64_t x = bson_iter_date_time(a);
+            bson_int64_t y = bson_iter_date_time(b);
+
+            *cmp = x < y ? -1 : x > y;
+            return 1;
+        }
+        case BSON_TYPE_TIMESTAMP: {
+            bson_uint32_t a_ts, a_inc, b_ts, b_inc;
+
+            bson_iter_timestamp(a, &a_ts, &a_inc);
+            bson_iter_timestamp(b, &b_ts, &b_inc);
+
+            if (a_ts != b_ts) {
+                *cmp = a_ts < b_ts ? -1 : 1;
+            } else {
+                *cmp = a_inc < b_inc ? -1 : a_inc > b_inc;
+            }
+            return 1;
+        }
+        case BSON_TYPE_BINARY: {
+            bson_subtype_t a_sub, b_sub;
+            bson_uint32_t a_len, b_len;
+            const bson_uint8_t * a_data, * b_data;
+
+            /* mongod's order: length, then subtype, then the bytes */
+            bson_iter_binary(a, &a_sub, &a_len, &a_data);
+            bson_iter_binary(b, &b_sub, &b_len, &b_data);
+
+            if (a_len != b_len) {
+                *cmp = a_len < b_len ? -1 : 1;
+            } else if (a_sub != b_sub) {
+                *cmp = a_sub < b_sub ? -1 : 1;
+            } else {
+                *cmp = memcmp(a_data, b_data, a_len);
+            }
+            return 1;
+        }
+        case BSON_TYPE_REGEX: {
+            const char * a_opts, * b_opts;
+            const char * a_re = bson_iter_regex(a, &a_opts);
+            const char * b_re = bson_iter_regex(b, &b_opts);
+
+            *cmp = strcmp(a_re, b_re);
+            if (! *cmp) *cmp = strcmp(a_opts ? a_opts : "", b_opts ? b_opts : "");
+            return 1;
+        }
+        case BSON_TYPE_CODE: {
+            bson_uint32_t a_len, b_len;
+            const char * a_code = bson_iter_code(a, &a_len);
+            const char * b_code = bson_iter_code(b, &b_len);
+
+            *cmp = bcon_match_memcmp(a_code, a_len, b_code, b_len);
+            return 1;
+        }
+        case BSON_TYPE_CODEWSCOPE: {
+            bson_uint32_t a_len, b_len, a_scope_len, b_scope_len;
+            const bson_uint8_t * a_scope, * b_scope;
+            const char * a_code = bson_iter_codewscope(a, &a_len, &a_scope_len, &a_scope);
+            const char * b_code = bson_iter_codewscope(b, &b_len, &b_scope_len, &b_scope);
+
+            *cmp = bcon_match_memcmp(a_code, a_len, b_code, b_len);
+            if (! *cmp) *cmp = bcon_match_memcmp(a_scope, a_scope_len, b_scope, b_scope_len);
+            return 1;
+        }
+        case BSON_TYPE_DBPOINTER: {
+            bson_uint32_t a_len, b_len;
+            const char * a_coll, * b_coll;
+            const bson_oid_t * a_oid, * b_oid;
+
+            bson_iter_dbpointer(a, &a_len, &a_coll, &a_oid);
+            bson_iter_dbpointer(b, &b_len, &b_coll, &b_oid);
+
+            *cmp = bcon_match_memcmp(a_coll, a_len, b_coll, b_len);
+            if (! *cmp) *cmp = memcmp(a_oid, b_oid, 12);
+            return 1;
+        }
+        case BSON_TYPE_NULL:
+        case BSON_TYPE_UNDEFINED:
+        case BSON_TYPE_MAXKEY:
+        case BSON_TYPE_MINKEY:
+            *cmp = 0;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int bcon_match_in(const bson_iter_t * value, const bson_iter_t * operand)
+{
+    bson_iter_t iter;
+    int cmp;
+
+    bson_iter_recurse(operand, &iter);
+
+    while (bson_iter_next(&iter)) {
+        if (bcon_match_compare(value, &iter, &cmp) && cmp == 0) return 1;
+    }
+
+    return 0;
+}
+
+static int bcon_match_scalar(bcon_match_clause_t * c, const bson_iter_t * value)
+{
+    int cmp;
+
+    switch (c->op) {
+        case BCON_MATCH_EQ:
+        case BCON_MATCH_NE:
+            return bcon_match_compare(value, &c->operand, &cmp) && cmp == 0;
+        case BCON_MATCH_GT:
+            return bcon_match_compare(value, &c->operand, &cmp) && cmp > 0;
+        case BCON_MATCH_GTE:
+            return bcon_match_compare(value, &c->operand, &cmp) && cmp >= 0;
+        case BCON_MATCH_LT:
+            return bcon_match_compare(value, &c->operand, &cmp) && cmp < 0;
+        case BCON_MATCH_LTE:
+            return bcon_match_compare(value, &c->operand, &cmp) && cmp <= 0;
+        case BCON_MATCH_IN:
+        case BCON_MATCH_NIN:
+            return bcon_match_in(value, &c->operand);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Applies a clause to a present value, before $ne/$nin negate it.  As
+ * with mongod, an array value matches if the array as a whole or any one
+ * of its elements does.
+ */
+static int bcon_match_value(bcon_match_clause_t * c, const bson_iter_t * value)
+{
+    bson_iter_t iter;
+    int r;
+
+    if (c->op == BCON_MATCH_EXISTS) return 1;
+
+    r = bcon_match_scalar(c, value);
+
+    if (! r && bson_iter_type(value) == BSON_TYPE_ARRAY) {
+        bson_iter_recurse(value, &iter);
+
+        while (! r && bson_iter_next(&iter)) {
+            r = bcon_match_scalar(c, &iter);
+        }
+    }
+
+    return r;
+}
+
+/*
+ * Follows the dotted remainder of a clause's path below a value, setting
+ * found if any value sits at the end of it.  Inside an array a segment
+ * picks the element with that index, and is also tried against every
+ * element that is a document, so "a.b" looks at b in each of a's
+ * documents.  Returns 1 as soon as one of those values matches.
+ */
+static int bcon_match_path(bcon_match_clause_t * c, const bson_iter_t * value, const char * path, int * found)
+{
+    bson_iter_t child;
+    bson_type_t type;
+    const char * dot;
+    size_t len;
+
+    if (! path) {
+        *found = 1;
+        return bcon_match_value(c, value);
+    }
+
+    type = bson_iter_type(value);
+
+    if (type != BSON_TYPE_DOCUMENT && type != BSON_TYPE_ARRAY) return 0;
+
+    dot = strchr(path, '.');
+    len = dot ? (size_t)(dot - path) : strlen(path);
+
+    bson_iter_recurse(value, &child);
+
+    while (bson_iter_next(&child)) {
+        const char * key = bson_iter_key(&child);
+
+        if (strncmp(key, path, len) == 0 && key[len] == '\0') {
+            if (bcon_match_path(c, &child, dot ? dot + 1 : NULL, found)) return 1;
+
+            /* a document's first match is its only one */
+            if (type == BSON_TYPE_DOCUMENT) return 0;
+        } else if (type == BSON_TYPE_ARRAY && bson_iter_type(&child) == BSON_TYPE_DOCUMENT) {
+            if (bcon_match_path(c, &child, path, found)) return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Whether the clause holds, given what its path turned up. */
+static int bcon_match_clause(bcon_matcher_t * m, bcon_match_clause_t * c)
+{
+    int found = 0;
+    int r = 0;
+
+    if (m->found[c->key]) r = bcon_match_path(c, &m->values[c->key], c->rest, &found);
+
+    if (! found) {
+        switch (c->op) {
+            case BCON_MATCH_NE:
+            case BCON_MATCH_NIN:
+                return 1;
+            case BCON_MATCH_EXISTS:
+                return ! bson_iter_bool(&c->operand);
+            default:
+                return 0;
+        }
+    }
+
+    switch (c->op) {
+        case BCON_MATCH_NE:
+        case BCON_MATCH_NIN:
+            return ! r;
+        case BCON_MATCH_EXISTS:
+            return bson_iter_bool(&c->operand);
+        default:
+            return r;
+    }
+}
+
+static void bcon_match_reorder(bcon_matcher_t * m)
+{
+    bcon_match_clause_t * c;
+    int i, j;
+
+    for (i = 1; i < m->n_clauses; i++) {
+        c = m->clauses[i];
+
+        for (j = i; j > 0 && m->clauses[j - 1]->fails < c->fails; j--) {
+            m->clauses[j] = m->clauses[j - 1];
+        }
+
+        m->clauses[j] = c;
+    }
+
+    for (i = 0; i < m->n_clauses; i++) {
+        m->clauses[i]->fails /= 2;
+    }
+}
+
+/*
+ * One walk over the document's fields indexes the first field for each
+ * clause key.  Clauses are checked in the matcher's current order as soon
+ * as their field has been seen, so when the clause at the front fails the
+ * walk stops there.  Clauses whose field never turned up are checked once
+ * the walk is over.
+ */
+int bcon_matcher_match(bcon_matcher_t * m, const bson_t * bson)
+{
+    bson_iter_t iter;
+    int next = 0, n_found = 0, k;
+
+    if (++m->docs % BCON_MATCH_REORDER_EVERY == 0) bcon_match_reorder(m);
+
+    if (! bson_iter_init(&iter, bson)) return 0;
+
+    memset(m->found, 0, m->n_keys);
+
+    while (n_found < m->n_keys && bson_iter_next(&iter)) {
+        const char * key = bson_iter_key(&iter);
+
+        for (k = 0; k < m->n_keys; k++) {
+            if (! m->found[k] && strcmp(key, m->keys[k]) == 0) break;
+        }
+
+        if (k == m->n_keys) continue;
+
+        m->values[k] = iter;
+        m->found[k] = 1;
+        n_found++;
+
+        for (; next < m->n_clauses && m->found[m->clauses[next]->key]; next++) {
+            if (! bcon_match_clause(m, m->clauses[next])) goto FAIL;
+        }
+    }
+
+    for (; next < m->n_clauses; next++) {
+        if (! bcon_match_clause(m, m->clauses[next])) goto FAIL;
+    }
+
+    return 1;
+
+FAIL:
+    m->clauses[next]->fails++;
+
+    return 0;
+}
+
+int bcon_matcher_match_data(bcon_matcher_t * m, const bson_uint8_t * data, size_t len)
+{
+    bson_t bson;
+
+    if (! bson_init_static(&bson, data, len)) return 0;
+
+    return bcon_matcher_match(m, &bson);
+}
+
+long bcon_matcher_match_batch(bcon_matcher_t * m, const bson_uint8_t * data, size_t len, bcon_match_cb_t cb, void * ctx)
+{
+    bson_uint32_t doc_len;
+    size_t off = 0;
+    long matched = 0;
+    bson_t bson;
+
+    while (off < len) {
+        if (len - off < 5) return -1;
+
+        memcpy(&doc_len, data + off, 4);
+        doc_len = BSON_UINT32_FROM_LE(doc_len);
+
+        if (doc_len < 5 || doc_len > len - off) return -1;
+        if (! bson_init_static(&bson, data + off, doc_len)) return -1;
+
+        if (bcon_matcher_match(m, &bson)) {
+            matched++;
+
+            if (cb && cb(&bson, ctx)) break;
+        }
+
+        off += doc_len;
+    }
+
+    return matched;
+}
+
+static char * bcon_match_add_clause(bcon_matcher_t * m, const char * path, bcon_match_op_t op, bson_iter_t * operand)
+{
+    bcon_match_clause_t * c;
+    const char * dot;
+    size_t len;
+
+    if (m->n_clauses == BCON_MATCH_MAX_CLAUSES) return strdup("too many clauses");
+
+    if (op == BCON_MATCH_IN || op == BCON_MATCH_NIN) {
+        if (bson_iter_type(operand) != BSON_TYPE_ARRAY) return strdup("$in/$nin need an array");
+    }
+
+    if (op == BCON_MATCH_EXISTS) {
+        if (bson_iter_type(operand) != BSON_TYPE_BOOL) return strdup("$exists needs a bool");
+    }
+
+    c = calloc(1, sizeof(*c));
+
+    dot = strchr(path, '.');
+    len = dot ? (size_t)(dot - path) : strlen(path);
+
+    for (c->key = 0; c->key < m->n_keys; c->key++) {
+        if (strncmp(m->keys[c->key], path, len) == 0 && m->keys[c->key][len] == '\0') break;
+    }
+
+    if (c->key == m->n_keys) m->keys[m->n_keys++] = strndup(path, len);
+
+    if (dot) c->rest = strdup(dot + 1);
+
+    c->op = op;
+    c->operand = *operand;
+
+    m->clauses[m->n_clauses++] = c;
+
+    return NULL;
+}
+
+static int bcon_match_is_operator_doc(bson_iter_t * iter)
+{
+    bson_iter_t child;
+
+    if (bson_iter_type(iter) != BSON_TYPE_DOCUMENT) return 0;
+
+    bson_iter_recurse(iter, &child);
+
+    return bson_iter_next(&child) && bson_iter_key(&child)[0] == '$';
+}
+
+char * bcon_matcher_compile(bcon_t * pattern, bcon_matcher_t ** out)
+{
+    bcon_matcher_t * m = calloc(1, sizeof(*m));
+    bson_iter_t iter, child;
+    const char * path;
+    char * err_str;
+    size_t i;
+
+    m->pattern = bson_new();
+
+    err_str = bcon_to_bson(pattern, m->pattern);
+    if (err_str) goto FAIL;
+
+    bson_iter_init(&iter, m->pattern);
+
+    while (bson_iter_next(&iter)) {
+        path = bson_iter_key(&iter);
+
+        if (path[0] == '$') {
+            err_str = strdup("top level operators are not supported");
+            goto FAIL;
+        }
+
+        if (! bcon_match_is_operator_doc(&iter)) {
+            err_str = bcon_match_add_clause(m, path, BCON_MATCH_EQ, &iter);
+            if (err_str) goto FAIL;
+            continue;
+        }
+
+        bson_iter_recurse(&iter, &child);
+
+        while (bson_iter_next(&child)) {
+            const char * op = bson_iter_key(&child);
+
+            for (i = 0; i < sizeof(bcon_match_ops) / sizeof(bcon_match_ops[0]); i++) {
+                if (strcmp(op, bcon_match_ops[i].name) == 0) break;
+            }
+
+            if (i == sizeof(bcon_match_ops) / sizeof(bcon_match_ops[0])) {
+                err_str = malloc(strlen(op) + 32);
+                sprintf(err_str, "unknown operator %s", op);
+                goto FAIL;
+            }
+
+            err_str = bcon_match_add_clause(m, path, bcon_match_ops[i].op, &child);
+            if (err_str) goto FAIL;
+        }
+    }
+
+    *out = m;
+
+    return NULL;
+
+FAIL:
+    bcon_matcher_destroy(m);
+    *out = NULL;
+
+    return err_str;
+}
+
+void bcon_matcher_destroy(bcon_matcher_t * m)
+{
+    int i;
+
+    for (i = 0; i < m->n_clauses; i++) {
+        free(m->clauses[i]->rest);
+        free(m->clauses[i]);
+    }
+
+    for (i = 0; i < m->n_keys; i++) {
+        free(m->keys[i]);
+    }
+
+    bson_destroy(m->pattern);
+    free(m);
+}
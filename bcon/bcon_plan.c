@@ -0,0 +1,1072 @@
+/*
+ * @file bcon_plan.c
+ * @brief BCON (BSON C Object Notation) Compiled encoding plans
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include <stddef.h>
+
+#include "bcon.h"
+#include "bcon_probes.h"
+
+#ifdef __x86_64__
+#include <sys/mman.h>
+#endif
+
+/*
+ * Plans also get native code on x86-64 where anonymous mappings exist.
+ * It goes through a writable mapping that is then made executable, never
+ * both at once.
+ */
+#if defined(__x86_64__) && defined(MAP_ANONYMOUS)
+#define BCON_PLAN_NATIVE
+#endif
+
+typedef enum {
+    BCON_PLAN_LIT,
+    BCON_PLAN_VALUE,
+    BCON_PLAN_OPEN,
+    BCON_PLAN_CLOSE,
+    BCON_PLAN_ENTER,
+    BCON_PLAN_LEAVE,
+    BCON_PLAN_SKIP,
+    BCON_PLAN_IF,
+} bcon_plan_code_t;
+
+/*
+ * LIT copies len bytes of the image from arg.  VALUE reads the token at
+ * slot arg of the current token array, through by_ref pointers (one for
+ * R bindings, two for P).  ENTER switches to the BCON_DOC() tokens at
+ * slot arg.  SKIP jumps to op len when the P binding at slot arg is NULL,
+ * so the element's header and value are left out.  IF jumps to op len
+ * when the BCON_IF() at slot arg is false and otherwise switches to its
+ * body like ENTER, with a LEAVE after the body.
+ */
+typedef struct bcon_plan_op {
+    bson_uint8_t code;
+    bson_uint8_t by_ref;
+    bcon_type_t type;
+    bson_uint32_t arg;
+    bson_uint32_t len;
+} bcon_plan_op_t;
+
+/* Returns the document size; it was only written if that fits in len. */
+typedef bson_uint32_t (*bcon_plan_native_fn_t)(bcon_t * in, bson_uint8_t * buf, size_t len);
+
+struct bcon_plan {
+    bcon_plan_op_t * ops;
+    int n_ops;
+    int ops_cap;
+
+    bson_uint8_t * image;
+    bson_uint32_t image_len;
+    bson_uint32_t image_cap;
+
+    /* ops before this can't be grown, they end a skippable element */
+    int lit_from;
+
+    /* token arrays ENTER and IF have switched from while compiling */
+    int n_bases;
+
+    bcon_plan_native_fn_t native;
+    size_t native_len;
+};
+
+static bcon_plan_op_t * bcon_plan_op(bcon_plan_t * plan, bcon_plan_code_t code)
+{
+    bcon_plan_op_t * op;
+
+    if (plan->n_ops == plan->ops_cap) {
+        plan->ops_cap = plan->ops_cap ? plan->ops_cap * 2 : 32;
+        plan->ops = realloc(plan->ops, plan->ops_cap * sizeof(*plan->ops));
+    }
+
+    op = &plan->ops[plan->n_ops++];
+    memset(op, 0, sizeof(*op));
+    op->code = code;
+
+    return op;
+}
+
+/*
+ * Appends literal bytes, growing the previous LIT op when it ends where
+ * these start so each run between values is a single copy.  Runs aren't
+ * merged across the end of an element SKIP or IF can jump over.
+ */
+static void bcon_plan_lit(bcon_plan_t * plan, const void * data, bson_uint32_t len)
+{
+    bcon_plan_op_t * last = plan->n_ops ? &plan->ops[plan->n_ops - 1] : NULL;
+
+    if (plan->image_len + len > plan->image_cap) {
+        plan->image_cap = plan->image_cap ? plan->image_cap * 2 : 256;
+        if (plan->image_cap < plan->image_len + len) plan->image_cap = plan->image_len + len;
+        plan->image = realloc(plan->image, plan->image_cap);
+    }
+
+    if (last && plan->n_ops > plan->lit_from && last->code == BCON_PLAN_LIT && last->arg + last->len == plan->image_len) {
+        last->len += len;
+    } else {
+        last = bcon_plan_op(plan, BCON_PLAN_LIT);
+        last->arg = plan->image_len;
+        last->len = len;
+    }
+
+    memcpy(plan->image + plan->image_len, data, len);
+    plan->image_len += len;
+}
+
+static void bcon_plan_header(bcon_plan_t * plan, bson_type_t type, const char * key)
+{
+    bson_uint8_t type_byte = (bson_uint8_t)type;
+
+    bcon_plan_lit(plan, &type_byte, 1);
+    bcon_plan_lit(plan, key, (bson_uint32_t)strlen(key) + 1);
+}
+
+/*
+ * Like bcon_token(), but also says where the value lives: its slot in
+ * base and how many pointers lead from that slot to it.  A P binding
+ * that is NULL right now still gives its type.
+ */
+static bcon_type_t bcon_plan_token(bcon_t * base, bcon_t ** in, bson_uint32_t * slot, int * by_ref, void ** obj)
+{
+    bcon_t * at = *in;
+    bcon_type_t type = bcon_token(in, obj);
+
+    *slot = 0;
+    *by_ref = 0;
+
+    if (at->UTF8 == BCON_MAGIC) {
+        bcon_type_t raw = at[1].type;
+
+        if (type == BCONT_OMIT) type = raw - 2;
+        if (raw != type && raw != type + 1 && raw != type + 2) return BCONT_ERROR;
+
+        *slot = (bson_uint32_t)(at + 2 - base);
+        *by_ref = raw - type;
+    } else {
+        *slot = (bson_uint32_t)(at - base);
+        *by_ref = 0;
+    }
+
+    return type;
+}
+
+static int bcon_plan__doc(bcon_plan_t * plan, bcon_t * base, bcon_t ** in, int is_array, int is_inline, int depth);
+static int bcon_plan__elems(bcon_plan_t * plan, bcon_t * base, bcon_t ** in, int is_array, int is_inline, int depth);
+
+/* Switches to another token array, as ENTER and IF do. */
+static int bcon_plan_enter(bcon_plan_t * plan, bcon_plan_code_t code, bson_uint32_t slot)
+{
+    bcon_plan_op_t * op;
+
+    if (plan->n_bases == BCON_VISIT_MAX_DEPTH) return 1;
+    plan->n_bases++;
+
+    op = bcon_plan_op(plan, code);
+    op->arg = slot;
+
+    return 0;
+}
+
+static void bcon_plan_leave(bcon_plan_t * plan)
+{
+    plan->n_bases--;
+    bcon_plan_op(plan, BCON_PLAN_LEAVE);
+}
+
+static int bcon_plan__value(bcon_plan_t * plan, bcon_t * base, bcon_t ** in, bcon_type_t type, bson_uint32_t slot, int by_ref, void * obj, const char * key, int depth)
+{
+    bcon_plan_op_t * op;
+
+    switch (type) {
+        case BCONT_DOC_START:
+        case BCONT_ARRAY_START:
+            bcon_plan_header(plan, bcon_bson_type(type), key);
+            return bcon_plan__doc(plan, base, in, type == BCONT_ARRAY_START, 1, depth + 1);
+        case BCONT_BCON_DOCUMENT:
+        case BCONT_BCON_ARRAY: {
+            bcon_t * child;
+
+            /* the child's shape is baked in, so it can't be rebound */
+            if (by_ref) return 1;
+
+            child = *((bcon_t **)obj);
+
+            bcon_plan_header(plan, bcon_bson_type(type), key);
+
+            if (bcon_plan_enter(plan, BCON_PLAN_ENTER, slot)) return 1;
+            if (bcon_plan__doc(plan, child, &child, type == BCONT_BCON_ARRAY, 0, depth + 1)) return 1;
+
+            bcon_plan_leave(plan);
+            return 0;
+        }
+        case BCONT_UNDEFINED:
+        case BCONT_NULL:
+        case BCONT_MAXKEY:
+        case BCONT_MINKEY:
+            bcon_plan_header(plan, bcon_bson_type(type), key);
+            return 0;
+        case BCONT_UTF8:
+        case BCONT_SYMBOL:
+        case BCONT_BCON_UTF8_LEN:
+        case BCONT_BCON_SYMBOL_LEN:
+        case BCONT_BCON_CODE_LEN:
+        case BCONT_DOUBLE:
+        case BCONT_BSON_DOCUMENT:
+        case BCONT_BSON_ARRAY:
+        case BCONT_BIN:
+        case BCONT_BSON_OID:
+        case BCONT_BCON_NEW_OID:
+        case BCONT_BCON_NOW:
+        case BCONT_BOOL:
+        case BCONT_DATE_TIME:
+        case BCONT_BCON_REGEX:
+        case BCONT_BCON_CODE:
+        case BCONT_INT32:
+        case BCONT_BCON_TIMESTAMP:
+        case BCONT_INT64:
+            bcon_plan_header(plan, bcon_bson_type(type), key);
+
+            op = bcon_plan_op(plan, BCON_PLAN_VALUE);
+            op->type = type;
+            op->arg = slot;
+            op->by_ref = by_ref;
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static int bcon_plan_value(bcon_plan_t * plan, bcon_t * base, bcon_t ** in, const char * key, int is_array, int depth)
+{
+    bcon_plan_op_t * op;
+    bson_uint32_t slot;
+    bcon_type_t type;
+    int by_ref, skip = 0;
+    void * obj;
+
+    type = bcon_plan_token(base, in, &slot, &by_ref, &obj);
+
+    /*
+     * A NULL P binding drops its element, which in an array would
+     * renumber the ones after it.
+     */
+    if (by_ref == 2) {
+        if (is_array) return 1;
+
+        skip = plan->n_ops;
+        op = bcon_plan_op(plan, BCON_PLAN_SKIP);
+        op->arg = slot;
+        op->by_ref = 2;
+    }
+
+    if (bcon_plan__value(plan, base, in, type, slot, by_ref, obj, key, depth)) return 1;
+
+    if (by_ref == 2) {
+        plan->ops[skip].len = plan->n_ops;
+        plan->lit_from = plan->n_ops;
+    }
+
+    return 0;
+}
+
+/*
+ * A BCON_IF() body continues the enclosing document; the whole of it is
+ * jumped over when the condition is false.  Like a BCON_DOC() body its
+ * shape is baked in, so the BCON_IF() itself can't be bound.
+ */
+static int bcon_plan_if(bcon_plan_t * plan, bson_uint32_t slot, void * obj, int depth)
+{
+    bcon_t * body = (*((bcon_if_t **)obj))->body;
+    int at = plan->n_ops;
+
+    if (bcon_plan_enter(plan, BCON_PLAN_IF, slot)) return 1;
+    if (bcon_plan__elems(plan, body, &body, 0, 0, depth)) return 1;
+
+    bcon_plan_leave(plan);
+
+    plan->ops[at].len = plan->n_ops;
+    plan->lit_from = plan->n_ops;
+
+    return 0;
+}
+
+/*
+ * Elements opened with "{" or "[" end with the matching bracket, top
+ * level, BCON_DOC() and BCON_IF() ones at the end of their tokens.
+ */
+static int bcon_plan__elems(bcon_plan_t * plan, bcon_t * base, bcon_t ** in, int is_array, int is_inline, int depth)
+{
+    bson_uint32_t i, slot;
+    bcon_type_t type;
+    const char * key;
+    char i_str[16];
+    int by_ref;
+    void * obj;
+
+    for (i = 0; ; i++) {
+        bcon_t * at = *in;
+
+        if (at->UTF8 == NULL) {
+            if (is_inline) return 1;
+            break;
+        }
+
+        if (at->UTF8 != BCON_MAGIC && (at->UTF8[0] == '}' || at->UTF8[0] == ']')) {
+            if (! is_inline || (at->UTF8[0] == ']') != is_array) return 1;
+            (*in)++;
+            break;
+        }
+
+        if (is_array) {
+            sprintf(i_str, "%u", i);
+            key = i_str;
+        } else {
+            type = bcon_plan_token(base, in, &slot, &by_ref, &obj);
+
+            if (type == BCONT_BCON_IF && ! by_ref) {
+                if (bcon_plan_if(plan, slot, obj, depth)) return 1;
+                continue;
+            }
+
+            /* keys are baked into the image, so they can't be bound */
+            if (type != BCONT_UTF8 || by_ref) return 1;
+
+            key = *((char **)obj);
+        }
+
+        if (bcon_plan_value(plan, base, in, key, is_array, depth)) return 1;
+    }
+
+    return 0;
+}
+
+static int bcon_plan__doc(bcon_plan_t * plan, bcon_t * base, bcon_t ** in, int is_array, int is_inline, int depth)
+{
+    if (depth > BCON_VISIT_MAX_DEPTH) return 1;
+
+    bcon_plan_op(plan, BCON_PLAN_OPEN);
+
+    if (bcon_plan__elems(plan, base, in, is_array, is_inline, depth)) return 1;
+
+    bcon_plan_op(plan, BCON_PLAN_CLOSE);
+
+    return 0;
+}
+
+#ifdef BCON_PLAN_NATIVE
+static void bcon_plan_native(bcon_plan_t * plan);
+#endif
+
+char * bcon_plan_compile(bcon_t * in, bcon_plan_t ** out)
+{
+    bcon_plan_t * plan = calloc(1, sizeof(*plan));
+    bcon_t * stream = in;
+
+    if (bcon_plan__doc(plan, in, &stream, 0, 0, 0)) {
+        bcon_plan_destroy(plan);
+        *out = NULL;
+
+        BCON_PROBE2(error, __func__, in);
+        return bcon_dump(in);
+    }
+
+#ifdef BCON_PLAN_NATIVE
+    bcon_plan_native(plan);
+#endif
+
+    *out = plan;
+
+    return NULL;
+}
+
+void bcon_plan_destroy(bcon_plan_t * plan)
+{
+    if (! plan) return;
+
+#ifdef BCON_PLAN_NATIVE
+    if (plan->native) munmap((void *)plan->native, plan->native_len);
+#endif
+
+    free(plan->ops);
+    free(plan->image);
+    free(plan);
+}
+
+/*
+ * Output stops being written once it would pass len but is still
+ * counted, so a short buffer returns the size it needs.
+ */
+typedef struct bcon_plan_out {
+    bson_uint8_t * buf;
+    size_t len;
+    size_t pos;
+} bcon_plan_out_t;
+
+static void bcon_plan_put(bcon_plan_out_t * out, const void * data, size_t len)
+{
+    if (out->pos + len <= out->len) memcpy(out->buf + out->pos, data, len);
+    out->pos += len;
+}
+
+static void bcon_plan_le32(bcon_plan_out_t * out, bson_uint32_t v)
+{
+    v = BSON_UINT32_TO_LE(v);
+    bcon_plan_put(out, &v, 4);
+}
+
+static void bcon_plan_le64(bcon_plan_out_t * out, bson_uint64_t v)
+{
+    v = BSON_UINT64_TO_LE(v);
+    bcon_plan_put(out, &v, 8);
+}
+
+static void bcon_plan_string(bcon_plan_out_t * out, const char * str, bson_uint32_t len)
+{
+    static const bson_uint8_t zero[1] = { 0 };
+
+    bcon_plan_le32(out, len + 1);
+    bcon_plan_put(out, str, len);
+    bcon_plan_put(out, zero, 1);
+}
+
+/* The address bcon_token() would give for the value op reads. */
+static void * bcon_plan_ref(bcon_t * base, const bcon_plan_op_t * op)
+{
+    void * val = base + op->arg;
+    int i;
+
+    for (i = 0; i < op->by_ref; i++) val = *((void **)val);
+
+    return val;
+}
+
+static void bcon_plan_run_value(bcon_plan_out_t * out, bcon_type_t type, void * val)
+{
+    switch (type) {
+        case BCONT_UTF8:
+        case BCONT_SYMBOL: {
+            char * str = *((char **)val);
+
+            bcon_plan_string(out, str, (bson_uint32_t)strlen(str));
+            break;
+        }
+        case BCONT_BCON_UTF8_LEN:
+        case BCONT_BCON_SYMBOL_LEN:
+        case BCONT_BCON_CODE_LEN: {
+            bcon_string_t * z = *((bcon_string_t **)val);
+
+            bcon_plan_string(out, z->str, z->length);
+            break;
+        }
+        case BCONT_BCON_CODE: {
+            char * code = (*((bcon_code_t **)val))->code;
+
+            bcon_plan_string(out, code, (bson_uint32_t)strlen(code));
+            break;
+        }
+        case BCONT_DOUBLE: {
+            bson_uint64_t v;
+
+            memcpy(&v, val, 8);
+            bcon_plan_le64(out, v);
+            break;
+        }
+        case BCONT_INT32:
+            bcon_plan_le32(out, (bson_uint32_t)*((bson_int32_t *)val));
+            break;
+        case BCONT_INT64:
+            bcon_plan_le64(out, (bson_uint64_t)*((bson_int64_t *)val));
+            break;
+        case BCONT_BOOL: {
+            bson_uint8_t b = *((bson_bool_t *)val) ? 1 : 0;
+
+            bcon_plan_put(out, &b, 1);
+            break;
+        }
+        case BCONT_DATE_TIME: {
+            struct timeval * tv = *((struct timeval **)val);
+
+            bcon_plan_le64(out, (bson_uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000);
+            break;
+        }
+        case BCONT_BCON_NOW: {
+            bson_int64_t * dst = *((bson_int64_t **)val);
+            bson_int64_t now = bcon_now_ms();
+
+            if (dst) *dst = now;
+            bcon_plan_le64(out, (bson_uint64_t)now);
+            break;
+        }
+        case BCONT_BSON_OID:
+            bcon_plan_put(out, *((bson_oid_t **)val), 12);
+            break;
+        case BCONT_BCON_NEW_OID: {
+            bson_oid_t * dst = *((bson_oid_t **)val);
+            bson_oid_t oid;
+
+            bcon_oid_gen(&oid);
+            if (dst) *dst = oid;
+            bcon_plan_put(out, &oid, 12);
+            break;
+        }
+        case BCONT_BCON_TIMESTAMP: {
+            bcon_timestamp_t * ts = *((bcon_timestamp_t **)val);
+
+            bcon_plan_le32(out, ts->increment);
+            bcon_plan_le32(out, ts->timestamp);
+            break;
+        }
+        case BCONT_BSON_DOCUMENT:
+        case BCONT_BSON_ARRAY: {
+            bson_t * bson = *((bson_t **)val);
+
+            bcon_plan_put(out, bson_get_data(bson), bson->len);
+            break;
+        }
+        case BCONT_BIN: {
+            bcon_binary_t * z = *((bcon_binary_t **)val);
+            bson_uint8_t subtype = (bson_uint8_t)z->subtype;
+
+            if (z->subtype == BSON_SUBTYPE_BINARY_DEPRECATED) {
+                bcon_plan_le32(out, z->length + 4);
+                bcon_plan_put(out, &subtype, 1);
+                bcon_plan_le32(out, z->length);
+            } else {
+                bcon_plan_le32(out, z->length);
+                bcon_plan_put(out, &subtype, 1);
+            }
+
+            bcon_plan_put(out, z->binary, z->length);
+            break;
+        }
+        case BCONT_BCON_REGEX: {
+            bcon_regex_t * r = *((bcon_regex_t **)val);
+            const char * flags = r->flags ? r->flags : "";
+
+            bcon_plan_put(out, r->regex, strlen(r->regex) + 1);
+            bcon_plan_put(out, flags, strlen(flags) + 1);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+#ifdef BCON_PLAN_NATIVE
+
+/*
+ * x86-64 code for a plan, System V ABI.  The generated function keeps the
+ * token array in r15, the buffer in r12, its length in r13 and the write
+ * position in r14.  Document starts and the token arrays ENTER leaves
+ * behind are spilled to fixed frame slots, since nesting is known up
+ * front.  Literal runs become immediate stores, fixed size values are
+ * loaded and stored directly and everything else calls
+ * bcon_plan_native_value().  Every write is checked against r13 first;
+ * one that doesn't fit is jumped over but r14 still advances, so a short
+ * buffer gets the size it needs from the same single pass.
+ */
+typedef struct bcon_plan_asm {
+    bson_uint8_t * code;
+    size_t len;
+    size_t cap;
+
+    /* rel32 fields of SKIP and IF jumps, and the ops they jump to */
+    size_t * jumps;
+    int * targets;
+    int n_jumps;
+    int jumps_cap;
+} bcon_plan_asm_t;
+
+static void bcon_plan_emit(bcon_plan_asm_t * a, const void * data, size_t len)
+{
+    if (a->len + len > a->cap) {
+        a->cap = a->cap ? a->cap * 2 : 1024;
+        if (a->cap < a->len + len) a->cap = a->len + len;
+        a->code = realloc(a->code, a->cap);
+    }
+
+    memcpy(a->code + a->len, data, len);
+    a->len += len;
+}
+
+static void bcon_plan_emit2(bcon_plan_asm_t * a, bson_uint8_t b0, bson_uint8_t b1)
+{
+    bson_uint8_t b[2] = { b0, b1 };
+
+    bcon_plan_emit(a, b, 2);
+}
+
+static void bcon_plan_emit3(bcon_plan_asm_t * a, bson_uint8_t b0, bson_uint8_t b1, bson_uint8_t b2)
+{
+    bson_uint8_t b[3] = { b0, b1, b2 };
+
+    bcon_plan_emit(a, b, 3);
+}
+
+static void bcon_plan_emit4(bcon_plan_asm_t * a, bson_uint8_t b0, bson_uint8_t b1, bson_uint8_t b2, bson_uint8_t b3)
+{
+    bson_uint8_t b[4] = { b0, b1, b2, b3 };
+
+    bcon_plan_emit(a, b, 4);
+}
+
+static void bcon_plan_emit32(bcon_plan_asm_t * a, bson_uint32_t v)
+{
+    bcon_plan_emit(a, &v, 4);
+}
+
+static void bcon_plan_emit64(bcon_plan_asm_t * a, bson_uint64_t v)
+{
+    bcon_plan_emit(a, &v, 8);
+}
+
+/* Points the rel32 field at offset at to the current position. */
+static void bcon_plan_emit_here(bcon_plan_asm_t * a, size_t at)
+{
+    bson_uint32_t rel = (bson_uint32_t)(a->len - (at + 4));
+
+    memcpy(a->code + at, &rel, 4);
+}
+
+/* jz to the code for op target */
+static void bcon_plan_emit_jz_op(bcon_plan_asm_t * a, int target)
+{
+    bcon_plan_emit2(a, 0x0f, 0x84);
+
+    if (a->n_jumps == a->jumps_cap) {
+        a->jumps_cap = a->jumps_cap ? a->jumps_cap * 2 : 16;
+        a->jumps = realloc(a->jumps, a->jumps_cap * sizeof(*a->jumps));
+        a->targets = realloc(a->targets, a->jumps_cap * sizeof(*a->targets));
+    }
+
+    a->jumps[a->n_jumps] = a->len;
+    a->targets[a->n_jumps++] = target;
+    bcon_plan_emit32(a, 0);
+}
+
+/*
+ * lea rcx, [r14 + len]; cmp rcx, r13; ja past the write.  Returns the
+ * rel32 field for bcon_plan_emit_here() once the write is emitted.
+ */
+static size_t bcon_plan_emit_room(bcon_plan_asm_t * a, bson_uint32_t len)
+{
+    bcon_plan_emit3(a, 0x49, 0x8d, 0x8e);
+    bcon_plan_emit32(a, len);
+    bcon_plan_emit3(a, 0x4c, 0x39, 0xe9);
+    bcon_plan_emit2(a, 0x0f, 0x87);
+    bcon_plan_emit32(a, 0);
+
+    return a->len - 4;
+}
+
+/* add r14, len */
+static void bcon_plan_emit_advance(bcon_plan_asm_t * a, bson_uint32_t len)
+{
+    bcon_plan_emit3(a, 0x49, 0x81, 0xc6);
+    bcon_plan_emit32(a, len);
+}
+
+/* rax = the value's address, the same one bcon_plan_ref() computes */
+static void bcon_plan_emit_value_ptr(bcon_plan_asm_t * a, const bcon_plan_op_t * op)
+{
+    int i;
+
+    /* mov rax, [r15 + disp32] or lea rax, [r15 + disp32] */
+    bcon_plan_emit3(a, 0x49, op->by_ref ? 0x8b : 0x8d, 0x87);
+    bcon_plan_emit32(a, op->arg * (bson_uint32_t)sizeof(bcon_t));
+
+    /* mov rax, [rax] */
+    for (i = 1; i < op->by_ref; i++) bcon_plan_emit3(a, 0x48, 0x8b, 0x00);
+}
+
+static void bcon_plan_emit_lit(bcon_plan_asm_t * a, const bson_uint8_t * data, bson_uint32_t len)
+{
+    size_t room = bcon_plan_emit_room(a, len);
+    bson_uint32_t off = 0;
+
+    /* lea rdx, [r12 + r14] */
+    bcon_plan_emit4(a, 0x4b, 0x8d, 0x14, 0x34);
+
+    for (; len - off >= 8; off += 8) {
+        bson_uint64_t v;
+
+        memcpy(&v, data + off, 8);
+
+        /* mov rax, imm64; mov [rdx + off], rax */
+        bcon_plan_emit2(a, 0x48, 0xb8);
+        bcon_plan_emit64(a, v);
+        bcon_plan_emit3(a, 0x48, 0x89, 0x82);
+        bcon_plan_emit32(a, off);
+    }
+
+    if (len - off >= 4) {
+        bson_uint32_t v;
+
+        memcpy(&v, data + off, 4);
+
+        /* mov dword [rdx + off], imm32 */
+        bcon_plan_emit2(a, 0xc7, 0x82);
+        bcon_plan_emit32(a, off);
+        bcon_plan_emit32(a, v);
+        off += 4;
+    }
+
+    if (len - off >= 2) {
+        /* mov word [rdx + off], imm16 */
+        bcon_plan_emit3(a, 0x66, 0xc7, 0x82);
+        bcon_plan_emit32(a, off);
+        bcon_plan_emit(a, data + off, 2);
+        off += 2;
+    }
+
+    if (len - off) {
+        /* mov byte [rdx + off], imm8 */
+        bcon_plan_emit2(a, 0xc6, 0x82);
+        bcon_plan_emit32(a, off);
+        bcon_plan_emit(a, data + off, 1);
+    }
+
+    bcon_plan_emit_here(a, room);
+    bcon_plan_emit_advance(a, len);
+}
+
+static size_t bcon_plan_native_value(bson_uint8_t * buf, size_t len, size_t pos, bcon_type_t type, void * val)
+{
+    bcon_plan_out_t out = { buf, len, pos };
+
+    bcon_plan_run_value(&out, type, val);
+
+    return out.pos;
+}
+
+static void bcon_plan_emit_value(bcon_plan_asm_t * a, const bcon_plan_op_t * op)
+{
+    size_t room;
+
+    switch (op->type) {
+        case BCONT_INT32:
+            room = bcon_plan_emit_room(a, 4);
+            bcon_plan_emit_value_ptr(a, op);
+            /* mov ecx, [rax]; mov [r12 + r14], ecx */
+            bcon_plan_emit2(a, 0x8b, 0x08);
+            bcon_plan_emit4(a, 0x43, 0x89, 0x0c, 0x34);
+            bcon_plan_emit_here(a, room);
+            bcon_plan_emit_advance(a, 4);
+            return;
+        case BCONT_INT64:
+        case BCONT_DOUBLE:
+            room = bcon_plan_emit_room(a, 8);
+            bcon_plan_emit_value_ptr(a, op);
+            /* mov rcx, [rax]; mov [r12 + r14], rcx */
+            bcon_plan_emit3(a, 0x48, 0x8b, 0x08);
+            bcon_plan_emit4(a, 0x4b, 0x89, 0x0c, 0x34);
+            bcon_plan_emit_here(a, room);
+            bcon_plan_emit_advance(a, 8);
+            return;
+        case BCONT_BOOL:
+            if (sizeof(bson_bool_t) != 1 && sizeof(bson_bool_t) != 4) break;
+
+            room = bcon_plan_emit_room(a, 1);
+            bcon_plan_emit_value_ptr(a, op);
+            /* cmp byte/dword [rax], 0; setne cl; mov [r12 + r14], cl */
+            bcon_plan_emit3(a, sizeof(bson_bool_t) == 1 ? 0x80 : 0x83, 0x38, 0x00);
+            bcon_plan_emit3(a, 0x0f, 0x95, 0xc1);
+            bcon_plan_emit4(a, 0x43, 0x88, 0x0c, 0x34);
+            bcon_plan_emit_here(a, room);
+            bcon_plan_emit_advance(a, 1);
+            return;
+        default:
+            break;
+    }
+
+    bcon_plan_emit_value_ptr(a, op);
+
+    /* r14 = bcon_plan_native_value(r12, r13, r14, type, rax) */
+    bcon_plan_emit3(a, 0x49, 0x89, 0xc0);
+    bcon_plan_emit3(a, 0x4c, 0x89, 0xe7);
+    bcon_plan_emit3(a, 0x4c, 0x89, 0xee);
+    bcon_plan_emit3(a, 0x4c, 0x89, 0xf2);
+    bcon_plan_emit(a, "\xb9", 1);
+    bcon_plan_emit32(a, (bson_uint32_t)op->type);
+    bcon_plan_emit2(a, 0x48, 0xb8);
+    bcon_plan_emit64(a, (bson_uint64_t)(size_t)bcon_plan_native_value);
+    bcon_plan_emit2(a, 0xff, 0xd0);
+    bcon_plan_emit3(a, 0x49, 0x89, 0xc6);
+}
+
+/* [rsp + disp32] as the memory operand for the register in modrm's reg field */
+static void bcon_plan_emit_frame(bcon_plan_asm_t * a, bson_uint8_t rex, bson_uint8_t opcode, bson_uint8_t reg, int slot)
+{
+    bcon_plan_emit4(a, rex, opcode, 0x84 | (reg << 3), 0x24);
+    bcon_plan_emit32(a, (bson_uint32_t)slot * 8);
+}
+
+/*
+ * Emits the plan's code and maps it.  Any failure just leaves the plan
+ * without native code.
+ */
+static void bcon_plan_native(bcon_plan_t * plan)
+{
+    const bcon_plan_op_t * op;
+    bcon_plan_asm_t a;
+    int depth = 0, max_depth = 0, n_bases = 0, max_bases = 0;
+    bson_uint32_t frame;
+    size_t * op_at;
+    size_t room;
+    void * code;
+    int i;
+
+    /* the IF test reads the condition as a byte or dword */
+    if (sizeof(bson_bool_t) != 1 && sizeof(bson_bool_t) != 4) return;
+
+    for (op = plan->ops; op < plan->ops + plan->n_ops; op++) {
+        if (op->code == BCON_PLAN_OPEN && ++depth > max_depth) max_depth = depth;
+        if (op->code == BCON_PLAN_CLOSE) depth--;
+        if ((op->code == BCON_PLAN_ENTER || op->code == BCON_PLAN_IF) && ++n_bases > max_bases) max_bases = n_bases;
+        if (op->code == BCON_PLAN_LEAVE) n_bases--;
+    }
+
+    /* four pushes leave rsp 8 off 16 byte alignment, the frame fixes it */
+    frame = (bson_uint32_t)(max_depth + max_bases) * 8;
+    if (frame % 16 == 0) frame += 8;
+
+    memset(&a, 0, sizeof(a));
+    op_at = malloc((plan->n_ops + 1) * sizeof(*op_at));
+    if (! op_at) return;
+
+    /* push r12; push r13; push r14; push r15; sub rsp, frame */
+    bcon_plan_emit4(&a, 0x41, 0x54, 0x41, 0x55);
+    bcon_plan_emit4(&a, 0x41, 0x56, 0x41, 0x57);
+    bcon_plan_emit3(&a, 0x48, 0x81, 0xec);
+    bcon_plan_emit32(&a, frame);
+
+    /* mov r15, rdi; mov r12, rsi; mov r13, rdx; xor r14d, r14d */
+    bcon_plan_emit3(&a, 0x49, 0x89, 0xff);
+    bcon_plan_emit3(&a, 0x49, 0x89, 0xf4);
+    bcon_plan_emit3(&a, 0x49, 0x89, 0xd5);
+    bcon_plan_emit3(&a, 0x45, 0x31, 0xf6);
+
+    depth = n_bases = 0;
+
+    for (op = plan->ops; op < plan->ops + plan->n_ops; op++) {
+        op_at[op - plan->ops] = a.len;
+
+        switch (op->code) {
+            case BCON_PLAN_LIT:
+                bcon_plan_emit_lit(&a, plan->image + op->arg, op->len);
+                break;
+            case BCON_PLAN_VALUE:
+                bcon_plan_emit_value(&a, op);
+                break;
+            case BCON_PLAN_OPEN:
+                /* mov [rsp + slot], r14 */
+                bcon_plan_emit_frame(&a, 0x4c, 0x89, 6, depth++);
+                bcon_plan_emit_advance(&a, 4);
+                break;
+            case BCON_PLAN_CLOSE:
+                /* mov byte [r12 + r14], 0 */
+                room = bcon_plan_emit_room(&a, 1);
+                bcon_plan_emit4(&a, 0x43, 0xc6, 0x04, 0x34);
+                bcon_plan_emit(&a, "", 1);
+                bcon_plan_emit_here(&a, room);
+                bcon_plan_emit_advance(&a, 1);
+
+                /* the prefix only goes in once the whole document fits: cmp r14, r13; ja past it */
+                bcon_plan_emit3(&a, 0x4d, 0x39, 0xee);
+                bcon_plan_emit2(&a, 0x0f, 0x87);
+                bcon_plan_emit32(&a, 0);
+                room = a.len - 4;
+
+                /* mov rcx, [rsp + slot]; mov eax, r14d; sub eax, ecx; mov [r12 + rcx], eax */
+                bcon_plan_emit_frame(&a, 0x48, 0x8b, 1, --depth);
+                bcon_plan_emit3(&a, 0x44, 0x89, 0xf0);
+                bcon_plan_emit2(&a, 0x29, 0xc8);
+                bcon_plan_emit4(&a, 0x41, 0x89, 0x04, 0x0c);
+                bcon_plan_emit_here(&a, room);
+                break;
+            case BCON_PLAN_ENTER:
+                /* mov [rsp + slot], r15; mov r15, [r15 + disp32] */
+                bcon_plan_emit_frame(&a, 0x4c, 0x89, 7, max_depth + n_bases++);
+                bcon_plan_emit3(&a, 0x4d, 0x8b, 0xbf);
+                bcon_plan_emit32(&a, op->arg * (bson_uint32_t)sizeof(bcon_t));
+                break;
+            case BCON_PLAN_LEAVE:
+                /* mov r15, [rsp + slot] */
+                bcon_plan_emit_frame(&a, 0x4c, 0x8b, 7, max_depth + --n_bases);
+                break;
+            case BCON_PLAN_SKIP:
+                /* test rax, rax; jz past the element */
+                bcon_plan_emit_value_ptr(&a, op);
+                bcon_plan_emit3(&a, 0x48, 0x85, 0xc0);
+                bcon_plan_emit_jz_op(&a, op->len);
+                break;
+            case BCON_PLAN_IF:
+                /* mov rax, [r15 + disp32]; mov rcx, [rax]; cmp byte/dword [rcx], 0; jz past the body */
+                bcon_plan_emit3(&a, 0x49, 0x8b, 0x87);
+                bcon_plan_emit32(&a, op->arg * (bson_uint32_t)sizeof(bcon_t));
+                bcon_plan_emit3(&a, 0x48, 0x8b, 0x08);
+                bcon_plan_emit3(&a, sizeof(bson_bool_t) == 1 ? 0x80 : 0x83, 0x39, 0x00);
+                bcon_plan_emit_jz_op(&a, op->len);
+
+                /* mov [rsp + slot], r15; mov r15, [rax + body] */
+                bcon_plan_emit_frame(&a, 0x4c, 0x89, 7, max_depth + n_bases++);
+                bcon_plan_emit4(&a, 0x4c, 0x8b, 0x78, (bson_uint8_t)offsetof(bcon_if_t, body));
+                break;
+        }
+    }
+
+    op_at[plan->n_ops] = a.len;
+
+    /* mov eax, r14d; add rsp, frame; pop r15; pop r14; pop r13; pop r12; ret */
+    bcon_plan_emit3(&a, 0x44, 0x89, 0xf0);
+    bcon_plan_emit3(&a, 0x48, 0x81, 0xc4);
+    bcon_plan_emit32(&a, frame);
+    bcon_plan_emit4(&a, 0x41, 0x5f, 0x41, 0x5e);
+    bcon_plan_emit4(&a, 0x41, 0x5d, 0x41, 0x5c);
+    bcon_plan_emit(&a, "\xc3", 1);
+
+    for (i = 0; i < a.n_jumps; i++) {
+        bson_uint32_t rel = (bson_uint32_t)(op_at[a.targets[i]] - (a.jumps[i] + 4));
+
+        memcpy(a.code + a.jumps[i], &rel, 4);
+    }
+
+    code = mmap(NULL, a.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (code != MAP_FAILED) {
+        memcpy(code, a.code, a.len);
+
+        if (mprotect(code, a.len, PROT_READ | PROT_EXEC) == 0) {
+            plan->native = (bcon_plan_native_fn_t)code;
+            plan->native_len = a.len;
+        } else {
+            munmap(code, a.len);
+        }
+    }
+
+    free(op_at);
+    free(a.code);
+    free(a.jumps);
+    free(a.targets);
+}
+
+#endif
+
+int bcon_plan_is_native(const bcon_plan_t * plan)
+{
+    return plan->native != NULL;
+}
+
+bson_uint32_t bcon_plan_encode(const bcon_plan_t * plan, bcon_t * in, bson_uint8_t * buf, size_t len)
+{
+    bcon_t * bases[BCON_VISIT_MAX_DEPTH + 1];
+    size_t starts[BCON_VISIT_MAX_DEPTH + 1];
+    const bcon_plan_op_t * op = plan->ops;
+    const bcon_plan_op_t * end = op + plan->n_ops;
+    bcon_plan_out_t out = { buf, len, 0 };
+    bcon_t * base = in;
+    int n_bases = 0, depth = 0;
+    bcon_if_t * cond;
+
+    if (plan->native) return plan->native(in, buf, len);
+
+    for (; op < end; op++) {
+        switch (op->code) {
+            case BCON_PLAN_LIT:
+                bcon_plan_put(&out, plan->image + op->arg, op->len);
+                break;
+            case BCON_PLAN_VALUE:
+                bcon_plan_run_value(&out, op->type, bcon_plan_ref(base, op));
+                break;
+            case BCON_PLAN_SKIP:
+                if (! bcon_plan_ref(base, op)) op = plan->ops + op->len - 1;
+                break;
+            case BCON_PLAN_IF:
+                cond = *((bcon_if_t **)(base + op->arg));
+
+                if (! *(cond->cond)) {
+                    op = plan->ops + op->len - 1;
+                    break;
+                }
+
+                bases[n_bases++] = base;
+                base = cond->body;
+                break;
+            case BCON_PLAN_OPEN:
+                starts[depth++] = out.pos;
+                out.pos += 4;
+                break;
+            case BCON_PLAN_CLOSE: {
+                static const bson_uint8_t zero[1] = { 0 };
+                size_t start = starts[--depth];
+                bson_uint32_t size;
+
+                bcon_plan_put(&out, zero, 1);
+
+                if (out.pos <= out.len) {
+                    size = BSON_UINT32_TO_LE((bson_uint32_t)(out.pos - start));
+                    memcpy(out.buf + start, &size, 4);
+                }
+                break;
+            }
+            case BCON_PLAN_ENTER:
+                bases[n_bases++] = base;
+                base = *((bcon_t **)(base + op->arg));
+                break;
+            case BCON_PLAN_LEAVE:
+                base = bases[--n_bases];
+                break;
+        }
+    }
+
+    return (bson_uint32_t)out.pos;
+}
+
+/*
+ * Compiles the template for a site that has just run hot.  Threads racing
+ * here each compile, and all but the first throw theirs away.
+ */
+bcon_plan_t * bcon_hot_promote(bcon_hot_t * hot, bcon_t * in)
+{
+    bcon_plan_t * plan = NULL;
+    bcon_plan_t * expected = NULL;
+    char * err;
+
+    err = bcon_plan_compile(in, &plan);
+
+    if (err) {
+        free(err);
+        __atomic_store_n(&hot->cold, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    if (! __atomic_compare_exchange_n(&hot->plan, &expected, plan, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        bcon_plan_destroy(plan);
+        plan = expected;
+    }
+
+    return plan;
+}
+
+void bcon_hot_destroy(bcon_hot_t * hot)
+{
+    bcon_plan_destroy(hot->plan);
+
+    memset(hot, 0, sizeof(*hot));
+}
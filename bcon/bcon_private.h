@@ -0,0 +1,99 @@
+/*
+ * @file bcon_private.h
+ * @brief BCON (BSON C Object Notation) Internal declarations
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef BCON_PRIVATE_H_
+#define BCON_PRIVATE_H_
+
+#include "bcon.h"
+
+/*
+ * A raw element wrapped in a one element document so libbson can iterate
+ * it.  Small elements are framed on the stack.
+ */
+typedef struct bcon_raw_iter {
+    bson_uint8_t stack[128];
+    bson_uint8_t * buf;
+    bson_t doc;
+    bson_iter_t iter;
+} bcon_raw_iter_t;
+
+int bcon_raw_iter_init(bcon_raw_iter_t * ri, const bcon_raw_t * raw);
+void bcon_raw_iter_destroy(bcon_raw_iter_t * ri);
+
+void bcon_iter_value_data(const bson_iter_t * iter, const bson_uint8_t ** data, bson_uint32_t * len);
+
+/*
+ * Appends every element of doc to bson, copying bytes rather than decoding.
+ */
+int bcon_concat(bson_t * bson, const bson_t * doc);
+
+/*
+ * Appends an element by copying its value bytes rather than decoding them.
+ */
+int bcon_append_raw(bson_t * bson, bson_type_t type, const char * key, const bson_uint8_t * value, bson_uint32_t value_len);
+
+/*
+ * Splits a raw element into its type, key and value bytes.
+ */
+int bcon_raw_split(const bcon_raw_t * raw, bson_type_t * type, const char ** key, const bson_uint8_t ** value, bson_uint32_t * value_len);
+
+/*
+ * Adds the encoded size of a value, not including its type byte and key.
+ */
+int bcon_value_size(void * val, bcon_type_t type, bson_uint32_t * size);
+
+/*
+ * Called when the token at at, read in key position, came back
+ * BCONT_OMIT.  A NULL P key takes the value after it with it, including
+ * an inline "{" or "[" body; a NULL spliced element (BCON_PITER_ELEMENT(),
+ * BCON_PBCON_RAW() or BCON_PBCON_IF()) already stands for whole elements.
+ */
+int bcon_skip_omitted(const bcon_t * at, bcon_t ** in);
+
+/*
+ * The elements of a BCON_IF() to splice in, or NULL when it's false.
+ */
+bcon_t * bcon_if_body(void * val);
+
+/*
+ * Visits the elements of the document or array in is already inside of,
+ * without its begin/end.  count, if not NULL, is the first array index
+ * and is left one past the last element.
+ */
+int bcon_visit__walk(bcon_t ** in, int is_array, int depth, bson_uint32_t * count, bcon_visitor_t * v, int n);
+
+/* Visits a whole top level document, including its begin/end. */
+int bcon_visit__doc(bcon_t ** in, int is_array, bcon_visitor_t * v, int n);
+
+/*
+ * The BCON_HASH_VALUES hash of the bytes behind a run of encoder pieces.
+ */
+void bcon_hash_pieces(const bcon_encoder_piece_t * pieces, int n, bcon_hash_t * out);
+
+/*
+ * Compiles a hot site's template and publishes the plan, or marks the site
+ * cold when it doesn't compile.
+ */
+bcon_plan_t * bcon_hot_promote(bcon_hot_t * hot, bcon_t * in);
+
+int bcon_to__bson(bcon_t ** in, bson_t * bson, int is_array);
+int bcon_to_bson_put_value(bson_t * bson, const char * key, void * val, bcon_type_t type);
+
+#endif
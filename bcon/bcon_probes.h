@@ -0,0 +1,80 @@
+/*
+ * @file bcon_probes.h
+ * @brief BCON (BSON C Object Notation) Static tracepoints
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef BCON_PROBES_H_
+#define BCON_PROBES_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/*
+ * USDT probes under the "bcon" provider, built when sys/sdt.h is found.
+ * An unattached probe is a single nop.  Each probe has a semaphore the
+ * tracer bumps while attached, so arguments that cost something to work
+ * out are only computed then:
+ *
+ *     encode_begin(bcon_t * in, int tokens, int depth)
+ *     encode_end(bcon_t * in, unsigned bytes, int failed)
+ *     dump_begin(bcon_t * in)
+ *     dump_end(bcon_t * in, unsigned bytes)
+ *     error(const char * function, bcon_t * in)
+ *
+ * See trace/ for bpftrace scripts using them.
+ */
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define BCON_PROBE_SEMAPHORE(name) bcon_##name##_semaphore
+#define BCON_PROBE_DECLARE(name) extern unsigned short BCON_PROBE_SEMAPHORE(name)
+#define BCON_PROBE_DEFINE(name) unsigned short BCON_PROBE_SEMAPHORE(name) __attribute__((section(".probes")))
+
+#define BCON_PROBE_ENABLED(name) __builtin_expect(BCON_PROBE_SEMAPHORE(name) != 0, 0)
+#define BCON_PROBE1(name, a) DTRACE_PROBE1(bcon, name, a)
+#define BCON_PROBE2(name, a, b) DTRACE_PROBE2(bcon, name, a, b)
+#define BCON_PROBE3(name, a, b, c) DTRACE_PROBE3(bcon, name, a, b, c)
+
+#else
+
+#define BCON_PROBE_DECLARE(name) extern int bcon_##name##_unused
+#define BCON_PROBE_DEFINE(name) extern int bcon_##name##_unused
+
+#define BCON_PROBE_ENABLED(name) 0
+#define BCON_PROBE1(name, a) do { if (0) { (void)(a); } } while (0)
+#define BCON_PROBE2(name, a, b) do { if (0) { (void)(a); (void)(b); } } while (0)
+#define BCON_PROBE3(name, a, b, c) do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+
+#endif
+
+BCON_PROBE_DECLARE(encode_begin);
+BCON_PROBE_DECLARE(encode_end);
+BCON_PROBE_DECLARE(dump_begin);
+BCON_PROBE_DECLARE(dump_end);
+BCON_PROBE_DECLARE(error);
+
+/*
+ * Counts the values and containers in a template and its deepest
+ * nesting, for encode_begin.
+ */
+void bcon_probe_shape(bcon_t * in, int * tokens, int * depth);
+
+#endif
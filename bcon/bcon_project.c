@@ -0,0 +1,299 @@
+/*
+ * @file bcon_project.c
+ * @brief BCON (BSON C Object Notation) Projection
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+#include "bcon_private.h"
+
+#define BCON_PROJECT_MAX_KEYS 256
+#define BCON_PROJECT_STACK_SIZE 512
+
+/*
+ * A spec is parsed once per call into a flat array of keys on the stack.
+ * Each level is a chain linked through next.  child is the first key of
+ * the nested spec for document values, or -1 when there isn't one: an
+ * empty nested spec still has is_doc set.
+ */
+typedef struct bcon_project_key {
+    const char * key;
+    int next;
+    int child;
+    int is_doc;
+} bcon_project_key_t;
+
+typedef struct bcon_project_spec {
+    bcon_project_key_t keys[BCON_PROJECT_MAX_KEYS];
+    int n_keys;
+} bcon_project_spec_t;
+
+/*
+ * Parses the keys of a spec document up to its end, leaving in past it,
+ * and returns the first key's index through first.  An inline "{"
+ * document ends at its "}", anything else at the end of its tokens.
+ */
+static int bcon_project_parse(bcon_project_spec_t * spec, bcon_t ** in, int is_inline, int depth, int * first)
+{
+    bcon_project_key_t * k;
+    bcon_t * child_in;
+    void * obj = NULL;
+    bcon_type_t type;
+    int * link = first;
+    int i;
+
+    *first = -1;
+
+    if (depth > BCON_VISIT_MAX_DEPTH) return 1;
+
+    while (1) {
+        type = bcon_token(in, &obj);
+
+        if (type == (is_inline ? BCONT_DOC_END : BCONT_END)) break;
+
+        if (type != BCONT_UTF8 || spec->n_keys == BCON_PROJECT_MAX_KEYS) return 1;
+
+        i = spec->n_keys++;
+        k = spec->keys + i;
+        k->key = *((char **)obj);
+        k->next = -1;
+        k->child = -1;
+        k->is_doc = 0;
+
+        *link = i;
+        link = &k->next;
+
+        type = bcon_token(in, &obj);
+
+        switch (type) {
+            case BCONT_BCON_DOCUMENT:
+                child_in = *((bcon_t **)obj);
+                spec->keys[i].is_doc = 1;
+                if (bcon_project_parse(spec, &child_in, 0, depth + 1, &spec->keys[i].child)) return 1;
+                break;
+            case BCONT_DOC_START:
+                spec->keys[i].is_doc = 1;
+                if (bcon_project_parse(spec, in, 1, depth + 1, &spec->keys[i].child)) return 1;
+                break;
+            case BCONT_END:
+            case BCONT_DOC_END:
+            case BCONT_ARRAY_START:
+            case BCONT_ARRAY_END:
+            case BCONT_ERROR:
+                return 1;
+            default:
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * The projected document is written straight into one buffer.  It can't
+ * be longer than the source unless an array's keys were shorter than the
+ * indices they're renumbered to, so the buffer starts at the source's
+ * size and only grows in that case.
+ */
+typedef struct bcon_project_out {
+    bson_uint8_t * buf;
+    bson_uint32_t len;
+    bson_uint32_t cap;
+    bson_uint8_t stack[BCON_PROJECT_STACK_SIZE];
+} bcon_project_out_t;
+
+static bson_uint8_t * bcon_project_reserve(bcon_project_out_t * out, bson_uint32_t len)
+{
+    bson_uint8_t * buf;
+    bson_uint32_t cap;
+
+    if (len > 0x7fffffff - out->len) return NULL;
+
+    if (out->len + len > out->cap) {
+        cap = out->cap * 2 > out->len + len ? out->cap * 2 : out->len + len;
+
+        buf = malloc(cap);
+        if (! buf) return NULL;
+
+        memcpy(buf, out->buf, out->len);
+        if (out->buf != out->stack) free(out->buf);
+
+        out->buf = buf;
+        out->cap = cap;
+    }
+
+    buf = out->buf + out->len;
+    out->len += len;
+
+    return buf;
+}
+
+static int bcon_project_put(bcon_project_out_t * out, const void * data, bson_uint32_t len)
+{
+    bson_uint8_t * buf = bcon_project_reserve(out, len);
+
+    if (! buf) return 1;
+
+    memcpy(buf, data, len);
+
+    return 0;
+}
+
+/* The type byte and key of the element under iter, as they are in the source. */
+static int bcon_project_header(bcon_project_out_t * out, const bson_iter_t * iter)
+{
+    const char * key = bson_iter_key(iter);
+
+    return bcon_project_put(out, key - 1, (bson_uint32_t)strlen(key) + 2);
+}
+
+static int bcon_project_close(bcon_project_out_t * out, bson_uint32_t start)
+{
+    bson_uint32_t size;
+
+    if (bcon_project_put(out, "", 1)) return 1;
+
+    size = BSON_UINT32_TO_LE(out->len - start);
+    memcpy(out->buf + start, &size, 4);
+
+    return 0;
+}
+
+static int bcon_project__iter(bcon_project_out_t * out, bson_iter_t * iter, const bcon_project_spec_t * spec, int first);
+
+/*
+ * Projects the document under iter into a new document at the end of
+ * out, length prefix and terminator included.
+ */
+static int bcon_project_doc(bcon_project_out_t * out, const bson_iter_t * iter, const bcon_project_spec_t * spec, int first)
+{
+    bson_uint32_t start = out->len;
+    bson_iter_t child;
+
+    if (! bcon_project_reserve(out, 4)) return 1;
+
+    bson_iter_recurse(iter, &child);
+
+    if (bcon_project__iter(out, &child, spec, first)) return 1;
+
+    return bcon_project_close(out, start);
+}
+
+/*
+ * Array elements that aren't documents are dropped, and the survivors
+ * are renumbered so the output is still a valid array.
+ */
+static int bcon_project_child(bcon_project_out_t * out, const bson_iter_t * iter, const bcon_project_spec_t * spec, int first)
+{
+    bson_uint32_t start, count = 0;
+    bson_iter_t child;
+    char index[16];
+
+    if (bson_iter_type(iter) == BSON_TYPE_DOCUMENT) {
+        if (bcon_project_header(out, iter)) return 1;
+
+        return bcon_project_doc(out, iter, spec, first);
+    }
+
+    if (bson_iter_type(iter) != BSON_TYPE_ARRAY) return 0;
+
+    if (bcon_project_header(out, iter)) return 1;
+
+    start = out->len;
+    if (! bcon_project_reserve(out, 4)) return 1;
+
+    bson_iter_recurse(iter, &child);
+
+    while (bson_iter_next(&child)) {
+        if (bson_iter_type(&child) != BSON_TYPE_DOCUMENT) continue;
+
+        index[0] = BSON_TYPE_DOCUMENT;
+        sprintf(index + 1, "%u", count++);
+
+        if (bcon_project_put(out, index, (bson_uint32_t)strlen(index + 1) + 2)) return 1;
+        if (bcon_project_doc(out, &child, spec, first)) return 1;
+    }
+
+    return bcon_project_close(out, start);
+}
+
+static int bcon_project__iter(bcon_project_out_t * out, bson_iter_t * iter, const bcon_project_spec_t * spec, int first)
+{
+    const bcon_project_key_t * k;
+    const bson_uint8_t * data;
+    const char * key;
+    bson_uint32_t len;
+    int i;
+
+    while (bson_iter_next(iter)) {
+        key = bson_iter_key(iter);
+
+        for (i = first; i >= 0; i = spec->keys[i].next) {
+            if (strcmp(spec->keys[i].key, key) == 0) break;
+        }
+
+        if (i < 0) continue;
+
+        k = spec->keys + i;
+
+        if (k->is_doc) {
+            if (bcon_project_child(out, iter, spec, k->child)) return 1;
+        } else {
+            /* the whole element, type byte through value, in one copy */
+            bcon_iter_value_data(iter, &data, &len);
+
+            if (bcon_project_put(out, key - 1, (bson_uint32_t)(data + len - (const bson_uint8_t *)(key - 1)))) return 1;
+        }
+    }
+
+    return 0;
+}
+
+char * bcon_project(const bson_t * bson, bcon_t * spec, bson_t * out)
+{
+    bcon_project_spec_t parsed;
+    bcon_project_out_t doc_out;
+    bcon_t * in = spec;
+    bson_iter_t iter;
+    bson_t doc;
+    int first, r;
+
+    if (! bson_iter_init(&iter, bson)) return strdup("invalid bson");
+
+    parsed.n_keys = 0;
+
+    if (bcon_project_parse(&parsed, &in, 0, 0, &first)) return bcon_dump(spec);
+
+    doc_out.buf = doc_out.stack;
+    doc_out.len = 0;
+    doc_out.cap = sizeof(doc_out.stack);
+
+    if (bson->len > doc_out.cap) {
+        doc_out.buf = malloc(bson->len);
+        doc_out.cap = bson->len;
+    }
+
+    r = ! doc_out.buf || ! bcon_project_reserve(&doc_out, 4) || bcon_project__iter(&doc_out, &iter, &parsed, first) || bcon_project_close(&doc_out, 0);
+
+    if (! r) r = ! bson_init_static(&doc, doc_out.buf, doc_out.len) || bcon_concat(out, &doc);
+
+    if (doc_out.buf != doc_out.stack) free(doc_out.buf);
+
+    if (r) return bcon_dump(spec);
+
+    return NULL;
+}
@@ -0,0 +1,272 @@
+/*
+ * @file bcon_sink.c
+ * @brief BCON (BSON C Object Notation) Streaming and compressed output
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <zlib.h>
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include "bcon.h"
+
+static int bcon_sink_file_write(bcon_sink_t * sink, const bson_uint8_t * data, size_t len)
+{
+    return fwrite(data, 1, len, (FILE *)sink->data) != len;
+}
+
+static int bcon_sink_file_finish(bcon_sink_t * sink)
+{
+    return fflush((FILE *)sink->data) != 0;
+}
+
+void bcon_sink_file_init(bcon_sink_t * sink, FILE * fp)
+{
+    memset(sink, 0, sizeof(*sink));
+
+    sink->write = bcon_sink_file_write;
+    sink->finish = bcon_sink_file_finish;
+    sink->data = fp;
+}
+
+static int bcon_sink_zlib_drain(bcon_sink_t * sink, int flush)
+{
+    z_stream * z = sink->data;
+    bson_uint8_t out[BCON_SINK_CHUNK];
+    size_t n;
+    int r;
+
+    do {
+        z->next_out = out;
+        z->avail_out = sizeof(out);
+
+        r = deflate(z, flush);
+
+        if (r == Z_STREAM_ERROR) return 1;
+
+        n = sizeof(out) - z->avail_out;
+
+        if (n && sink->next->write(sink->next, out, n)) return 1;
+    } while (flush == Z_FINISH ? r != Z_STREAM_END : z->avail_out == 0);
+
+    return 0;
+}
+
+static int bcon_sink_zlib_write(bcon_sink_t * sink, const bson_uint8_t * data, size_t len)
+{
+    z_stream * z = sink->data;
+    uInt n;
+
+    while (len) {
+        n = len > BCON_SINK_CHUNK ? BCON_SINK_CHUNK : (uInt)len;
+
+        z->next_in = (Bytef *)data;
+        z->avail_in = n;
+
+        if (bcon_sink_zlib_drain(sink, Z_NO_FLUSH)) return 1;
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int bcon_sink_zlib_finish(bcon_sink_t * sink)
+{
+    if (bcon_sink_zlib_drain(sink, Z_FINISH)) return 1;
+
+    return bcon_sink_finish(sink->next);
+}
+
+static void bcon_sink_zlib_destroy(bcon_sink_t * sink)
+{
+    deflateEnd(sink->data);
+    free(sink->data);
+}
+
+char * bcon_sink_zlib_init(bcon_sink_t * sink, bcon_sink_t * next, int level)
+{
+    z_stream * z = calloc(1, sizeof(*z));
+
+    memset(sink, 0, sizeof(*sink));
+
+    if (deflateInit(z, level) != Z_OK) {
+        free(z);
+        return strdup("deflateInit failed");
+    }
+
+    sink->write = bcon_sink_zlib_write;
+    sink->finish = bcon_sink_zlib_finish;
+    sink->destroy = bcon_sink_zlib_destroy;
+    sink->data = z;
+    sink->next = next;
+
+    return NULL;
+}
+
+#ifdef HAVE_LIBZSTD
+
+static int bcon_sink_zstd_drain(bcon_sink_t * sink, ZSTD_inBuffer * in, ZSTD_EndDirective mode)
+{
+    bson_uint8_t out_buf[BCON_SINK_CHUNK];
+    ZSTD_outBuffer out;
+    size_t r;
+
+    do {
+        out.dst = out_buf;
+        out.size = sizeof(out_buf);
+        out.pos = 0;
+
+        r = ZSTD_compressStream2(sink->data, &out, in, mode);
+
+        if (ZSTD_isError(r)) return 1;
+
+        if (out.pos && sink->next->write(sink->next, out_buf, out.pos)) return 1;
+    } while (mode == ZSTD_e_end ? r != 0 : in->pos < in->size);
+
+    return 0;
+}
+
+static int bcon_sink_zstd_write(bcon_sink_t * sink, const bson_uint8_t * data, size_t len)
+{
+    ZSTD_inBuffer in = { data, len, 0 };
+
+    return bcon_sink_zstd_drain(sink, &in, ZSTD_e_continue);
+}
+
+static int bcon_sink_zstd_finish(bcon_sink_t * sink)
+{
+    ZSTD_inBuffer in = { NULL, 0, 0 };
+
+    if (bcon_sink_zstd_drain(sink, &in, ZSTD_e_end)) return 1;
+
+    return bcon_sink_finish(sink->next);
+}
+
+static void bcon_sink_zstd_destroy(bcon_sink_t * sink)
+{
+    ZSTD_freeCCtx(sink->data);
+}
+
+char * bcon_sink_zstd_init(bcon_sink_t * sink, bcon_sink_t * next, int level)
+{
+    ZSTD_CCtx * cctx = ZSTD_createCCtx();
+
+    memset(sink, 0, sizeof(*sink));
+
+    if (! cctx) return strdup("ZSTD_createCCtx failed");
+
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+
+    sink->write = bcon_sink_zstd_write;
+    sink->finish = bcon_sink_zstd_finish;
+    sink->destroy = bcon_sink_zstd_destroy;
+    sink->data = cctx;
+    sink->next = next;
+
+    return NULL;
+}
+
+#else
+
+char * bcon_sink_zstd_init(bcon_sink_t * sink, bcon_sink_t * next, int level)
+{
+    memset(sink, 0, sizeof(*sink));
+
+    return strdup("zstd support not compiled in");
+}
+
+#endif
+
+int bcon_sink_finish(bcon_sink_t * sink)
+{
+    if (sink->finish) return sink->finish(sink);
+    if (sink->next) return bcon_sink_finish(sink->next);
+
+    return 0;
+}
+
+void bcon_sink_destroy(bcon_sink_t * sink)
+{
+    if (sink->destroy) sink->destroy(sink);
+
+    memset(sink, 0, sizeof(*sink));
+}
+
+/*
+ * Encodes in after the *pos bytes already buffered in buf, handing full
+ * chunks to the sink.  The tail stays buffered so small documents of a
+ * batch reach the sink together.
+ */
+static char * bcon_sink_encode(bcon_t * in, bcon_sink_t * sink, bson_uint8_t * buf, size_t * pos)
+{
+    bcon_encoder_t enc;
+    bcon_encoder_status_t status;
+    size_t n;
+
+    if (*pos == BCON_SINK_CHUNK) {
+        if (sink->write(sink, buf, *pos)) return strdup("sink write failed");
+        *pos = 0;
+    }
+
+    bcon_encoder_init(&enc, in);
+    status = bcon_encoder_feed(&enc, buf + *pos, BCON_SINK_CHUNK - *pos, &n);
+
+    while (1) {
+        if (status == BCON_ENCODER_ERROR) return bcon_dump(in);
+
+        *pos += n;
+
+        if (status == BCON_ENCODER_DONE) break;
+
+        if (sink->write(sink, buf, *pos)) return strdup("sink write failed");
+
+        *pos = 0;
+        status = bcon_encoder_feed(&enc, buf, BCON_SINK_CHUNK, &n);
+    }
+
+    return NULL;
+}
+
+char * bcon_encode_to_sink(bcon_t * in, bcon_sink_t * sink)
+{
+    return bcon_encode_batch_to_sink(&in, 1, sink);
+}
+
+char * bcon_encode_batch_to_sink(bcon_t ** in, size_t n, bcon_sink_t * sink)
+{
+    bson_uint8_t buf[BCON_SINK_CHUNK];
+    size_t pos = 0;
+    char * err;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        err = bcon_sink_encode(in[i], sink, buf, &pos);
+        if (err) return err;
+    }
+
+    if (pos && sink->write(sink, buf, pos)) return strdup("sink write failed");
+
+    return NULL;
+}
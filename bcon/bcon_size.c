@@ -0,0 +1,213 @@
+/*
+ * @file bcon_size.c
+ * @brief BCON (BSON C Object Notation) Encoded size profiling
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+#include "bcon_private.h"
+#include "inc/utstring.h"
+
+static void bcon_size_line(UT_string * s, int indent, const char * key, bson_uint32_t key_bytes, bson_uint32_t value_bytes)
+{
+    utstring_printf(s, "%-*s\"%s\" : %u (key %u, value %u)", indent + 2, "", key, key_bytes + value_bytes, key_bytes, value_bytes);
+}
+
+/* Containers also get the elements and levels of nesting below them. */
+static void bcon_size_container_line(UT_string * s, int indent, const char * key, bson_uint32_t key_bytes, bson_uint32_t value_bytes, bson_uint32_t elements, int depth)
+{
+    utstring_printf(s, "%-*s\"%s\" : %u (key %u, value %u, elements %u, depth %d)", indent + 2, "", key, key_bytes + value_bytes, key_bytes, value_bytes, elements, depth);
+}
+
+/*
+ * Sizes one document or array, rendering it into s when s isn't NULL.
+ * Nested documents are rendered into their own string first since their
+ * line needs the size before the children can be printed.  With count,
+ * in is the body of a BCON_IF() whose elements continue the enclosing
+ * document at index *count.  *deepest is raised to the deepest level
+ * reached.
+ */
+static int bcon_size__walk(bcon_t ** in, int is_array, int depth, bson_uint32_t * count, bcon_size_report_t * r, UT_string * s, int indent, bson_uint32_t * size, int * deepest)
+{
+    void * obj = NULL;
+    bcon_type_t type;
+    bson_uint32_t i = count ? *count : 0, key_bytes, value_bytes;
+    const char * key = NULL;
+    char i_str[16];
+    bcon_t * child;
+    bcon_t * at;
+    UT_string child_s;
+    bson_uint32_t elements;
+    int spliced, err, child_deepest;
+
+    if (! count) {
+        *size = 5;
+        r->overhead_bytes += 5;
+
+        if (depth > *deepest) *deepest = depth;
+
+        if (s) utstring_printf(s, "%s\n", is_array ? "[" : "{");
+    }
+
+    while (1) {
+        spliced = 0;
+
+        if (is_array) {
+            sprintf(i_str, "%u", i);
+            key = i_str;
+        } else {
+            at = *in;
+            type = bcon_token(in, &obj);
+
+            if (type == BCONT_END || type == BCONT_DOC_END) break;
+
+            if (type == BCONT_OMIT) {
+                if (bcon_skip_omitted(at, in)) return 1;
+                continue;
+            }
+
+            if (type == BCONT_BCON_IF) {
+                child = bcon_if_body(obj);
+                if (child && bcon_size__walk(&child, 0, depth, &i, r, s, indent, size, deepest)) return 1;
+                continue;
+            }
+
+            if (type == BCONT_UTF8) {
+                key = *((char **)obj);
+            } else if (type == BCONT_ITER_ELEMENT) {
+                key = bson_iter_key(*((bson_iter_t **)obj));
+                spliced = 1;
+            } else if (type == BCONT_BCON_RAW) {
+                bson_type_t raw_type;
+                const bson_uint8_t * data;
+                bson_uint32_t len;
+
+                if (bcon_raw_split(*((bcon_raw_t **)obj), &raw_type, &key, &data, &len)) return 1;
+                spliced = 1;
+            } else {
+                return 1;
+            }
+        }
+
+        if (! spliced) {
+            type = bcon_token(in, &obj);
+
+            if (type == BCONT_END || type == BCONT_ARRAY_END) {
+                if (! is_array) return 1;
+                break;
+            }
+
+            if (type == BCONT_DOC_END) break;
+
+            if (type == BCONT_OMIT) continue;
+
+            if (type == BCONT_BCON_IF) {
+                if (! is_array) return 1;
+                child = bcon_if_body(obj);
+                if (child && bcon_size__walk(&child, 1, depth, &i, r, s, indent, size, deepest)) return 1;
+                continue;
+            }
+        }
+
+        key_bytes = strlen(key) + 2;
+        value_bytes = 0;
+
+        if (s && i) utstring_printf(s, ",\n");
+
+        switch (type) {
+            case BCONT_DOC_START:
+            case BCONT_ARRAY_START:
+            case BCONT_BCON_DOCUMENT:
+            case BCONT_BCON_ARRAY: {
+                bcon_t ** child_in = in;
+
+                if (type == BCONT_BCON_DOCUMENT || type == BCONT_BCON_ARRAY) {
+                    child = *((bcon_t **)obj);
+                    child_in = &child;
+                }
+
+                if (s) utstring_init(&child_s);
+
+                elements = r->elements;
+                child_deepest = depth + 1;
+
+                err = bcon_size__walk(child_in, type == BCONT_ARRAY_START || type == BCONT_BCON_ARRAY, depth + 1, NULL, r, s ? &child_s : NULL, indent + 2, &value_bytes, &child_deepest);
+
+                if (child_deepest > *deepest) *deepest = child_deepest;
+
+                if (s) {
+                    if (! err) {
+                        bcon_size_container_line(s, indent, key, key_bytes, value_bytes, r->elements - elements, child_deepest - depth);
+                        utstring_printf(s, " %s", utstring_body(&child_s));
+                    }
+                    utstring_done(&child_s);
+                }
+
+                if (err) return 1;
+                break;
+            }
+            default:
+                if (bcon_value_size(obj, type, &value_bytes)) return 1;
+
+                r->value_bytes += value_bytes;
+
+                if (s) bcon_size_line(s, indent, key, key_bytes, value_bytes);
+                break;
+        }
+
+        r->key_bytes += key_bytes;
+        r->elements++;
+
+        *size += key_bytes + value_bytes;
+        i++;
+    }
+
+    if (count) {
+        *count = i;
+        return 0;
+    }
+
+    if (s) utstring_printf(s, "%s%-*s%s", i ? "\n" : "", indent, "", is_array ? "]" : "}");
+
+    return 0;
+}
+
+char * bcon_size_report(bcon_t * in, bcon_size_report_t * report, char ** tree)
+{
+    bcon_t * start = in;
+    UT_string s;
+
+    memset(report, 0, sizeof(*report));
+
+    if (tree) utstring_init(&s);
+
+    if (bcon_size__walk(&in, 0, 1, NULL, report, tree ? &s : NULL, 0, &report->total, &report->max_depth)) {
+        if (tree) utstring_done(&s);
+
+        return bcon_dump(start);
+    }
+
+    if (tree) {
+        utstring_printf(&s, "\n%u bytes (keys %u, values %u, overhead %u), %u elements, depth %d",
+            report->total, report->key_bytes, report->value_bytes, report->overhead_bytes,
+            report->elements, report->max_depth);
+
+        *tree = utstring_body(&s);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,257 @@
+/*
+ * @file bcon_struct.c
+ * @brief BCON (BSON C Object Notation) Struct mapped encoding
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+#include "bcon_private.h"
+
+static int bcon_struct__append(const bcon_struct_t * desc, const bson_uint8_t * record, bson_t * bson);
+static int bcon_struct_array_append(const bcon_struct_t * desc, const void * records, size_t n, bson_t * bson, const char * key);
+
+static int bcon_field_put_int32(bson_t * bson, const bcon_field_t * field, const void * val, const bson_uint8_t * record)
+{
+    bson_append_int32(bson, field->key, field->key_len, *((const bson_int32_t *)val));
+    return 0;
+}
+
+static int bcon_field_put_int64(bson_t * bson, const bcon_field_t * field, const void * val, const bson_uint8_t * record)
+{
+    bson_append_int64(bson, field->key, field->key_len, *((const bson_int64_t *)val));
+    return 0;
+}
+
+static int bcon_field_put_double(bson_t * bson, const bcon_field_t * field, const void * val, const bson_uint8_t * record)
+{
+    bson_append_double(bson, field->key, field->key_len, *((const double *)val));
+    return 0;
+}
+
+static int bcon_field_put_bool(bson_t * bson, const bcon_field_t * field, const void * val, const bson_uint8_t * record)
+{
+    bson_append_bool(bson, field->key, field->key_len, *((const bson_bool_t *)val));
+    return 0;
+}
+
+static int bcon_field_put_utf8(bson_t * bson, const bcon_field_t * field, const void * val, const bson_uint8_t * record)
+{
+    const char * str = *((char * const *)val);
+
+    if (str) {
+        bson_append_utf8(bson, field->key, field->key_len, str, -1);
+    } else {
+        bson_append_null(bson, field->key, field->key_len);
+    }
+
+    return 0;
+}
+
+static int bcon_field_put_struct(bson_t * bson, const bcon_field_t * field, const void * val, const bson_uint8_t * record)
+{
+    bson_t child;
+
+    bson_append_document_begin(bson, field->key, field->key_len, &child);
+    if (bcon_struct__append(field->nested, val, &child)) return 1;
+    bson_append_document_end(bson, &child);
+
+    return 0;
+}
+
+static int bcon_field_put_struct_array(bson_t * bson, const bcon_field_t * field, const void * val, const bson_uint8_t * record)
+{
+    const bson_uint8_t * records = *((const bson_uint8_t * const *)val);
+    size_t n = *((const size_t *)(record + field->count_offset));
+
+    return bcon_struct_array_append(field->nested, records, n, bson, field->key);
+}
+
+/*
+ * Everything the per-type functions above don't cover goes through the
+ * regular value appender, which reads the member the same way it reads a
+ * bcon_t slot.
+ */
+static int bcon_field_put_value(bson_t * bson, const bcon_field_t * field, const void * val, const bson_uint8_t * record)
+{
+    return bcon_to_bson_put_value(bson, field->key, (void *)val, field->base_type);
+}
+
+static char * bcon_struct_error(const char * key, const char * msg)
+{
+    char * err = malloc(strlen(key) + strlen(msg) + 9);
+
+    sprintf(err, "field %s %s", key, msg);
+
+    return err;
+}
+
+char * bcon_struct_init(bcon_struct_t * desc)
+{
+    bcon_field_t * field;
+    char * err;
+
+    if (desc->ready) return NULL;
+
+    /* set early so self-referencing descriptors terminate */
+    desc->ready = 1;
+
+    for (field = desc->fields; field->key; field++) {
+        field->key_len = strlen(field->key);
+        field->indirection = 0;
+        field->base_type = field->type;
+
+        if (field->type < BCONT_ARRAY_START) {
+            field->indirection = field->type % 3;
+            field->base_type = field->type - field->indirection;
+        }
+
+        switch (field->base_type) {
+            case BCONT_INT32:
+                field->put = bcon_field_put_int32;
+                break;
+            case BCONT_INT64:
+                field->put = bcon_field_put_int64;
+                break;
+            case BCONT_DOUBLE:
+                field->put = bcon_field_put_double;
+                break;
+            case BCONT_BOOL:
+                field->put = bcon_field_put_bool;
+                break;
+            case BCONT_UTF8:
+                field->put = bcon_field_put_utf8;
+                break;
+            case BCONT_DOC_START:
+            case BCONT_ARRAY_START:
+                if (! field->nested) {
+                    desc->ready = 0;
+                    return bcon_struct_error(field->key, "has no nested descriptor");
+                }
+
+                err = bcon_struct_init((bcon_struct_t *)field->nested);
+                if (err) {
+                    desc->ready = 0;
+                    return err;
+                }
+
+                field->put = field->base_type == BCONT_DOC_START ? bcon_field_put_struct : bcon_field_put_struct_array;
+                break;
+            case BCONT_ITER_ELEMENT:
+            case BCONT_BCON_IF:
+            case BCONT_ARRAY_END:
+            case BCONT_DOC_END:
+            case BCONT_END:
+            case BCONT_ERROR:
+                desc->ready = 0;
+                return bcon_struct_error(field->key, "has an unsupported type");
+            default:
+                field->put = bcon_field_put_value;
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+static int bcon_struct__append(const bcon_struct_t * desc, const bson_uint8_t * record, bson_t * bson)
+{
+    const bcon_field_t * field;
+    const void * val;
+    int i;
+
+    for (field = desc->fields; field->key; field++) {
+        val = record + field->offset;
+
+        for (i = 0; val && i < field->indirection; i++) val = *((void * const *)val);
+
+        if (! val) {
+            if (field->indirection == 2) continue;
+            return 1;
+        }
+
+        if (field->put(bson, field, val, record)) return 1;
+    }
+
+    return 0;
+}
+
+static int bcon_struct_array_append(const bcon_struct_t * desc, const void * records, size_t n, bson_t * bson, const char * key)
+{
+    const bson_uint8_t * record = records;
+    bson_t array, child;
+    char i_str[24];
+    size_t i;
+
+    bson_append_array_begin(bson, key, -1, &array);
+
+    for (i = 0; i < n; i++, record += desc->size) {
+        sprintf(i_str, "%zu", i);
+
+        bson_append_document_begin(&array, i_str, -1, &child);
+        if (bcon_struct__append(desc, record, &child)) return 1;
+        bson_append_document_end(&array, &child);
+    }
+
+    bson_append_array_end(bson, &array);
+
+    return 0;
+}
+
+char * bcon_struct_to_bson(bcon_struct_t * desc, const void * record, bson_t * bson)
+{
+    char * err = bcon_struct_init(desc);
+
+    if (err) return err;
+
+    if (bcon_struct__append(desc, record, bson)) return strdup("struct encoding failed");
+
+    return NULL;
+}
+
+char * bcon_struct_array_to_bson(bcon_struct_t * desc, const void * records, size_t n, bson_t * bson, const char * key)
+{
+    char * err = bcon_struct_init(desc);
+
+    if (err) return err;
+
+    if (bcon_struct_array_append(desc, records, n, bson, key)) return strdup("struct encoding failed");
+
+    return NULL;
+}
+
+char * bcon_struct_write(bcon_struct_t * desc, const void * records, size_t n, bson_writer_t * writer)
+{
+    const bson_uint8_t * record = records;
+    bson_t * bson;
+    char * err = bcon_struct_init(desc);
+    size_t i;
+
+    if (err) return err;
+
+    for (i = 0; i < n; i++, record += desc->size) {
+        if (! bson_writer_begin(writer, &bson)) return strdup("bson_writer_begin failed");
+
+        if (bcon_struct__append(desc, record, bson)) {
+            bson_writer_rollback(writer);
+            return strdup("struct encoding failed");
+        }
+
+        bson_writer_end(writer);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,556 @@
+/*
+ * @file bcon_template.c
+ * @brief BCON (BSON C Object Notation) Runtime text templates
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+
+#include "bcon.h"
+#include "inc/utstring.h"
+
+#define BCON_FORMAT_CACHE_SIZE 32
+
+typedef union bcon_template_arg {
+    char * utf8;
+    bson_int32_t int32;
+    bson_int64_t int64;
+    double dbl;
+    bson_bool_t b;
+    bson_t * bson;
+    bson_oid_t * oid;
+    struct timeval * tv;
+} bcon_template_arg_t;
+
+struct bcon_template {
+    bcon_t * tokens;
+    size_t n_tokens;
+    size_t cap;
+
+    char ** strings;
+    size_t n_strings;
+
+    bcon_template_arg_t args[BCON_TEMPLATE_MAX_ARGS];
+    bcon_type_t arg_types[BCON_TEMPLATE_MAX_ARGS];
+    int n_args;
+};
+
+typedef struct bcon_template_parser {
+    bcon_template_t * t;
+    const char * text;
+    const char * p;
+    int depth;
+    char * err;
+} bcon_template_parser_t;
+
+static const struct {
+    const char * name;
+    bcon_type_t type;
+} bcon_template_types[] = {
+    { "utf8", BCONT_UTF8 },
+    { "int32", BCONT_INT32 },
+    { "int64", BCONT_INT64 },
+    { "double", BCONT_DOUBLE },
+    { "bool", BCONT_BOOL },
+    { "doc", BCONT_BSON_DOCUMENT },
+    { "array", BCONT_BSON_ARRAY },
+    { "oid", BCONT_BSON_OID },
+    { "date", BCONT_DATE_TIME },
+    { NULL, BCONT_ERROR }
+};
+
+static int bcon_template_fail(bcon_template_parser_t * ps, const char * what)
+{
+    char buf[128];
+
+    if (! ps->err) {
+        snprintf(buf, sizeof(buf), "%s at offset %d", what, (int)(ps->p - ps->text));
+        ps->err = strdup(buf);
+    }
+
+    return 1;
+}
+
+static bcon_t * bcon_template_slots(bcon_template_t * t, size_t n)
+{
+    bcon_t * slots;
+
+    if (t->n_tokens + n > t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 32;
+        if (t->cap < t->n_tokens + n) t->cap = t->n_tokens + n;
+        t->tokens = realloc(t->tokens, t->cap * sizeof(*t->tokens));
+    }
+
+    slots = t->tokens + t->n_tokens;
+    t->n_tokens += n;
+
+    memset(slots, 0, n * sizeof(*slots));
+
+    return slots;
+}
+
+static void bcon_template_bare(bcon_template_t * t, char * s)
+{
+    bcon_template_slots(t, 1)->UTF8 = s;
+}
+
+/*
+ * Typed tokens are the three slot form the BCON_* macros expand to.
+ * Strings always use it, so a literal starting with a bracket isn't taken
+ * for structure.
+ */
+static bcon_t * bcon_template_typed(bcon_template_t * t, bcon_type_t type)
+{
+    bcon_t * slots = bcon_template_slots(t, 3);
+
+    slots[0].UTF8 = BCON_MAGIC;
+    slots[1].type = type;
+
+    return &slots[2];
+}
+
+static void bcon_template_string(bcon_template_t * t, char * s)
+{
+    t->strings = realloc(t->strings, (t->n_strings + 1) * sizeof(*t->strings));
+    t->strings[t->n_strings++] = s;
+
+    bcon_template_typed(t, BCONT_UTF8)->UTF8 = s;
+}
+
+static void bcon_template_ws(bcon_template_parser_t * ps)
+{
+    while (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n' || *ps->p == '\r') ps->p++;
+}
+
+static void bcon_template_utf8(UT_string * s, unsigned cp)
+{
+    char out[3];
+
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        utstring_bincpy(s, out, 1);
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xc0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        utstring_bincpy(s, out, 2);
+    } else {
+        out[0] = (char)(0xe0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        utstring_bincpy(s, out, 3);
+    }
+}
+
+static char * bcon_template_parse_string(bcon_template_parser_t * ps)
+{
+    UT_string s;
+    unsigned cp;
+    char * out;
+    int k;
+
+    ps->p++;
+
+    utstring_init(&s);
+
+    while (*ps->p != '"') {
+        if (*ps->p == '\0' || (unsigned char)*ps->p < 0x20) {
+            utstring_done(&s);
+            bcon_template_fail(ps, "unterminated string");
+            return NULL;
+        }
+
+        if (*ps->p != '\\') {
+            utstring_bincpy(&s, ps->p++, 1);
+            continue;
+        }
+
+        ps->p++;
+
+        switch (*ps->p) {
+            case '"':  utstring_bincpy(&s, "\"", 1); break;
+            case '\\': utstring_bincpy(&s, "\\", 1); break;
+            case '/':  utstring_bincpy(&s, "/", 1); break;
+            case 'b':  utstring_bincpy(&s, "\b", 1); break;
+            case 'f':  utstring_bincpy(&s, "\f", 1); break;
+            case 'n':  utstring_bincpy(&s, "\n", 1); break;
+            case 'r':  utstring_bincpy(&s, "\r", 1); break;
+            case 't':  utstring_bincpy(&s, "\t", 1); break;
+            case 'u':
+                for (cp = 0, k = 1; k <= 4; k++) {
+                    char c = ps->p[k];
+
+                    cp <<= 4;
+
+                    if (c >= '0' && c <= '9') {
+                        cp |= c - '0';
+                    } else if (c >= 'a' && c <= 'f') {
+                        cp |= c - 'a' + 10;
+                    } else if (c >= 'A' && c <= 'F') {
+                        cp |= c - 'A' + 10;
+                    } else {
+                        break;
+                    }
+                }
+
+                /* surrogate pairs aren't supported, nor is an embedded NUL */
+                if (k <= 4 || cp == 0 || (cp >= 0xd800 && cp <= 0xdfff)) {
+                    utstring_done(&s);
+                    bcon_template_fail(ps, "bad \\u escape");
+                    return NULL;
+                }
+
+                bcon_template_utf8(&s, cp);
+                ps->p += 4;
+                break;
+            default:
+                utstring_done(&s);
+                bcon_template_fail(ps, "bad escape");
+                return NULL;
+        }
+
+        ps->p++;
+    }
+
+    ps->p++;
+
+    out = strdup(utstring_body(&s));
+    utstring_done(&s);
+
+    return out;
+}
+
+static int bcon_template_parse_placeholder(bcon_template_parser_t * ps)
+{
+    bcon_template_t * t = ps->t;
+    bcon_t * slot;
+    bcon_type_t type = BCONT_ERROR;
+    size_t len;
+    long n;
+    char * end;
+    int i;
+
+    ps->p++;
+
+    n = strtol(ps->p, &end, 10);
+    if (end == ps->p || n < 1 || n > BCON_TEMPLATE_MAX_ARGS) return bcon_template_fail(ps, "bad placeholder number");
+
+    ps->p = end;
+
+    if (*ps->p != ':') return bcon_template_fail(ps, "expected ':' after placeholder");
+
+    ps->p++;
+
+    for (len = 0; (ps->p[len] >= 'a' && ps->p[len] <= 'z') || (ps->p[len] >= '0' && ps->p[len] <= '9'); len++);
+
+    for (i = 0; bcon_template_types[i].name; i++) {
+        if (strlen(bcon_template_types[i].name) == len && memcmp(bcon_template_types[i].name, ps->p, len) == 0) {
+            type = bcon_template_types[i].type;
+            break;
+        }
+    }
+
+    if (type == BCONT_ERROR) return bcon_template_fail(ps, "unknown placeholder type");
+
+    i = (int)n - 1;
+
+    if (t->arg_types[i] != BCONT_ERROR && t->arg_types[i] != type) return bcon_template_fail(ps, "placeholder reused with another type");
+
+    t->arg_types[i] = type;
+    if (i >= t->n_args) t->n_args = i + 1;
+
+    ps->p += len;
+
+    slot = bcon_template_typed(t, type + 1);
+
+    switch (type) {
+        case BCONT_UTF8:          slot->RUTF8 = &t->args[i].utf8; break;
+        case BCONT_INT32:         slot->RINT32 = &t->args[i].int32; break;
+        case BCONT_INT64:         slot->RINT64 = &t->args[i].int64; break;
+        case BCONT_DOUBLE:        slot->RDOUBLE = &t->args[i].dbl; break;
+        case BCONT_BOOL:          slot->RBOOL = &t->args[i].b; break;
+        case BCONT_BSON_DOCUMENT: slot->RBSON_DOCUMENT = &t->args[i].bson; break;
+        case BCONT_BSON_ARRAY:    slot->RBSON_ARRAY = &t->args[i].bson; break;
+        case BCONT_BSON_OID:      slot->RBSON_OID = &t->args[i].oid; break;
+        case BCONT_DATE_TIME:     slot->RDATE_TIME = &t->args[i].tv; break;
+        default:                  break;
+    }
+
+    return 0;
+}
+
+static int bcon_template_parse_number(bcon_template_parser_t * ps)
+{
+    const char * start = ps->p;
+    const char * q = ps->p;
+    long long ll;
+    double d;
+    char * end;
+
+    if (*q == '-') q++;
+    while (*q >= '0' && *q <= '9') q++;
+
+    if (*q == '.' || *q == 'e' || *q == 'E') {
+        d = strtod(start, &end);
+        if (end == start) return bcon_template_fail(ps, "bad number");
+
+        bcon_template_typed(ps->t, BCONT_DOUBLE)->DOUBLE = d;
+    } else {
+        errno = 0;
+        ll = strtoll(start, &end, 10);
+        if (end == start || errno) return bcon_template_fail(ps, "bad number");
+
+        if (ll >= INT32_MIN && ll <= INT32_MAX) {
+            bcon_template_typed(ps->t, BCONT_INT32)->INT32 = (bson_int32_t)ll;
+        } else {
+            bcon_template_typed(ps->t, BCONT_INT64)->INT64 = ll;
+        }
+    }
+
+    ps->p = end;
+
+    return 0;
+}
+
+static int bcon_template_keyword(bcon_template_parser_t * ps, const char * word)
+{
+    size_t len = strlen(word);
+
+    if (strncmp(ps->p, word, len) != 0) return 0;
+
+    ps->p += len;
+
+    return 1;
+}
+
+static int bcon_template_parse_container(bcon_template_parser_t * ps, int is_array);
+
+static int bcon_template_parse_value(bcon_template_parser_t * ps)
+{
+    char * s;
+
+    bcon_template_ws(ps);
+
+    switch (*ps->p) {
+        case '"':
+            if (! (s = bcon_template_parse_string(ps))) return 1;
+            bcon_template_string(ps->t, s);
+            return 0;
+        case '{':
+        case '[':
+            return bcon_template_parse_container(ps, *ps->p == '[');
+        case '$':
+            return bcon_template_parse_placeholder(ps);
+        default:
+            break;
+    }
+
+    if (*ps->p == '-' || (*ps->p >= '0' && *ps->p <= '9')) return bcon_template_parse_number(ps);
+
+    if (bcon_template_keyword(ps, "true")) {
+        bcon_template_typed(ps->t, BCONT_BOOL)->BOOL = 1;
+    } else if (bcon_template_keyword(ps, "false")) {
+        bcon_template_typed(ps->t, BCONT_BOOL)->BOOL = 0;
+    } else if (bcon_template_keyword(ps, "null")) {
+        bcon_template_typed(ps->t, BCONT_NULL);
+    } else {
+        return bcon_template_fail(ps, "unexpected character");
+    }
+
+    return 0;
+}
+
+/*
+ * Parses a document or array starting at its opening bracket.  The top
+ * level document's brackets aren't emitted, matching BCON( ... ).
+ */
+static int bcon_template_parse_container(bcon_template_parser_t * ps, int is_array)
+{
+    char close = is_array ? ']' : '}';
+    char * key;
+    int first = 1;
+
+    if (ps->depth == BCON_VISIT_MAX_DEPTH) return bcon_template_fail(ps, "nested too deeply");
+
+    if (ps->depth++) bcon_template_bare(ps->t, is_array ? "[" : "{");
+
+    ps->p++;
+
+    while (1) {
+        bcon_template_ws(ps);
+
+        if (*ps->p == close) break;
+
+        if (! first) {
+            if (*ps->p != ',') return bcon_template_fail(ps, "expected ','");
+            ps->p++;
+            bcon_template_ws(ps);
+        }
+
+        first = 0;
+
+        if (! is_array) {
+            if (*ps->p != '"') return bcon_template_fail(ps, "expected key");
+            if (! (key = bcon_template_parse_string(ps))) return 1;
+
+            bcon_template_string(ps->t, key);
+
+            bcon_template_ws(ps);
+            if (*ps->p != ':') return bcon_template_fail(ps, "expected ':'");
+            ps->p++;
+        }
+
+        if (bcon_template_parse_value(ps)) return 1;
+    }
+
+    ps->p++;
+
+    if (--ps->depth) bcon_template_bare(ps->t, is_array ? "]" : "}");
+
+    return 0;
+}
+
+void bcon_template_destroy(bcon_template_t * t)
+{
+    size_t i;
+
+    if (! t) return;
+
+    for (i = 0; i < t->n_strings; i++) free(t->strings[i]);
+
+    free(t->strings);
+    free(t->tokens);
+    free(t);
+}
+
+char * bcon_template_compile(const char * text, bcon_template_t ** out)
+{
+    bcon_template_parser_t ps;
+    bcon_template_t * t = calloc(1, sizeof(*t));
+    int i;
+
+    for (i = 0; i < BCON_TEMPLATE_MAX_ARGS; i++) t->arg_types[i] = BCONT_ERROR;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.t = t;
+    ps.text = text;
+    ps.p = text;
+
+    bcon_template_ws(&ps);
+
+    if (*ps.p != '{') {
+        bcon_template_fail(&ps, "expected '{'");
+    } else if (! bcon_template_parse_container(&ps, 0)) {
+        bcon_template_ws(&ps);
+        if (*ps.p) bcon_template_fail(&ps, "trailing characters");
+    }
+
+    for (i = 0; ! ps.err && i < t->n_args; i++) {
+        if (t->arg_types[i] == BCONT_ERROR) bcon_template_fail(&ps, "placeholders must be numbered from $1 without gaps");
+    }
+
+    if (ps.err) {
+        bcon_template_destroy(t);
+        return ps.err;
+    }
+
+    bcon_template_slots(t, 1);
+
+    *out = t;
+
+    return NULL;
+}
+
+bcon_t * bcon_template_vbind(bcon_template_t * t, va_list ap)
+{
+    int i;
+
+    for (i = 0; i < t->n_args; i++) {
+        switch (t->arg_types[i]) {
+            case BCONT_UTF8:          t->args[i].utf8 = va_arg(ap, char *); break;
+            case BCONT_INT32:         t->args[i].int32 = va_arg(ap, bson_int32_t); break;
+            case BCONT_INT64:         t->args[i].int64 = va_arg(ap, bson_int64_t); break;
+            case BCONT_DOUBLE:        t->args[i].dbl = va_arg(ap, double); break;
+            case BCONT_BOOL:          t->args[i].b = va_arg(ap, int); break;
+            case BCONT_BSON_DOCUMENT:
+            case BCONT_BSON_ARRAY:    t->args[i].bson = va_arg(ap, bson_t *); break;
+            case BCONT_BSON_OID:      t->args[i].oid = va_arg(ap, bson_oid_t *); break;
+            case BCONT_DATE_TIME:     t->args[i].tv = va_arg(ap, struct timeval *); break;
+            default:                  break;
+        }
+    }
+
+    return t->tokens;
+}
+
+bcon_t * bcon_template_bind(bcon_template_t * t, ...)
+{
+    bcon_t * r;
+    va_list ap;
+
+    va_start(ap, t);
+    r = bcon_template_vbind(t, ap);
+    va_end(ap);
+
+    return r;
+}
+
+/*
+ * Compiled formats are kept per thread, so binding arguments into a
+ * cached template never races with another thread using the same one.
+ */
+static __thread struct {
+    const char * fmt;
+    bcon_template_t * t;
+} bcon_format_cache[BCON_FORMAT_CACHE_SIZE];
+
+char * bcon_format(bson_t * bson, const char * fmt, ...)
+{
+    size_t slot = ((uintptr_t)fmt >> 3) % BCON_FORMAT_CACHE_SIZE;
+    bcon_template_t * t;
+    bcon_t * in;
+    va_list ap;
+    char * err;
+
+    if (bcon_format_cache[slot].fmt == fmt) {
+        t = bcon_format_cache[slot].t;
+    } else {
+        err = bcon_template_compile(fmt, &t);
+        if (err) return err;
+
+        bcon_template_destroy(bcon_format_cache[slot].t);
+        bcon_format_cache[slot].fmt = fmt;
+        bcon_format_cache[slot].t = t;
+    }
+
+    va_start(ap, fmt);
+    in = bcon_template_vbind(t, ap);
+    va_end(ap);
+
+    return bcon_to_bson(in, bson);
+}
+
+void bcon_format_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < BCON_FORMAT_CACHE_SIZE; i++) {
+        bcon_template_destroy(bcon_format_cache[i].t);
+        bcon_format_cache[i].fmt = NULL;
+        bcon_format_cache[i].t = NULL;
+    }
+}
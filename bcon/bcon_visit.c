@@ -0,0 +1,265 @@
+/*
+ * @file bcon_visit.c
+ * @brief BCON (BSON C Object Notation) Token stream visitor
+ */
+
+/*    Copyright 2009-2013 MongoDB Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "bcon.h"
+#include "bcon_private.h"
+#include "bcon_probes.h"
+
+static int bcon_visit_begin(bcon_visitor_t * v, int n, const char * key, int is_array)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (v[i].begin && v[i].begin(v[i].data, key, is_array)) return 1;
+    }
+
+    return 0;
+}
+
+static int bcon_visit_end(bcon_visitor_t * v, int n, int is_array)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (v[i].end && v[i].end(v[i].data, is_array)) return 1;
+    }
+
+    return 0;
+}
+
+static int bcon_visit_value(bcon_visitor_t * v, int n, const char * key, void * val, bcon_type_t type)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (v[i].value && v[i].value(v[i].data, key, val, type)) return 1;
+    }
+
+    return 0;
+}
+
+static int bcon_visit_container(bcon_t ** in, const char * key, int is_array, int depth, bcon_visitor_t * v, int n)
+{
+    if (depth >= BCON_VISIT_MAX_DEPTH) return 1;
+
+    if (bcon_visit_begin(v, n, key, is_array)) return 1;
+    if (bcon_visit__walk(in, is_array, depth + 1, NULL, v, n)) return 1;
+
+    return bcon_visit_end(v, n, is_array);
+}
+
+int bcon_visit__walk(bcon_t ** in, int is_array, int depth, bson_uint32_t * count, bcon_visitor_t * v, int n)
+{
+    void * obj = NULL;
+    bcon_type_t type;
+    bcon_t * child;
+    bcon_t * at;
+
+    bson_uint32_t i = count ? *count : 0;
+    char i_str[16];
+    const char * key;
+
+    while (1) {
+        if (is_array) {
+            sprintf(i_str, "%u", i);
+            key = i_str;
+        } else {
+            at = *in;
+            type = bcon_token(in, &obj);
+
+            if (type == BCONT_END || type == BCONT_DOC_END) break;
+
+            if (type == BCONT_OMIT) {
+                if (bcon_skip_omitted(at, in)) return 1;
+                continue;
+            }
+
+            if (type == BCONT_ITER_ELEMENT || type == BCONT_BCON_RAW) {
+                if (bcon_visit_value(v, n, NULL, obj, type)) return 1;
+                i++;
+                continue;
+            }
+
+            if (type == BCONT_BCON_IF) {
+                child = bcon_if_body(obj);
+                if (child && bcon_visit__walk(&child, 0, depth, &i, v, n)) return 1;
+                continue;
+            }
+
+            if (type != BCONT_UTF8) return 1;
+
+            key = *((char **)obj);
+        }
+
+        type = bcon_token(in, &obj);
+
+        if (type == BCONT_END || type == BCONT_ARRAY_END) {
+            if (! is_array) return 1;
+            break;
+        }
+
+        if (type == BCONT_DOC_END) break;
+
+        switch (type) {
+            case BCONT_OMIT:
+                continue;
+            case BCONT_BCON_IF:
+                if (! is_array) return 1;
+                child = bcon_if_body(obj);
+                if (child && bcon_visit__walk(&child, 1, depth, &i, v, n)) return 1;
+                continue;
+            case BCONT_DOC_START:
+            case BCONT_ARRAY_START:
+                if (bcon_visit_container(in, key, type == BCONT_ARRAY_START, depth, v, n)) return 1;
+                break;
+            case BCONT_BCON_DOCUMENT:
+            case BCONT_BCON_ARRAY:
+                child = *((bcon_t **)obj);
+                if (bcon_visit_container(&child, key, type == BCONT_BCON_ARRAY, depth, v, n)) return 1;
+                break;
+            case BCONT_ERROR:
+                return 1;
+            default:
+                if (bcon_visit_value(v, n, key, obj, type)) return 1;
+                break;
+        }
+
+        i++;
+    }
+
+    if (count) *count = i;
+
+    return 0;
+}
+
+int bcon_visit__doc(bcon_t ** in, int is_array, bcon_visitor_t * v, int n)
+{
+    if (bcon_visit_begin(v, n, NULL, is_array)) return 1;
+    if (bcon_visit__walk(in, is_array, 1, NULL, v, n)) return 1;
+
+    return bcon_visit_end(v, n, is_array);
+}
+
+char * bcon_visit(bcon_t * in, bcon_visitor_t * visitors, int n_visitors)
+{
+    bcon_t * start = in;
+
+    if (bcon_visit__doc(&in, 0, visitors, n_visitors)) {
+        BCON_PROBE2(error, __func__, start);
+        return bcon_dump(start);
+    }
+
+    return NULL;
+}
+
+typedef struct bcon_probe_shape_state {
+    int tokens;
+    int depth;
+    int max_depth;
+} bcon_probe_shape_state_t;
+
+static int bcon_probe_shape_begin(void * data, const char * key, int is_array)
+{
+    bcon_probe_shape_state_t * state = data;
+
+    state->tokens++;
+    if (++state->depth > state->max_depth) state->max_depth = state->depth;
+
+    return 0;
+}
+
+static int bcon_probe_shape_end(void * data, int is_array)
+{
+    bcon_probe_shape_state_t * state = data;
+
+    state->depth--;
+
+    return 0;
+}
+
+static int bcon_probe_shape_value(void * data, const char * key, void * val, bcon_type_t type)
+{
+    bcon_probe_shape_state_t * state = data;
+
+    state->tokens++;
+
+    return 0;
+}
+
+void bcon_probe_shape(bcon_t * in, int * tokens, int * depth)
+{
+    bcon_probe_shape_state_t state;
+    bcon_visitor_t v;
+
+    memset(&state, 0, sizeof(state));
+
+    v.begin = bcon_probe_shape_begin;
+    v.end = bcon_probe_shape_end;
+    v.value = bcon_probe_shape_value;
+    v.data = &state;
+
+    bcon_visit__doc(&in, 0, &v, 1);
+
+    *tokens = state.tokens;
+    *depth = state.max_depth;
+}
+
+static int bcon_size_visit_begin(void * data, const char * key, int is_array)
+{
+    bson_uint32_t * size = data;
+
+    if (key) *size += strlen(key) + 2;
+
+    *size += 5;
+
+    return 0;
+}
+
+static int bcon_size_visit_value(void * data, const char * key, void * val, bcon_type_t type)
+{
+    bson_uint32_t * size = data;
+
+    if (! key) {
+        if (type == BCONT_ITER_ELEMENT) {
+            key = bson_iter_key(*((bson_iter_t **)val));
+        } else {
+            bson_type_t raw_type;
+            const bson_uint8_t * raw_value;
+            bson_uint32_t raw_len;
+
+            if (bcon_raw_split(*((bcon_raw_t **)val), &raw_type, &key, &raw_value, &raw_len)) return 1;
+        }
+    }
+
+    *size += strlen(key) + 2;
+
+    return bcon_value_size(val, type, size);
+}
+
+void bcon_size_visitor_init(bcon_visitor_t * v, bson_uint32_t * size)
+{
+    memset(v, 0, sizeof(*v));
+
+    *size = 0;
+
+    v->begin = bcon_size_visit_begin;
+    v->value = bcon_size_visit_value;
+    v->data = size;
+}
@@ -51,7 +51,7 @@ while (my $row = <$rows>) {
         print $bcon_indirection join("\n",
             "case BCONT_$name: *out = (void *)(&(in->$name)); break;",
             "case BCONT_R$name: *out = (void *)(in->R$name); type = BCONT_$name; break;",
-            "case BCONT_P$name: *out = (void *)(*(in->P$name)); type = BCONT_$name; break;"
+            "case BCONT_P$name: *out = (void *)(*(in->P$name)); type = *out ? BCONT_$name : BCONT_OMIT; break;"
         ), "\n";
     } else {
         print $bcon_indirection "case BCONT_$name: break;\n";
@@ -20,9 +20,14 @@
 
 #include "bcon-test.h"
 
-void bcon_eq_bson(bcon_t * bcon, bson_t * expected)
+/*
+ * Checks that bcon encodes to exactly the len bytes at data, however
+ * those were produced.
+ */
+void bcon_eq_data(bcon_t * bcon, const bson_uint8_t * data, bson_uint32_t len)
 {
     char * bson_json, * expected_json, * err_str;
+    bson_t expected;
     int unequal;
 
     bson_t * bson = bson_new();
@@ -31,12 +36,13 @@ void bcon_eq_bson(bcon_t * bcon, bson_t * expected)
     ck_assert_msg(err_str == NULL, "Error in bcon_to_bson: (%s)", err_str);
     if (err_str) free(err_str);
 
-    unequal = (expected->len != bson->len);
-    if (! unequal) unequal = memcmp(bson_get_data(expected), bson_get_data(bson), expected->len);
+    unequal = (len != bson->len);
+    if (! unequal) unequal = memcmp(data, bson_get_data(bson), len);
 
     if (unequal) {
+        bson_init_static(&expected, data, len);
         bson_json = bson_as_json(bson, NULL);
-        expected_json = bson_as_json(expected, NULL);
+        expected_json = bson_as_json(&expected, NULL);
     }
     ck_assert_msg(! unequal, "bson objects unequal: (%s) != (%s)", bson_json, expected_json);
     if (unequal) {
@@ -45,6 +51,12 @@ void bcon_eq_bson(bcon_t * bcon, bson_t * expected)
     }
 
     bson_destroy(bson);
+}
+
+void bcon_eq_bson(bcon_t * bcon, bson_t * expected)
+{
+    bcon_eq_data(bcon, bson_get_data(expected), expected->len);
+
     bson_destroy(expected);
 }
 
@@ -4,7 +4,16 @@
 #include <check.h>
 #include "bcon.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void bcon_eq_bson(bcon_t * bcon, bson_t * expected);
+void bcon_eq_data(bcon_t * bcon, const bson_uint8_t * data, bson_uint32_t len);
 extern void add_tests(Suite * s);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
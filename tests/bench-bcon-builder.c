@@ -0,0 +1,132 @@
+/*
+ * Times bcon_builder_t: the appends alone, per key/value call, and the
+ * same document built with the builder and with BCON() and encoded
+ * through bcon_to_bson().
+ *
+ *     ./bench-bcon-builder [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bcon.h"
+
+/* builder calls per document, begin and end markers included */
+#define BENCH_CALLS 13
+
+static const char * user = "alice";
+static bson_int32_t hits = 42;
+static double score = 0.75;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void append_tokens(bcon_builder_t * b)
+{
+    bcon_builder_reset(b);
+
+    bcon_builder_utf8(b, "user", user);
+    bcon_builder_int32(b, "hits", hits);
+    bcon_builder_double(b, "score", score);
+    bcon_builder_bool(b, "active", 1);
+    bcon_builder_begin_doc(b, "state");
+    bcon_builder_utf8(b, "region", "eu-west");
+    bcon_builder_begin_array(b, "tags");
+    bcon_builder_utf8(b, NULL, "a");
+    bcon_builder_utf8(b, NULL, "b");
+    bcon_builder_utf8(b, NULL, "c");
+    bcon_builder_end_array(b);
+    bcon_builder_end_doc(b);
+    bcon_builder_int32(b, "version", 3);
+}
+
+static void run_appends(bcon_builder_t * b, long n)
+{
+    double start, secs;
+    long i;
+
+    start = now_sec();
+
+    for (i = 0; i < n; i++) {
+        append_tokens(b);
+    }
+
+    secs = now_sec() - start;
+
+    /* keep the last stream from being optimized away */
+    if (! bcon_builder_tokens(b)) abort();
+
+    printf("%-8s %10.1f ns/call\n", "append", secs * 1e9 / ((double)n * BENCH_CALLS));
+}
+
+static void run_builder(bcon_builder_t * b, long n)
+{
+    bson_t bson;
+    double start, secs;
+    long i;
+
+    start = now_sec();
+
+    for (i = 0; i < n; i++) {
+        bson_init(&bson);
+        append_tokens(b);
+        bcon_to_bson(bcon_builder_tokens(b), &bson);
+        bson_destroy(&bson);
+    }
+
+    secs = now_sec() - start;
+
+    printf("%-8s %10.1f ns/doc\n", "builder", secs * 1e9 / n);
+}
+
+static void run_literal(long n)
+{
+    bson_t bson;
+    double start, secs;
+    long i;
+
+    start = now_sec();
+
+    for (i = 0; i < n; i++) {
+        bson_init(&bson);
+        bcon_to_bson(BCON(
+            "user", BCON_RUTF8((char **)&user),
+            "hits", BCON_RINT32(&hits),
+            "score", BCON_RDOUBLE(&score),
+            "active", BCON_BOOL(1),
+            "state", "{",
+                "region", "eu-west",
+                "tags", "[", "a", "b", "c", "]",
+            "}",
+            "version", BCON_INT32(3)
+        ), &bson);
+        bson_destroy(&bson);
+    }
+
+    secs = now_sec() - start;
+
+    printf("%-8s %10.1f ns/doc\n", "literal", secs * 1e9 / n);
+}
+
+int main(int argc, char ** argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+    bcon_builder_t b;
+
+    bcon_builder_init(&b);
+
+    run_appends(&b, n);
+    run_builder(&b, n);
+    run_literal(n);
+
+    bcon_builder_destroy(&b);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Times the same document built through bcon_to_bson(), through
+ * BCON_INLINE_TO_BSON() and with hand written bson_append_*() calls, and
+ * encoded into a bcon_ctx_t with and without a hot site plan.
+ *
+ *     ./bench-bcon-inline [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bcon.h"
+#include "bcon_inline.h"
+
+static const char * user = "alice";
+static bson_int32_t hits = 42;
+static double score = 0.75;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_TOKENS \
+    "user", BCON_RUTF8((char **)&user), \
+    "hits", BCON_RINT32(&hits), \
+    "score", BCON_RDOUBLE(&score), \
+    "active", BCON_BOOL(1), \
+    "state", "{", \
+        "region", "eu-west", \
+        "tags", "[", "a", "b", "c", "]", \
+    "}", \
+    "version", BCON_INT32(3)
+
+static void build_library(bson_t * bson)
+{
+    bcon_to_bson(BCON( BENCH_TOKENS ), bson);
+}
+
+static void build_inline(bson_t * bson)
+{
+    BCON_INLINE_TO_BSON(bson, BENCH_TOKENS);
+}
+
+static void build_manual(bson_t * bson)
+{
+    bson_t state, tags;
+
+    bson_append_utf8(bson, "user", 4, user, -1);
+    bson_append_int32(bson, "hits", 4, hits);
+    bson_append_double(bson, "score", 5, score);
+    bson_append_bool(bson, "active", 6, 1);
+    bson_append_document_begin(bson, "state", 5, &state);
+    bson_append_utf8(&state, "region", 6, "eu-west", -1);
+    bson_append_array_begin(&state, "tags", 4, &tags);
+    bson_append_utf8(&tags, "0", 1, "a", -1);
+    bson_append_utf8(&tags, "1", 1, "b", -1);
+    bson_append_utf8(&tags, "2", 1, "c", -1);
+    bson_append_array_end(&state, &tags);
+    bson_append_document_end(bson, &state);
+    bson_append_int32(bson, "version", 7, 3);
+}
+
+static void run(const char * name, void (*build)(bson_t *), long n)
+{
+    bson_t bson;
+    double start, secs;
+    long i;
+
+    start = now_sec();
+
+    for (i = 0; i < n; i++) {
+        bson_init(&bson);
+        build(&bson);
+        bson_destroy(&bson);
+    }
+
+    secs = now_sec() - start;
+
+    printf("%-8s %10.1f ns/doc\n", name, secs * 1e9 / n);
+}
+
+static void run_ctx(const char * name, int hot_site, long n)
+{
+    bcon_hot_t hot = BCON_HOT_INIT;
+    bcon_ctx_t ctx;
+    double start, secs;
+    long i;
+
+    bcon_ctx_init(&ctx);
+
+    start = now_sec();
+
+    for (i = 0; i < n; i++) {
+        if (hot_site) {
+            bcon_ctx_to_bson_hot(&ctx, &hot, BCON( BENCH_TOKENS ));
+        } else {
+            bcon_ctx_to_bson(&ctx, BCON( BENCH_TOKENS ));
+        }
+    }
+
+    secs = now_sec() - start;
+
+    printf("%-8s %10.1f ns/doc\n", name, secs * 1e9 / n);
+
+    bcon_hot_destroy(&hot);
+    bcon_ctx_destroy(&ctx);
+}
+
+int main(int argc, char ** argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+    run("library", build_library, n);
+    run("inline", build_inline, n);
+    run("manual", build_manual, n);
+    run_ctx("ctx", 0, n);
+    run_ctx("hot", 1, n);
+
+    return 0;
+}
@@ -403,6 +403,139 @@ START_TEST(test_inline_nested)
 }
 END_TEST
 
+START_TEST(test_iter)
+{
+    bson_t * src = bson_new();
+    bson_iter_t iter;
+    bson_append_utf8(src, "a", -1, "hello", -1);
+    bson_append_int32(src, "b", -1, 5);
+
+    bson_t * bson = bson_new();
+    bson_append_utf8(bson, "foo", -1, "hello", -1);
+    bson_append_utf8(bson, "a", -1, "hello", -1);
+
+    bson_t child;
+    bson_append_array_begin(bson, "bar", -1, &child);
+    bson_append_int32(&child, "0", -1, 5);
+    bson_append_array_end(bson, &child);
+
+    bson_iter_init_find(&iter, src, "a");
+
+    bson_iter_t iter_b;
+    bson_iter_init_find(&iter_b, src, "b");
+
+    bcon_t * bcon = BCON(
+        "foo", BCON_ITER(&iter),
+        BCON_ITER_ELEMENT(&iter),
+        "bar", BCON_ARRAY( BCON_ITER_ELEMENT(&iter_b) ),
+    );
+
+    bcon_eq_bson(bcon, bson);
+
+    bson_destroy(src);
+}
+END_TEST
+
+START_TEST(test_raw)
+{
+    bson_t * src = bson_new();
+    bson_t * sub = bson_new();
+    bson_append_utf8(sub, "x", -1, "y", -1);
+    bson_append_document(src, "doc", -1, sub);
+
+    bson_t * bson = bson_new();
+    bson_append_document(bson, "doc", -1, sub);
+    bson_append_document(bson, "foo", -1, sub);
+
+    /* skip the 4 byte length and the trailing nul */
+    const bson_uint8_t * elem = bson_get_data(src) + 4;
+    bson_uint32_t elem_len = src->len - 5;
+
+    bcon_t * bcon = BCON(
+        BCON_RAW(elem, elem_len),
+        "foo", BCON_RAW(elem, elem_len),
+    );
+
+    bcon_eq_bson(bcon, bson);
+
+    bson_destroy(src);
+    bson_destroy(sub);
+}
+END_TEST
+
+START_TEST(test_nesting_limit)
+{
+    bcon_t bcon[3 * BCON_VISIT_MAX_DEPTH + 1];
+    bson_t * bson;
+    char * err_str;
+    int levels, i, n;
+
+    /* documents nested below the top level one */
+    for (levels = BCON_VISIT_MAX_DEPTH - 1; levels <= BCON_VISIT_MAX_DEPTH; levels++) {
+        n = 0;
+
+        for (i = 0; i < levels; i++) {
+            bcon[n++].UTF8 = "a";
+            bcon[n++].UTF8 = "{";
+        }
+        for (i = 0; i < levels; i++) bcon[n++].UTF8 = "}";
+        bcon[n].UTF8 = NULL;
+
+        bson = bson_new();
+        err_str = bcon_to_bson(bcon, bson);
+
+        if (levels < BCON_VISIT_MAX_DEPTH) {
+            ck_assert(err_str == NULL);
+        } else {
+            ck_assert(err_str != NULL);
+            free(err_str);
+        }
+
+        bson_destroy(bson);
+    }
+}
+END_TEST
+
+START_TEST(test_raw_rejects_extra_bytes)
+{
+    bson_t * src = bson_new();
+    bson_append_int32(src, "a", -1, 1);
+    bson_append_utf8(src, "b", -1, "two", -1);
+    bson_append_null(src, "c", -1);
+
+    const bson_uint8_t * elem = bson_get_data(src) + 4;
+    bson_uint32_t first_len = 1 + 2 + 4;
+    bson_uint32_t size;
+    bson_t * bson;
+    char * err_str;
+
+    /* both elements, one element with a byte missing, or a trailing byte */
+    bson_uint32_t lens[] = { src->len - 5, first_len + 1 + 2 + 8, first_len - 1, first_len + 1 };
+    int i;
+
+    for (i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); i++) {
+        bson = bson_new();
+
+        err_str = bcon_to_bson(BCON( BCON_RAW(elem, lens[i]) ), bson);
+        ck_assert_msg(err_str != NULL, "raw of %u bytes accepted", lens[i]);
+        free(err_str);
+
+        err_str = bcon_encoded_size(BCON( "k", BCON_RAW(elem, lens[i]) ), &size);
+        ck_assert(err_str != NULL);
+        free(err_str);
+
+        bson_destroy(bson);
+    }
+
+    bson = bson_new();
+    ck_assert(bcon_to_bson(BCON( BCON_RAW(elem, first_len) ), bson) == NULL);
+    ck_assert_int_eq(bson->len, 5 + first_len);
+    bson_destroy(bson);
+
+    bson_destroy(src);
+}
+END_TEST
+
 void add_tests(Suite * s)
 {
     TCase * core = tcase_create("Basic");
@@ -431,6 +564,10 @@ void add_tests(Suite * s)
     tcase_add_test(core, test_inline_array);
     tcase_add_test(core, test_inline_doc);
     tcase_add_test(core, test_inline_nested);
+    tcase_add_test(core, test_iter);
+    tcase_add_test(core, test_raw);
+    tcase_add_test(core, test_raw_rejects_extra_bytes);
+    tcase_add_test(core, test_nesting_limit);
     suite_add_tcase(s, core);
 
     return;
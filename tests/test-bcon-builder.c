@@ -0,0 +1,176 @@
+#include "bcon-test.h"
+
+static void check_same(bcon_t * built, bcon_t * expected)
+{
+    bson_t * bson = bson_new();
+
+    ck_assert(built != NULL);
+    ck_assert(bcon_to_bson(built, bson) == NULL);
+
+    bcon_eq_data(expected, bson_get_data(bson), bson->len);
+
+    bson_destroy(bson);
+}
+
+START_TEST(test_builder_types)
+{
+    bcon_builder_t b;
+    bson_t * sub = bson_new();
+    bson_oid_t oid;
+    struct timeval tv = { 1234, 567000 };
+    bson_int32_t n = 5;
+    bcon_t bound;
+
+    bson_append_utf8(sub, "k", -1, "v", -1);
+    bson_oid_init(&oid, NULL);
+
+    bcon_builder_init(&b);
+
+    bcon_builder_utf8(&b, "s", "str");
+    bcon_builder_utf8_len(&b, "slice", "sliced", 3);
+    bcon_builder_int32(&b, "i", 1);
+    bcon_builder_int64(&b, "l", 1LL << 40);
+    bcon_builder_double(&b, "d", 2.5);
+    bcon_builder_bool(&b, "t", 1);
+    bcon_builder_null(&b, "n");
+    bcon_builder_oid(&b, "o", &oid);
+    bcon_builder_date_time(&b, "when", 1234567);
+    bcon_builder_bson(&b, "sub", sub, 0);
+    bcon_builder_regex(&b, "re", "^a", "i");
+    bcon_builder_binary(&b, "bin", BSON_SUBTYPE_BINARY, (const bson_uint8_t *)"deadbeef", 8);
+
+    bound.RINT32 = &n;
+    bcon_builder_value(&b, "bound", BCONT_RINT32, bound);
+
+    n = 6;
+
+    check_same(bcon_builder_tokens(&b), BCON(
+        "s", "str",
+        "slice", BCON_UTF8_LEN("sliced", 3),
+        "i", BCON_INT32(1),
+        "l", BCON_INT64(1LL << 40),
+        "d", BCON_DOUBLE(2.5),
+        "t", BCON_BOOL(1),
+        "n", BCON_NULL,
+        "o", BCON_BSON_OID(&oid),
+        "when", BCON_DATE_TIME(&tv),
+        "sub", BCON_BSON_DOCUMENT(sub),
+        "re", BCON_REGEX("^a", "i"),
+        "bin", BCON_BINARY(BSON_SUBTYPE_BINARY, "deadbeef", 8),
+        "bound", BCON_INT32(6)
+    ));
+
+    bcon_builder_destroy(&b);
+    bson_destroy(sub);
+}
+END_TEST
+
+START_TEST(test_builder_nesting)
+{
+    bcon_builder_t b;
+
+    bcon_builder_init(&b);
+
+    bcon_builder_begin_doc(&b, "a");
+    bcon_builder_begin_array(&b, "b");
+    bcon_builder_int32(&b, "ignored", 1);
+    bcon_builder_utf8(&b, NULL, "[not structure]");
+    bcon_builder_begin_doc(&b, NULL);
+    bcon_builder_utf8(&b, "{key", "v");
+    bcon_builder_end_doc(&b);
+    bcon_builder_end_array(&b);
+    bcon_builder_end_doc(&b);
+    bcon_builder_begin_array(&b, "empty");
+    bcon_builder_end_array(&b);
+
+    check_same(bcon_builder_tokens(&b), BCON(
+        "a", "{",
+            "b", "[", BCON_INT32(1), BCON_UTF8("[not structure]"), "{", BCON_UTF8("{key"), "v", "}", "]",
+        "}",
+        "empty", "[", "]"
+    ));
+
+    bcon_builder_destroy(&b);
+}
+END_TEST
+
+START_TEST(test_builder_growth)
+{
+    bcon_builder_t b;
+    bson_t * expected;
+    bson_t * built;
+    const char * keys[3];
+    char key[16];
+    int i, round;
+
+    bcon_builder_init(&b);
+
+    for (round = 0; round < 3; round++) {
+        bcon_builder_reset(&b);
+        expected = bson_new();
+        built = bson_new();
+
+        for (i = 0; i < 2000; i++) {
+            sprintf(key, "k%d", i);
+            bcon_builder_date_time(&b, bcon_builder_strdup(&b, key), i);
+            bson_append_date_time(expected, key, -1, i);
+        }
+
+        ck_assert(bcon_to_bson(bcon_builder_tokens(&b), built) == NULL);
+        ck_assert_int_eq(built->len, expected->len);
+        ck_assert(memcmp(bson_get_data(built), bson_get_data(expected), built->len) == 0);
+
+        keys[round] = b.tokens[0].UTF8;
+
+        bson_destroy(expected);
+        bson_destroy(built);
+    }
+
+    /* reset reuses the arena from the start */
+    ck_assert(keys[0] == keys[1] && keys[1] == keys[2]);
+
+    bcon_builder_destroy(&b);
+}
+END_TEST
+
+START_TEST(test_builder_unbalanced)
+{
+    bcon_builder_t b;
+
+    bcon_builder_init(&b);
+
+    bcon_builder_begin_doc(&b, "open");
+    ck_assert(bcon_builder_tokens(&b) == NULL);
+
+    bcon_builder_reset(&b);
+    bcon_builder_end_doc(&b);
+    ck_assert(bcon_builder_tokens(&b) == NULL);
+
+    bcon_builder_reset(&b);
+    bcon_builder_begin_array(&b, "a");
+    bcon_builder_end_doc(&b);
+    ck_assert(bcon_builder_tokens(&b) == NULL);
+
+    bcon_builder_reset(&b);
+    bcon_builder_int32(&b, NULL, 1);
+    ck_assert(bcon_builder_tokens(&b) == NULL);
+
+    bcon_builder_reset(&b);
+    bcon_builder_int32(&b, "ok", 1);
+    check_same(bcon_builder_tokens(&b), BCON( "ok", BCON_INT32(1) ));
+
+    bcon_builder_destroy(&b);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Builder");
+    tcase_add_test(core, test_builder_types);
+    tcase_add_test(core, test_builder_nesting);
+    tcase_add_test(core, test_builder_growth);
+    tcase_add_test(core, test_builder_unbalanced);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,92 @@
+#include "bcon-test.h"
+
+static int count_to(bcon_append_ctx_t * ctx, void * data)
+{
+    bson_int32_t i, n = *(bson_int32_t *)data;
+
+    for (i = 0; i < n; i++) {
+        bson_append_int32(ctx->bson, bcon_append_key(ctx, NULL), -1, i);
+    }
+
+    return bcon_append(ctx, BCON( BCON_DOC( "n", BCON_INT32(n) ), "end" )) != NULL;
+}
+
+static int fields(bcon_append_ctx_t * ctx, void * data)
+{
+    (void)data;
+
+    bson_append_utf8(ctx->bson, bcon_append_key(ctx, "a"), -1, "b", -1);
+
+    return bcon_append(ctx, BCON( "c", BCON_ARRAY( "d" ) )) != NULL;
+}
+
+static int fail(bcon_append_ctx_t * ctx, void * data)
+{
+    (void)ctx;
+    (void)data;
+
+    return 1;
+}
+
+START_TEST(test_callback_array)
+{
+    bson_int32_t n = 3;
+    bson_t * bson = bson_new();
+    bson_t child, grandchild;
+    bson_append_array_begin(bson, "foo", -1, &child);
+    bson_append_int32(&child, "0", -1, 0);
+    bson_append_int32(&child, "1", -1, 1);
+    bson_append_int32(&child, "2", -1, 2);
+    bson_append_document_begin(&child, "3", -1, &grandchild);
+    bson_append_int32(&grandchild, "n", -1, 3);
+    bson_append_document_end(&child, &grandchild);
+    bson_append_utf8(&child, "4", -1, "end", -1);
+    bson_append_array_end(bson, &child);
+    bson_append_null(bson, "bar", -1);
+
+    bcon_eq_bson(BCON(
+        "foo", BCON_CALLBACK_ARRAY(count_to, &n),
+        "bar", BCON_NULL,
+    ), bson);
+}
+END_TEST
+
+START_TEST(test_callback_doc)
+{
+    bson_t * bson = bson_new();
+    bson_t child, grandchild;
+    bson_append_document_begin(bson, "foo", -1, &child);
+    bson_append_utf8(&child, "a", -1, "b", -1);
+    bson_append_array_begin(&child, "c", -1, &grandchild);
+    bson_append_utf8(&grandchild, "0", -1, "d", -1);
+    bson_append_array_end(&child, &grandchild);
+    bson_append_document_end(bson, &child);
+
+    bcon_eq_bson(BCON(
+        "foo", BCON_CALLBACK_DOC(fields, NULL),
+    ), bson);
+}
+END_TEST
+
+START_TEST(test_callback_fail)
+{
+    bson_t * bson = bson_new();
+    char * err_str = bcon_to_bson(BCON( "foo", BCON_CALLBACK_DOC(fail, NULL) ), bson);
+
+    ck_assert(err_str != NULL);
+
+    free(err_str);
+    bson_destroy(bson);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Callback");
+    tcase_add_test(core, test_callback_array);
+    tcase_add_test(core, test_callback_doc);
+    tcase_add_test(core, test_callback_fail);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,210 @@
+#include "bcon-test.h"
+
+/*
+ * Finds path in doc the slow way.  Keys point into the document, so the
+ * element starts one byte before its key and ends where the next one's
+ * type byte is.
+ */
+static void find_path(const bson_uint8_t * data, bson_uint32_t len, const char * path, bson_uint64_t * offset, bson_uint32_t * length, bson_type_t * type)
+{
+    const bson_uint8_t * base = data;
+    const char * dot;
+    const char * key;
+    char part[64];
+    bson_iter_t iter;
+    bson_t doc;
+
+    *type = BSON_TYPE_EOD;
+
+    while (1) {
+        dot = strchr(path, '.');
+        snprintf(part, sizeof(part), "%.*s", dot ? (int)(dot - path) : (int)strlen(path), path);
+
+        ck_assert(bson_init_static(&doc, data, len));
+        if (! bson_iter_init_find(&iter, &doc, part)) return;
+
+        key = bson_iter_key(&iter);
+
+        if (dot) {
+            if (bson_iter_type(&iter) == BSON_TYPE_DOCUMENT) {
+                bson_iter_document(&iter, &len, &data);
+            } else if (bson_iter_type(&iter) == BSON_TYPE_ARRAY) {
+                bson_iter_array(&iter, &len, &data);
+            } else {
+                return;
+            }
+            path = dot + 1;
+            continue;
+        }
+
+        *offset = (bson_uint64_t)((const bson_uint8_t *)key - 1 - base);
+        *type = bson_iter_type(&iter);
+
+        if (bson_iter_next(&iter)) {
+            *length = (bson_uint32_t)((const bson_uint8_t *)bson_iter_key(&iter) - 1 - base - *offset);
+        } else {
+            *length = (bson_uint32_t)(data + len - 1 - base - *offset);
+        }
+        return;
+    }
+}
+
+static void check_captures(const bson_uint8_t * data, bson_uint32_t len, bcon_capture_t * caps, int n)
+{
+    bson_uint64_t offset;
+    bson_uint32_t length;
+    bson_type_t type;
+    int c;
+
+    for (c = 0; c < n; c++) {
+        find_path(data, len, caps[c].path, &offset, &length, &type);
+
+        ck_assert_int_eq(caps[c].type, type);
+        if (type == BSON_TYPE_EOD) continue;
+
+        ck_assert_int_eq(caps[c].offset, offset);
+        ck_assert_int_eq(caps[c].length, length);
+    }
+}
+
+static bson_bool_t yes = 1;
+static bson_int32_t * missing = NULL;
+
+#define TEMPLATE BCON( \
+        "name", "John Doe", \
+        "age", BCON_INT32(10), \
+        "loc", "{", \
+            "region", "eu-west", \
+            "zone", BCON_INT64(4), \
+        "}", \
+        "tags", BCON_ARRAY( "a", "b", BCON_DOC( "deep", BCON_DOUBLE(1.5) ) ), \
+        "gone", BCON_PINT32(&missing), \
+        BCON_IF(&yes, "spliced", BCON_INT32(7), "inner", "{", "x", "y", "}"), \
+        "scope", BCON_CODEWSCOPE("f()", "z", BCON_INT32(1)), \
+        "last", BCON_BOOL(1) \
+)
+
+#define N_CAPS 12
+
+static void init_caps(bcon_capture_t * caps)
+{
+    static const char * paths[N_CAPS] = {
+        "name", "loc.region", "loc", "tags.2.deep", "tags.1", "tags",
+        "spliced", "inner.x", "gone", "scope", "scope.z", "last",
+    };
+    int c;
+
+    memset(caps, 0, sizeof(*caps) * N_CAPS);
+
+    for (c = 0; c < N_CAPS; c++) {
+        caps[c].path = paths[c];
+    }
+}
+
+START_TEST(test_capture_offsets)
+{
+    bcon_capture_t caps[N_CAPS];
+    bcon_ctx_t ctx;
+    const bson_t * bson;
+
+    init_caps(caps);
+    bcon_ctx_init(&ctx);
+    ck_assert_int_eq(bcon_ctx_capture(&ctx, caps, N_CAPS), 0);
+
+    bson = bcon_ctx_to_bson(&ctx, TEMPLATE);
+    ck_assert(bson != NULL);
+
+    check_captures(bson_get_data(bson), bson->len, caps, N_CAPS);
+
+    ck_assert_int_eq(caps[2].type, BSON_TYPE_DOCUMENT);
+    ck_assert_int_eq(caps[6].type, BSON_TYPE_INT32);
+    ck_assert_int_eq(caps[8].type, BSON_TYPE_EOD);
+    ck_assert_int_eq(caps[9].type, BSON_TYPE_CODEWSCOPE);
+    ck_assert_int_eq(caps[10].type, BSON_TYPE_EOD);
+
+    bcon_ctx_destroy(&ctx);
+}
+END_TEST
+
+START_TEST(test_capture_chunks)
+{
+    bcon_capture_t caps[N_CAPS];
+    bcon_encoder_t enc;
+    bcon_encoder_status_t status;
+    bson_uint8_t buf[32];
+    bson_uint8_t out[1024];
+    size_t chunk, n, len;
+
+    for (chunk = 1; chunk <= sizeof(buf); chunk++) {
+        init_caps(caps);
+        len = 0;
+
+        bcon_encoder_init(&enc, TEMPLATE);
+        ck_assert_int_eq(bcon_encoder_capture(&enc, caps, N_CAPS), 0);
+
+        status = bcon_encoder_feed(&enc, buf, chunk, &n);
+        memcpy(out + len, buf, n);
+        len += n;
+
+        while (status == BCON_ENCODER_NEED_SPACE) {
+            status = bcon_encoder_resume(&enc, &n);
+            memcpy(out + len, buf, n);
+            len += n;
+        }
+
+        ck_assert_int_eq(status, BCON_ENCODER_DONE);
+        check_captures(out, len, caps, N_CAPS);
+    }
+}
+END_TEST
+
+static void shard(bcon_t * in, bcon_hash_t * out)
+{
+    bcon_capture_t caps[2] = { { "user" }, { "loc.region" } };
+    bcon_encoder_t enc;
+    bson_uint8_t buf[256];
+    size_t n;
+
+    bcon_encoder_init(&enc, in);
+    bcon_encoder_capture(&enc, caps, 2);
+    ck_assert_int_eq(bcon_encoder_feed(&enc, buf, sizeof(buf), &n), BCON_ENCODER_DONE);
+
+    bcon_capture_shard_hash(caps, 2, out);
+}
+
+START_TEST(test_capture_shard_hash)
+{
+    bcon_hash_t a, b, c, d;
+
+    shard(BCON( "user", "alice", "n", BCON_INT32(1), "loc", "{", "region", "eu", "}" ), &a);
+    shard(BCON( "loc", BCON_DOC( "x", BCON_NULL, "region", "eu" ), "user", "alice" ), &b);
+    shard(BCON( "user", "alice", "loc", "{", "region", "us", "}" ), &c);
+    shard(BCON( "user", "alice" ), &d);
+
+    ck_assert(a.lo == b.lo && a.hi == b.hi);
+    ck_assert(a.lo != c.lo || a.hi != c.hi);
+    ck_assert(a.lo != d.lo || a.hi != d.hi);
+}
+END_TEST
+
+START_TEST(test_capture_limit)
+{
+    bcon_capture_t caps[BCON_ENCODER_MAX_CAPTURES + 1];
+    bcon_encoder_t enc;
+
+    bcon_encoder_init(&enc, BCON( "a", "b" ));
+    ck_assert_int_eq(bcon_encoder_capture(&enc, caps, BCON_ENCODER_MAX_CAPTURES + 1), 1);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Capture");
+    tcase_add_test(core, test_capture_offsets);
+    tcase_add_test(core, test_capture_chunks);
+    tcase_add_test(core, test_capture_shard_hash);
+    tcase_add_test(core, test_capture_limit);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,140 @@
+#include "bcon-test.h"
+
+#define N_DOCS 10
+
+START_TEST(test_columns_data)
+{
+    bson_uint8_t * buf = NULL;
+    size_t buflen = 0;
+    bson_writer_t * writer = bson_writer_new(&buf, &buflen, 0, NULL, NULL);
+    bson_t * bson;
+    bcon_columns_t cols;
+    bson_int64_t ts[N_DOCS];
+    double vals[N_DOCS];
+    char * names[N_DOCS];
+    bson_uint8_t ts_valid[2], vals_valid[2], names_valid[2];
+    bson_uint8_t * validity[] = { ts_valid, vals_valid, names_valid };
+    int i;
+
+    for (i = 0; i < N_DOCS; i++) {
+        ck_assert(bson_writer_begin(writer, &bson));
+
+        if (i == 3) {
+            ck_assert(bcon_to_bson(BCON( "other", BCON_INT32(1) ), bson) == NULL);
+        } else if (i == 4) {
+            ck_assert(bcon_to_bson(BCON( "value", BCON_NULL, "ts", BCON_INT32(i), "name", "four" ), bson) == NULL);
+        } else if (i == 5) {
+            ck_assert(bcon_to_bson(BCON( "ts", "five", "value", BCON_DOUBLE(5.5) ), bson) == NULL);
+        } else {
+            ck_assert(bcon_to_bson(BCON( "name", "n", "ts", BCON_INT64(1000 + i), "value", BCON_DOUBLE(i / 2.0) ), bson) == NULL);
+        }
+
+        bson_writer_end(writer);
+    }
+
+    ck_assert(bcon_columns_init(&cols, BCON(
+        "ts", BCON_RINT64(ts),
+        "value", BCON_RDOUBLE(vals),
+        "name", BCON_RUTF8(names)
+    ), validity, N_DOCS) == NULL);
+
+    ck_assert_int_eq(cols.n_cols, 3);
+    ck_assert(bcon_columns_from_data(&cols, buf, bson_writer_get_length(writer)) == NULL);
+    ck_assert_int_eq(cols.n_rows, N_DOCS);
+
+    for (i = 0; i < N_DOCS; i++) {
+        int ts_ok = (ts_valid[i / 8] >> (i % 8)) & 1;
+        int vals_ok = (vals_valid[i / 8] >> (i % 8)) & 1;
+        int names_ok = (names_valid[i / 8] >> (i % 8)) & 1;
+
+        if (i == 3) {
+            ck_assert(! ts_ok && ! vals_ok && ! names_ok);
+            ck_assert(ts[i] == 0 && vals[i] == 0 && names[i] == NULL);
+        } else if (i == 4) {
+            ck_assert(ts_ok && ! vals_ok && names_ok);
+            ck_assert(ts[i] == 4);
+            ck_assert_str_eq(names[i], "four");
+        } else if (i == 5) {
+            ck_assert(! ts_ok && vals_ok && ! names_ok);
+            ck_assert(vals[i] == 5.5);
+        } else {
+            ck_assert(ts_ok && vals_ok && names_ok);
+            ck_assert(ts[i] == 1000 + i);
+            ck_assert(vals[i] == i / 2.0);
+            ck_assert_str_eq(names[i], "n");
+        }
+    }
+
+    ck_assert(bcon_columns_from_data(&cols, buf, 20) != NULL);
+
+    bson_writer_destroy(writer);
+    free(buf);
+}
+END_TEST
+
+START_TEST(test_columns_bson)
+{
+    bson_t * docs[3];
+    bson_int32_t counts[3];
+    bson_bool_t flags[3];
+    bcon_columns_t cols;
+    char * err_str;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        docs[i] = bson_new();
+        ck_assert(bcon_to_bson(BCON( "count", BCON_INT32(i * 10), "flag", BCON_BOOL(i % 2) ), docs[i]) == NULL);
+    }
+
+    ck_assert(bcon_columns_init(&cols, BCON( "flag", BCON_RBOOL(flags), "count", BCON_RINT32(counts) ), NULL, 2) == NULL);
+
+    err_str = bcon_columns_from_bson(&cols, (const bson_t * const *)docs, 3);
+
+    ck_assert(err_str != NULL);
+    ck_assert_int_eq(cols.n_rows, 2);
+
+    for (i = 0; i < 2; i++) {
+        ck_assert_int_eq(counts[i], i * 10);
+        ck_assert_int_eq(!! flags[i], i % 2);
+    }
+
+    free(err_str);
+
+    for (i = 0; i < 3; i++) bson_destroy(docs[i]);
+}
+END_TEST
+
+START_TEST(test_columns_bad_spec)
+{
+    bcon_columns_t cols;
+    bson_int32_t xs[1];
+    bson_int32_t * xs_ptr = xs;
+    char * err_str = bcon_columns_init(&cols, BCON( "x", BCON_RINT32(xs), "y", BCON_DOC( "z", "w" ) ), NULL, 1);
+
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    /* plain values would be written through as if they were columns */
+    err_str = bcon_columns_init(&cols, BCON( "x", BCON_INT32(1) ), NULL, 1);
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    err_str = bcon_columns_init(&cols, BCON( "s", "plain" ), NULL, 1);
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    ck_assert(bcon_columns_init(&cols, BCON( "x", BCON_PINT32(&xs_ptr) ), NULL, 1) == NULL);
+    ck_assert(cols.cols[0].data == xs);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Columns");
+    tcase_add_test(core, test_columns_data);
+    tcase_add_test(core, test_columns_bson);
+    tcase_add_test(core, test_columns_bad_spec);
+    suite_add_tcase(s, core);
+
+    return;
+}
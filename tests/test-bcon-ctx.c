@@ -0,0 +1,173 @@
+#include "bcon-test.h"
+
+#ifdef __GLIBC__
+/*
+ * Counts heap calls made while counting is set by interposing the libc
+ * allocator, and fails realloc() while failing is set.
+ */
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void __libc_free(void * ptr);
+
+static int counting;
+static int failing;
+static long allocs;
+
+void * malloc(size_t size)
+{
+    if (counting) allocs++;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+    if (counting) allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    if (counting) allocs++;
+    if (failing) return NULL;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void * ptr)
+{
+    if (counting && ptr) allocs++;
+    __libc_free(ptr);
+}
+#endif
+
+static char * big;
+
+#define TEMPLATE BCON( \
+    "name", "John Doe", \
+    "n", BCON_RINT32(&n), \
+    "big", BCON_RUTF8(&big), \
+    "scope", BCON_CODEWSCOPE("x", "y", BCON_DOC( "z", BCON_RINT32(&n) )), \
+    "nested", BCON_DOC( "a", BCON_ARRAY( "b", BCON_DOC( "c", BCON_INT64(3) ) ) ), \
+    "inline", "[", BCON_RINT32(&n), "{", "x", "y", "}", "]" \
+)
+
+START_TEST(test_ctx_matches)
+{
+    bcon_ctx_t ctx;
+    const bson_t * out;
+    bson_t * bson;
+    bson_int32_t n;
+
+    big = calloc(1, 3000);
+    memset(big, 'x', 2999);
+
+    bcon_ctx_init(&ctx);
+
+    for (n = 0; n < 10; n++) {
+        bson = bson_new();
+        ck_assert(bcon_to_bson(TEMPLATE, bson) == NULL);
+
+        out = bcon_ctx_to_bson(&ctx, TEMPLATE);
+
+        ck_assert(out != NULL);
+        ck_assert_int_eq(out->len, bson->len);
+        ck_assert(memcmp(bson_get_data(out), bson_get_data(bson), bson->len) == 0);
+
+        bson_destroy(bson);
+    }
+
+    bcon_ctx_destroy(&ctx);
+    free(big);
+}
+END_TEST
+
+START_TEST(test_ctx_no_allocs)
+{
+#ifdef __GLIBC__
+    bcon_ctx_t ctx;
+    bson_int32_t n = 0;
+    int i;
+
+    big = calloc(1, 3000);
+    memset(big, 'x', 2999);
+
+    bcon_ctx_init(&ctx);
+
+    ck_assert(bcon_ctx_to_bson(&ctx, TEMPLATE) != NULL);
+
+    allocs = 0;
+    counting = 1;
+
+    for (i = 0; i < 1000; i++) {
+        n = i;
+        if (! bcon_ctx_to_bson(&ctx, TEMPLATE)) break;
+    }
+
+    counting = 0;
+
+    ck_assert_int_eq(i, 1000);
+    ck_assert_int_eq(allocs, 0);
+
+    bcon_ctx_destroy(&ctx);
+    free(big);
+#endif
+}
+END_TEST
+
+START_TEST(test_ctx_out_of_memory)
+{
+#ifdef __GLIBC__
+    bcon_ctx_t ctx;
+    bson_int32_t n = 0;
+    const bson_t * out;
+
+    big = calloc(1, 3000);
+    memset(big, 'x', 2999);
+
+    bcon_ctx_init(&ctx);
+
+    ck_assert(bcon_ctx_to_bson(&ctx, BCON( "a", BCON_INT32(1) )) != NULL);
+
+    failing = 1;
+    out = bcon_ctx_to_bson(&ctx, TEMPLATE);
+    failing = 0;
+
+    ck_assert(out == NULL);
+    ck_assert_str_eq(bcon_ctx_error(&ctx), "out of memory");
+    ck_assert(ctx.buf != NULL);
+
+    ck_assert(bcon_ctx_to_bson(&ctx, TEMPLATE) != NULL);
+
+    bcon_ctx_destroy(&ctx);
+    free(big);
+#endif
+}
+END_TEST
+
+START_TEST(test_ctx_error)
+{
+    bcon_ctx_t ctx;
+
+    bcon_ctx_init(&ctx);
+
+    ck_assert(bcon_ctx_to_bson(&ctx, BCON( "a", BCON_INT32(1), BCON_INT32(2), "b" )) == NULL);
+    ck_assert(bcon_ctx_error(&ctx) != NULL);
+
+    ck_assert(bcon_ctx_to_bson(&ctx, BCON( "a", BCON_INT32(1) )) != NULL);
+    ck_assert(bcon_ctx_error(&ctx) == NULL);
+
+    bcon_ctx_destroy(&ctx);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Ctx");
+    tcase_add_test(core, test_ctx_matches);
+    tcase_add_test(core, test_ctx_no_allocs);
+    tcase_add_test(core, test_ctx_out_of_memory);
+    tcase_add_test(core, test_ctx_error);
+    suite_add_tcase(s, core);
+
+    return;
+}
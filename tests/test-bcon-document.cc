@@ -0,0 +1,112 @@
+#include <utility>
+
+#include "bcon-test.h"
+#include "bcon.hpp"
+
+static bcon::document make_session(const char * user, bson_int32_t hits)
+{
+    bcon::document doc(BCON( "user", BCON_UTF8((char *)user), "hits", BCON_INT32(hits) ));
+
+    return doc;
+}
+
+START_TEST(test_document_inline)
+{
+    bson_int32_t n = 3;
+    bcon::document doc(BCON( "a", BCON_RINT32(&n), "b", "{", "c", "d", "}" ));
+
+    ck_assert(doc.is_inline());
+    bcon_eq_data(BCON( "a", BCON_RINT32(&n), "b", "{", "c", "d", "}" ), doc.data(), doc.size());
+
+    bcon::document empty;
+    ck_assert_int_eq(empty.size(), 5);
+}
+END_TEST
+
+START_TEST(test_document_heap)
+{
+    char big[1000];
+
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+
+    bcon::document doc(BCON( "head", "h", "big", big, "list", "[", big, big, "]", "tail", BCON_INT32(1) ));
+
+    ck_assert(! doc.is_inline());
+    bcon_eq_data(BCON( "head", "h", "big", big, "list", "[", big, big, "]", "tail", BCON_INT32(1) ), doc.data(), doc.size());
+}
+END_TEST
+
+START_TEST(test_document_move)
+{
+    char big[1000];
+
+    memset(big, 'y', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+
+    bcon::document small = make_session("alice", 7);
+    bcon_eq_data(BCON( "user", "alice", "hits", BCON_INT32(7) ), small.data(), small.size());
+
+    bcon::document large(BCON( "big", big ));
+    const bson_uint8_t * heap = large.data();
+
+    bcon::document moved(std::move(large));
+    ck_assert(moved.data() == heap);
+    ck_assert_int_eq(large.size(), 5);
+
+    bcon::document moved_small(std::move(small));
+    ck_assert(moved_small.is_inline());
+    ck_assert_int_eq(small.size(), 5);
+    bcon_eq_data(BCON( "user", "alice", "hits", BCON_INT32(7) ), moved_small.data(), moved_small.size());
+
+    moved_small = std::move(moved);
+    ck_assert(moved_small.data() == heap);
+    bcon_eq_data(BCON( "big", big ), moved_small.data(), moved_small.size());
+
+    bcon::document copied = moved_small.copy();
+    ck_assert(copied.data() != heap);
+    bcon_eq_data(BCON( "big", big ), copied.data(), copied.size());
+}
+END_TEST
+
+START_TEST(test_document_view)
+{
+    bcon::document doc(BCON( "k", "v" ));
+    bcon::view v = doc.as_view();
+    bson_iter_t iter;
+
+    ck_assert(bson_iter_init(&iter, v));
+    ck_assert(bson_iter_next(&iter));
+    ck_assert_str_eq(bson_iter_key(&iter), "k");
+
+    bcon::document from_bson(v.get());
+    bcon_eq_data(BCON( "k", "v" ), from_bson.data(), from_bson.size());
+}
+END_TEST
+
+START_TEST(test_document_error)
+{
+    bool thrown = false;
+
+    try {
+        bcon::document doc(BCON( "a", BCON_INT32(1), BCON_INT32(2) ));
+    } catch (const bcon::error & e) {
+        thrown = true;
+    }
+
+    ck_assert(thrown);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Document");
+    tcase_add_test(core, test_document_inline);
+    tcase_add_test(core, test_document_heap);
+    tcase_add_test(core, test_document_move);
+    tcase_add_test(core, test_document_view);
+    tcase_add_test(core, test_document_error);
+    suite_add_tcase(s, core);
+
+    return;
+}
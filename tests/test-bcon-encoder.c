@@ -0,0 +1,125 @@
+#include "bcon-test.h"
+
+static bson_t * sub;
+static bson_oid_t oid;
+static struct timeval tv = { 1000, 500000 };
+static char * big;
+static bson_t src;
+static bson_iter_t iter;
+
+static void setup(void)
+{
+    if (! big) {
+        big = malloc(5000);
+        memset(big, 'x', 4999);
+        big[4999] = '\0';
+
+        bson_oid_init(&oid, NULL);
+
+        sub = bson_new();
+        bson_append_utf8(sub, "a", -1, "b", -1);
+
+        bson_init(&src);
+        bson_append_int64(&src, "spliced", -1, 42);
+        bson_iter_init_find(&iter, &src, "spliced");
+    }
+}
+
+/* compound literals only live as long as the enclosing block */
+#define TEMPLATE BCON( \
+        "name", "John Doe", \
+        "age", BCON_INT32(10), \
+        "big", BCON_RUTF8(&big), \
+        "weight", BCON_DOUBLE(72.5), \
+        "_id", BCON_BSON_OID(&oid), \
+        "when", BCON_DATE_TIME(&tv), \
+        "ok", BCON_BOOL(1), \
+        "nothing", BCON_NULL, \
+        "re", BCON_REGEX("^a", "i"), \
+        "bin", BCON_BINARY(BSON_SUBTYPE_BINARY, "deadbeef", 8), \
+        "ts", BCON_TIMESTAMP(1, 2), \
+        "code", BCON_CODE("x()"), \
+        "scope", BCON_CODEWSCOPE("x", "y", BCON_DOC( "z", BCON_INT32(1) )), \
+        "nested", BCON_DOC( "a", BCON_ARRAY( "b", BCON_DOC( "c", BCON_INT64(3) ), "[", "d", "]" ) ), \
+        "inline", "{", "a", "[", BCON_INT32(1), "{", "x", "y", "}", "]", "}", \
+        "sub", BCON_BSON_DOCUMENT(sub), \
+        "value", BCON_ITER(&iter), \
+        BCON_ITER_ELEMENT(&iter), \
+        "max", BCON_MAXKEY \
+)
+
+START_TEST(test_encoder_chunks)
+{
+    bson_t * bson = bson_new();
+    bson_uint8_t buf[64];
+    bson_uint8_t * out;
+    bcon_encoder_t * enc = malloc(sizeof(*enc));
+    bcon_encoder_status_t status;
+    size_t chunk, n, len;
+    bson_uint32_t size;
+
+    setup();
+
+    ck_assert(bcon_to_bson(TEMPLATE, bson) == NULL);
+
+    ck_assert(bcon_encoded_size(TEMPLATE, &size) == NULL);
+    ck_assert_int_eq(size, bson->len);
+
+    out = malloc(bson->len);
+
+    for (chunk = 1; chunk <= sizeof(buf); chunk++) {
+        len = 0;
+
+        bcon_encoder_init(enc, TEMPLATE);
+        status = bcon_encoder_feed(enc, buf, chunk, &n);
+
+        while (1) {
+            ck_assert(len + n <= bson->len);
+            memcpy(out + len, buf, n);
+            len += n;
+
+            if (status != BCON_ENCODER_NEED_SPACE) break;
+
+            status = bcon_encoder_resume(enc, &n);
+        }
+
+        ck_assert_int_eq(status, BCON_ENCODER_DONE);
+        ck_assert_int_eq(len, bson->len);
+        ck_assert_msg(memcmp(out, bson_get_data(bson), len) == 0, "chunk size %d differs", (int)chunk);
+    }
+
+    free(out);
+    free(enc);
+    bson_destroy(bson);
+}
+END_TEST
+
+START_TEST(test_encoder_one_buffer)
+{
+    bson_t * bson = bson_new();
+    bson_uint8_t buf[8192];
+    bcon_encoder_t enc;
+    size_t n;
+
+    setup();
+
+    ck_assert(bcon_to_bson(TEMPLATE, bson) == NULL);
+
+    bcon_encoder_init(&enc, TEMPLATE);
+    ck_assert_int_eq(bcon_encoder_feed(&enc, buf, sizeof(buf), &n), BCON_ENCODER_DONE);
+    ck_assert_int_eq(n, bson->len);
+    ck_assert(memcmp(buf, bson_get_data(bson), n) == 0);
+
+    bson_destroy(bson);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Encoder");
+    tcase_add_test(core, test_encoder_chunks);
+    tcase_add_test(core, test_encoder_one_buffer);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,79 @@
+#include "bcon-test.h"
+
+START_TEST(test_equal_differs)
+{
+    bson_t * bson = bson_new();
+    bson_t child;
+    bson_append_utf8(bson, "foo", -1, "bar", -1);
+    bson_append_array_begin(bson, "baz", -1, &child);
+    bson_append_int32(&child, "0", -1, 1);
+    bson_append_int32(&child, "1", -1, 2);
+    bson_append_array_end(bson, &child);
+
+    ck_assert(bcon_equal_bson(BCON( "foo", "bar", "baz", BCON_ARRAY( BCON_INT32(1), BCON_INT32(2) ) ), bson));
+    ck_assert(bcon_equal_bson(BCON( "foo", "bar", "baz", "[", BCON_INT32(1), BCON_INT32(2), "]" ), bson));
+
+    ck_assert(! bcon_equal_bson(BCON( "foo", "baz", "baz", BCON_ARRAY( BCON_INT32(1), BCON_INT32(2) ) ), bson));
+    ck_assert(! bcon_equal_bson(BCON( "fob", "bar", "baz", BCON_ARRAY( BCON_INT32(1), BCON_INT32(2) ) ), bson));
+    ck_assert(! bcon_equal_bson(BCON( "foo", "bar", "baz", BCON_ARRAY( BCON_INT32(1), BCON_INT64(2) ) ), bson));
+    ck_assert(! bcon_equal_bson(BCON( "foo", "bar", "baz", BCON_ARRAY( BCON_INT32(1) ) ), bson));
+    ck_assert(! bcon_equal_bson(BCON( "foo", "bar", "baz", BCON_ARRAY( BCON_INT32(1), BCON_INT32(2), BCON_INT32(3) ) ), bson));
+    ck_assert(! bcon_equal_bson(BCON( "foo", "bar" ), bson));
+    ck_assert(! bcon_equal_bson(BCON( "foo", "bar", "baz", BCON_ARRAY( BCON_INT32(1), BCON_INT32(2) ), "x", BCON_NULL ), bson));
+
+    bson_destroy(bson);
+}
+END_TEST
+
+START_TEST(test_equal_bound)
+{
+    bson_t * bson = bson_new();
+    bson_append_int32(bson, "foo", -1, 5);
+
+    bson_int32_t i = 5;
+    bcon_t * bcon = BCON( "foo", BCON_RINT32(&i) );
+
+    ck_assert(bcon_equal_bson(bcon, bson));
+    i = 6;
+    ck_assert(! bcon_equal_bson(bcon, bson));
+
+    bson_destroy(bson);
+}
+END_TEST
+
+START_TEST(test_equal_bson_values)
+{
+    bson_t * bson = bson_new();
+    bson_t * doc = bson_new();
+    bson_t * arr = bson_new();
+    bson_t * other = bson_new();
+    bson_append_utf8(doc, "bar", -1, "baz", -1);
+    bson_append_utf8(arr, "0", -1, "baz", -1);
+    bson_append_utf8(other, "0", -1, "qux", -1);
+    bson_append_document(bson, "d", -1, doc);
+    bson_append_array(bson, "a", -1, arr);
+
+    ck_assert(bcon_equal_bson(BCON( "d", BCON_BSON_DOCUMENT(doc), "a", BCON_BSON_ARRAY(arr) ), bson));
+    ck_assert(bcon_equal_bson(BCON( "d", BCON_DOC( "bar", "baz" ), "a", BCON_ARRAY( "baz" ) ), bson));
+
+    ck_assert(! bcon_equal_bson(BCON( "d", BCON_BSON_DOCUMENT(doc), "a", BCON_BSON_ARRAY(other) ), bson));
+    ck_assert(! bcon_equal_bson(BCON( "d", BCON_BSON_DOCUMENT(doc), "a", BCON_BSON_DOCUMENT(arr) ), bson));
+    ck_assert(! bcon_equal_bson(BCON( "d", BCON_BSON_ARRAY(doc), "a", BCON_BSON_ARRAY(arr) ), bson));
+
+    bson_destroy(bson);
+    bson_destroy(doc);
+    bson_destroy(arr);
+    bson_destroy(other);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Equal");
+    tcase_add_test(core, test_equal_differs);
+    tcase_add_test(core, test_equal_bound);
+    tcase_add_test(core, test_equal_bson_values);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,116 @@
+#include <pthread.h>
+#include <time.h>
+
+#include "bcon-test.h"
+
+#define N_THREADS 4
+#define N_PER_THREAD 5000
+
+START_TEST(test_gen_to_bson)
+{
+    bson_t * bson = bson_new();
+    bson_oid_t oid;
+    bson_int64_t now = 0;
+    bson_int64_t wall = (bson_int64_t)time(NULL) * 1000;
+    bson_iter_t iter;
+
+    ck_assert(bcon_to_bson(BCON( "_id", BCON_NEW_OID(&oid), "at", BCON_NOW(&now), "other", BCON_NEW_OID(NULL) ), bson) == NULL);
+
+    ck_assert(bson_iter_init_find(&iter, bson, "_id"));
+    ck_assert(bson_iter_type(&iter) == BSON_TYPE_OID);
+    ck_assert(memcmp(bson_iter_oid(&iter), &oid, 12) == 0);
+
+    ck_assert(bson_iter_init_find(&iter, bson, "at"));
+    ck_assert(bson_iter_type(&iter) == BSON_TYPE_DATE_TIME);
+    ck_assert(bson_iter_date_time(&iter) == now);
+    ck_assert(now > wall - 5000 && now < wall + 5000);
+
+    ck_assert(bson_iter_init_find(&iter, bson, "other"));
+    ck_assert(memcmp(bson_iter_oid(&iter), &oid, 12) != 0);
+
+    ck_assert(bcon_equal_bson(BCON( "_id", BCON_NEW_OID(NULL), "at", BCON_NOW(NULL), "other", BCON_NEW_OID(NULL) ), bson));
+
+    bson_destroy(bson);
+}
+END_TEST
+
+START_TEST(test_gen_encoder)
+{
+    bson_oid_t oid;
+    bson_int64_t now = 0;
+    const bson_t * bson;
+    bson_uint32_t size;
+    bson_iter_t iter;
+    bcon_ctx_t ctx;
+
+    ck_assert(bcon_encoded_size(BCON( "_id", BCON_NEW_OID(NULL), "at", BCON_NOW(NULL) ), &size) == NULL);
+
+    bcon_ctx_init(&ctx);
+    bson = bcon_ctx_to_bson(&ctx, BCON( "_id", BCON_NEW_OID(&oid), "at", BCON_NOW(&now) ));
+
+    ck_assert(bson != NULL);
+    ck_assert_int_eq(bson->len, size);
+
+    ck_assert(bson_iter_init_find(&iter, bson, "_id"));
+    ck_assert(memcmp(bson_iter_oid(&iter), &oid, 12) == 0);
+    ck_assert(bson_iter_init_find(&iter, bson, "at"));
+    ck_assert(bson_iter_date_time(&iter) == now);
+
+    bcon_ctx_destroy(&ctx);
+}
+END_TEST
+
+START_TEST(test_gen_hash)
+{
+    bcon_hash_t hash;
+    char * err_str = bcon_hash(BCON( "_id", BCON_NEW_OID(NULL) ), BCON_HASH_VALUES, &hash);
+
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    ck_assert(bcon_hash(BCON( "_id", BCON_NEW_OID(NULL) ), BCON_HASH_SHAPE, &hash) == NULL);
+}
+END_TEST
+
+static bson_oid_t oids[N_THREADS * N_PER_THREAD];
+
+static void * gen_thread(void * data)
+{
+    bson_oid_t * out = data;
+    int i;
+
+    for (i = 0; i < N_PER_THREAD; i++) bcon_oid_gen(&out[i]);
+
+    return NULL;
+}
+
+static int oid_cmp(const void * a, const void * b)
+{
+    return memcmp(a, b, 12);
+}
+
+START_TEST(test_gen_unique)
+{
+    pthread_t threads[N_THREADS];
+    int i;
+
+    for (i = 0; i < N_THREADS; i++) pthread_create(&threads[i], NULL, gen_thread, &oids[i * N_PER_THREAD]);
+    for (i = 0; i < N_THREADS; i++) pthread_join(threads[i], NULL);
+
+    qsort(oids, N_THREADS * N_PER_THREAD, sizeof(bson_oid_t), oid_cmp);
+
+    for (i = 1; i < N_THREADS * N_PER_THREAD; i++) ck_assert(memcmp(&oids[i - 1], &oids[i], 12) != 0);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Gen");
+    tcase_add_test(core, test_gen_to_bson);
+    tcase_add_test(core, test_gen_encoder);
+    tcase_add_test(core, test_gen_hash);
+    tcase_add_test(core, test_gen_unique);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,94 @@
+#include "bcon-test.h"
+
+static void hash_eq_encoded(bcon_t * bcon, bcon_hash_mode_t mode)
+{
+    bcon_hash_t a, b;
+    char * err_str;
+
+    bson_t * bson = bson_new();
+
+    err_str = bcon_to_bson(bcon, bson);
+    ck_assert_msg(err_str == NULL, "Error in bcon_to_bson: (%s)", err_str);
+
+    err_str = bcon_hash(bcon, mode, &a);
+    ck_assert_msg(err_str == NULL, "Error in bcon_hash: (%s)", err_str);
+
+    bcon_hash_bson(bson, mode, &b);
+
+    ck_assert_msg(a.lo == b.lo && a.hi == b.hi, "bcon_hash != bcon_hash_bson");
+
+    bson_destroy(bson);
+}
+
+START_TEST(test_hash_matches_encoded)
+{
+    bson_oid_t oid;
+    struct timeval tv = { 1000, 0 };
+    bson_oid_init(&oid, NULL);
+
+    bson_t * sub = bson_new();
+    bson_iter_t iter;
+    bson_append_int32(sub, "x", -1, 1);
+    bson_iter_init_find(&iter, sub, "x");
+
+    bcon_t * bcon = BCON(
+        "name", "John Doe",
+        "age", BCON_INT32(10),
+        "weight", BCON_DOUBLE(72.5),
+        "big", BCON_INT64(1LL << 40),
+        "_id", BCON_BSON_OID(&oid),
+        "when", BCON_DATE_TIME(&tv),
+        "ok", BCON_BOOL(1),
+        "nothing", BCON_NULL,
+        "re", BCON_REGEX("^a", "i"),
+        "bin", BCON_BINARY(BSON_SUBTYPE_BINARY, "deadbeef", 8),
+        "ts", BCON_TIMESTAMP(1, 2),
+        "code", BCON_CODEWSCOPE("x", "y", BCON_INT32(1)),
+        "interests", BCON_ARRAY( "music", "dance" ),
+        "inline", "{", "a", "[", BCON_INT32(1), "]", "}",
+        "sub", BCON_BSON_DOCUMENT(sub),
+        "spliced", BCON_ITER(&iter),
+        BCON_ITER_ELEMENT(&iter),
+    );
+
+    hash_eq_encoded(bcon, BCON_HASH_VALUES);
+    hash_eq_encoded(bcon, BCON_HASH_SHAPE);
+
+    bson_destroy(sub);
+}
+END_TEST
+
+START_TEST(test_hash_shape)
+{
+    bcon_hash_t a, b;
+    bson_int32_t i = 1;
+
+    bcon_t * bcon = BCON(
+        "foo", BCON_RINT32(&i),
+        "bar", BCON_ARRAY( "baz" ),
+    );
+
+    bcon_hash(bcon, BCON_HASH_VALUES, &a);
+    i = 2;
+    bcon_hash(bcon, BCON_HASH_VALUES, &b);
+    ck_assert_msg(a.lo != b.lo || a.hi != b.hi, "value change didn't change hash");
+
+    bcon_hash(bcon, BCON_HASH_SHAPE, &a);
+    i = 3;
+    bcon_hash(bcon, BCON_HASH_SHAPE, &b);
+    ck_assert_msg(a.lo == b.lo && a.hi == b.hi, "value change changed shape hash");
+
+    bcon_hash(BCON( "foo", BCON_INT64(3), "bar", BCON_ARRAY( "baz" ) ), BCON_HASH_SHAPE, &b);
+    ck_assert_msg(a.lo != b.lo || a.hi != b.hi, "type change didn't change shape hash");
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Hash");
+    tcase_add_test(core, test_hash_matches_encoded);
+    tcase_add_test(core, test_hash_shape);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,202 @@
+#include "bcon-test.h"
+
+static bson_bool_t is_admin;
+static bson_bool_t has_tags;
+static bson_int32_t level;
+static char * nick;
+static char ** nick_ref;
+static char * key_scalar = "ks";
+static char * key_inline = "ki";
+static char * key_doc = "kd";
+static char ** key_scalar_ref;
+static char ** key_inline_ref;
+static char ** key_doc_ref;
+
+#define USER_TEMPLATE BCON( \
+    "name", "alice", \
+    "nick", BCON_PUTF8(&nick_ref), \
+    BCON_PUTF8(&key_scalar_ref), "scalar", \
+    BCON_PUTF8(&key_inline_ref), "{", "x", "[", "y", "{", "}", "]", "}", \
+    BCON_PUTF8(&key_doc_ref), BCON_DOC( "z", BCON_INT32(1) ), \
+    BCON_IF(&is_admin, \
+        "role", "admin", \
+        "level", BCON_RINT32(&level) \
+    ), \
+    "tags", "[", \
+        "a", \
+        BCON_IF(&has_tags, "b", BCON_IF(&is_admin, "c")), \
+        BCON_PUTF8(&nick_ref), \
+    "]", \
+    "tail", BCON_INT32(1) \
+)
+
+static void append_tag(bson_t * tags, int * i, const char * value)
+{
+    char key[16];
+
+    sprintf(key, "%d", (*i)++);
+    bson_append_utf8(tags, key, -1, value, -1);
+}
+
+static void expected_bson(bson_t * bson)
+{
+    bson_t tags, child, grandchild, empty;
+    int i = 0;
+
+    bson_append_utf8(bson, "name", -1, "alice", -1);
+    if (nick_ref) bson_append_utf8(bson, "nick", -1, nick, -1);
+
+    if (key_scalar_ref) {
+        bson_append_utf8(bson, "ks", -1, "scalar", -1);
+
+        bson_append_document_begin(bson, "ki", -1, &child);
+        bson_append_array_begin(&child, "x", -1, &grandchild);
+        bson_append_utf8(&grandchild, "0", -1, "y", -1);
+        bson_append_document_begin(&grandchild, "1", -1, &empty);
+        bson_append_document_end(&grandchild, &empty);
+        bson_append_array_end(&child, &grandchild);
+        bson_append_document_end(bson, &child);
+
+        bson_append_document_begin(bson, "kd", -1, &child);
+        bson_append_int32(&child, "z", -1, 1);
+        bson_append_document_end(bson, &child);
+    }
+
+    if (is_admin) {
+        bson_append_utf8(bson, "role", -1, "admin", -1);
+        bson_append_int32(bson, "level", -1, level);
+    }
+
+    bson_append_array_begin(bson, "tags", -1, &tags);
+    append_tag(&tags, &i, "a");
+    if (has_tags) append_tag(&tags, &i, "b");
+    if (has_tags && is_admin) append_tag(&tags, &i, "c");
+    if (nick_ref) append_tag(&tags, &i, nick);
+    bson_append_array_end(bson, &tags);
+
+    bson_append_int32(bson, "tail", -1, 1);
+}
+
+static void check_variant(void)
+{
+    bson_t * bson = bson_new();
+    bson_t * expected = bson_new();
+    bson_uint8_t buf[7];
+    bson_uint8_t * out;
+    bcon_encoder_t enc;
+    bcon_encoder_status_t status;
+    bcon_size_report_t report;
+    bcon_hash_t a, b;
+    bson_uint32_t size;
+    size_t written, total = 0;
+
+    expected_bson(expected);
+
+    ck_assert(bcon_to_bson(USER_TEMPLATE, bson) == NULL);
+    ck_assert_int_eq(bson->len, expected->len);
+    ck_assert(memcmp(bson_get_data(bson), bson_get_data(expected), bson->len) == 0);
+
+    ck_assert(bcon_encoded_size(USER_TEMPLATE, &size) == NULL);
+    ck_assert_int_eq(size, expected->len);
+
+    ck_assert(bcon_size_report(USER_TEMPLATE, &report, NULL) == NULL);
+    ck_assert_int_eq(report.total, expected->len);
+
+    /* small buffers make the encoder size the open frames early */
+    out = malloc(expected->len);
+    bcon_encoder_init(&enc, USER_TEMPLATE);
+
+    do {
+        status = bcon_encoder_feed(&enc, buf, sizeof(buf), &written);
+        ck_assert(total + written <= expected->len);
+        memcpy(out + total, buf, written);
+        total += written;
+    } while (status == BCON_ENCODER_NEED_SPACE);
+
+    ck_assert_int_eq(status, BCON_ENCODER_DONE);
+    ck_assert_int_eq(total, expected->len);
+    ck_assert(memcmp(out, bson_get_data(expected), total) == 0);
+
+    ck_assert(bcon_equal_bson(USER_TEMPLATE, expected));
+
+    ck_assert(bcon_hash(USER_TEMPLATE, BCON_HASH_VALUES, &a) == NULL);
+    bcon_hash_bson(expected, BCON_HASH_VALUES, &b);
+    ck_assert(a.lo == b.lo && a.hi == b.hi);
+
+    free(out);
+    bson_destroy(bson);
+    bson_destroy(expected);
+}
+
+START_TEST(test_if_variants)
+{
+    int mask;
+
+    nick = "al";
+    level = 7;
+
+    for (mask = 0; mask < 16; mask++) {
+        is_admin = mask & 1;
+        has_tags = (mask >> 1) & 1;
+        nick_ref = mask & 4 ? &nick : NULL;
+
+        /* NULL P keys drop their values, scalar or nested */
+        key_scalar_ref = mask & 8 ? &key_scalar : NULL;
+        key_inline_ref = mask & 8 ? &key_inline : NULL;
+        key_doc_ref = mask & 8 ? &key_doc : NULL;
+
+        check_variant();
+    }
+}
+END_TEST
+
+START_TEST(test_if_equal_mismatch)
+{
+    bson_t * expected = bson_new();
+
+    is_admin = 1;
+    has_tags = 1;
+    level = 7;
+    nick = "al";
+    nick_ref = &nick;
+
+    expected_bson(expected);
+
+    ck_assert(bcon_equal_bson(USER_TEMPLATE, expected));
+
+    is_admin = 0;
+    ck_assert(! bcon_equal_bson(USER_TEMPLATE, expected));
+
+    is_admin = 1;
+    nick_ref = NULL;
+    ck_assert(! bcon_equal_bson(USER_TEMPLATE, expected));
+
+    bson_destroy(expected);
+}
+END_TEST
+
+START_TEST(test_if_value_position)
+{
+    bson_t * bson = bson_new();
+    char * err_str;
+
+    is_admin = 1;
+
+    err_str = bcon_to_bson(BCON( "a", BCON_IF(&is_admin, "b", "c") ), bson);
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    bson_destroy(bson);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("If");
+    tcase_add_test(core, test_if_variants);
+    tcase_add_test(core, test_if_equal_mismatch);
+    tcase_add_test(core, test_if_value_position);
+    suite_add_tcase(s, core);
+
+    return;
+}
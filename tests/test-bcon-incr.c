@@ -0,0 +1,190 @@
+#include "bcon-test.h"
+
+#ifdef __GLIBC__
+/*
+ * Fails the next realloc() once failing is set by interposing the libc
+ * allocator.
+ */
+extern void * __libc_realloc(void * ptr, size_t size);
+
+static int failing;
+
+void * realloc(void * ptr, size_t size)
+{
+    if (failing) {
+        failing = 0;
+        return NULL;
+    }
+
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+static char * user;
+static char ** user_ref;
+static char * note;
+static bson_int32_t hits;
+static double score;
+static bson_bool_t active;
+static bson_t * prefs;
+static bson_oid_t oid;
+
+#define SESSION_TEMPLATE BCON( \
+    "user", BCON_PUTF8(&user_ref), \
+    "hits", BCON_RINT32(&hits), \
+    "state", "{", \
+        "active", BCON_RBOOL(&active), \
+        "score", BCON_RDOUBLE(&score), \
+        "notes", "[", BCON_RUTF8(&note), "fixed", "]", \
+    "}", \
+    "prefs", BCON_RBSON_DOCUMENT(&prefs), \
+    "oid", BCON_BSON_OID(&oid), \
+    "tail", "end" \
+)
+
+static void setup(void)
+{
+    user = "alice";
+    user_ref = &user;
+    note = "n";
+    hits = 1;
+    score = 0.5;
+    active = 1;
+    prefs = bson_new();
+    bson_append_utf8(prefs, "theme", -1, "dark", -1);
+    bson_oid_init(&oid, NULL);
+}
+
+static void teardown(void)
+{
+    bson_destroy(prefs);
+}
+
+START_TEST(test_incr_update)
+{
+    bcon_t * tmpl = SESSION_TEMPLATE;
+    char * rebound = "someone-with-a-longer-name";
+    bcon_incr_t incr;
+
+    setup();
+
+    ck_assert(bcon_incr_init(&incr, tmpl) == NULL);
+    bcon_eq_data(tmpl, bson_get_data(&incr.doc), incr.doc.len);
+
+    ck_assert(bcon_incr_update(&incr) == NULL);
+    ck_assert_int_eq(incr.n_changed, 0);
+    bcon_eq_data(tmpl, bson_get_data(&incr.doc), incr.doc.len);
+
+    hits = 2;
+    ck_assert(bcon_incr_update(&incr) == NULL);
+    ck_assert_int_eq(incr.n_changed, 1);
+    bcon_eq_data(tmpl, bson_get_data(&incr.doc), incr.doc.len);
+
+    note = "a much longer note than before";
+    score = 1.5;
+    ck_assert(bcon_incr_update(&incr) == NULL);
+    ck_assert_int_eq(incr.n_changed, 2);
+    bcon_eq_data(tmpl, bson_get_data(&incr.doc), incr.doc.len);
+
+    user_ref = &rebound;
+    bson_append_int32(prefs, "size", -1, 12);
+    ck_assert(bcon_incr_update(&incr) == NULL);
+    ck_assert_int_eq(incr.n_changed, 2);
+    bcon_eq_data(tmpl, bson_get_data(&incr.doc), incr.doc.len);
+
+    note = "";
+    user = "bob";
+    user_ref = &user;
+    active = 0;
+    bson_oid_init(&oid, NULL);
+    ck_assert(bcon_incr_update(&incr) == NULL);
+    ck_assert_int_eq(incr.n_changed, 4);
+    bcon_eq_data(tmpl, bson_get_data(&incr.doc), incr.doc.len);
+
+    bcon_incr_destroy(&incr);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_incr_grow)
+{
+    bcon_t * tmpl = SESSION_TEMPLATE;
+    char big[4096];
+    bcon_incr_t incr;
+
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+
+    setup();
+
+    ck_assert(bcon_incr_init(&incr, tmpl) == NULL);
+
+    note = big;
+    ck_assert(bcon_incr_update(&incr) == NULL);
+    bcon_eq_data(tmpl, bson_get_data(&incr.doc), incr.doc.len);
+
+    note = "short";
+    ck_assert(bcon_incr_update(&incr) == NULL);
+    bcon_eq_data(tmpl, bson_get_data(&incr.doc), incr.doc.len);
+
+    bcon_incr_destroy(&incr);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_incr_out_of_memory)
+{
+#ifdef __GLIBC__
+    bcon_t * tmpl = SESSION_TEMPLATE;
+    char big[4096];
+    bcon_incr_t incr;
+    char * err_str;
+
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+
+    setup();
+
+    failing = 1;
+    err_str = bcon_incr_init(&incr, tmpl);
+
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    ck_assert(bcon_incr_init(&incr, tmpl) == NULL);
+
+    note = big;
+    failing = 1;
+    err_str = bcon_incr_update(&incr);
+
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    bcon_incr_destroy(&incr);
+    teardown();
+#endif
+}
+END_TEST
+
+START_TEST(test_incr_bad_template)
+{
+    bcon_incr_t incr;
+    char * err_str = bcon_incr_init(&incr, BCON( "a", BCON_INT32(1), BCON_INT32(2) ));
+
+    ck_assert(err_str != NULL);
+
+    free(err_str);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Incr");
+    tcase_add_test(core, test_incr_update);
+    tcase_add_test(core, test_incr_grow);
+    tcase_add_test(core, test_incr_out_of_memory);
+    tcase_add_test(core, test_incr_bad_template);
+    suite_add_tcase(s, core);
+
+    return;
+}
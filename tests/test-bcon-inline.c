@@ -0,0 +1,146 @@
+#include "bcon-test.h"
+#include "bcon_inline.h"
+
+static int append_two(bcon_append_ctx_t * ctx, void * data)
+{
+    bson_append_int32(ctx->bson, bcon_append_key(ctx, "x"), -1, 1);
+    bson_append_int32(ctx->bson, bcon_append_key(ctx, "y"), -1, 2);
+
+    return 0;
+}
+
+#define CHECK_INLINE(...) do { \
+    bson_t * inl = bson_new(); \
+    ck_assert(BCON_INLINE_TO_BSON(inl, __VA_ARGS__) == NULL); \
+    bcon_eq_data(BCON( __VA_ARGS__ ), bson_get_data(inl), inl->len); \
+    bson_destroy(inl); \
+} while (0)
+
+START_TEST(test_inline_types)
+{
+    char * name = "alice";
+    bson_int32_t n = 3;
+    bson_int64_t big = 1LL << 40;
+    double d = 2.5;
+    bson_bool_t flag = 1;
+    struct timeval tv = { 1234, 567000 };
+    bcon_string_t slice = { "sliced", 3 };
+    bson_t * sub = bson_new();
+    bson_oid_t oid;
+
+    bson_append_utf8(sub, "k", -1, "v", -1);
+    bson_oid_init(&oid, NULL);
+
+    CHECK_INLINE(
+        "utf8", "literal",
+        "rutf8", BCON_RUTF8(&name),
+        "symbol", BCON_SYMBOL("sym"),
+        "slice", BCON_UTF8_LEN(slice.str, slice.length),
+        "int32", BCON_INT32(7),
+        "rint32", BCON_RINT32(&n),
+        "int64", BCON_RINT64(&big),
+        "double", BCON_RDOUBLE(&d),
+        "bool", BCON_RBOOL(&flag),
+        "null", BCON_NULL,
+        "oid", BCON_BSON_OID(&oid),
+        "date", BCON_DATE_TIME(&tv),
+        "doc", BCON_BSON_DOCUMENT(sub),
+        "array", BCON_BSON_ARRAY(sub),
+        "max", BCON_MAXKEY,
+        "min", BCON_MINKEY
+    );
+
+    bson_destroy(sub);
+}
+END_TEST
+
+START_TEST(test_inline_nesting)
+{
+    CHECK_INLINE(
+        "a", "{",
+            "b", "[", "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "]",
+            "c", "{", "d", "[", "[", "x", "]", "{", "y", BCON_INT32(1), "}", "]", "}",
+        "}",
+        "e", "[", "]",
+        "f", "{", "}"
+    );
+}
+END_TEST
+
+START_TEST(test_inline_fallback)
+{
+    bson_bool_t yes = 1, no = 0;
+    bson_int32_t * missing = NULL;
+    bson_int32_t level = 4;
+    bson_t * elem_doc = bson_new();
+    bson_iter_t iter;
+    const bson_uint8_t * elem;
+
+    bson_append_int32(elem_doc, "raw", -1, 9);
+    bson_iter_init(&iter, elem_doc);
+    bson_iter_next(&iter);
+    elem = bson_get_data(elem_doc) + 4;
+
+    CHECK_INLINE(
+        "doc", BCON_DOC( "x", BCON_INT32(1) ),
+        "array", BCON_ARRAY( "x", "y" ),
+        "re", BCON_REGEX("^a", "i"),
+        "code", BCON_CODE("f()"),
+        "cb", BCON_CALLBACK_ARRAY(append_two, NULL),
+        BCON_IF(&yes, "on", BCON_RINT32(&level)),
+        BCON_IF(&no, "off", BCON_INT32(0)),
+        "gone", BCON_PINT32(&missing),
+        BCON_RAW(elem, elem_doc->len - 5),
+        BCON_ITER_ELEMENT(&iter),
+        "list", "[", "a", BCON_IF(&yes, "b", BCON_DOC( "c", "d" )), BCON_PINT32(&missing), "e", "]"
+    );
+
+    bson_destroy(elem_doc);
+}
+END_TEST
+
+START_TEST(test_inline_null_key)
+{
+    char * key = "k";
+    char ** key_ref = NULL;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        CHECK_INLINE(
+            "a", BCON_INT32(1),
+            BCON_PUTF8(&key_ref), "scalar",
+            BCON_PUTF8(&key_ref), "{", "x", "[", "y", "{", "}", "]", "}",
+            BCON_PUTF8(&key_ref), BCON_DOC( "z", BCON_INT32(1) ),
+            "b", BCON_INT32(2)
+        );
+
+        key_ref = &key;
+    }
+}
+END_TEST
+
+START_TEST(test_inline_error)
+{
+    bson_t * bson = bson_new();
+    char * err_str;
+
+    err_str = BCON_INLINE_TO_BSON(bson, "a", BCON_INT32(1), BCON_INT32(2));
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    bson_destroy(bson);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Inline");
+    tcase_add_test(core, test_inline_types);
+    tcase_add_test(core, test_inline_nesting);
+    tcase_add_test(core, test_inline_fallback);
+    tcase_add_test(core, test_inline_null_key);
+    tcase_add_test(core, test_inline_error);
+    suite_add_tcase(s, core);
+
+    return;
+}
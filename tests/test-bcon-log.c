@@ -0,0 +1,245 @@
+#include <pthread.h>
+
+#include "bcon-test.h"
+
+#define N_THREADS 4
+#define N_PER_THREAD 500
+
+static size_t count_lines(FILE * fp, const char * needle)
+{
+    char line[256];
+    size_t n = 0;
+
+    rewind(fp);
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (! needle || strstr(line, needle)) n++;
+    }
+
+    return n;
+}
+
+static void log_opts_init(bcon_log_opts_t * opts, FILE * fp, size_t n_slots, bcon_log_policy_t policy)
+{
+    memset(opts, 0, sizeof(*opts));
+
+    opts->out = fp;
+    opts->n_slots = n_slots;
+    opts->slot_size = 128;
+    opts->policy = policy;
+    opts->sample_every = 4;
+}
+
+START_TEST(test_log_basic)
+{
+    FILE * fp = tmpfile();
+    bcon_log_opts_t opts;
+    bcon_log_t * log;
+    bson_t * bson = bson_new();
+    int i;
+
+    log_opts_init(&opts, fp, 64, BCON_LOG_BLOCK);
+    ck_assert(bcon_log_start(&opts, &log) == NULL);
+
+    for (i = 0; i < 100; i++) {
+        ck_assert(bcon_log(log, BCON( "op", "insert", "n", BCON_INT32(i) )) == 0);
+    }
+
+    ck_assert(bcon_to_bson(BCON( "op", "bson" ), bson) == NULL);
+    ck_assert(bcon_log_bson(log, bson) == 0);
+
+    bcon_log_stop(log);
+
+    ck_assert_int_eq(count_lines(fp, "insert"), 100);
+    ck_assert_int_eq(count_lines(fp, "bson"), 1);
+    ck_assert_int_eq(count_lines(fp, NULL), 101);
+
+    bson_destroy(bson);
+    fclose(fp);
+}
+END_TEST
+
+START_TEST(test_log_oversized)
+{
+    FILE * fp = tmpfile();
+    bcon_log_opts_t opts;
+    bcon_log_stats_t stats;
+    bcon_log_t * log;
+    char big[200];
+
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+
+    log_opts_init(&opts, fp, 4, BCON_LOG_BLOCK);
+    ck_assert(bcon_log_start(&opts, &log) == NULL);
+
+    ck_assert(bcon_log(log, BCON( "big", big )) != 0);
+    ck_assert(bcon_log(log, BCON( "small", BCON_INT32(1) )) == 0);
+
+    bcon_log_stats(log, &stats);
+    ck_assert_int_eq(stats.oversized, 1);
+    ck_assert_int_eq(stats.errors, 0);
+    ck_assert_int_eq(stats.logged, 1);
+
+    bcon_log_stop(log);
+
+    ck_assert_int_eq(count_lines(fp, NULL), 1);
+    ck_assert_int_eq(count_lines(fp, "small"), 1);
+
+    fclose(fp);
+}
+END_TEST
+
+START_TEST(test_log_errors)
+{
+    FILE * fp = tmpfile();
+    bcon_log_opts_t opts;
+    bcon_log_stats_t stats;
+    bcon_log_t * log;
+
+    log_opts_init(&opts, fp, 4, BCON_LOG_BLOCK);
+    ck_assert(bcon_log_start(&opts, &log) == NULL);
+
+    ck_assert(bcon_log(log, BCON( "a", BCON_INT32(1), BCON_INT32(2), "b" )) != 0);
+    ck_assert(bcon_log(log, BCON( "small", BCON_INT32(1) )) == 0);
+
+    bcon_log_stats(log, &stats);
+    ck_assert_int_eq(stats.errors, 1);
+    ck_assert_int_eq(stats.oversized, 0);
+    ck_assert_int_eq(stats.logged, 1);
+
+    bcon_log_stop(log);
+
+    ck_assert_int_eq(count_lines(fp, NULL), 1);
+
+    fclose(fp);
+}
+END_TEST
+
+START_TEST(test_log_too_large)
+{
+    bcon_log_opts_t opts;
+    bcon_log_t * log;
+    char * err_str;
+
+    log_opts_init(&opts, stderr, (size_t)1 << (sizeof(size_t) * 8 - 4), BCON_LOG_BLOCK);
+
+    err_str = bcon_log_start(&opts, &log);
+    ck_assert(err_str != NULL);
+    free(err_str);
+}
+END_TEST
+
+static void log_burst(bcon_log_policy_t policy)
+{
+    FILE * fp = tmpfile();
+    bcon_log_opts_t opts;
+    bcon_log_stats_t stats;
+    bcon_log_t * log;
+    int i;
+
+    log_opts_init(&opts, fp, 4, policy);
+    ck_assert(bcon_log_start(&opts, &log) == NULL);
+
+    for (i = 0; i < 10000; i++) bcon_log(log, BCON( "n", BCON_INT32(i) ));
+
+    /* producers are done, so once the writer catches up the counters are final */
+    do {
+        bcon_log_stats(log, &stats);
+    } while (stats.written < stats.logged);
+
+    ck_assert_int_eq(stats.logged + stats.dropped, 10000);
+    ck_assert_int_eq(stats.oversized, 0);
+
+    bcon_log_stop(log);
+
+    ck_assert_int_eq(count_lines(fp, NULL), stats.logged);
+
+    fclose(fp);
+}
+
+START_TEST(test_log_drop)
+{
+    log_burst(BCON_LOG_DROP);
+}
+END_TEST
+
+START_TEST(test_log_sample)
+{
+    log_burst(BCON_LOG_SAMPLE);
+}
+END_TEST
+
+START_TEST(test_log_bad_opts)
+{
+    bcon_log_opts_t opts;
+    bcon_log_t * log;
+    char * err_str;
+
+    log_opts_init(&opts, stderr, 6, BCON_LOG_DROP);
+
+    err_str = bcon_log_start(&opts, &log);
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    log_opts_init(&opts, stderr, 8, BCON_LOG_SAMPLE);
+    opts.sample_every = 0;
+
+    err_str = bcon_log_start(&opts, &log);
+    ck_assert(err_str != NULL);
+    free(err_str);
+}
+END_TEST
+
+static void * log_producer(void * data)
+{
+    bcon_log_t * log = data;
+    int i;
+
+    for (i = 0; i < N_PER_THREAD; i++) bcon_log(log, BCON( "n", BCON_INT32(i), "producer", "yes" ));
+
+    return NULL;
+}
+
+START_TEST(test_log_threads)
+{
+    FILE * fp = tmpfile();
+    bcon_log_opts_t opts;
+    bcon_log_stats_t stats;
+    bcon_log_t * log;
+    pthread_t threads[N_THREADS];
+    int i;
+
+    log_opts_init(&opts, fp, 16, BCON_LOG_BLOCK);
+    ck_assert(bcon_log_start(&opts, &log) == NULL);
+
+    for (i = 0; i < N_THREADS; i++) pthread_create(&threads[i], NULL, log_producer, log);
+    for (i = 0; i < N_THREADS; i++) pthread_join(threads[i], NULL);
+
+    bcon_log_stats(log, &stats);
+    ck_assert_int_eq(stats.logged, N_THREADS * N_PER_THREAD);
+    ck_assert_int_eq(stats.dropped, 0);
+
+    bcon_log_stop(log);
+
+    ck_assert_int_eq(count_lines(fp, "producer"), N_THREADS * N_PER_THREAD);
+
+    fclose(fp);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Log");
+    tcase_add_test(core, test_log_basic);
+    tcase_add_test(core, test_log_oversized);
+    tcase_add_test(core, test_log_errors);
+    tcase_add_test(core, test_log_too_large);
+    tcase_add_test(core, test_log_drop);
+    tcase_add_test(core, test_log_sample);
+    tcase_add_test(core, test_log_bad_opts);
+    tcase_add_test(core, test_log_threads);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,245 @@
+#include "bcon-test.h"
+
+static bson_t * person(char * name, bson_int32_t age, char * tag)
+{
+    bson_t * bson = bson_new();
+    char * err_str = bcon_to_bson(BCON(
+        "name", BCON_RUTF8(&name),
+        "age", BCON_INT32(age),
+        "tags", BCON_ARRAY( "x", BCON_RUTF8(&tag) ),
+        "addr", BCON_DOC( "zip", BCON_INT32(age * 1000) ),
+    ), bson);
+
+    free(err_str);
+
+    return bson;
+}
+
+static int count_cb(const bson_t * bson, void * ctx)
+{
+    (void)bson;
+    (*(int *)ctx)++;
+
+    return 0;
+}
+
+START_TEST(test_match_operators)
+{
+    bcon_matcher_t * m;
+    char * err_str;
+
+    bson_t * john = person("John", 30, "music");
+    bson_t * jane = person("Jane", 70, "dance");
+
+    err_str = bcon_matcher_compile(BCON(
+        "age", BCON_DOC( "$gte", BCON_INT32(21), "$lt", BCON_INT64(65) ),
+        "tags", BCON_DOC( "$in", BCON_ARRAY( "music", "art" ) ),
+        "addr.zip", BCON_DOUBLE(30000),
+        "missing", BCON_DOC( "$exists", BCON_BOOL(0) ),
+        "name", BCON_DOC( "$ne", "Bob" ),
+    ), &m);
+    ck_assert_msg(err_str == NULL, "Error in bcon_matcher_compile: (%s)", err_str);
+
+    ck_assert(bcon_matcher_match(m, john));
+    ck_assert(! bcon_matcher_match(m, jane));
+
+    bcon_matcher_destroy(m);
+
+    err_str = bcon_matcher_compile(BCON( "name", "Jane", "tags", "dance" ), &m);
+    ck_assert_msg(err_str == NULL, "Error in bcon_matcher_compile: (%s)", err_str);
+
+    ck_assert(! bcon_matcher_match(m, john));
+    ck_assert(bcon_matcher_match(m, jane));
+
+    bcon_matcher_destroy(m);
+
+    bson_destroy(john);
+    bson_destroy(jane);
+}
+END_TEST
+
+START_TEST(test_match_batch)
+{
+    bcon_matcher_t * m;
+    bson_uint8_t * buf = NULL;
+    size_t len = 0;
+    bson_t * b;
+    int i, seen = 0;
+
+    for (i = 0; i < 3000; i++) {
+        b = person("x", i % 100, "y");
+
+        buf = realloc(buf, len + b->len);
+        memcpy(buf + len, bson_get_data(b), b->len);
+        len += b->len;
+
+        bson_destroy(b);
+    }
+
+    ck_assert(bcon_matcher_compile(BCON( "age", BCON_DOC( "$lt", BCON_INT32(10) ) ), &m) == NULL);
+
+    ck_assert_int_eq(bcon_matcher_match_batch(m, buf, len, count_cb, &seen), 300);
+    ck_assert_int_eq(seen, 300);
+    ck_assert_int_eq(bcon_matcher_match_batch(m, buf, len - 1, NULL, NULL), -1);
+
+    bcon_matcher_destroy(m);
+    free(buf);
+}
+END_TEST
+
+START_TEST(test_match_arrays)
+{
+    bcon_matcher_t * m;
+
+    bson_t * john = person("John", 30, "music");
+
+    ck_assert(bcon_matcher_compile(BCON( "tags", BCON_ARRAY( "x", "music" ) ), &m) == NULL);
+    ck_assert(bcon_matcher_match(m, john));
+    bcon_matcher_destroy(m);
+
+    ck_assert(bcon_matcher_compile(BCON( "tags", BCON_ARRAY( "x", "art" ) ), &m) == NULL);
+    ck_assert(! bcon_matcher_match(m, john));
+    bcon_matcher_destroy(m);
+
+    ck_assert(bcon_matcher_compile(BCON( "tags", BCON_DOC( "$gt", BCON_ARRAY( "x", "art" ) ) ), &m) == NULL);
+    ck_assert(bcon_matcher_match(m, john));
+    bcon_matcher_destroy(m);
+
+    bson_destroy(john);
+}
+END_TEST
+
+START_TEST(test_match_array_paths)
+{
+    bcon_matcher_t * m;
+    bson_t * bson = bson_new();
+
+    bcon_to_bson(BCON(
+        "a", "[", "{", "b", BCON_INT32(1), "}", "{", "b", BCON_INT32(2), "}", BCON_INT32(3), "]",
+        "n", "[", "[", "{", "b", BCON_INT32(9), "}", "]", "]",
+    ), bson);
+
+    ck_assert(bcon_matcher_compile(BCON( "a.b", BCON_INT32(2) ), &m) == NULL);
+    ck_assert(bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    ck_assert(bcon_matcher_compile(BCON( "a.b", BCON_INT32(3) ), &m) == NULL);
+    ck_assert(! bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    ck_assert(bcon_matcher_compile(BCON( "a.b", BCON_DOC( "$ne", BCON_INT32(1) ) ), &m) == NULL);
+    ck_assert(! bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    ck_assert(bcon_matcher_compile(BCON( "a.b", BCON_DOC( "$exists", BCON_BOOL(1) ) ), &m) == NULL);
+    ck_assert(bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    ck_assert(bcon_matcher_compile(BCON( "a.1.b", BCON_INT32(2), "a.2", BCON_INT32(3) ), &m) == NULL);
+    ck_assert(bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    /* only documents directly in the array are stepped into */
+    ck_assert(bcon_matcher_compile(BCON( "n.b", BCON_DOC( "$exists", BCON_BOOL(1) ) ), &m) == NULL);
+    ck_assert(! bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    bson_destroy(bson);
+}
+END_TEST
+
+START_TEST(test_match_bytes)
+{
+    bcon_matcher_t * m;
+    bson_t * bson = bson_new();
+    bson_oid_t oid;
+
+    bson_oid_init(&oid, NULL);
+
+    bcon_to_bson(BCON(
+        "blob", BCON_BINARY(BSON_SUBTYPE_BINARY, "abc", 3),
+        "re", BCON_REGEX("^a", "i"),
+        "code", BCON_CODE("f()"),
+        "ptr", BCON_DBPOINTER("coll", &oid),
+    ), bson);
+
+    ck_assert(bcon_matcher_compile(BCON(
+        "blob", BCON_BINARY(BSON_SUBTYPE_BINARY, "abc", 3),
+        "re", BCON_REGEX("^a", "i"),
+        "code", BCON_CODE("f()"),
+        "ptr", BCON_DBPOINTER("coll", &oid),
+    ), &m) == NULL);
+    ck_assert(bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    ck_assert(bcon_matcher_compile(BCON( "blob", BCON_BINARY(BSON_SUBTYPE_BINARY, "abd", 3) ), &m) == NULL);
+    ck_assert(! bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    ck_assert(bcon_matcher_compile(BCON( "blob", BCON_DOC( "$ne", BCON_BINARY(BSON_SUBTYPE_BINARY, "abc", 3) ) ), &m) == NULL);
+    ck_assert(! bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    ck_assert(bcon_matcher_compile(BCON( "re", BCON_REGEX("^a", "m") ), &m) == NULL);
+    ck_assert(! bcon_matcher_match(m, bson));
+    bcon_matcher_destroy(m);
+
+    bson_destroy(bson);
+}
+END_TEST
+
+START_TEST(test_match_reorder)
+{
+    bcon_matcher_t * m;
+    bson_t * young = person("x", 5, "y");
+    bson_t * old = person("x", 50, "y");
+    int i;
+
+    /* the age clause fails most, moves first, and results don't change */
+    ck_assert(bcon_matcher_compile(BCON(
+        "name", "x",
+        "tags", "y",
+        "age", BCON_DOC( "$lt", BCON_INT32(10) ),
+    ), &m) == NULL);
+
+    for (i = 0; i < 3000; i++) {
+        ck_assert(bcon_matcher_match(m, young));
+        ck_assert(! bcon_matcher_match(m, old));
+    }
+
+    bcon_matcher_destroy(m);
+    bson_destroy(young);
+    bson_destroy(old);
+}
+END_TEST
+
+START_TEST(test_match_bad_pattern)
+{
+    bcon_matcher_t * m;
+    char * err_str;
+
+    err_str = bcon_matcher_compile(BCON( "a", BCON_DOC( "$foo", BCON_INT32(1) ) ), &m);
+    ck_assert(err_str != NULL);
+    ck_assert(m == NULL);
+    free(err_str);
+
+    err_str = bcon_matcher_compile(BCON( "a", BCON_DOC( "$in", BCON_INT32(1) ) ), &m);
+    ck_assert(err_str != NULL);
+    free(err_str);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Match");
+    tcase_add_test(core, test_match_operators);
+    tcase_add_test(core, test_match_batch);
+    tcase_add_test(core, test_match_arrays);
+    tcase_add_test(core, test_match_array_paths);
+    tcase_add_test(core, test_match_bytes);
+    tcase_add_test(core, test_match_reorder);
+    tcase_add_test(core, test_match_bad_pattern);
+    suite_add_tcase(s, core);
+
+    return;
+}
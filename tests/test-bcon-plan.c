@@ -0,0 +1,337 @@
+#include "bcon-test.h"
+
+static char * name;
+static bson_int32_t n;
+static bson_int64_t big;
+static double d;
+static bson_bool_t flag;
+static struct timeval tv;
+static struct timeval * tvp = &tv;
+static bson_t * sub;
+static bson_oid_t oid;
+
+static void setup(void)
+{
+    if (! sub) {
+        sub = bson_new();
+        bson_append_utf8(sub, "k", -1, "v", -1);
+        bson_oid_init(&oid, NULL);
+    }
+}
+
+/* compound literals only live as long as the enclosing block */
+#define TEMPLATE(i) BCON( \
+        "name", BCON_RUTF8(&name), \
+        "literal", "fixed", \
+        "i", BCON_INT32(i), \
+        "l", BCON_INT64(-5), \
+        "dbl", BCON_DOUBLE(-2.25), \
+        "yes", BCON_BOOL(1), \
+        "n", BCON_RINT32(&n), \
+        "big", BCON_RINT64(&big), \
+        "d", BCON_RDOUBLE(&d), \
+        "flag", BCON_RBOOL(&flag), \
+        "when", BCON_RDATE_TIME(&tvp), \
+        "slice", BCON_UTF8_LEN("sliced", 3), \
+        "sym", BCON_SYMBOL("s"), \
+        "null", BCON_NULL, \
+        "oid", BCON_BSON_OID(&oid), \
+        "sub", BCON_BSON_DOCUMENT(sub), \
+        "re", BCON_REGEX("^a", "i"), \
+        "re2", BCON_REGEX("^b", NULL), \
+        "bin", BCON_BINARY(BSON_SUBTYPE_BINARY, "deadbeef", 8), \
+        "ts", BCON_TIMESTAMP(1, 2), \
+        "code", BCON_CODE("f()"), \
+        "nested", BCON_DOC( "a", BCON_ARRAY( "b", BCON_DOC( "c", BCON_RINT64(&big) ), "[", "d", "]" ) ), \
+        "inline", "{", "a", "[", BCON_INT32(1), "{", "x", "y", "}", "]", "}", \
+        "list", "[", "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "]", \
+        "empty", "{", "}", \
+        "max", BCON_MAXKEY, \
+        "min", BCON_MINKEY \
+)
+
+static void check_plan(bcon_plan_t * plan, bcon_t * in)
+{
+    bson_uint8_t buf[1024];
+    bson_uint32_t size;
+
+    size = bcon_plan_encode(plan, in, buf, sizeof(buf));
+    ck_assert(size <= sizeof(buf));
+
+    bcon_eq_data(in, buf, size);
+}
+
+START_TEST(test_plan_matches_encoder)
+{
+    bcon_plan_t * plan;
+    int i;
+
+    setup();
+
+    ck_assert(bcon_plan_compile(TEMPLATE(0), &plan) == NULL);
+
+#ifdef __x86_64__
+    ck_assert(bcon_plan_is_native(plan));
+#endif
+
+    for (i = 0; i < 20; i++) {
+        char str[32];
+
+        sprintf(str, "user-%d", i * 1000);
+        name = str;
+        n = i;
+        big = (bson_int64_t)i << 40;
+        d = i / 3.0;
+        flag = i & 1;
+        tv.tv_sec = 1000 + i;
+        tv.tv_usec = i * 1000;
+
+        check_plan(plan, TEMPLATE(i * 7));
+    }
+
+    bcon_plan_destroy(plan);
+}
+END_TEST
+
+START_TEST(test_plan_short_buffer)
+{
+    bcon_plan_t * plan;
+    bson_uint8_t buf[64];
+    bson_uint32_t size;
+
+    setup();
+    name = "somebody";
+
+    ck_assert(bcon_plan_compile(TEMPLATE(1), &plan) == NULL);
+
+    memset(buf, 0xee, sizeof(buf));
+    size = bcon_plan_encode(plan, TEMPLATE(1), buf, 32);
+
+    ck_assert(size > sizeof(buf));
+    ck_assert_int_eq(buf[32], 0xee);
+
+    bcon_plan_destroy(plan);
+}
+END_TEST
+
+/* every short length has to return the full size and write nothing past it */
+START_TEST(test_plan_every_length)
+{
+    bcon_plan_t * plan;
+    bson_uint8_t buf[1024];
+    bson_uint32_t size, len;
+
+    setup();
+    name = "every";
+
+    ck_assert(bcon_plan_compile(TEMPLATE(2), &plan) == NULL);
+
+    size = bcon_plan_encode(plan, TEMPLATE(2), buf, sizeof(buf));
+    ck_assert(size < sizeof(buf));
+
+    for (len = 0; len <= size; len++) {
+        memset(buf, 0xee, sizeof(buf));
+
+        ck_assert_int_eq(bcon_plan_encode(plan, TEMPLATE(2), buf, len), size);
+        ck_assert_int_eq(buf[len], 0xee);
+    }
+
+    bcon_eq_data(TEMPLATE(2), buf, size);
+
+    bcon_plan_destroy(plan);
+}
+END_TEST
+
+static bson_int32_t * opt_n;
+static char ** opt_name;
+static bson_bool_t * opt_flag;
+static bson_bool_t show_a, show_b;
+
+#define OPTIONAL BCON( \
+        "first", BCON_INT32(1), \
+        "n", BCON_PINT32(&opt_n), \
+        "name", BCON_PUTF8(&opt_name), \
+        BCON_IF(&show_a, \
+            "a", BCON_RINT32(&n), \
+            BCON_IF(&show_b, "b", "[", "x", "y", "]"), \
+            "flag", BCON_PBOOL(&opt_flag) \
+        ), \
+        "sub", "{", "k", BCON_PINT32(&opt_n), "}", \
+        "last", "end" \
+)
+
+/* P bindings and BCON_IF() drop elements at encode time, natively too */
+START_TEST(test_plan_optional)
+{
+    bson_int32_t n_val = 7;
+    char * name_val = "nm";
+    bson_bool_t flag_val = 1;
+    bson_uint8_t buf[256];
+    bcon_plan_t * plan;
+    bson_uint32_t size, len;
+    int i;
+
+    n = 3;
+
+    ck_assert(bcon_plan_compile(OPTIONAL, &plan) == NULL);
+
+#ifdef __x86_64__
+    ck_assert(bcon_plan_is_native(plan));
+#endif
+
+    for (i = 0; i < 32; i++) {
+        opt_n = i & 1 ? &n_val : NULL;
+        opt_name = i & 2 ? &name_val : NULL;
+        opt_flag = i & 4 ? &flag_val : NULL;
+        show_a = (i & 8) != 0;
+        show_b = (i & 16) != 0;
+
+        size = bcon_plan_encode(plan, OPTIONAL, buf, sizeof(buf));
+        ck_assert(size <= sizeof(buf));
+        bcon_eq_data(OPTIONAL, buf, size);
+
+        for (len = 0; len < size; len++) {
+            memset(buf, 0xee, sizeof(buf));
+            ck_assert_int_eq(bcon_plan_encode(plan, OPTIONAL, buf, len), size);
+            ck_assert_int_eq(buf[len], 0xee);
+        }
+    }
+
+    bcon_plan_destroy(plan);
+}
+END_TEST
+
+/* a short buffer still generates each value once, in one pass */
+START_TEST(test_plan_generates_once)
+{
+    bson_oid_t before, id, after;
+    bson_uint8_t buf[8];
+    bcon_plan_t * plan;
+
+    ck_assert(bcon_plan_compile(BCON( "_id", BCON_NEW_OID(&id) ), &plan) == NULL);
+
+    bcon_oid_gen(&before);
+    ck_assert_int_eq(bcon_plan_encode(plan, BCON( "_id", BCON_NEW_OID(&id) ), buf, sizeof(buf)), 4 + 1 + 4 + 12 + 1);
+    bcon_oid_gen(&after);
+
+    ck_assert_int_eq(id.bytes[11], (bson_uint8_t)(before.bytes[11] + 1));
+    ck_assert_int_eq(after.bytes[11], (bson_uint8_t)(before.bytes[11] + 2));
+
+    bcon_plan_destroy(plan);
+}
+END_TEST
+
+static int cb(bcon_append_ctx_t * ctx, void * data)
+{
+    return 0;
+}
+
+START_TEST(test_plan_rejects)
+{
+    bson_int32_t * missing = NULL;
+    bson_bool_t yes = 1;
+    char * key = "k";
+    bcon_t * child = BCON( "a", BCON_INT32(1) );
+    bcon_plan_t * plan;
+    char * err;
+
+    /* dropping an array element would renumber the rest */
+    err = bcon_plan_compile(BCON( "a", "[", BCON_PINT32(&missing), "]" ), &plan);
+    ck_assert(err != NULL);
+    ck_assert(plan == NULL);
+    free(err);
+
+    err = bcon_plan_compile(BCON( "a", "[", BCON_IF(&yes, "b"), "]" ), &plan);
+    ck_assert(err != NULL);
+    free(err);
+
+    err = bcon_plan_compile(BCON( "cb", BCON_CALLBACK_DOC(cb, NULL) ), &plan);
+    ck_assert(err != NULL);
+    free(err);
+
+    err = bcon_plan_compile(BCON( BCON_RUTF8(&key), "v" ), &plan);
+    ck_assert(err != NULL);
+    free(err);
+
+    err = bcon_plan_compile(BCON( "a", BCON_INT32(1), BCON_INT32(2) ), &plan);
+    ck_assert(err != NULL);
+    free(err);
+
+    /* a bound container could point at a different shape next time */
+    err = bcon_plan_compile(BCON( "d", BCON_RBCON_DOCUMENT(&child) ), &plan);
+    ck_assert(err != NULL);
+    free(err);
+
+    err = bcon_plan_compile(BCON( "a", BCON_RBCON_ARRAY(&child) ), &plan);
+    ck_assert(err != NULL);
+    free(err);
+}
+END_TEST
+
+static const bson_t * run_hot(bcon_ctx_t * ctx, bcon_hot_t * hot, bson_int32_t i)
+{
+    return bcon_ctx_to_bson_hot(ctx, hot, BCON( "i", BCON_INT32(i), "n", BCON_RINT32(&n), "a", "[", BCON_RUTF8(&name), "]" ));
+}
+
+START_TEST(test_plan_hot)
+{
+    static bcon_hot_t hot = BCON_HOT_INIT;
+    static bcon_hot_t cold = BCON_HOT_INIT;
+    bson_int32_t * missing = NULL;
+    const bson_t * bson;
+    bson_t * expected;
+    bcon_ctx_t ctx;
+    char big_name[2000];
+    int i;
+
+    bcon_ctx_init(&ctx);
+    name = "x";
+
+    for (i = 0; i < 2 * BCON_HOT_THRESHOLD; i++) {
+        n = -i;
+
+        if (i == BCON_HOT_THRESHOLD + 10) {
+            memset(big_name, 'y', sizeof(big_name) - 1);
+            big_name[sizeof(big_name) - 1] = '\0';
+            name = big_name;
+        }
+
+        bson = run_hot(&ctx, &hot, i);
+        ck_assert(bson != NULL);
+
+        ck_assert((hot.plan != NULL) == (i >= BCON_HOT_THRESHOLD - 1));
+
+        expected = bson_new();
+        bcon_to_bson(BCON( "i", BCON_INT32(i), "n", BCON_RINT32(&n), "a", "[", BCON_RUTF8(&name), "]" ), expected);
+        ck_assert_int_eq(bson->len, expected->len);
+        ck_assert(memcmp(bson_get_data(bson), bson_get_data(expected), bson->len) == 0);
+        bson_destroy(expected);
+
+        bson = bcon_ctx_to_bson_hot(&ctx, &cold, BCON( "p", "[", BCON_PINT32(&missing), "]", "i", BCON_INT32(i) ));
+        ck_assert(bson != NULL);
+        ck_assert_int_eq(bson->len, 5 + 1 + 2 + 5 + 1 + 2 + 4);
+    }
+
+    ck_assert(cold.plan == NULL);
+    ck_assert(cold.cold);
+
+    bcon_hot_destroy(&hot);
+    bcon_hot_destroy(&cold);
+    bcon_ctx_destroy(&ctx);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Plan");
+    tcase_add_test(core, test_plan_matches_encoder);
+    tcase_add_test(core, test_plan_short_buffer);
+    tcase_add_test(core, test_plan_every_length);
+    tcase_add_test(core, test_plan_optional);
+    tcase_add_test(core, test_plan_generates_once);
+    tcase_add_test(core, test_plan_rejects);
+    tcase_add_test(core, test_plan_hot);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,142 @@
+#include "bcon-test.h"
+
+START_TEST(test_project)
+{
+    bson_t * src = bson_new();
+    bson_t * out = bson_new();
+    char * err_str;
+
+    bcon_to_bson(BCON(
+        "_id", BCON_INT32(1),
+        "name", "John",
+        "addr", BCON_DOC( "street", "Main", "zip", BCON_INT32(12345) ),
+        "kids", BCON_ARRAY( BCON_DOC( "name", "a", "age", BCON_INT32(3) ), BCON_DOC( "name", "b" ) ),
+        "junk", BCON_DOUBLE(1.5),
+    ), src);
+
+    err_str = bcon_project(src, BCON(
+        "name", BCON_BOOL(1),
+        "_id", BCON_BOOL(1),
+        "addr", "{", "zip", BCON_BOOL(1), "}",
+        "kids", BCON_DOC( "age", BCON_BOOL(1) ),
+        "nope", BCON_BOOL(1),
+    ), out);
+    ck_assert_msg(err_str == NULL, "Error in bcon_project: (%s)", err_str);
+
+    bcon_eq_bson(BCON(
+        "_id", BCON_INT32(1),
+        "name", "John",
+        "addr", BCON_DOC( "zip", BCON_INT32(12345) ),
+        "kids", BCON_ARRAY( BCON_DOC( "age", BCON_INT32(3) ), BCON_DOC() ),
+    ), out);
+
+    bson_destroy(src);
+}
+END_TEST
+
+START_TEST(test_project_array_renumbered)
+{
+    bson_t * src = bson_new();
+    bson_t * out = bson_new();
+    char * err_str;
+
+    bcon_to_bson(BCON(
+        "kids", BCON_ARRAY( "skip", BCON_DOC( "name", "a", "age", BCON_INT32(3) ), BCON_INT32(7), BCON_DOC( "age", BCON_INT32(5) ) ),
+        "code", BCON_CODE("f()"),
+        "re", BCON_REGEX("^a", "i"),
+    ), src);
+
+    err_str = bcon_project(src, BCON( "kids", BCON_DOC( "age", BCON_BOOL(1) ), "code", BCON_BOOL(1), "re", BCON_BOOL(1) ), out);
+    ck_assert_msg(err_str == NULL, "Error in bcon_project: (%s)", err_str);
+
+    bcon_eq_bson(BCON(
+        "kids", BCON_ARRAY( BCON_DOC( "age", BCON_INT32(3) ), BCON_DOC( "age", BCON_INT32(5) ) ),
+        "code", BCON_CODE("f()"),
+        "re", BCON_REGEX("^a", "i"),
+    ), out);
+
+    bson_destroy(src);
+}
+END_TEST
+
+START_TEST(test_project_bad_spec)
+{
+    bson_t * src = bson_new();
+    bson_t * out = bson_new();
+    char * err_str;
+
+    bson_append_int32(src, "a", -1, 1);
+
+    err_str = bcon_project(src, BCON( "a", "{", "b", BCON_BOOL(1), "}", "}" ), out);
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    err_str = bcon_project(src, BCON( "a", "[", "]" ), out);
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    bson_destroy(src);
+    bson_destroy(out);
+}
+END_TEST
+
+START_TEST(test_project_buffers)
+{
+    bson_t * src = bson_new();
+    bson_t * out = bson_new();
+    bson_t arr, elem;
+    char big[2000];
+    char key[8];
+    char * err_str;
+    char * bigp = big;
+    int i;
+
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+
+    bcon_to_bson(BCON( "big", BCON_RUTF8(&bigp), "n", BCON_INT32(1) ), src);
+
+    /* array keys shorter than the indices they're renumbered to */
+    bson_append_array_begin(src, "a", -1, &arr);
+    for (i = 0; i < 400; i++) {
+        bson_append_document_begin(&arr, "", 0, &elem);
+        bson_append_int32(&elem, "v", -1, i);
+        bson_append_document_end(&arr, &elem);
+    }
+    bson_append_array_end(src, &arr);
+
+    err_str = bcon_project(src, BCON( "big", BCON_BOOL(1), "a", BCON_DOC( "v", BCON_BOOL(1) ) ), out);
+    ck_assert_msg(err_str == NULL, "Error in bcon_project: (%s)", err_str);
+
+    bson_destroy(src);
+    src = bson_new();
+
+    bson_append_utf8(src, "big", -1, big, -1);
+    bson_append_array_begin(src, "a", -1, &arr);
+    for (i = 0; i < 400; i++) {
+        sprintf(key, "%d", i);
+        bson_append_document_begin(&arr, key, -1, &elem);
+        bson_append_int32(&elem, "v", -1, i);
+        bson_append_document_end(&arr, &elem);
+    }
+    bson_append_array_end(src, &arr);
+
+    ck_assert_int_eq(out->len, src->len);
+    ck_assert(memcmp(bson_get_data(out), bson_get_data(src), src->len) == 0);
+
+    bson_destroy(src);
+    bson_destroy(out);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Project");
+    tcase_add_test(core, test_project);
+    tcase_add_test(core, test_project_array_renumbered);
+    tcase_add_test(core, test_project_bad_spec);
+    tcase_add_test(core, test_project_buffers);
+    suite_add_tcase(s, core);
+
+    return;
+}
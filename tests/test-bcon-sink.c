@@ -0,0 +1,160 @@
+#include <zlib.h>
+
+#include "bcon-test.h"
+
+typedef struct mem_sink {
+    bson_uint8_t * data;
+    size_t len;
+    int writes;
+} mem_sink_t;
+
+static int mem_write(bcon_sink_t * sink, const bson_uint8_t * data, size_t len)
+{
+    mem_sink_t * mem = sink->data;
+
+    mem->data = realloc(mem->data, mem->len + len);
+    memcpy(mem->data + mem->len, data, len);
+    mem->len += len;
+    mem->writes++;
+
+    return 0;
+}
+
+static void mem_init(bcon_sink_t * sink, mem_sink_t * mem)
+{
+    memset(sink, 0, sizeof(*sink));
+    memset(mem, 0, sizeof(*mem));
+
+    sink->write = mem_write;
+    sink->data = mem;
+}
+
+static char * big_string(void)
+{
+    static char * big;
+
+    if (! big) {
+        big = malloc(10000);
+        memset(big, 'q', 9999);
+        big[9999] = '\0';
+    }
+
+    return big;
+}
+
+START_TEST(test_sink_plain)
+{
+    bson_t * bson = bson_new();
+    bcon_sink_t sink;
+    mem_sink_t mem;
+    char * big = big_string();
+
+    bcon_t * bcon = BCON(
+        "a", BCON_INT32(1),
+        "big", big,
+        "b", BCON_DOC( "c", "d" ),
+    );
+
+    ck_assert(bcon_to_bson(bcon, bson) == NULL);
+
+    mem_init(&sink, &mem);
+
+    ck_assert(bcon_encode_to_sink(bcon, &sink) == NULL);
+    ck_assert_int_eq(mem.len, bson->len);
+    ck_assert(memcmp(mem.data, bson_get_data(bson), mem.len) == 0);
+    ck_assert_int_eq(mem.writes, (bson->len + BCON_SINK_CHUNK - 1) / BCON_SINK_CHUNK);
+
+    free(mem.data);
+    bson_destroy(bson);
+}
+END_TEST
+
+START_TEST(test_sink_zlib_batch)
+{
+    bson_t * bson;
+    bcon_sink_t sink, zlib;
+    mem_sink_t mem;
+    bcon_t * docs[300];
+    bson_uint8_t * expected = NULL;
+    size_t expected_len = 0;
+    bson_uint8_t * out;
+    uLongf out_len;
+    char * big = big_string();
+    int i;
+
+    bcon_t * small_doc = BCON( "i", BCON_INT32(1) );
+    bcon_t * nested_doc = BCON( "a", "[", "x", "{", "y", BCON_INT64(2), "}", "]" );
+    bcon_t * big_doc = BCON( "i", BCON_INT32(3), "big", big );
+
+    for (i = 0; i < 300; i++) {
+        docs[i] = i == 150 ? big_doc : i % 2 ? nested_doc : small_doc;
+    }
+
+    for (i = 0; i < 300; i++) {
+        bson = bson_new();
+        ck_assert(bcon_to_bson(docs[i], bson) == NULL);
+
+        expected = realloc(expected, expected_len + bson->len);
+        memcpy(expected + expected_len, bson_get_data(bson), bson->len);
+        expected_len += bson->len;
+
+        bson_destroy(bson);
+    }
+
+    mem_init(&sink, &mem);
+    ck_assert(bcon_sink_zlib_init(&zlib, &sink, Z_DEFAULT_COMPRESSION) == NULL);
+
+    ck_assert(bcon_encode_batch_to_sink(docs, 300, &zlib) == NULL);
+    ck_assert_int_eq(bcon_sink_finish(&zlib), 0);
+    bcon_sink_destroy(&zlib);
+
+    ck_assert(mem.len < expected_len);
+
+    out_len = expected_len;
+    out = malloc(out_len);
+
+    ck_assert_int_eq(uncompress(out, &out_len, mem.data, mem.len), Z_OK);
+    ck_assert_int_eq(out_len, expected_len);
+    ck_assert(memcmp(out, expected, expected_len) == 0);
+
+    free(out);
+    free(expected);
+    free(mem.data);
+}
+END_TEST
+
+static int no_fields(bcon_append_ctx_t * ctx, void * data)
+{
+    (void)ctx;
+    (void)data;
+
+    return 0;
+}
+
+START_TEST(test_sink_error)
+{
+    bcon_sink_t sink;
+    mem_sink_t mem;
+    char * err_str;
+
+    mem_init(&sink, &mem);
+
+    err_str = bcon_encode_to_sink(BCON( "a", BCON_CALLBACK_DOC(no_fields, NULL) ), &sink);
+
+    ck_assert(err_str != NULL);
+
+    free(err_str);
+    free(mem.data);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Sink");
+    tcase_add_test(core, test_sink_plain);
+    tcase_add_test(core, test_sink_zlib_batch);
+    tcase_add_test(core, test_sink_error);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,88 @@
+#include "bcon-test.h"
+
+START_TEST(test_size_totals)
+{
+    bson_t * bson = bson_new();
+    bcon_size_report_t report;
+
+    bcon_t * bcon = BCON(
+        "a", BCON_INT32(1),
+        "b", BCON_DOC( "c", "hello", "d", BCON_ARRAY( BCON_INT64(2), BCON_DOUBLE(1.5) ) ),
+        "e", "[", "x", "{", "y", BCON_NULL, "}", "]",
+    );
+
+    ck_assert(bcon_to_bson(bcon, bson) == NULL);
+    ck_assert(bcon_size_report(bcon, &report, NULL) == NULL);
+
+    ck_assert_int_eq(report.total, bson->len);
+    ck_assert_int_eq(report.total, report.key_bytes + report.value_bytes + report.overhead_bytes);
+    ck_assert_int_eq(report.elements, 10);
+    ck_assert_int_eq(report.max_depth, 3);
+    ck_assert_int_eq(report.overhead_bytes, 5 * 5);
+
+    bson_destroy(bson);
+}
+END_TEST
+
+START_TEST(test_size_tree)
+{
+    bcon_size_report_t report;
+    char * tree = NULL;
+
+    ck_assert(bcon_size_report(BCON( "a", BCON_INT32(1), "b", BCON_DOC( "c", "hi" ) ), &report, &tree) == NULL);
+
+    ck_assert_str_eq(tree,
+        "{\n"
+        "  \"a\" : 7 (key 3, value 4),\n"
+        "  \"b\" : 18 (key 3, value 15, elements 1, depth 1) {\n"
+        "    \"c\" : 10 (key 3, value 7)\n"
+        "  }\n"
+        "}\n"
+        "30 bytes (keys 9, values 11, overhead 10), 3 elements, depth 2"
+    );
+
+    free(tree);
+}
+END_TEST
+
+START_TEST(test_size_subtree)
+{
+    bcon_size_report_t report;
+    char * tree = NULL;
+
+    ck_assert(bcon_size_report(BCON( "a", "[", "{", "b", "[", BCON_INT32(1), BCON_INT32(2), "]", "}", "x", "]" ), &report, &tree) == NULL);
+
+    ck_assert(strstr(tree, "\"a\" : 47 (key 3, value 44, elements 5, depth 3) [") != NULL);
+    ck_assert(strstr(tree, "\"0\" : 30 (key 3, value 27, elements 3, depth 2) {") != NULL);
+    ck_assert(strstr(tree, "\"b\" : 22 (key 3, value 19, elements 2, depth 1) [") != NULL);
+    ck_assert_int_eq(report.elements, 6);
+    ck_assert_int_eq(report.max_depth, 4);
+
+    free(tree);
+}
+END_TEST
+
+START_TEST(test_size_error)
+{
+    bcon_size_report_t report;
+    char * tree = NULL;
+    char * err_str = bcon_size_report(BCON( "a", BCON_INT32(1), BCON_INT32(2), "b" ), &report, &tree);
+
+    ck_assert(err_str != NULL);
+    ck_assert(tree == NULL);
+
+    free(err_str);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Size");
+    tcase_add_test(core, test_size_totals);
+    tcase_add_test(core, test_size_tree);
+    tcase_add_test(core, test_size_subtree);
+    tcase_add_test(core, test_size_error);
+    suite_add_tcase(s, core);
+
+    return;
+}
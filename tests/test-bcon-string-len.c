@@ -0,0 +1,110 @@
+#include "bcon-test.h"
+
+static const char packet[] = "GETusers/42HTTPfunction(){}";
+
+static void expected_bson(bson_t * bson)
+{
+    bson_append_utf8(bson, "method", -1, "GET", -1);
+    bson_append_symbol(bson, "path", -1, "users/42", -1);
+    bson_append_code(bson, "fn", -1, "function(){}");
+    bson_append_utf8(bson, "empty", -1, "", -1);
+}
+
+#define PACKET_TEMPLATE BCON( \
+    "method", BCON_UTF8_LEN(packet, 3), \
+    "path", BCON_SYMBOL_LEN(packet + 3, 8), \
+    "fn", BCON_CODE_LEN(packet + 15, 12), \
+    "empty", BCON_UTF8_LEN(packet, 0) \
+)
+
+START_TEST(test_string_len_to_bson)
+{
+    bson_t * bson = bson_new();
+    bson_t * expected = bson_new();
+
+    ck_assert(bcon_to_bson(PACKET_TEMPLATE, bson) == NULL);
+    expected_bson(expected);
+
+    ck_assert_int_eq(bson->len, expected->len);
+    ck_assert(memcmp(bson_get_data(bson), bson_get_data(expected), bson->len) == 0);
+
+    bson_destroy(bson);
+    bson_destroy(expected);
+}
+END_TEST
+
+START_TEST(test_string_len_encoder)
+{
+    bson_t * expected = bson_new();
+    const bson_t * bson;
+    bson_uint32_t size;
+    bcon_ctx_t ctx;
+
+    expected_bson(expected);
+
+    ck_assert(bcon_encoded_size(PACKET_TEMPLATE, &size) == NULL);
+    ck_assert_int_eq(size, expected->len);
+
+    bcon_ctx_init(&ctx);
+    bson = bcon_ctx_to_bson(&ctx, PACKET_TEMPLATE);
+
+    ck_assert(bson != NULL);
+    ck_assert_int_eq(bson->len, expected->len);
+    ck_assert(memcmp(bson_get_data(bson), bson_get_data(expected), bson->len) == 0);
+
+    bcon_ctx_destroy(&ctx);
+    bson_destroy(expected);
+}
+END_TEST
+
+START_TEST(test_string_len_hash_equal)
+{
+    bson_t * expected = bson_new();
+    bcon_hash_t a, b;
+
+    expected_bson(expected);
+
+    ck_assert(bcon_hash(PACKET_TEMPLATE, BCON_HASH_VALUES, &a) == NULL);
+    bcon_hash_bson(expected, BCON_HASH_VALUES, &b);
+    ck_assert(a.lo == b.lo && a.hi == b.hi);
+
+    ck_assert(bcon_equal_bson(PACKET_TEMPLATE, expected));
+    ck_assert(! bcon_equal_bson(BCON( "method", BCON_UTF8_LEN(packet, 2) ), expected));
+
+    bson_destroy(expected);
+}
+END_TEST
+
+START_TEST(test_string_len_ref)
+{
+    bcon_string_t slice = { packet, 3 };
+    bcon_string_t * slice_ref = &slice;
+    bson_t * bson = bson_new();
+    bson_iter_t iter;
+    bcon_t * tmpl = BCON( "a", BCON_BCON_UTF8_LEN(&slice), "b", BCON_RBCON_UTF8_LEN(&slice_ref) );
+    bson_uint32_t len;
+
+    slice.str = packet + 3;
+    slice.length = 5;
+
+    ck_assert(bcon_to_bson(tmpl, bson) == NULL);
+    ck_assert(bson_iter_init_find(&iter, bson, "a"));
+    ck_assert_str_eq(bson_iter_utf8(&iter, &len), "users");
+    ck_assert(bson_iter_init_find(&iter, bson, "b"));
+    ck_assert_str_eq(bson_iter_utf8(&iter, &len), "users");
+
+    bson_destroy(bson);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("StringLen");
+    tcase_add_test(core, test_string_len_to_bson);
+    tcase_add_test(core, test_string_len_encoder);
+    tcase_add_test(core, test_string_len_hash_equal);
+    tcase_add_test(core, test_string_len_ref);
+    suite_add_tcase(s, core);
+
+    return;
+}
@@ -0,0 +1,279 @@
+#include "bcon-test.h"
+
+typedef struct point {
+    double x;
+    double y;
+} point_t;
+
+typedef struct sample {
+    bson_int32_t id;
+    bson_int64_t ts;
+    char * host;
+    bson_bool_t ok;
+    bson_int32_t * limit;
+    bson_oid_t * oid;
+    point_t origin;
+    point_t * path;
+    size_t path_len;
+} sample_t;
+
+static bcon_field_t point_fields[] = {
+    BCON_FIELD(point_t, x, DOUBLE),
+    BCON_FIELD(point_t, y, DOUBLE),
+    BCON_FIELD_END
+};
+
+static bcon_struct_t point_desc = BCON_STRUCT(point_t, point_fields);
+
+static bcon_field_t sample_fields[] = {
+    BCON_FIELD_AS("_id", sample_t, id, INT32),
+    BCON_FIELD(sample_t, ts, INT64),
+    BCON_FIELD(sample_t, host, UTF8),
+    BCON_FIELD(sample_t, ok, BOOL),
+    BCON_FIELD(sample_t, limit, RINT32),
+    BCON_FIELD(sample_t, oid, BSON_OID),
+    BCON_FIELD_STRUCT(sample_t, origin, point_desc),
+    BCON_FIELD_STRUCT_ARRAY(sample_t, path, path_len, point_desc),
+    BCON_FIELD_END
+};
+
+static bcon_struct_t sample_desc = BCON_STRUCT(sample_t, sample_fields);
+
+static void sample_init(sample_t * s, int i, bson_int32_t * limit, bson_oid_t * oid, point_t * path)
+{
+    s->id = i;
+    s->ts = 1000000000000LL + i;
+    s->host = i % 2 ? "db1" : "db2";
+    s->ok = i % 3 == 0;
+    s->limit = limit;
+    s->oid = oid;
+    s->origin.x = i;
+    s->origin.y = -i;
+    s->path = path;
+    s->path_len = i % 3;
+}
+
+static void sample_expected_path(sample_t * s, bson_t * bson)
+{
+    bson_t path, child;
+    char i_str[24];
+    size_t i;
+
+    bson_append_array_begin(bson, "path", -1, &path);
+
+    for (i = 0; i < s->path_len; i++) {
+        sprintf(i_str, "%zu", i);
+        bson_append_document_begin(&path, i_str, -1, &child);
+        bson_append_double(&child, "x", -1, s->path[i].x);
+        bson_append_double(&child, "y", -1, s->path[i].y);
+        bson_append_document_end(&path, &child);
+    }
+
+    bson_append_array_end(bson, &path);
+}
+
+static void sample_build(sample_t * s, bson_t * bson)
+{
+    ck_assert(bcon_to_bson(BCON(
+        "_id", BCON_INT32(s->id),
+        "ts", BCON_INT64(s->ts),
+        "host", s->host,
+        "ok", BCON_BOOL(s->ok),
+        "limit", BCON_INT32(*s->limit),
+        "oid", BCON_BSON_OID(s->oid),
+        "origin", BCON_DOC( "x", BCON_DOUBLE(s->origin.x), "y", BCON_DOUBLE(s->origin.y) ),
+    ), bson) == NULL);
+
+    sample_expected_path(s, bson);
+}
+
+START_TEST(test_struct_single)
+{
+    bson_t * bson = bson_new();
+    bson_t * expected = bson_new();
+    bson_int32_t limit = 50;
+    bson_oid_t oid;
+    point_t path[2] = { { 1, 2 }, { 3, 4 } };
+    sample_t s;
+
+    bson_oid_init(&oid, NULL);
+    sample_init(&s, 2, &limit, &oid, path);
+
+    ck_assert(bcon_struct_to_bson(&sample_desc, &s, bson) == NULL);
+
+    sample_build(&s, expected);
+
+    ck_assert_int_eq(bson->len, expected->len);
+    ck_assert(memcmp(bson_get_data(bson), bson_get_data(expected), bson->len) == 0);
+
+    bson_destroy(bson);
+    bson_destroy(expected);
+}
+END_TEST
+
+START_TEST(test_struct_write)
+{
+    bson_uint8_t * buf = NULL;
+    size_t buflen = 0;
+    bson_writer_t * writer = bson_writer_new(&buf, &buflen, 0, NULL, NULL);
+    bson_t * expected;
+    bson_int32_t limit = 7;
+    bson_oid_t oid;
+    point_t path[2] = { { 1, 2 }, { 3, 4 } };
+    sample_t samples[20];
+    size_t off = 0;
+    int i;
+
+    bson_oid_init(&oid, NULL);
+
+    for (i = 0; i < 20; i++) sample_init(&samples[i], i, &limit, &oid, path);
+
+    ck_assert(bcon_struct_write(&sample_desc, samples, 20, writer) == NULL);
+
+    for (i = 0; i < 20; i++) {
+        expected = bson_new();
+        sample_build(&samples[i], expected);
+
+        ck_assert(off + expected->len <= bson_writer_get_length(writer));
+        ck_assert(memcmp(buf + off, bson_get_data(expected), expected->len) == 0);
+        off += expected->len;
+
+        bson_destroy(expected);
+    }
+
+    ck_assert_int_eq(off, bson_writer_get_length(writer));
+
+    bson_writer_destroy(writer);
+    free(buf);
+}
+END_TEST
+
+START_TEST(test_struct_array)
+{
+    bson_t * bson = bson_new();
+    bson_t * expected = bson_new();
+    point_t points[3] = { { 1, 2 }, { 3, 4 }, { 5, 6 } };
+
+    ck_assert(bcon_struct_array_to_bson(&point_desc, points, 3, bson, "points") == NULL);
+
+    ck_assert(bcon_to_bson(BCON(
+        "points", "[",
+            "{", "x", BCON_DOUBLE(1), "y", BCON_DOUBLE(2), "}",
+            "{", "x", BCON_DOUBLE(3), "y", BCON_DOUBLE(4), "}",
+            "{", "x", BCON_DOUBLE(5), "y", BCON_DOUBLE(6), "}",
+        "]"
+    ), expected) == NULL);
+
+    ck_assert_int_eq(bson->len, expected->len);
+    ck_assert(memcmp(bson_get_data(bson), bson_get_data(expected), bson->len) == 0);
+
+    bson_destroy(bson);
+    bson_destroy(expected);
+}
+END_TEST
+
+START_TEST(test_struct_bad_descriptor)
+{
+    static bcon_field_t bad_fields[] = {
+        { "p", BCONT_DOC_START, 0, NULL, 0 },
+        BCON_FIELD_END
+    };
+    static bcon_struct_t bad_desc = BCON_STRUCT(point_t, bad_fields);
+
+    char * err_str = bcon_struct_init(&bad_desc);
+
+    ck_assert(err_str != NULL);
+    ck_assert(! bad_desc.ready);
+
+    free(err_str);
+}
+END_TEST
+
+typedef struct retry {
+    bson_int32_t * n;
+    point_t p;
+} retry_t;
+
+START_TEST(test_struct_retry)
+{
+    static bcon_field_t retry_fields[] = {
+        BCON_FIELD(retry_t, n, RINT32),
+        { "p", BCONT_DOC_START, offsetof(retry_t, p), NULL, 0 },
+        BCON_FIELD_END
+    };
+    static bcon_struct_t retry_desc = BCON_STRUCT(retry_t, retry_fields);
+    bson_int32_t n = 7;
+    retry_t r = { &n, { 1, 2 } };
+    bson_t * bson = bson_new();
+    char * err_str;
+
+    err_str = bcon_struct_init(&retry_desc);
+    ck_assert(err_str != NULL);
+    free(err_str);
+
+    ck_assert_int_eq(retry_fields[0].type, BCONT_RINT32);
+
+    retry_fields[1].nested = &point_desc;
+
+    err_str = bcon_struct_to_bson(&retry_desc, &r, bson);
+    ck_assert_msg(err_str == NULL, "Error in bcon_struct_to_bson: (%s)", err_str);
+
+    bcon_eq_bson(BCON( "n", BCON_INT32(7), "p", BCON_DOC( "x", BCON_DOUBLE(1), "y", BCON_DOUBLE(2) ) ), bson);
+}
+END_TEST
+
+typedef struct nullable {
+    bson_int32_t * r;
+    bson_int32_t ** p;
+} nullable_t;
+
+START_TEST(test_struct_null_pointers)
+{
+    static bcon_field_t nullable_fields[] = {
+        BCON_FIELD(nullable_t, r, RINT32),
+        BCON_FIELD(nullable_t, p, PINT32),
+        BCON_FIELD_END
+    };
+    static bcon_struct_t nullable_desc = BCON_STRUCT(nullable_t, nullable_fields);
+    bson_int32_t n = 1, m = 2;
+    bson_int32_t * m_ptr = NULL;
+    nullable_t rec = { &n, NULL };
+    bson_t * bson;
+    char * err_str;
+
+    bson = bson_new();
+    ck_assert(bcon_struct_to_bson(&nullable_desc, &rec, bson) == NULL);
+    bcon_eq_bson(BCON( "r", BCON_INT32(1) ), bson);
+
+    rec.p = &m_ptr;
+    bson = bson_new();
+    ck_assert(bcon_struct_to_bson(&nullable_desc, &rec, bson) == NULL);
+    bcon_eq_bson(BCON( "r", BCON_INT32(1) ), bson);
+
+    m_ptr = &m;
+    bson = bson_new();
+    ck_assert(bcon_struct_to_bson(&nullable_desc, &rec, bson) == NULL);
+    bcon_eq_bson(BCON( "r", BCON_INT32(1), "p", BCON_INT32(2) ), bson);
+
+    rec.r = NULL;
+    bson = bson_new();
+    err_str = bcon_struct_to_bson(&nullable_desc, &rec, bson);
+    ck_assert(err_str != NULL);
+    free(err_str);
+    bson_destroy(bson);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Struct");
+    tcase_add_test(core, test_struct_single);
+    tcase_add_test(core, test_struct_write);
+    tcase_add_test(core, test_struct_array);
+    tcase_add_test(core, test_struct_bad_descriptor);
+    tcase_add_test(core, test_struct_retry);
+    tcase_add_test(core, test_struct_null_pointers);
+    suite_add_tcase(s, core);
+
+    return;
+}
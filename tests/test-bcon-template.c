@@ -0,0 +1,134 @@
+#include "bcon-test.h"
+
+START_TEST(test_template_literals)
+{
+    bcon_template_t * t;
+    bson_t * bson = bson_new();
+
+    ck_assert(bcon_template_compile(
+        " { \"a\" : 1, \"b\": -5000000000, \"c\": 2.5, \"d\": \"x\\\"y\\u00e9\","
+        " \"e\": true, \"f\": false, \"g\": null, \"h\": \"{\","
+        " \"i\": { \"j\": [ 1, \"two\", [], {} ] } } ", &t) == NULL);
+
+    ck_assert(bcon_to_bson(bcon_template_bind(t), bson) == NULL);
+
+    bcon_eq_data(BCON(
+        "a", BCON_INT32(1),
+        "b", BCON_INT64(-5000000000LL),
+        "c", BCON_DOUBLE(2.5),
+        "d", "x\"y\xc3\xa9",
+        "e", BCON_BOOL(1),
+        "f", BCON_BOOL(0),
+        "g", BCON_NULL,
+        "h", BCON_UTF8("{"),
+        "i", "{", "j", "[", BCON_INT32(1), "two", "[", "]", "{", "}", "]", "}"
+    ), bson_get_data(bson), bson->len);
+
+    bson_destroy(bson);
+    bcon_template_destroy(t);
+}
+END_TEST
+
+START_TEST(test_template_placeholders)
+{
+    bcon_template_t * t;
+    bson_t * bson;
+    bson_t * sub = bson_new();
+    bson_oid_t oid;
+    int i;
+
+    bson_oid_init(&oid, NULL);
+    bson_append_int32(sub, "k", -1, 7);
+
+    ck_assert(bcon_template_compile(
+        "{\"user\": $1:utf8, \"n\": $2:int32, \"big\": $3:int64, \"again\": $1:utf8,"
+        " \"x\": [$4:double, $5:bool], \"sub\": $6:doc, \"oid\": $7:oid}", &t) == NULL);
+
+    for (i = 0; i < 3; i++) {
+        bson = bson_new();
+
+        ck_assert(bcon_to_bson(bcon_template_bind(t, i ? "bob" : "alice", i, (bson_int64_t)i << 40, i / 2.0, i % 2, sub, &oid), bson) == NULL);
+
+        bcon_eq_data(BCON(
+            "user", i ? "bob" : "alice",
+            "n", BCON_INT32(i),
+            "big", BCON_INT64((bson_int64_t)i << 40),
+            "again", i ? "bob" : "alice",
+            "x", "[", BCON_DOUBLE(i / 2.0), BCON_BOOL(i % 2), "]",
+            "sub", BCON_BSON_DOCUMENT(sub),
+            "oid", BCON_BSON_OID(&oid)
+        ), bson_get_data(bson), bson->len);
+
+        bson_destroy(bson);
+    }
+
+    bson_destroy(sub);
+    bcon_template_destroy(t);
+}
+END_TEST
+
+START_TEST(test_template_errors)
+{
+    static const char * bad[] = {
+        "[1]",
+        "{\"a\" 1}",
+        "{\"a\": 1,}",
+        "{\"a\": 1} x",
+        "{\"a\": \"unterminated}",
+        "{\"a\": $1:nope}",
+        "{\"a\": $2:int32}",
+        "{\"a\": $1:int32, \"b\": $1:utf8}",
+        "{\"a\": \"\\q\"}",
+        "{\"a\": tru}",
+        NULL
+    };
+    bcon_template_t * t;
+    char * err_str;
+    int i;
+
+    for (i = 0; bad[i]; i++) {
+        err_str = bcon_template_compile(bad[i], &t);
+        ck_assert_msg(err_str != NULL, bad[i]);
+        free(err_str);
+    }
+}
+END_TEST
+
+static const char * audit_fmt = "{\"op\": $1:utf8, \"ms\": $2:int32}";
+
+START_TEST(test_format)
+{
+    bson_t * bson;
+    char * err_str;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        bson = bson_new();
+
+        ck_assert(bcon_format(bson, audit_fmt, "insert", i) == NULL);
+        bcon_eq_data(BCON( "op", "insert", "ms", BCON_INT32(i) ), bson_get_data(bson), bson->len);
+
+        bson_destroy(bson);
+    }
+
+    bson = bson_new();
+    err_str = bcon_format(bson, "{\"a\": ", 1);
+    ck_assert(err_str != NULL);
+    free(err_str);
+    bson_destroy(bson);
+
+    bcon_format_cleanup();
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Template");
+    tcase_add_test(core, test_template_literals);
+    tcase_add_test(core, test_template_placeholders);
+    tcase_add_test(core, test_template_errors);
+    tcase_add_test(core, test_format);
+    suite_add_tcase(s, core);
+
+    return;
+}
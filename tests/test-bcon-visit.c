@@ -0,0 +1,190 @@
+#include "bcon-test.h"
+
+typedef struct count_state {
+    int begins;
+    int ends;
+    int values;
+    int max_depth;
+    int depth;
+} count_state_t;
+
+static int count_begin(void * data, const char * key, int is_array)
+{
+    count_state_t * c = data;
+
+    c->begins++;
+    if (++c->depth > c->max_depth) c->max_depth = c->depth;
+
+    return 0;
+}
+
+static int count_end(void * data, int is_array)
+{
+    count_state_t * c = data;
+
+    c->ends++;
+    c->depth--;
+
+    return 0;
+}
+
+static int count_value(void * data, const char * key, void * val, bcon_type_t type)
+{
+    count_state_t * c = data;
+
+    c->values++;
+
+    return type == BCONT_MINKEY;
+}
+
+START_TEST(test_visit_fused)
+{
+    bson_t * expected = bson_new();
+    bson_t * bson = bson_new();
+    bcon_bson_visitor_t bson_state;
+    bcon_hash_state_t hash_state;
+    bcon_visitor_t v[3];
+    bcon_hash_t hash, expected_hash;
+    bson_uint32_t size, expected_size;
+    bson_int32_t n = 7;
+
+    bcon_t * bcon = BCON(
+        "a", BCON_RINT32(&n),
+        "b", BCON_DOC( "c", "d", "e", BCON_ARRAY( BCON_INT64(1), BCON_DOC( "f", BCON_NULL ) ) ),
+        "g", "[", "h", "{", "i", BCON_DOUBLE(1.5), "}", "]",
+        "j", BCON_CODEWSCOPE("x()", "k", BCON_INT32(2))
+    );
+
+    ck_assert(bcon_to_bson(bcon, expected) == NULL);
+    ck_assert(bcon_encoded_size(bcon, &expected_size) == NULL);
+    ck_assert(bcon_hash(bcon, BCON_HASH_VALUES, &expected_hash) == NULL);
+
+    bcon_size_visitor_init(&v[0], &size);
+    bcon_hash_visitor_init(&v[1], &hash_state, BCON_HASH_VALUES);
+    bcon_bson_visitor_init(&v[2], &bson_state, bson);
+
+    ck_assert(bcon_visit(bcon, v, 3) == NULL);
+
+    bcon_hash_visitor_final(&hash_state, &hash);
+    bcon_bson_visitor_destroy(&bson_state);
+
+    ck_assert_int_eq(size, expected_size);
+    ck_assert_int_eq(size, expected->len);
+    ck_assert(hash.lo == expected_hash.lo && hash.hi == expected_hash.hi);
+    ck_assert_int_eq(bson->len, expected->len);
+    ck_assert(memcmp(bson_get_data(bson), bson_get_data(expected), bson->len) == 0);
+
+    bson_destroy(bson);
+    bson_destroy(expected);
+}
+END_TEST
+
+START_TEST(test_visit_events)
+{
+    count_state_t c;
+    bcon_visitor_t v = { count_begin, count_end, count_value, &c };
+    char * err_str;
+
+    memset(&c, 0, sizeof(c));
+
+    ck_assert(bcon_visit(BCON(
+        "a", BCON_INT32(1),
+        "b", BCON_DOC( "c", BCON_ARRAY( "d", "e" ) ),
+        "f", "{", "g", "[", "]", "}"
+    ), &v, 1) == NULL);
+
+    ck_assert_int_eq(c.begins, 5);
+    ck_assert_int_eq(c.ends, 5);
+    ck_assert_int_eq(c.values, 3);
+    ck_assert_int_eq(c.max_depth, 3);
+
+    memset(&c, 0, sizeof(c));
+
+    err_str = bcon_visit(BCON( "a", BCON_INT32(1), "stop", BCON_MINKEY, "b", BCON_INT32(2) ), &v, 1);
+
+    ck_assert(err_str != NULL);
+    ck_assert_int_eq(c.values, 2);
+
+    free(err_str);
+}
+END_TEST
+
+START_TEST(test_visit_dump)
+{
+    char * str = bcon_dump(BCON(
+        "a", "b",
+        "c", BCON_DOC( "d", BCON_INT32(1) ),
+        "e", "[", BCON_NULL, "]"
+    ));
+
+    ck_assert_str_eq(str,
+        "{\n"
+        "  \"a\" : \"b\",\n"
+        "  \"c\" : {\n"
+        "    \"d\" : BCONT_INT32,\n"
+        "  },\n"
+        "  \"e\" : [\n"
+        "    BCONT_NULL,\n"
+        "  ],\n"
+        "}"
+    );
+
+    free(str);
+
+    str = bcon_dump(BCON( "a", BCON_INT32(1), BCON_INT32(2) ));
+
+    ck_assert_str_eq(str,
+        "{\n"
+        "  \"a\" : BCONT_INT32,\n"
+        "<ERROR HERE>"
+    );
+
+    free(str);
+}
+END_TEST
+
+#define DEEP 30
+
+START_TEST(test_visit_deep)
+{
+    bcon_t tokens[3 * DEEP + 3];
+    bson_t * level[DEEP + 1];
+    int i, n = 0;
+
+    /* "k", "{", "k", "{", ... "v", "v", "}", ... "}" */
+    for (i = 0; i < DEEP; i++) {
+        tokens[n++].UTF8 = "k";
+        tokens[n++].UTF8 = "{";
+    }
+    tokens[n++].UTF8 = "v";
+    tokens[n++].UTF8 = "v";
+    for (i = 0; i < DEEP; i++) {
+        tokens[n++].UTF8 = "}";
+    }
+    tokens[n].UTF8 = NULL;
+
+    for (i = 0; i <= DEEP; i++) {
+        level[i] = bson_new();
+    }
+
+    bson_append_utf8(level[DEEP], "v", -1, "v", -1);
+    for (i = DEEP; i > 0; i--) {
+        bson_append_document(level[i - 1], "k", -1, level[i]);
+        bson_destroy(level[i]);
+    }
+
+    bcon_eq_bson(tokens, level[0]);
+}
+END_TEST
+
+void add_tests(Suite * s)
+{
+    TCase * core = tcase_create("Visit");
+    tcase_add_test(core, test_visit_fused);
+    tcase_add_test(core, test_visit_events);
+    tcase_add_test(core, test_visit_dump);
+    tcase_add_test(core, test_visit_deep);
+    suite_add_tcase(s, core);
+
+    return;
+}